@@ -7,39 +7,127 @@ in mat3 f_TBN;
 
 #define _PI_ 3.14159
 
-uniform vec3 uniform_camera_pos;
-uniform vec3 uniform_camera_dir;
-
-uniform vec3 uniform_diffuse;
-uniform vec3 uniform_specular;
-uniform vec3 uniform_ambient;
-uniform float uniform_shininess;
+// camera and light, written once per frame
+layout(std140) uniform FrameBlock
+{
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_light_umbra;
+	vec3 uniform_camera_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	// point light, the far plane of its cube faces
+	float uniform_light_range;
+	vec3 uniform_light_dir;
+	int uniform_light_point;
+	mat4 uniform_projection_view;
+	// directional light cascades, the view depth each one ends at and the part of its layer it covers
+	mat4 uniform_cascade_projection_view[4];
+	vec4 uniform_cascade_splits;
+	vec4 uniform_cascade_scales;
+	int uniform_cascade_count;
+	int uniform_light_directional;
+	// taps of the poisson filter and the radius of its disk in texels
+	int uniform_shadow_taps;
+	float uniform_shadow_radius;
+};
+
+// spotlights besides the main light, their shadow maps are tiles of one atlas.
+// w of position and direction are the cosines of half the umbra and penumbra, w of color is 1 once
+// the light's tile holds its map, tile is the offset and scale of the map in the atlas
+struct AtlasLight
+{
+	mat4 projection_view;
+	vec4 position;
+	vec4 direction;
+	vec4 color;
+	vec4 tile;
+};
+layout(std140) uniform LightsBlock
+{
+	int uniform_atlas_light_count;
+	AtlasLight uniform_atlas_lights[32];
+};
+
+// built once per material, the layers change when the maps finish loading.
+// which maps a part has is a shader feature, see the variants below
+#ifdef MULTI_DRAW
+// one material per draw of a multi draw call, same size as Renderer's batch
+#define MULTI_DRAW_BATCH 256
+struct Material
+{
+	vec3 diffuse;
+	float shininess;
+	vec3 specular;
+	int tex_diffuse_layer;
+	vec3 ambient;
+	int tex_normal_layer;
+};
+layout(std140) uniform MaterialBlock
+{
+	Material uniform_materials[MULTI_DRAW_BATCH];
+};
+flat in int f_draw;
+#define uniform_diffuse uniform_materials[f_draw].diffuse
+#define uniform_shininess uniform_materials[f_draw].shininess
+#define uniform_specular uniform_materials[f_draw].specular
+#define uniform_tex_diffuse_layer uniform_materials[f_draw].tex_diffuse_layer
+#define uniform_ambient uniform_materials[f_draw].ambient
+#define uniform_tex_normal_layer uniform_materials[f_draw].tex_normal_layer
+#else
+layout(std140) uniform MaterialBlock
+{
+	vec3 uniform_diffuse;
+	float uniform_shininess;
+	vec3 uniform_specular;
+	int uniform_tex_diffuse_layer;
+	vec3 uniform_ambient;
+	int uniform_tex_normal_layer;
+};
+#endif
+
+// variant features, the renderer compiles one program per combination it draws with
+//   HAS_TEX_DIFFUSE, HAS_TEX_NORMAL, IS_TEX_BUMP: the maps of the part
+//   TEX_DIFFUSE_ARRAY, TEX_NORMAL_ARRAY: the maps live in a texture array layer
+//   CAST_SHADOWS: the light casts shadows
+//   SHADOW_NEAREST, SHADOW_PCF_MEAN: shadow filter, 2x2 weighted pcf otherwise
+//   SHADOW_HARDWARE, SHADOW_POISSON: shadow filter on the comparison samplers, one bilinear
+//     pcf tap or uniform_shadow_taps of them on a poisson disk
+//   CASCADED_SHADOWS: directional light, shadows from the cascades instead of the spotlight map
+//   a point light is not a feature, uniform_light_point picks its cube over the spotlight map
+//   MULTI_DRAW: drawn by glMultiDrawArraysIndirect, the materials of the call are an array
 
-uniform int uniform_has_tex_diffuse;
-uniform int uniform_has_tex_normal;
-uniform int uniform_is_tex_bumb;
 uniform sampler2D uniform_tex_diffuse;
 uniform sampler2D uniform_tex_normal;
+uniform sampler2DArray uniform_tex_diffuse_array;
+uniform sampler2DArray uniform_tex_normal_array;
 
-uniform vec3 uniform_light_color;
-uniform vec3 uniform_light_pos;
-uniform vec3 uniform_light_dir;
-
-uniform float uniform_light_umbra;
-uniform float uniform_light_penumbra;
-
-uniform mat4 uniform_light_projection_view;
-uniform int uniform_cast_shadows;
 uniform float uniform_constant_bias = 0.0002;
 
 uniform sampler2D uniform_shadow_map;
-
-float compute_spotlight(const in vec3 pSurfToLight)
+uniform sampler2DArray uniform_shadow_cascades;
+// the same maps through the light's comparison sampler, a tap returns the lit fraction of its 2x2 texels
+uniform sampler2DShadow uniform_shadow_map_compare;
+uniform sampler2DArrayShadow uniform_shadow_cascades_compare;
+uniform sampler2DShadow uniform_shadow_atlas;
+uniform samplerCubeShadow uniform_shadow_cube;
+
+// near plane of the point light's cube faces, LightNode::kPointNear
+const float point_near = 0.1;
+
+// points of the unit disk, the poisson filter takes the first uniform_shadow_taps
+const vec2 poisson_disk[16] = vec2[](
+	vec2(-0.9420, -0.3991), vec2(0.9456, -0.7689), vec2(-0.0942, -0.9294), vec2(0.3450, 0.2939),
+	vec2(-0.9159, 0.4577), vec2(-0.8154, -0.8791), vec2(-0.3828, 0.2768), vec2(0.9748, 0.7565),
+	vec2(0.4432, -0.9751), vec2(0.5374, -0.4737), vec2(-0.2650, -0.4189), vec2(0.7920, 0.1909),
+	vec2(-0.2419, 0.9971), vec2(-0.8141, 0.9144), vec2(0.1998, 0.7864), vec2(0.1438, -0.1410));
+
+float compute_spotlight(const in vec3 pSurfToLight, const in vec3 pLightDir, float cos_umbra, float cos_penumbra)
 {
-	float cos_umbra = cos(radians(0.5 * uniform_light_umbra));
-	float cos_penumbra = cos(radians(0.5 * uniform_light_penumbra));
 	float spoteffect = 1;
-	float angle_vertex_spot_dir = dot(-pSurfToLight, uniform_light_dir);
+	float angle_vertex_spot_dir = dot(-pSurfToLight, pLightDir);
 
 	if (angle_vertex_spot_dir > cos_umbra) 
 	{
@@ -118,6 +206,123 @@ float shadow_nearest(vec3 light_space_xyz)
 	return ((light_space_xyz.z - uniform_constant_bias) < shadow_map_z) ? 1.0 : 0.0;
 }
 
+float shadow_hardware(vec3 light_space_xyz)
+{
+	// the comparison and the bilinear weights are done by the sampler
+	return texture(uniform_shadow_map_compare, vec3(light_space_xyz.xy, light_space_xyz.z - uniform_constant_bias));
+}
+
+float shadow_poisson(vec3 light_space_xyz)
+{
+	vec2 radius = uniform_shadow_radius / vec2(textureSize(uniform_shadow_map_compare, 0));
+	float z = light_space_xyz.z - uniform_constant_bias;
+	float lit = 0.0;
+	for (int i = 0; i < uniform_shadow_taps; i++)
+		lit += texture(uniform_shadow_map_compare, vec3(light_space_xyz.xy + poisson_disk[i] * radius, z));
+	return lit / float(uniform_shadow_taps);
+}
+
+float shadow_atlas(const in AtlasLight light, vec3 pwcs)
+{
+	vec4 plcs = light.projection_view * vec4(pwcs, 1.0);
+	vec3 uvz = plcs.xyz / plcs.w * 0.5 + 0.5;
+	if (any(lessThan(uvz.xy, vec2(0.0))) || any(greaterThan(uvz.xy, vec2(1.0))))
+		return 0.0;
+
+	// half a texel in from the tile's edges, the bilinear taps would read the neighbours
+	vec2 texel = 1.0 / vec2(textureSize(uniform_shadow_atlas, 0));
+	vec2 uv = clamp(light.tile.xy + uvz.xy * light.tile.zw, light.tile.xy + texel * 0.5, light.tile.xy + light.tile.zw - texel * 0.5);
+	return texture(uniform_shadow_atlas, vec3(uv, uvz.z - uniform_constant_bias));
+}
+
+// the point light's cube. A face is the 90 degree perspective along the major axis of the direction,
+// the reference is that axis' distance as the face's projection stores it
+float shadow_point(vec3 pwcs)
+{
+	vec3 light_to_surface = pwcs - uniform_light_pos;
+	float z = max(max(abs(light_to_surface.x), abs(light_to_surface.y)), abs(light_to_surface.z));
+	if (z >= uniform_light_range)
+		return 1.0;
+
+	float n = point_near;
+	float f = uniform_light_range;
+	float depth = ((f + n) / (f - n) - 2.0 * f * n / ((f - n) * z)) * 0.5 + 0.5;
+	return texture(uniform_shadow_cube, vec4(light_to_surface, depth - uniform_constant_bias));
+}
+
+vec3 sample_diffuse(vec2 uv)
+{
+#ifdef TEX_DIFFUSE_ARRAY
+	return texture(uniform_tex_diffuse_array, vec3(uv, uniform_tex_diffuse_layer)).rgb;
+#else
+	return texture(uniform_tex_diffuse, uv).rgb;
+#endif
+}
+
+vec3 sample_normal(vec2 uv)
+{
+#ifdef TEX_NORMAL_ARRAY
+	return texture(uniform_tex_normal_array, vec3(uv, uniform_tex_normal_layer)).rgb;
+#else
+	return texture(uniform_tex_normal, uv).rgb;
+#endif
+}
+
+// bump heights one texel back along u and v
+vec2 sample_bump_prev(vec2 uv)
+{
+#ifdef TEX_NORMAL_ARRAY
+	vec3 uvw = vec3(uv, uniform_tex_normal_layer);
+	return vec2(textureOffset(uniform_tex_normal_array, uvw, ivec2(-1, 0)).r, textureOffset(uniform_tex_normal_array, uvw, ivec2(0, -1)).r);
+#else
+	return vec2(textureOffset(uniform_tex_normal, uv, ivec2(-1, 0)).r, textureOffset(uniform_tex_normal, uv, ivec2(0, -1)).r);
+#endif
+}
+
+#ifdef CASCADED_SHADOWS
+// the first cascade whose slice holds the point, lit past the last one
+float shadow(vec3 pwcs)
+{
+	float depth = dot(pwcs - uniform_camera_pos, uniform_camera_dir);
+	int cascade = 0;
+	while (cascade < uniform_cascade_count && depth > uniform_cascade_splits[cascade])
+		cascade++;
+	if (cascade == uniform_cascade_count)
+		return 1.0;
+
+	// orthographic, nothing to divide. [-1 1] to [0 1], then to the corner of the layer
+	vec3 plcs = (uniform_cascade_projection_view[cascade] * vec4(pwcs, 1.0)).xyz * 0.5 + 0.5;
+	vec2 uv = plcs.xy * uniform_cascade_scales[cascade];
+	float z = plcs.z - uniform_constant_bias;
+
+#if defined(SHADOW_NEAREST)
+	return (texture(uniform_shadow_cascades, vec3(uv, cascade)).r > z) ? 1.0 : 0.0;
+#elif defined(SHADOW_HARDWARE)
+	vec2 texel = 1.0 / vec2(textureSize(uniform_shadow_cascades_compare, 0).xy);
+	vec2 limit = uniform_cascade_scales[cascade] - texel * 0.5;
+	return texture(uniform_shadow_cascades_compare, vec4(min(uv, limit), cascade, z));
+#elif defined(SHADOW_POISSON)
+	// the disk is clamped to the cascade's corner like the mean below
+	vec2 texel = 1.0 / vec2(textureSize(uniform_shadow_cascades_compare, 0).xy);
+	vec2 limit = uniform_cascade_scales[cascade] - texel * 0.5;
+	float lit = 0.0;
+	for (int i = 0; i < uniform_shadow_taps; i++)
+		lit += texture(uniform_shadow_cascades_compare, vec4(min(uv + poisson_disk[i] * uniform_shadow_radius * texel, limit), cascade, z));
+	return lit / float(uniform_shadow_taps);
+#else
+	// 2x2 mean, the taps stay inside the cascade's corner
+	vec2 texel = 1.0 / vec2(textureSize(uniform_shadow_cascades, 0).xy);
+	vec2 limit = uniform_cascade_scales[cascade] - texel * 0.5;
+	float lit = 0.0;
+	for (int i = 0; i < 4; i++)
+	{
+		vec2 tap = min(uv + (vec2(i & 1, i >> 1) - 0.5) * texel, limit);
+		lit += (texture(uniform_shadow_cascades, vec3(tap, cascade)).r > z) ? 0.25 : 0.0;
+	}
+	return lit;
+#endif
+}
+#else
 // 1 sample per pixel
 float shadow(vec3 pwcs)
 {
@@ -138,39 +343,58 @@ float shadow(vec3 pwcs)
 	plcs.z = 0.5 * plcs.z + 0.5;
 
 	// sample shadow map
-	//return shadow_nearest(plcs.xyz);
+#if defined(SHADOW_NEAREST)
+	return shadow_nearest(plcs.xyz);
+#elif defined(SHADOW_PCF_MEAN)
+	return shadow_pcf2x2_mean(plcs.xyz);
+#elif defined(SHADOW_HARDWARE)
+	return shadow_hardware(plcs.xyz);
+#elif defined(SHADOW_POISSON)
+	return shadow_poisson(plcs.xyz);
+#else
 	return shadow_pcf2x2_weighted(plcs.xyz);
-	//return shadow_pcf2x2_mean(plcs.xyz);
+#endif
 }
+#endif
 
-vec3 blinn_phong(const in vec3 pSurfToEye, const in vec3 pSurfToLight)
+vec3 surface_normal()
 {
 	vec3 normal = f_TBN[2];
 
-	if(uniform_has_tex_normal == 1)
-	{
-		vec3 nmap = texture(uniform_tex_normal, f_texcoord).rgb;
-
-		if(uniform_is_tex_bumb == 1)
-		{
-			float heigh_prev_U = textureOffset(uniform_tex_normal, f_texcoord, ivec2(-1, 0)).r;
-			float heigh_prev_V = textureOffset(uniform_tex_normal, f_texcoord, ivec2(0, -1)).r;
-			normal = normal - f_TBN[0] * (nmap.r - heigh_prev_U) - f_TBN[1] * (nmap.r - heigh_prev_V);
-		}
-		else
-		{
-			nmap = nmap * 2.0 - 1.0;
-			normal = normalize(f_TBN * nmap);
-		}
-	}
+#ifdef HAS_TEX_NORMAL
+	vec3 nmap = sample_normal(f_texcoord);
+
+#ifdef IS_TEX_BUMP
+	vec2 heigh_prev = sample_bump_prev(f_texcoord);
+	float heigh_prev_U = heigh_prev.x;
+	float heigh_prev_V = heigh_prev.y;
+	normal = normal - f_TBN[0] * (nmap.r - heigh_prev_U) - f_TBN[1] * (nmap.r - heigh_prev_V);
+#else
+	nmap = nmap * 2.0 - 1.0;
+	normal = normalize(f_TBN * nmap);
+#endif
+#endif
+
+	return normal;
+}
 
+vec3 surface_albedo()
+{
+#ifdef HAS_TEX_DIFFUSE
+	return sample_diffuse(f_texcoord);
+#else
+	return uniform_diffuse;
+#endif
+}
+
+// the maps are read once per fragment, every light shades with the same normal and albedo
+vec3 blinn_phong(const in vec3 pSurfToEye, const in vec3 pSurfToLight, const in vec3 normal, const in vec3 albedo, const in vec3 light_color)
+{
 	vec3 halfVector = normalize(pSurfToEye + pSurfToLight);
 
 	float NdotL = max(dot(normal, pSurfToLight), 0.0);
 	float NdotH = max(dot(normal, halfVector), 0.0);
 
-	vec3 albedo = uniform_has_tex_diffuse == 1 ? texture(uniform_tex_diffuse, f_texcoord).rgb : uniform_diffuse;
-
 	vec3 kd = albedo / _PI_;
 	vec3 ks = uniform_specular;
 
@@ -181,20 +405,58 @@ vec3 blinn_phong(const in vec3 pSurfToEye, const in vec3 pSurfToLight)
 	vec3 diffuse = kd * NdotL;
 	vec3 specular = NdotL > 0.0 ? ks * fn * pow(NdotH, uniform_shininess) : vec3(0.0);
 
-	return (diffuse) * uniform_light_color + uniform_ambient;
+	return (diffuse) * light_color;
+}
+
+// the atlas spotlights, each with the same falloff as the main one
+vec3 atlas_lights(const in vec3 pSurfToEye, const in vec3 normal, const in vec3 albedo)
+{
+	vec3 color = vec3(0.0);
+	for (int i = 0; i < uniform_atlas_light_count; i++)
+	{
+		vec3 surfToLight = uniform_atlas_lights[i].position.xyz - f_position_wcs;
+		float dist = length(surfToLight);
+		surfToLight /= dist;
+
+		float spotEffect = compute_spotlight(surfToLight, uniform_atlas_lights[i].direction.xyz,
+			uniform_atlas_lights[i].position.w, uniform_atlas_lights[i].direction.w);
+		if (spotEffect <= 0.0)
+			continue;
+
+		float shadow_value = (uniform_atlas_lights[i].color.w > 0.0) ? shadow_atlas(uniform_atlas_lights[i], f_position_wcs) : 1.0;
+		color += shadow_value * spotEffect * blinn_phong(pSurfToEye, surfToLight, normal, albedo, uniform_atlas_lights[i].color.rgb) / (dist * dist);
+	}
+	return color;
 }
 
 void main(void)
 {
 	vec3 surfToEye = normalize(uniform_camera_pos - f_position_wcs);
-	vec3 surfToLight = normalize(uniform_light_pos - f_position_wcs);
+	vec3 surfToLight = (uniform_light_directional != 0) ? -uniform_light_dir : normalize(uniform_light_pos - f_position_wcs);
 
 	// check if we have shadows
-	float shadow_value = (uniform_cast_shadows == 1) ? shadow(f_position_wcs) : 1.0;
+#ifdef CAST_SHADOWS
+	float shadow_value = (uniform_light_point != 0) ? shadow_point(f_position_wcs) : shadow(f_position_wcs);
+#else
+	float shadow_value = 1.0;
+#endif
+
+	vec3 normal = surface_normal();
+	vec3 albedo = surface_albedo();
+	vec3 brdf = blinn_phong(surfToEye, surfToLight, normal, albedo, uniform_light_color) + uniform_ambient;
+	vec3 atlas = atlas_lights(surfToEye, normal, albedo);
+
+	// no cone and no falloff for a directional light
+	if (uniform_light_directional != 0)
+	{
+		out_color = vec4(shadow_value * brdf + atlas, 1.0);
+		return;
+	}
 
-	vec3 brdf = blinn_phong(surfToEye, surfToLight);
-	float spotEffect =  compute_spotlight(surfToLight);
+	// a point light has no cone
+	float spotEffect = (uniform_light_point != 0) ? 1.0 : compute_spotlight(surfToLight, uniform_light_dir,
+		cos(radians(0.5 * uniform_light_umbra)), cos(radians(0.5 * uniform_light_penumbra)));
 	float dist = distance(uniform_light_pos, f_position_wcs);
 
-	out_color = vec4(shadow_value * brdf * spotEffect / pow(dist, 2), 1.0);
-}
\ No newline at end of file
+	out_color = vec4(shadow_value * brdf * spotEffect / pow(dist, 2) + atlas, 1.0);
+}
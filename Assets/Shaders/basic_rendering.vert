@@ -1,26 +1,53 @@
 #version 330 core
+#ifdef MULTI_DRAW
+#extension GL_ARB_shader_draw_parameters : require
+#endif
 layout(location = 0) in vec3 coord3d;
 layout(location = 1) in vec3 v_normal;
 layout(location = 2) in vec2 texcoord;
 layout(location = 3) in vec3 v_tangent;
 layout(location = 4) in vec3 v_bitangent;
+// per instance transforms, every node that shares the asset is drawn in one call
+layout(location = 5) in mat4 i_world_matrix;
+layout(location = 9) in mat3 i_normal_matrix;
 
 out vec2 f_texcoord;
 out vec3 f_position_wcs;
 out mat3 f_TBN;
+#ifdef MULTI_DRAW
+// which draw of the multi draw call, picks the material
+flat out int f_draw;
+#endif
 
-uniform mat4 uniform_projection_matrix;
-uniform mat4 uniform_normal_matrix;
-uniform mat4 uniform_world_matrix;
+// same block as basic_rendering.frag
+layout(std140) uniform FrameBlock
+{
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_light_umbra;
+	vec3 uniform_camera_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_range;
+	vec3 uniform_light_dir;
+	int uniform_light_point;
+	mat4 uniform_projection_view;
+};
 
 void main(void)
 {
 	f_TBN = mat3(
-		normalize(vec3(uniform_normal_matrix * vec4(v_tangent, 0.0))),
-		normalize(vec3(uniform_normal_matrix * vec4(v_bitangent, 0.0))),
-		normalize(vec3(uniform_normal_matrix * vec4(v_normal, 0.0))));
+		normalize(i_normal_matrix * v_tangent),
+		normalize(i_normal_matrix * v_bitangent),
+		normalize(i_normal_matrix * v_normal));
 
 	f_texcoord = texcoord;
-	f_position_wcs = vec3(uniform_world_matrix * vec4(coord3d, 1.0));
-	gl_Position = uniform_projection_matrix * vec4(coord3d, 1.0);
+	vec4 position_wcs = i_world_matrix * vec4(coord3d, 1.0);
+	f_position_wcs = position_wcs.xyz;
+	gl_Position = uniform_projection_view * position_wcs;
+#ifdef MULTI_DRAW
+	f_draw = gl_DrawIDARB;
+#endif
 }
@@ -0,0 +1,21 @@
+#version 330 core
+layout(location = 0) out vec4 out_color;
+
+uniform vec3 uniform_diffuse;
+uniform vec3 uniform_specular;
+uniform vec3 uniform_ambient;
+uniform float uniform_shininess;
+
+uniform int uniform_has_tex_diffuse;
+uniform int uniform_has_tex_normal;
+uniform int uniform_is_tex_bumb;
+uniform sampler2D uniform_tex_diffuse;
+uniform sampler2D uniform_tex_normal;
+
+void main(void)
+{
+	vec3 color = uniform_diffuse + uniform_specular * uniform_shininess + uniform_ambient;
+	if (uniform_has_tex_diffuse == 1) color *= texture(uniform_tex_diffuse, vec2(0.5)).rgb;
+	if (uniform_has_tex_normal == 1 && uniform_is_tex_bumb == 0) color *= texture(uniform_tex_normal, vec2(0.5)).rgb;
+	out_color = vec4(color, 1.0);
+}
@@ -0,0 +1,10 @@
+#version 330 core
+layout(location = 0) in vec3 coord3d;
+
+// the per part uniforms basic_rendering used before the uniform blocks
+uniform mat4 uniform_world_matrix;
+
+void main(void)
+{
+	gl_Position = uniform_world_matrix * vec4(coord3d, 1.0);
+}
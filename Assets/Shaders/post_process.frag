@@ -15,8 +15,9 @@ float linearize(const in float depth)
     return ((2.0 * near * far) / (far + near - z * (far - near))) / far;
 }
 
-//#define PREVIEW_SHADOW_MAP
-//#define CROSS_HAIR
+// variant features, toggled by the renderer
+//   PREVIEW_SHADOW_MAP: show the linearized shadow map
+//   CROSS_HAIR: draw a cross hair through the center
 
 void main(void)
 {
@@ -0,0 +1,4 @@
+#version 330 core
+layout(location = 0) out vec4 out_color;
+
+void main(void) { /* Empty */ }
\ No newline at end of file
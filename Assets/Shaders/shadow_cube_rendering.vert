@@ -0,0 +1,9 @@
+#version 330 core
+layout(location = 0) in vec3 coord3d;
+layout(location = 5) in mat4 i_world_matrix;
+
+// the faces are projected in the geometry shader, only the world position is needed here
+void main(void)
+{
+	gl_Position = i_world_matrix * vec4(coord3d, 1.0);
+}
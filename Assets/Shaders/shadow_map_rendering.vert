@@ -1,9 +1,11 @@
 #version 330 core
 layout(location = 0) in vec3 coord3d;
+layout(location = 5) in mat4 i_world_matrix;
 
+// the light's projection and view, the instances bring their world transform
 uniform mat4 uniform_projection_matrix;
 
 void main(void) 
 {
-	gl_Position = uniform_projection_matrix * vec4(coord3d, 1.0);
+	gl_Position = uniform_projection_matrix * i_world_matrix * vec4(coord3d, 1.0);
 }
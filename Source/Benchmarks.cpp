@@ -0,0 +1,1090 @@
+#include "Benchmarks.h"
+#include "SDL2/SDL.h"
+#include "SDL2/SDL_image.h"
+#include "GLEW\glew.h"
+#include "glm/gtc/matrix_transform.hpp"
+#include "Renderer.h"
+#include "helpers/AABBTree.h"
+#include "helpers/FrustumCuller.h"
+#include "helpers/GLState.h"
+#include "helpers/JobSystem.h"
+#include "helpers/OBJLoader.h"
+#include "helpers/PNGDecoder.h"
+#include "helpers/ShaderProgram.h"
+#include "helpers/Tools.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace Benchmarks
+{
+	static const int kRepetitions = 5;
+
+	static double ElapsedMs(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// hidden window with the demo's 3.3 context, for the benchmarks that need GL
+	class HiddenContext
+	{
+	public:
+		HiddenContext() : window(nullptr), context(nullptr) {}
+		~HiddenContext()
+		{
+			if (context) SDL_GL_DeleteContext(context);
+			if (window) SDL_DestroyWindow(window);
+			SDL_Quit();
+		}
+
+		bool Create(int width = 1024, int height = 860)
+		{
+			if (SDL_Init(SDL_INIT_VIDEO) < 0)
+				return false;
+
+			SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+			SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+			SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+
+			window = SDL_CreateWindow("Benchmark", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+				width, height, SDL_WINDOW_HIDDEN | SDL_WINDOW_OPENGL);
+			if (window == nullptr)
+			{
+				printf("Could not create window: %s\n", SDL_GetError());
+				return false;
+			}
+
+			context = SDL_GL_CreateContext(window);
+			if (context == nullptr)
+			{
+				printf("OpenGL context could not be created! SDL Error: %s\n", SDL_GetError());
+				return false;
+			}
+
+			if (glewInit() != GLEW_OK)
+			{
+				printf("Error loading GLEW\n");
+				return false;
+			}
+			glGetError();
+
+			// nothing cached belongs to this context
+			GLState::GetInstance().Invalidate();
+			return true;
+		}
+
+	private:
+		SDL_Window* window;
+		SDL_GLContext context;
+	};
+
+	int Run(int argc, char* argv[])
+	{
+		for (int i = 1; i + 1 < argc; i++)
+		{
+			if (strcmp(argv[i], "--bench") != 0)
+				continue;
+
+			const char* name = argv[i + 1];
+			if (strcmp(name, "png") == 0) return PNGDecode();
+			if (strcmp(name, "uniforms") == 0) return UniformUploads();
+			if (strcmp(name, "shaders") == 0) return ShaderStartup();
+			if (strcmp(name, "state") == 0) return StateChanges();
+			if (strcmp(name, "queue") == 0) return RenderQueueOrder();
+			if (strcmp(name, "instancing") == 0) return Instancing();
+			if (strcmp(name, "culling") == 0) return FrustumCulling();
+			if (strcmp(name, "multidraw") == 0) return MultiDraw();
+			if (strcmp(name, "jobs") == 0) return JobScaling();
+			if (strcmp(name, "prepare") == 0) return PacketPrepare();
+			if (strcmp(name, "shadowcache") == 0) return ShadowCaching();
+			if (strcmp(name, "castercull") == 0) return ShadowCasterCulling();
+			if (strcmp(name, "shadowfilter") == 0) return ShadowFilters();
+			if (strcmp(name, "atlas") == 0) return ShadowAtlasBudget();
+			if (strcmp(name, "pointshadow") == 0) return PointShadowFaces();
+
+			printf("Unknown benchmark %s\n", name);
+			return 1;
+		}
+		return -1;
+	}
+
+	int PNGDecode()
+	{
+		std::array<const char*, 5> files = {
+			"Assets/game_assets/craft_BaseMap.png",
+			"Assets/game_assets/craft_MaskMap.png",
+			"Assets/game_assets/craft_Normal.png",
+			"Assets/game_assets/terrain_Lightmap.png",
+			"Assets/game_assets/terrain_MaskMap.png" };
+
+		PNGDecoder decoder;
+		std::vector<unsigned char> file;
+		std::vector<unsigned char> pixels;
+		double total_sdl = 0.0;
+		double total_png = 0.0;
+		bool all_match = true;
+
+		printf("%-40s %12s %12s %8s %10s\n", "file", "SDL_image", "PNGDecoder", "speedup", "MB/s");
+		for (auto filename : files)
+		{
+			// best of N, the file read counts for both since IMG_Load reads it too
+			double sdl_ms = 1e9;
+			SDL_Surface* surf = nullptr;
+			for (int i = 0; i < kRepetitions; i++)
+			{
+				if (surf) SDL_FreeSurface(surf);
+				auto start = std::chrono::steady_clock::now();
+				surf = IMG_Load(filename);
+				sdl_ms = std::min(sdl_ms, ElapsedMs(start));
+			}
+
+			double png_ms = 1e9;
+			PNGDecoder::Info info = {};
+			bool decoded = false;
+			for (int i = 0; i < kRepetitions; i++)
+			{
+				auto start = std::chrono::steady_clock::now();
+				decoded = Tools::LoadWholeBinaryFile(filename, file) && decoder.ReadInfo(file.data(), file.size(), info);
+				if (decoded)
+				{
+					pixels.resize((size_t)info.width * info.height * info.channels);
+					decoded = decoder.Decode(file.data(), file.size(), pixels.data(), false);
+				}
+				png_ms = std::min(png_ms, ElapsedMs(start));
+			}
+
+			if (surf == nullptr || !decoded)
+			{
+				printf("%-40s could not be decoded (%s)\n", filename, surf ? "PNGDecoder" : SDL_GetError());
+				if (surf) SDL_FreeSurface(surf);
+				all_match = false;
+				continue;
+			}
+
+			// same rows, SDL pads them to its pitch
+			bool match = (surf->w == info.width && surf->h == info.height && surf->format->BytesPerPixel == info.channels);
+			size_t stride = (size_t)info.width * info.channels;
+			for (int y = 0; match && y < info.height; y++)
+			{
+				match = memcmp(static_cast<unsigned char*>(surf->pixels) + y * surf->pitch, &pixels[y * stride], stride) == 0;
+			}
+			all_match = all_match && match;
+			SDL_FreeSurface(surf);
+
+			double megabytes = pixels.size() / (1024.0 * 1024.0);
+			printf("%-40s %9.2f ms %9.2f ms %7.2fx %10.1f%s\n", filename, sdl_ms, png_ms, sdl_ms / png_ms,
+				megabytes / (png_ms / 1000.0), match ? "" : "  PIXELS DIFFER");
+
+			total_sdl += sdl_ms;
+			total_png += png_ms;
+		}
+
+		printf("%-40s %9.2f ms %9.2f ms %7.2fx\n", "total", total_sdl, total_png, total_png > 0.0 ? total_sdl / total_png : 0.0);
+		return all_match ? 0 : 1;
+	}
+
+	int UniformUploads()
+	{
+		HiddenContext gl;
+		if (!gl.Create())
+			return 1;
+
+		ShaderProgram program;
+		program.LoadVertexShaderFromFile("Assets/Shaders/benchmarks/uniforms.vert");
+		program.LoadFragmentShaderFromFile("Assets/Shaders/benchmarks/uniforms.frag");
+		program.CreateProgram();
+		program.Bind();
+
+		// the per part uploads RenderStaticGeometry made before the uniform blocks, 10 per part
+		const int kUploads = 10000;
+		const int kPerPart = 10;
+		const int kRounds = 20;
+		glm::vec3 color(0.5f);
+		glm::mat4 matrix(1.f);
+
+		auto diffuse = program.GetUniform<glm::vec3>("uniform_diffuse");
+		auto ambient = program.GetUniform<glm::vec3>("uniform_ambient");
+		auto specular = program.GetUniform<glm::vec3>("uniform_specular");
+		auto shininess = program.GetUniform<float>("uniform_shininess");
+		auto has_tex_diffuse = program.GetUniform<int>("uniform_has_tex_diffuse");
+		auto has_tex_normal = program.GetUniform<int>("uniform_has_tex_normal");
+		auto is_tex_bumb = program.GetUniform<int>("uniform_is_tex_bumb");
+		auto tex_diffuse = program.GetUniform<int>("uniform_tex_diffuse");
+		auto tex_normal = program.GetUniform<int>("uniform_tex_normal");
+		auto world_matrix = program.GetUniform<glm::mat4>("uniform_world_matrix");
+
+		double string_ms = 1e9;
+		double handle_ms = 1e9;
+		for (int round = 0; round < kRounds; round++)
+		{
+			// keep the GPU out of the measurement
+			glFinish();
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < kUploads / kPerPart; i++)
+			{
+				program.loadVec3("uniform_diffuse", color);
+				program.loadVec3("uniform_ambient", color);
+				program.loadVec3("uniform_specular", color);
+				program.loadFloat("uniform_shininess", 1.f);
+				program.loadInt("uniform_has_tex_diffuse", 1);
+				program.loadInt("uniform_has_tex_normal", 1);
+				program.loadInt("uniform_is_tex_bumb", 0);
+				program.loadInt("uniform_tex_diffuse", 0);
+				program.loadInt("uniform_tex_normal", 1);
+				program.loadMat4("uniform_world_matrix", matrix);
+			}
+			string_ms = std::min(string_ms, ElapsedMs(start));
+
+			glFinish();
+			start = std::chrono::steady_clock::now();
+			for (int i = 0; i < kUploads / kPerPart; i++)
+			{
+				program.Set(diffuse, color);
+				program.Set(ambient, color);
+				program.Set(specular, color);
+				program.Set(shininess, 1.f);
+				program.Set(has_tex_diffuse, 1);
+				program.Set(has_tex_normal, 1);
+				program.Set(is_tex_bumb, 0);
+				program.Set(tex_diffuse, 0);
+				program.Set(tex_normal, 1);
+				program.Set(world_matrix, matrix);
+			}
+			handle_ms = std::min(handle_ms, ElapsedMs(start));
+		}
+
+		program.Unbind();
+		printf("%d uniform uploads, best of %d\n", kUploads, kRounds);
+		printf("string keys   %9.1f us\n", string_ms * 1000.0);
+		printf("typed handles %9.1f us (%.2fx)\n", handle_ms * 1000.0, string_ms / handle_ms);
+		return 0;
+	}
+
+	// the programs Renderer::InitShaders builds
+	static double BuildRendererPrograms()
+	{
+		const char* shaders[][2] = {
+			{ "Assets/Shaders/post_process.vert", "Assets/Shaders/post_process.frag" },
+			{ "Assets/Shaders/shadow_map_rendering.vert", "Assets/Shaders/shadow_map_rendering.frag" } };
+
+		glFinish();
+		auto start = std::chrono::steady_clock::now();
+		{
+			// the geometry variants the renderer compiles at startup
+			ShaderVariants geometry;
+			geometry.Init("Assets/Shaders/basic_rendering.vert", "Assets/Shaders/basic_rendering.frag",
+				{ "HAS_TEX_DIFFUSE", "HAS_TEX_NORMAL", "IS_TEX_BUMP", "TEX_DIFFUSE_ARRAY", "TEX_NORMAL_ARRAY",
+				  "CAST_SHADOWS", "SHADOW_NEAREST", "SHADOW_PCF_MEAN" });
+			geometry.Precompile("Assets/Shaders/basic_rendering.variants");
+
+			ShaderProgram programs[2];
+			for (int i = 0; i < 2; i++)
+			{
+				programs[i].LoadVertexShaderFromFile(shaders[i][0]);
+				programs[i].LoadFragmentShaderFromFile(shaders[i][1]);
+				programs[i].CreateProgram();
+			}
+			glFinish();
+		}
+		return ElapsedMs(start);
+	}
+
+	int ShaderStartup()
+	{
+		HiddenContext gl;
+		if (!gl.Create())
+			return 1;
+
+		// the driver keeps its own shader cache, so only the first build is truly cold
+		ShaderProgram::DisableBinaryCache();
+		double source_ms = BuildRendererPrograms();
+
+		if (!ShaderProgram::EnableBinaryCache("ShaderCache"))
+			return 1;
+		double populate_ms = BuildRendererPrograms();
+		double cached_ms = BuildRendererPrograms();
+
+		int hits = 0, misses = 0;
+		ShaderProgram::GetBinaryCacheStatistics(hits, misses);
+		printf("from source     %9.2f ms\n", source_ms);
+		printf("cache populate  %9.2f ms\n", populate_ms);
+		printf("from cache      %9.2f ms (%.2fx)\n", cached_ms, source_ms / cached_ms);
+		printf("%d programs from the cache, %d compiled\n", hits, misses);
+		return 0;
+	}
+
+	int StateChanges()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// let the streamed textures arrive so both runs draw the same scene
+		const float dt = 1.f / 60.f;
+		for (int i = 0; i < 120; i++)
+		{
+			renderer->Update(dt);
+			renderer->Render();
+		}
+		glFinish();
+
+		const int frames = 200;
+		GLState::Statistics totals[2] = {};
+		for (int filtered = 0; filtered < 2; filtered++)
+		{
+			GLState::GetInstance().EnableFiltering(filtered == 1);
+			for (int i = 0; i < frames; i++)
+			{
+				renderer->Update(dt);
+				renderer->Render();
+				GLState::Statistics frame = GLState::GetInstance().GetLastFrameStatistics();
+				totals[filtered].issued += frame.issued;
+				totals[filtered].skipped += frame.skipped;
+			}
+		}
+		GLState::GetInstance().EnableFiltering(true);
+		delete renderer;
+
+		printf("%-12s %16s %16s\n", "", "state calls/frame", "dropped/frame");
+		printf("%-12s %16.1f %16.1f\n", "unfiltered", totals[0].issued / (double)frames, totals[0].skipped / (double)frames);
+		printf("%-12s %16.1f %16.1f\n", "GLState", totals[1].issued / (double)frames, totals[1].skipped / (double)frames);
+		printf("%.1f%% fewer state calls reach the driver\n", 100.0 * (1.0 - totals[1].issued / (double)totals[0].issued));
+		return 0;
+	}
+
+	int RenderQueueOrder()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// let the streamed textures arrive so both runs draw the same scene
+		const float dt = 1.f / 60.f;
+		for (int i = 0; i < 120; i++)
+		{
+			renderer->Update(dt);
+			renderer->Render();
+		}
+		glFinish();
+
+		const int frames = 200;
+		RenderQueue::Statistics totals[2] = {};
+		size_t issued[2] = {};
+		double cpu_ms[2] = {};
+		for (int sorted = 0; sorted < 2; sorted++)
+		{
+			renderer->SetSortedDraws(sorted == 1);
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < frames; i++)
+			{
+				renderer->Update(dt);
+				renderer->Render();
+				RenderQueue::Statistics frame = renderer->GetRenderQueueStatistics();
+				totals[sorted].packets += frame.packets;
+				totals[sorted].programs += frame.programs;
+				totals[sorted].textureSets += frame.textureSets;
+				totals[sorted].materials += frame.materials;
+				issued[sorted] += GLState::GetInstance().GetLastFrameStatistics().issued;
+			}
+			glFinish();
+			cpu_ms[sorted] = ElapsedMs(start) / frames;
+		}
+		delete renderer;
+
+		printf("%-10s %8s %9s %9s %10s %12s %9s\n", "", "packets", "programs", "textures", "materials", "state calls", "ms/frame");
+		for (int sorted = 0; sorted < 2; sorted++)
+		{
+			printf("%-10s %8.1f %9.1f %9.1f %10.1f %12.1f %9.3f\n", sorted ? "sorted" : "scene", totals[sorted].packets / (double)frames,
+				totals[sorted].programs / (double)frames, totals[sorted].textureSets / (double)frames,
+				totals[sorted].materials / (double)frames, issued[sorted] / (double)frames, cpu_ms[sorted]);
+		}
+		return 0;
+	}
+
+	int Instancing()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+		renderer->SpawnCrafts(10000);
+
+		const float dt = 1.f / 60.f;
+		for (int i = 0; i < 60; i++)
+		{
+			renderer->Update(dt);
+			renderer->Render();
+		}
+		glFinish();
+
+		// the GPU work is part of the frame, each one is waited for
+		const int frames = 60;
+		double frame_ms[2] = {};
+		size_t draws[2] = {};
+		for (int instanced = 0; instanced < 2; instanced++)
+		{
+			renderer->SetInstancing(instanced == 1);
+			renderer->Update(dt);
+			renderer->Render();
+			glFinish();
+
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < frames; i++)
+			{
+				renderer->Update(dt);
+				renderer->Render();
+				glFinish();
+				draws[instanced] += renderer->GetRenderQueueStatistics().packets;
+			}
+			frame_ms[instanced] = ElapsedMs(start) / frames;
+		}
+		delete renderer;
+
+		printf("10000 crafts\n");
+		printf("%-10s %16s %10s %8s\n", "", "geometry draws", "ms/frame", "fps");
+		printf("%-10s %16.1f %10.2f %8.1f\n", "per node", draws[0] / (double)frames, frame_ms[0], 1000.0 / frame_ms[0]);
+		printf("%-10s %16.1f %10.2f %8.1f\n", "instanced", draws[1] / (double)frames, frame_ms[1], 1000.0 / frame_ms[1]);
+		return 0;
+	}
+
+	int FrustumCulling()
+	{
+		const size_t count = 100000;
+		FrustumCuller culler;
+		culler.Resize(count);
+
+		// boxes of 0.5 to 4 units scattered over a 1km square, rotated and scaled like the nodes
+		std::mt19937 random(1234);
+		std::uniform_real_distribution<float> position(-500.f, 500.f);
+		std::uniform_real_distribution<float> size(0.5f, 4.f);
+		std::uniform_real_distribution<float> angle(0.f, 6.2831853f);
+		std::vector<glm::vec3> mins(count), maxs(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			glm::vec3 extent(size(random), size(random), size(random));
+			glm::mat4 transform = glm::translate(glm::mat4(1.f), glm::vec3(position(random), position(random) * 0.05f, position(random)));
+			transform = glm::rotate(transform, angle(random), glm::vec3(0.f, 1.f, 0.f));
+			Tools::TransformBounds(-extent, extent, transform, mins[i], maxs[i]);
+			culler.SetBox(i, mins[i], maxs[i]);
+		}
+
+		glm::mat4 view_projection = glm::perspective(glm::radians(60.f), 1024.f / 860.f, 0.1f, 1000.f) *
+			glm::lookAt(glm::vec3(0.f, 20.f, 0.f), glm::vec3(100.f, 0.f, 100.f), glm::vec3(0.f, 1.f, 0.f));
+
+		std::vector<unsigned int> reference;
+		culler.Cull(view_projection, reference, FrustumCuller::PATH_SCALAR);
+
+		std::array<FrustumCuller::Path, 3> paths = { FrustumCuller::PATH_SCALAR, FrustumCuller::PATH_SSE, FrustumCuller::PATH_AVX };
+		std::vector<unsigned int> visible;
+		visible.reserve(count);
+		double scalar_ms = 0.0;
+		bool all_match = true;
+
+		printf("%zu boxes, %zu visible, auto picks %s\n", count, reference.size(), FrustumCuller::PathName(FrustumCuller::BestPath()));
+		printf("%-8s %10s %8s %6s\n", "path", "ms", "speedup", "match");
+		for (auto path : paths)
+		{
+			double ms = 1e9;
+			for (int i = 0; i < kRepetitions * 4; i++)
+			{
+				visible.clear();
+				auto start = std::chrono::steady_clock::now();
+				culler.Cull(view_projection, visible, path);
+				ms = std::min(ms, ElapsedMs(start));
+			}
+			if (path == FrustumCuller::PATH_SCALAR)
+				scalar_ms = ms;
+
+			bool match = (visible == reference);
+			all_match = all_match && match;
+			printf("%-8s %10.3f %7.2fx %6s\n", FrustumCuller::PathName(path), ms, scalar_ms / ms, match ? "yes" : "NO");
+		}
+
+		// the same boxes in the tree, its fattened leaves give a superset of the flat result
+		AABBTree tree;
+		std::vector<int> proxies(count);
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < count; i++)
+			proxies[i] = tree.Insert(mins[i], maxs[i], (unsigned int)i);
+		double build_ms = ElapsedMs(start);
+
+		double tree_ms = 1e9;
+		for (int i = 0; i < kRepetitions * 4; i++)
+		{
+			visible.clear();
+			start = std::chrono::steady_clock::now();
+			tree.QueryFrustum(view_projection, visible);
+			tree_ms = std::min(tree_ms, ElapsedMs(start));
+		}
+		std::sort(visible.begin(), visible.end());
+		bool superset = std::includes(visible.begin(), visible.end(), reference.begin(), reference.end());
+		all_match = all_match && superset;
+		printf("%-8s %10.3f %7.2fx %6s  %zu found, %zu of %zu tree nodes visited\n", "tree", tree_ms, scalar_ms / tree_ms,
+			superset ? "yes" : "NO", visible.size(), tree.GetVisitedCount(), 2 * count - 1);
+
+		// the renderer's lists, the tree's candidates refined against the exact boxes give the flat result again
+		std::vector<unsigned int> refined;
+		refined.reserve(count);
+		double refine_ms = 1e9;
+		for (int i = 0; i < kRepetitions * 4; i++)
+		{
+			refined.clear();
+			start = std::chrono::steady_clock::now();
+			culler.Cull(view_projection, visible, refined);
+			refine_ms = std::min(refine_ms, ElapsedMs(start));
+		}
+		bool refined_match = (refined == reference);
+		all_match = all_match && refined_match;
+		printf("%-8s %10.3f %7.2fx %6s  tree query plus refine of its candidates\n", "refine", tree_ms + refine_ms,
+			scalar_ms / (tree_ms + refine_ms), refined_match ? "yes" : "NO");
+
+		// narrow queries are where the tree pays off, the flat paths always test every box
+		std::vector<unsigned int> hits;
+		start = std::chrono::steady_clock::now();
+		tree.QueryBox(glm::vec3(-10.f), glm::vec3(10.f), hits);
+		double box_ms = ElapsedMs(start);
+		size_t box_visited = tree.GetVisitedCount();
+		size_t box_hits = hits.size();
+		hits.clear();
+		start = std::chrono::steady_clock::now();
+		tree.QueryRay(glm::vec3(-600.f, 1.f, 3.f), glm::vec3(1.f, 0.f, 0.f), 1200.f, hits);
+		double ray_ms = ElapsedMs(start);
+		printf("box query %.3f ms, %zu hits, %zu nodes visited\n", box_ms, box_hits, box_visited);
+		printf("ray query %.3f ms, %zu hits, %zu nodes visited\n", ray_ms, hits.size(), tree.GetVisitedCount());
+
+		// a tenth of the boxes drift each frame, most stay inside their fattened leaf
+		std::uniform_real_distribution<float> drift(-0.2f, 0.2f);
+		size_t reinserted = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < count; i += 10)
+		{
+			glm::vec3 offset(drift(random), 0.f, drift(random));
+			mins[i] += offset;
+			maxs[i] += offset;
+			reinserted += tree.Move(proxies[i], mins[i], maxs[i]) ? 1 : 0;
+		}
+		bool rebuilt = tree.Rebalance();
+		printf("tree build %.2f ms, %zu moves in %.3f ms (%zu reinserted%s), height %d\n", build_ms, count / 10,
+			ElapsedMs(start), reinserted, rebuilt ? ", rebuilt" : "", tree.GetHeight());
+		return all_match ? 0 : 1;
+	}
+
+	int MultiDraw()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+		if (!renderer->IsMultiDrawSupported())
+			printf("multi draw indirect not supported, only the loop is measured\n");
+
+		// one draw per part so the submit grows with the scene
+		renderer->SetInstancing(false);
+
+		const float dt = 1.f / 60.f;
+		const int frames = 30;
+		const int counts[] = { 100, 1000, 5000, 10000 };
+		int spawned = 0;
+		printf("%-8s %10s %14s %14s\n", "crafts", "draws", "loop ms", "indirect ms");
+		for (int count : counts)
+		{
+			renderer->SpawnCrafts(count - spawned);
+			spawned = count;
+
+			double submit_ms[2] = {};
+			size_t draws = 0;
+			for (int indirect = 0; indirect < 2; indirect++)
+			{
+				if (indirect == 1 && !renderer->IsMultiDrawSupported())
+					break;
+
+				renderer->SetMultiDraw(indirect == 1);
+				renderer->Update(dt);
+				renderer->Render();
+				glFinish();
+
+				for (int i = 0; i < frames; i++)
+				{
+					renderer->Update(dt);
+					renderer->Render();
+					glFinish();
+					submit_ms[indirect] += renderer->GetSubmitMilliseconds();
+				}
+				submit_ms[indirect] /= frames;
+				draws = renderer->GetRenderQueueStatistics().packets;
+			}
+
+			printf("%-8d %10zu %14.3f %14.3f\n", count, draws, submit_ms[0], submit_ms[1]);
+		}
+		delete renderer;
+		return 0;
+	}
+
+	int JobScaling()
+	{
+		// the instance transforms of a large scene, as BuildInstanceGroups computes them
+		const size_t count = 200000;
+		std::mt19937 random(1234);
+		std::uniform_real_distribution<float> position(-500.f, 500.f);
+		std::uniform_real_distribution<float> angle(0.f, 6.2831853f);
+		std::vector<glm::mat4> models(count);
+		for (auto& model : models)
+			model = glm::rotate(glm::translate(glm::mat4(1.f), glm::vec3(position(random), 0.f, position(random))), angle(random), glm::vec3(0.f, 1.f, 0.f));
+		std::vector<InstanceData> instances(count);
+		std::vector<glm::vec3> mins(count), maxs(count);
+		const glm::vec3 box_min(-1.f), box_max(1.f);
+
+		// 1, 2, 4, ... threads up to the hardware ones
+		int hardware = std::max(1, (int)std::thread::hardware_concurrency());
+		std::vector<int> thread_counts;
+		for (int threads = 1; threads < hardware; threads *= 2)
+			thread_counts.push_back(threads);
+		thread_counts.push_back(hardware);
+
+		double base_transforms = 0.0, base_load = 0.0;
+		printf("%-8s %16s %8s %16s %8s %8s\n", "threads", "transforms ms", "speedup", "4x craft.obj ms", "speedup", "steals");
+		for (int threads : thread_counts)
+		{
+			JobSystem& jobs = JobSystem::GetInstance();
+			jobs.Init(threads - 1);
+			jobs.ResetStatistics();
+
+			double transforms_ms = 1e9;
+			for (int i = 0; i < kRepetitions; i++)
+			{
+				auto start = std::chrono::steady_clock::now();
+				jobs.ParallelFor(count, 256, [&](size_t begin, size_t end)
+				{
+					for (size_t n = begin; n < end; n++)
+					{
+						glm::mat3 normal = glm::transpose(glm::inverse(glm::mat3(models[n])));
+						instances[n].world_matrix = models[n];
+						instances[n].normal_matrix[0] = glm::vec4(normal[0], 0.f);
+						instances[n].normal_matrix[1] = glm::vec4(normal[1], 0.f);
+						instances[n].normal_matrix[2] = glm::vec4(normal[2], 0.f);
+						Tools::TransformBounds(box_min, box_max, models[n], mins[n], maxs[n]);
+					}
+				});
+				transforms_ms = std::min(transforms_ms, ElapsedMs(start));
+			}
+
+			// whole loads side by side, each one splitting its tangents into jobs too
+			double load_ms = 1e9;
+			for (int i = 0; i < kRepetitions; i++)
+			{
+				std::array<GeometricMesh*, 4> meshes = {};
+				auto start = std::chrono::steady_clock::now();
+				JobSystem::Job* root = jobs.CreateJob([]() {});
+				for (auto& mesh : meshes)
+				{
+					GeometricMesh** target = &mesh;
+					jobs.Run(jobs.CreateJob([target]() { OBJLoader loader; *target = loader.load("Assets/game_assets/craft.obj"); }, root));
+				}
+				jobs.Run(root);
+				jobs.Wait(root);
+				load_ms = std::min(load_ms, ElapsedMs(start));
+
+				for (auto mesh : meshes)
+					delete mesh;
+			}
+
+			if (threads == 1)
+			{
+				base_transforms = transforms_ms;
+				base_load = load_ms;
+			}
+			printf("%-8d %16.2f %8.2f %16.2f %8.2f %8zu\n", threads, transforms_ms, base_transforms / transforms_ms,
+				load_ms, base_load / load_ms, jobs.GetStatistics().steals);
+		}
+		JobSystem::GetInstance().Shutdown();
+		return 0;
+	}
+
+	int PacketPrepare()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		JobSystem& jobs = JobSystem::GetInstance();
+		jobs.Init();
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// a group and its packets per node, so the prepare grows with the scene
+		renderer->SetInstancing(false);
+		renderer->SpawnCrafts(10000);
+
+		// the maps finish loading and every part gets resolved before anything is measured
+		const float dt = 1.f / 60.f;
+		for (int i = 0; i < 60; i++)
+		{
+			renderer->Update(dt);
+			renderer->Render();
+			glFinish();
+		}
+
+		int hardware = std::max(1, (int)std::thread::hardware_concurrency());
+		std::vector<int> thread_counts;
+		for (int threads = 1; threads < hardware; threads *= 2)
+			thread_counts.push_back(threads);
+		thread_counts.push_back(hardware);
+
+		const int frames = 30;
+		double base_prepare = 0.0, base_frame = 0.0;
+		printf("%-8s %10s %12s %8s %12s %14s %8s\n", "threads", "packets", "prepare ms", "speedup", "submit ms", "cpu frame ms", "speedup");
+		for (int threads : thread_counts)
+		{
+			jobs.Init(threads - 1);
+
+			double prepare_ms = 0.0, submit_ms = 0.0, frame_ms = 0.0;
+			for (int i = 0; i < frames; i++)
+			{
+				auto start = std::chrono::steady_clock::now();
+				renderer->Update(dt);
+				renderer->Render();
+				frame_ms += ElapsedMs(start);
+				glFinish();
+
+				prepare_ms += renderer->GetPrepareMilliseconds();
+				submit_ms += renderer->GetSubmitMilliseconds();
+			}
+			prepare_ms /= frames;
+			submit_ms /= frames;
+			frame_ms /= frames;
+
+			if (threads == 1)
+			{
+				base_prepare = prepare_ms;
+				base_frame = frame_ms;
+			}
+			printf("%-8d %10zu %12.3f %8.2f %12.3f %14.3f %8.2f\n", threads, renderer->GetRenderQueueStatistics().packets,
+				prepare_ms, base_prepare / prepare_ms, submit_ms, frame_ms, base_frame / frame_ms);
+		}
+		delete renderer;
+		jobs.Shutdown();
+		return 0;
+	}
+
+	int ShadowCaching()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// still crafts around the terrain, the player's one goes back and forth as the moving caster
+		renderer->SpawnCrafts(2000);
+
+		const float dt = 1.f / 60.f;
+		const int frames = 60;
+		printf("%-10s %14s %14s\n", "caching", "shadow gpu ms", "cache redraws");
+		for (int caching = 0; caching < 2; caching++)
+		{
+			renderer->SetShadowCaching(caching == 1);
+
+			double shadow_ms = 0.0;
+			size_t updates = 0;
+			for (int i = -30; i < frames; i++)
+			{
+				if (i % 2 == 0)
+					renderer->CraftMoveForward(true);
+				else
+					renderer->CraftMoveBackward(true);
+
+				if (i == 0)
+					updates = renderer->GetShadowCacheUpdates();
+				renderer->Update(dt);
+				renderer->Render();
+				glFinish();
+				if (i >= 0)
+					shadow_ms += renderer->GetShadowMilliseconds();
+			}
+
+			printf("%-10s %14.3f %14zu\n", caching ? "on" : "off", shadow_ms / frames,
+				renderer->GetShadowCacheUpdates() - updates);
+		}
+		delete renderer;
+		return 0;
+	}
+
+	int ShadowCasterCulling()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// every caster drawn each frame, so the culling decides what the pass costs
+		renderer->SpawnCrafts(2000);
+		renderer->SetShadowCaching(false);
+
+		const float dt = 1.f / 60.f;
+		const int frames = 60;
+		printf("%-8s %12s %12s %10s %10s %14s\n", "culling", "candidates", "before near", "culled", "drawn", "shadow gpu ms");
+		for (int culling = 0; culling < 2; culling++)
+		{
+			renderer->SetShadowCasterCulling(culling == 1);
+
+			Renderer::ShadowCullStatistics total = {};
+			double shadow_ms = 0.0;
+			for (int i = -10; i < frames; i++)
+			{
+				renderer->Update(dt);
+				renderer->Render();
+				glFinish();
+				if (i < 0)
+					continue;
+
+				Renderer::ShadowCullStatistics statistics = renderer->GetShadowCullStatistics();
+				total.candidates += statistics.candidates;
+				total.before_near += statistics.before_near;
+				total.culled += statistics.culled;
+				total.drawn += statistics.drawn;
+				shadow_ms += renderer->GetShadowMilliseconds();
+			}
+
+			printf("%-8s %12zu %12zu %10zu %10zu %14.3f\n", culling ? "on" : "off", total.candidates / frames,
+				total.before_near / frames, total.culled / frames, total.drawn / frames, shadow_ms / frames);
+		}
+		delete renderer;
+		return 0;
+	}
+
+	int ShadowFilters()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// the camera is still, only the filter changes what the geometry pass costs
+		renderer->SetShadowCaching(true);
+
+		struct Mode
+		{
+			const char* name;
+			Renderer::SHADOW_FILTER filter;
+			int taps;
+			int fetches;
+		};
+		const Mode modes[] = {
+			{ "nearest", Renderer::SHADOW_FILTER_NEAREST, 0, 1 },
+			{ "pcf mean", Renderer::SHADOW_FILTER_PCF_MEAN, 0, 4 },
+			{ "pcf weighted", Renderer::SHADOW_FILTER_PCF_WEIGHTED, 0, 4 },
+			{ "hardware", Renderer::SHADOW_FILTER_HARDWARE, 0, 1 },
+			{ "poisson 4", Renderer::SHADOW_FILTER_POISSON, 4, 4 },
+			{ "poisson 8", Renderer::SHADOW_FILTER_POISSON, 8, 8 },
+			{ "poisson 16", Renderer::SHADOW_FILTER_POISSON, 16, 16 } };
+
+		const float dt = 1.f / 60.f;
+		const int frames = 60;
+		double pixels = (double)width * height;
+		printf("%-8s %-14s %8s %16s %16s\n", "light", "filter", "fetches", "geometry gpu ms", "ns per pixel");
+		for (int directional = 0; directional < 2; directional++)
+		{
+			renderer->SetDirectionalLight(directional == 1);
+			for (const Mode& mode : modes)
+			{
+				renderer->SetShadowFilter(mode.filter);
+				if (mode.taps > 0)
+					renderer->SetShadowPoissonTaps(mode.taps, 1.5f);
+
+				// the first frames compile the variant and fill the queries
+				double geometry_ms = 0.0;
+				for (int i = -10; i < frames; i++)
+				{
+					renderer->Update(dt);
+					renderer->Render();
+					glFinish();
+					if (i >= 0)
+						geometry_ms += renderer->GetGeometryMilliseconds();
+				}
+
+				geometry_ms /= frames;
+				printf("%-8s %-14s %8d %16.3f %16.3f\n", directional ? "sun" : "spot", mode.name, mode.fetches,
+					geometry_ms, geometry_ms * 1.0e6 / pixels);
+			}
+		}
+		delete renderer;
+		return 0;
+	}
+
+	int ShadowAtlasBudget()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// casters under the lights, and every light swaying so each tile falls behind every frame
+		renderer->SpawnCrafts(500);
+		renderer->SpawnShadowLights(Renderer::kMaxAtlasLights);
+		std::vector<glm::vec3> positions, targets;
+		for (int i = 0; i < renderer->GetShadowLightCount(); i++)
+		{
+			LightNode* light = renderer->GetShadowLight(i);
+			positions.push_back(light->GetPosition());
+			targets.push_back(light->GetPosition() + light->GetDirection() * 3.f);
+		}
+
+		const float dt = 1.f / 60.f;
+		const int frames = 60;
+		const int budgets[] = { 0, 16, 8, 4, 2 };
+		printf("%-8s %8s %8s %10s %10s %10s %14s\n", "budget", "visible", "tiles", "redrawn", "stale", "atlas use", "shadow gpu ms");
+		for (int budget : budgets)
+		{
+			renderer->SetShadowAtlasBudget(budget);
+
+			Renderer::ShadowAtlasStatistics total = {};
+			double shadow_ms = 0.0;
+			for (int i = -10; i < frames; i++)
+			{
+				for (int l = 0; l < (int)positions.size(); l++)
+				{
+					glm::vec3 sway(0.2f * std::sin(i * dt * 4.f + l), 0.f, 0.f);
+					renderer->GetShadowLight(l)->SetPosition(positions[l] + sway);
+					renderer->GetShadowLight(l)->SetTarget(targets[l] + sway);
+				}
+				renderer->Update(dt);
+				renderer->Render();
+				glFinish();
+				if (i < 0)
+					continue;
+
+				Renderer::ShadowAtlasStatistics statistics = renderer->GetShadowAtlasStatistics();
+				total.visible += statistics.visible;
+				total.tiles += statistics.tiles;
+				total.redrawn += statistics.redrawn;
+				total.stale += statistics.stale;
+				total.used_texels += statistics.used_texels;
+				shadow_ms += renderer->GetShadowMilliseconds();
+			}
+
+			double atlas_texels = 4096.0 * 4096.0;
+			printf("%-8d %8zu %8zu %10.1f %10.1f %9.1f%% %14.3f\n", budget, total.visible / frames, total.tiles / frames,
+				total.redrawn / (double)frames, total.stale / (double)frames, 100.0 * total.used_texels / frames / atlas_texels,
+				shadow_ms / frames);
+		}
+		delete renderer;
+		return 0;
+	}
+
+	int PointShadowFaces()
+	{
+		const int width = 1024, height = 860;
+		HiddenContext gl;
+		if (!gl.Create(width, height))
+			return 1;
+
+		Renderer* renderer = new Renderer();
+		if (!renderer->Init(width, height))
+		{
+			delete renderer;
+			return 1;
+		}
+
+		// casters all around the light, the whole cube is redrawn every frame
+		renderer->SpawnCrafts(500);
+		renderer->SetPointLight(true);
+		renderer->SetPointLightRange(30.f);
+
+		const float dt = 1.f / 60.f;
+		const int frames = 60;
+		printf("%-10s %8s %16s %8s %14s\n", "faces", "casters", "face submissions", "batches", "shadow gpu ms");
+		for (int culling = 0; culling < 2; culling++)
+		{
+			renderer->SetPointFaceCulling(culling == 1);
+
+			Renderer::PointShadowStatistics total = {};
+			double shadow_ms = 0.0;
+			for (int i = -10; i < frames; i++)
+			{
+				renderer->Update(dt);
+				renderer->Render();
+				glFinish();
+				if (i < 0)
+					continue;
+
+				Renderer::PointShadowStatistics statistics = renderer->GetPointShadowStatistics();
+				total.casters += statistics.casters;
+				total.face_submissions += statistics.face_submissions;
+				total.batches += statistics.batches;
+				shadow_ms += renderer->GetShadowMilliseconds();
+			}
+
+			printf("%-10s %8zu %16zu %8zu %14.3f\n", culling ? "overlapped" : "all six", total.casters / frames,
+				total.face_submissions / frames, total.batches / frames, shadow_ms / frames);
+		}
+		delete renderer;
+		return 0;
+	}
+};
@@ -0,0 +1,59 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+/* Headless benchmarks, run instead of the demo:
+Lab3 --bench <name> [--workers <count>]
+-- Timings go to stdout
+*/
+namespace Benchmarks
+{
+	// Run the benchmark named on the command line, -1 when none was asked for
+	int Run(int argc, char* argv[]);
+
+	// Decode the game asset PNGs with SDL_image and with PNGDecoder, compare time and pixels
+	int PNGDecode();
+
+	// CPU time of 10k uniform uploads through string keys and through typed handles
+	int UniformUploads();
+
+	// Time to build the renderer's programs from source and from the program binary cache
+	int ShaderStartup();
+
+	// GL state calls per frame of the demo scene with and without GLState filtering
+	int StateChanges();
+
+	// State changes per frame of the demo scene with the draws in scene order and sorted by key
+	int RenderQueueOrder();
+
+	// Frame time of the demo scene with 10k extra crafts, one draw per node and instanced
+	int Instancing();
+
+	// Frustum culling of 100k random boxes on the scalar, SSE and AVX paths and with the AABB tree
+	int FrustumCulling();
+
+	// CPU time of the geometry submit at growing scene sizes, a draw call per part and multi draw indirect
+	int MultiDraw();
+
+	// Instance transforms and OBJ loads on the job system with 1 to N threads
+	int JobScaling();
+
+	// Geometry pass prepare and CPU frame time of 10k crafts drawn one by one with 1 to N threads
+	int PacketPrepare();
+
+	// GPU time of the shadow pass with 2000 still crafts and a moving one, redrawn every frame and cached
+	int ShadowCaching();
+
+	// Spotlight casters per frame found, culled for shadowing no visible receiver and drawn, with the shadow pass time
+	int ShadowCasterCulling();
+
+	// GPU time of the geometry pass per shadow filter, shader compares, hardware compare and poisson taps
+	int ShadowFilters();
+
+	// Shadow atlas of 32 swaying spotlights, tiles redrawn and left stale per frame and the shadow pass time at each budget
+	int ShadowAtlasBudget();
+
+	// Point light cube drawn in one layered pass, casters sent to all six faces or only the ones they overlap
+	int PointShadowFaces();
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "RenderThread.h"
+#include "Renderer.h"
+#include "helpers/JobSystem.h"
+#include <chrono>
+#include <cstdio>
+
+RenderThread::RenderThread()
+{
+	renderer = nullptr;
+	window = nullptr;
+	context = nullptr;
+	running = false;
+	stop = false;
+	frames = 0;
+	frameMs = 0.0;
+}
+
+RenderThread::~RenderThread()
+{
+	Stop();
+}
+
+bool RenderThread::Start(Renderer* renderer, SDL_Window* window, SDL_GLContext context)
+{
+	if (running)
+		return true;
+
+	this->renderer = renderer;
+	this->window = window;
+	this->context = context;
+
+	// a context is current on one thread at a time
+	if (SDL_GL_MakeCurrent(window, nullptr) != 0)
+	{
+		printf("Could not release the GL context: %s\n", SDL_GetError());
+		return false;
+	}
+
+	stop = false;
+	running = true;
+	thread = std::thread(&RenderThread::Loop, this);
+
+	printf("Render thread: %d frame latency\n", renderer->GetFrameLatency());
+	return true;
+}
+
+void RenderThread::Stop()
+{
+	if (!running)
+		return;
+
+	stop = true;
+	thread.join();
+	running = false;
+
+	SDL_GL_MakeCurrent(window, context);
+}
+
+void RenderThread::Post(std::function<void()> command)
+{
+	std::lock_guard<std::mutex> lock(commandMutex);
+	commands.push_back(std::move(command));
+}
+
+void RenderThread::Loop()
+{
+	if (SDL_GL_MakeCurrent(window, context) != 0)
+	{
+		printf("Could not make the GL context current on the render thread: %s\n", SDL_GetError());
+		renderer->CloseFrames();
+		return;
+	}
+
+	// culling and instance building submit jobs from here too
+	JobSystem::GetInstance().Attach();
+
+	auto frame_start = std::chrono::steady_clock::now();
+	while (!stop)
+	{
+		{
+			std::lock_guard<std::mutex> lock(commandMutex);
+			pending.swap(commands);
+		}
+		for (auto& command : pending)
+			command();
+		pending.clear();
+
+		// nothing new within the wait, check for stop and commands again
+		if (!renderer->Render())
+			continue;
+
+		SDL_GL_SwapWindow(window);
+
+		auto frame_end = std::chrono::steady_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(frame_end - frame_start).count();
+		frameMs = frameMs * 0.9 + ms * 0.1;
+		frame_start = frame_end;
+		frames++;
+	}
+
+	JobSystem::GetInstance().Detach();
+	// the simulation must not wait on frames no one draws anymore
+	renderer->CloseFrames();
+	SDL_GL_MakeCurrent(window, nullptr);
+}
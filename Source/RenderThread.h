@@ -0,0 +1,54 @@
+#ifndef BIM_ENGINE_RENDER_THREAD_H
+#define BIM_ENGINE_RENDER_THREAD_H
+
+#include "SDL2/SDL.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Renderer;
+
+// Thread that owns the GL context, draws the renderer's snapshots and swaps the window.
+// The simulation stays on the thread that starts it, anything else that needs GL is posted
+// and runs before the next frame.
+class RenderThread
+{
+public:
+	RenderThread();
+	~RenderThread();
+
+	// Release the context on the calling thread and render on a new one, with the renderer's frame latency
+	bool Start(Renderer* renderer, SDL_Window* window, SDL_GLContext context);
+	// Finish the frame in flight and make the context current on the calling thread again
+	void Stop();
+	bool IsRunning() const { return running; }
+
+	// Run a command on the render thread before its next frame
+	void Post(std::function<void()> command);
+
+	// frames drawn and the average time of the last ones, swap included
+	unsigned long GetFrameCount() const { return frames; }
+	double GetFrameMilliseconds() const { return frameMs; }
+
+private:
+	Renderer* renderer;
+	SDL_Window* window;
+	SDL_GLContext context;
+
+	std::thread thread;
+	std::atomic<bool> running;
+	std::atomic<bool> stop;
+
+	std::mutex commandMutex;
+	std::vector<std::function<void()>> commands;
+	std::vector<std::function<void()>> pending;
+
+	std::atomic<unsigned long> frames;
+	std::atomic<double> frameMs;
+
+	void Loop();
+};
+
+#endif
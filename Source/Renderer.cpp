@@ -3,11 +3,18 @@
 #include "helpers/Tools.h"
 #include "helpers/OBJLoader.h"
 #include "helpers/ShaderProgram.h"
+#include "helpers/TextureManager.h"
+#include "helpers/GLState.h"
+#include "helpers/JobSystem.h"
 #include "glm/gtc/type_ptr.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
 #include <algorithm>
 #include <array>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <iostream>
 
 // RENDERER
@@ -15,6 +22,45 @@ Renderer::Renderer()
 {
 	this->m_nodes = {};
 	this->m_continous_time = 0.0;
+
+	// pooled material maps skip the per-texture mip streaming
+	this->m_use_texture_arrays = false;
+	this->m_frame_ubo = 0;
+
+	this->m_post_features = 0;
+	this->m_shadow_filter = SHADOW_FILTER_PCF_WEIGHTED;
+	this->m_shadow_poisson_taps = 8;
+	this->m_shadow_poisson_radius = 1.5f;
+	this->m_instancing = true;
+	this->m_multi_draw = true;
+	this->m_multi_draw_supported = false;
+	this->m_geometry_instance_base = 0;
+	this->m_instance_pass_count = 0;
+	this->m_submit_ms = 0.0;
+	this->m_prepare_ms = 0.0;
+	this->m_prepared_slices = 0;
+	this->m_shadow_caching = true;
+	this->m_shadow_caster_culling = true;
+	this->m_shadow_cull_statistics = {};
+	this->m_shadow_cache_valid = false;
+	this->m_shadow_cache_dirty = false;
+	this->m_shadow_cache_revision = 0;
+	this->m_shadow_cache_updates = 0;
+	this->m_frame_index = 0;
+	this->m_shadow_queries[0] = this->m_shadow_queries[1] = 0;
+	this->m_shadow_query_issued[0] = this->m_shadow_query_issued[1] = false;
+	this->m_shadow_ms = 0.0;
+	this->m_geometry_queries[0] = this->m_geometry_queries[1] = 0;
+	this->m_geometry_query_issued[0] = this->m_geometry_query_issued[1] = false;
+	this->m_geometry_ms = 0.0;
+	this->m_point_face_culling = true;
+	this->m_point_shadow_statistics = {};
+	this->m_shadow_atlas_budget = 4;
+	this->m_shadow_atlas_statistics = {};
+	this->m_lights_ubo = 0;
+	this->m_simulation.time = 0.f;
+	this->m_frame = nullptr;
+	this->m_frame_latency = 0;
 }
 
 Renderer::~Renderer()
@@ -24,6 +70,16 @@ Renderer::~Renderer()
 
 	glDeleteVertexArrays(1, &m_vao_fbo);
 	glDeleteBuffers(1, &m_vbo_fbo_vertices);
+
+	glDeleteBuffers(1, &m_frame_ubo);
+	glDeleteBuffers(1, &m_lights_ubo);
+	glDeleteQueries(2, m_shadow_queries);
+	glDeleteQueries(2, m_geometry_queries);
+	m_instance_ring.Destroy();
+	m_command_ring.Destroy();
+	m_draw_material_ring.Destroy();
+
+	ShaderCompiler::GetInstance().Shutdown();
 }
 
 // INIT
@@ -32,7 +88,25 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 	this->m_screen_width = SCREEN_WIDTH;
 	this->m_screen_height = SCREEN_HEIGHT;
 
+	// link from the binary cache when the sources and the driver are unchanged
+	ShaderProgram::EnableBinaryCache("ShaderCache");
+	auto shaders_start = std::chrono::steady_clock::now();
 	bool techniques_initialization = InitShaders();
+	int cached_programs = 0, compiled_programs = 0;
+	ShaderProgram::GetBinaryCacheStatistics(cached_programs, compiled_programs);
+	printf("Shaders ready in %.1f ms (%d from the binary cache, %d compiled)\n",
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shaders_start).count(),
+		cached_programs, compiled_programs);
+
+	// later rebuilds happen off the frame and start on their own when a shader is saved
+	ShaderCompiler::GetInstance().Init();
+	m_shader_watcher.Watch("Assets/Shaders");
+
+	TextureManager::GetInstance().EnableBuiltinPNG(true);
+	TextureManager::GetInstance().EnableStreaming(64 * 1024 * 1024);
+	TextureManager::GetInstance().EnableTextureArrays(m_use_texture_arrays);
+	// decodes go to the job system when it has workers
+	TextureManager::GetInstance().EnableAsyncUploads((JobSystem::GetInstance().GetWorkerCount() > 0) ? 0 : 2, 32 * 1024 * 1024);
 
 	bool meshes_initialization = InitGeometricMeshes();
 
@@ -40,6 +114,7 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 
 	bool common_initialization = InitCommonItems();
 	bool inter_buffers_initialization = InitIntermediateBuffers();
+	bool uniform_buffers_initialization = InitUniformBuffers();
 
 	//If there was any errors
 	if (Tools::CheckGLError() != GL_NO_ERROR)
@@ -51,9 +126,14 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 	this->BuildWorld();
 	this->InitCamera();
 
+	// the first snapshot, Render always has one to draw
+	this->CaptureTransforms();
+	this->UpdateWorldBounds();
+	m_frames.Publish(m_simulation);
+
 	//If everything initialized
 	return techniques_initialization && meshes_initialization &&
-		common_initialization && inter_buffers_initialization;
+		common_initialization && inter_buffers_initialization && uniform_buffers_initialization;
 }
 
 	bool Renderer::InitShaders()
@@ -61,16 +141,44 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 		std::string vertex_shader_path = "Assets/Shaders/basic_rendering.vert";
 		std::string fragment_shader_path = "Assets/Shaders/basic_rendering.frag";
 
-		m_geometry_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
-		m_geometry_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
-		m_geometry_program.CreateProgram();
+		// same order as GEOMETRY_FEATURES
+		m_geometry_variants.Init(vertex_shader_path.c_str(), fragment_shader_path.c_str(),
+			{ "HAS_TEX_DIFFUSE", "HAS_TEX_NORMAL", "IS_TEX_BUMP", "TEX_DIFFUSE_ARRAY", "TEX_NORMAL_ARRAY",
+			  "CAST_SHADOWS", "SHADOW_NEAREST", "SHADOW_PCF_MEAN", "MULTI_DRAW", "CASCADED_SHADOWS",
+			  "SHADOW_HARDWARE", "SHADOW_POISSON" });
+		m_geometry_variants.DeclareTextureSlot(TEXTURE_SLOT_DIFFUSE, "uniform_tex_diffuse");
+		m_geometry_variants.DeclareTextureSlot(TEXTURE_SLOT_NORMAL, "uniform_tex_normal");
+		m_geometry_variants.DeclareTextureSlot(TEXTURE_SLOT_BUMP, "uniform_tex_normal");
+		m_geometry_variants.DeclareTextureSlot(TEXTURE_SLOT_DIFFUSE, "uniform_tex_diffuse_array");
+		m_geometry_variants.DeclareTextureSlot(TEXTURE_SLOT_NORMAL, "uniform_tex_normal_array");
+		m_geometry_variants.DeclareTextureSlot(TEXTURE_SLOT_BUMP, "uniform_tex_normal_array");
+		m_geometry_variants.BindUniformBlock("FrameBlock", UNIFORM_BLOCK_FRAME);
+		m_geometry_variants.BindUniformBlock("MaterialBlock", UNIFORM_BLOCK_MATERIAL);
+		m_geometry_variants.BindUniformBlock("LightsBlock", UNIFORM_BLOCK_LIGHTS);
+
+		// fixed texture units
+		m_geometry_variants.BindSampler("uniform_tex_diffuse", 0);
+		m_geometry_variants.BindSampler("uniform_tex_normal", 1);
+		m_geometry_variants.BindSampler("uniform_shadow_map", 2);
+		m_geometry_variants.BindSampler("uniform_tex_diffuse_array", 3);
+		m_geometry_variants.BindSampler("uniform_tex_normal_array", 4);
+		m_geometry_variants.BindSampler("uniform_shadow_cascades", 5);
+		m_geometry_variants.BindSampler("uniform_shadow_map_compare", 6);
+		m_geometry_variants.BindSampler("uniform_shadow_cascades_compare", 7);
+		m_geometry_variants.BindSampler("uniform_shadow_atlas", 8);
+		m_geometry_variants.BindSampler("uniform_shadow_cube", 9);
+
+		// the common combinations up front, the rest on first use
+		m_geometry_variants.Precompile("Assets/Shaders/basic_rendering.variants");
 
 		vertex_shader_path = "Assets/Shaders/post_process.vert";
 		fragment_shader_path = "Assets/Shaders/post_process.frag";
 
-		m_post_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
-		m_post_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
-		m_post_program.CreateProgram();
+		// same order as POST_FEATURES
+		m_post_variants.Init(vertex_shader_path.c_str(), fragment_shader_path.c_str(), { "PREVIEW_SHADOW_MAP", "CROSS_HAIR" });
+		m_post_variants.BindSampler("uniform_texture", 0);
+		m_post_variants.BindSampler("uniform_shadow_map", 1);
+		m_post_variants.Get(m_post_features);
 
 		vertex_shader_path = "Assets/Shaders/shadow_map_rendering.vert";
 		fragment_shader_path = "Assets/Shaders/shadow_map_rendering.frag";
@@ -79,24 +187,55 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 		m_spot_light_shadow_map_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
 		m_spot_light_shadow_map_program.CreateProgram();
 
+		// the point light's cube in one pass, the geometry stage routes the triangles to the faces
+		m_point_shadow_program.LoadVertexShaderFromFile("Assets/Shaders/shadow_cube_rendering.vert");
+		m_point_shadow_program.LoadGeometryShaderFromFile("Assets/Shaders/shadow_cube_rendering.geom");
+		m_point_shadow_program.LoadFragmentShaderFromFile("Assets/Shaders/shadow_cube_rendering.frag");
+		m_point_shadow_program.CreateProgram();
+
+		InitUniformHandles();
+
 		return true;
 	}
 
+	void Renderer::InitUniformHandles()
+	{
+		m_shadow_projection_matrix = m_spot_light_shadow_map_program.GetUniform<glm::mat4>("uniform_projection_matrix");
+		m_point_face_projection_view = m_point_shadow_program.GetUniform<glm::mat4>("uniform_face_projection_view");
+		m_point_face_mask = m_point_shadow_program.GetUniform<int>("uniform_face_mask");
+	}
+
 	bool Renderer::InitGeometricMeshes()
 	{
 		std::array<const char*, 2> assets = { "Assets/game_assets/terrain.obj", "Assets/game_assets/craft.obj" };
 
 		bool initialized = true;
-		OBJLoader loader;
 
-		for (auto& asset : assets)
+		// the files parse side by side, the GL objects are made here once they are read
+		std::array<GeometricMesh*, 3> meshes = {};
+		JobSystem& jobs = JobSystem::GetInstance();
+		JobSystem::Job* parse = jobs.CreateJob([]() {});
+		for (size_t i = 0; i < meshes.size(); i++)
 		{
-			GeometricMesh* mesh = loader.load(asset);
+			const char* asset = (i < assets.size()) ? assets[i] : assets[1];
+			GeometricMesh** mesh = &meshes[i];
+			jobs.Run(jobs.CreateJob([asset, mesh]()
+			{
+				OBJLoader loader;
+				*mesh = loader.load(asset);
+			}, parse));
+		}
+		jobs.Run(parse);
+		jobs.Wait(parse);
+
+		for (size_t i = 0; i < assets.size(); i++)
+		{
+			GeometricMesh* mesh = meshes[i];
 
 			if (mesh != nullptr)
 			{
 				GeometryNode* node = new GeometryNode();
-				node->Init(asset, mesh);
+				node->Init(assets[i], mesh);
 				this->m_nodes.push_back(node);
 				delete mesh;
 			}
@@ -106,7 +245,7 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 			}
 		}
 
-		GeometricMesh* mesh = loader.load(assets[1]);
+		GeometricMesh* mesh = meshes[2];
 
 		if (mesh != nullptr)
 		{
@@ -127,24 +266,55 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 		this->m_light.SetConeSize(120, 120);
 		this->m_light.CastShadow(true);
 
-		return true;
+		// the tiles of the atlas lights, none until some are added
+		return this->m_shadow_atlas.Init(kShadowAtlasResolution, kShadowAtlasMinTile);
+	}
+
+	bool Renderer::InitUniformBuffers()
+	{
+		glGenBuffers(1, &m_frame_ubo);
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, m_frame_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_DYNAMIC_DRAW);
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+
+		glGenBuffers(1, &m_lights_ubo);
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, m_lights_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(LightsBlock), NULL, GL_DYNAMIC_DRAW);
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+
+		// room for about 18k instances per frame to start with, UpdateInstances grows the sections to what a frame needs
+		bool ring_initialized = m_instance_ring.Init(4 * 1024 * 1024, 3, GL_ARRAY_BUFFER);
+
+		// indirect draws need base instance and the draw id, GL 3.3 contexts take the loop instead
+		m_multi_draw_supported = GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance && GLEW_ARB_shader_draw_parameters;
+		if (m_multi_draw_supported)
+		{
+			// 16k commands and the materials of about 20k draws to start with, grown to what a frame needs
+			ring_initialized = ring_initialized && m_command_ring.Init(256 * 1024, 3, GL_DRAW_INDIRECT_BUFFER);
+			ring_initialized = ring_initialized && m_draw_material_ring.Init(1024 * 1024);
+		}
+
+		return m_frame_ubo != 0 && m_lights_ubo != 0 && ring_initialized;
 	}
 
 	bool Renderer::InitCommonItems()
 	{
 		glGenVertexArrays(1, &m_vao_fbo);
-		glBindVertexArray(m_vao_fbo);
+		GLState::GetInstance().BindVertexArray(m_vao_fbo);
 
 		GLfloat fbo_vertices[] = { -1, -1, 1, -1, -1, 1, 1, 1, };
 
 		glGenBuffers(1, &m_vbo_fbo_vertices);
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_fbo_vertices);
+		GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, m_vbo_fbo_vertices);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(fbo_vertices), fbo_vertices, GL_STATIC_DRAW);
 
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
-		glBindVertexArray(0);
+		GLState::GetInstance().BindVertexArray(0);
+
+		glGenQueries(2, m_shadow_queries);
+		glGenQueries(2, m_geometry_queries);
 		return true;
 	}
 
@@ -179,58 +349,94 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 
 	void Renderer::InitCamera()
 	{
-		GeometryNode& craft = *this->m_nodes[OBJECS::CRAFT];
-
-		this->m_camera_position = glm::vec3(craft_x * 0.02 , (craft_y * 0.02) + 0.5, (craft_z * 0.02) + 1.5);
-		this->m_camera_target_position = glm::vec3(craft_x * 0.02 , craft_y * 0.02 , craft_z * 0.02);
-		this->m_camera_up_vector = glm::vec3(0, 1, 0);
-
-		this->m_view_matrix = glm::lookAt(
-			this->m_camera_position,
-			this->m_camera_target_position,
-			m_camera_up_vector);
-
-		this->m_projection_matrix = glm::perspective(
-			glm::radians(45.f),
-			this->m_screen_width / (float)this->m_screen_height,
-			0.1f, 100.f);
+		this->UpdateCamera(0.f);
 	}
 
 // UPDATE
 void Renderer::Update(float dt)
 {
+	// simulation side, everything it produces goes into the snapshot and nothing GL is touched
 	this->UpdateGeometry(dt);
 	this->UpdateCamera(dt);
+	this->UpdateWorldBounds();
 	m_continous_time += dt;
+	m_simulation.time = m_continous_time;
+
+	// blocks while the render side is m_frame_latency frames behind
+	m_frames.Publish(m_simulation);
 }
 
 	void Renderer::UpdateGeometry(float dt)
 	{
-		GeometryNode& craft = *this->m_nodes[OBJECS::CRAFT];
-
-		craft.model_matrix = glm::translate(glm::mat4(1.f), glm::vec3(craft_x, craft_y, craft_z));
-		craft.app_model_matrix = craft.model_matrix;
-
+		m_simulation.node_transforms[OBJECS::CRAFT] = glm::translate(glm::mat4(1.f), glm::vec3(craft_x, craft_y, craft_z));
 	}
 		
 	void Renderer::UpdateCamera(float dt)
 	{
-		GeometryNode& craft = *this->m_nodes[OBJECS::CRAFT];
+		m_simulation.camera_position = glm::vec3(craft_x * 0.02, (craft_y * 0.02) + 0.5, (craft_z * 0.02) + 1.5);
+		m_simulation.camera_target_position = glm::vec3(craft_x * 0.02, craft_y * 0.02, craft_z * 0.02);
+		m_simulation.camera_up_vector = glm::vec3(0, 1, 0);
+
+		m_simulation.view_matrix = glm::lookAt(
+			m_simulation.camera_position,
+			m_simulation.camera_target_position,
+			m_simulation.camera_up_vector);
+	}
 
-		this->m_camera_position = glm::vec3(craft_x * 0.02, (craft_y * 0.02) + 0.5, (craft_z * 0.02) + 1.5);
-		this->m_camera_target_position = glm::vec3(craft_x * 0.02, craft_y * 0.02, craft_z * 0.02);
-		this->m_camera_up_vector = glm::vec3(0, 1, 0);
+	void Renderer::CaptureTransforms()
+	{
+		// m_nodes followed by m_collidables_nodes, as the render side last placed them
+		m_simulation.node_transforms.clear();
+		for (auto node : m_nodes)
+			m_simulation.node_transforms.push_back(node->app_model_matrix);
+		for (auto node : m_collidables_nodes)
+			m_simulation.node_transforms.push_back(node->app_model_matrix);
+	}
 
-		this->m_view_matrix = glm::lookAt(
-			this->m_camera_position,
-			this->m_camera_target_position,
-			m_camera_up_vector);
+	void Renderer::SetFrameLatency(int frames)
+	{
+		// 0 renders on the simulation thread, a newer snapshot simply replaces an unrendered one
+		m_frame_latency = std::max(0, frames);
+		m_frames.Init(std::max(1, m_frame_latency), m_frame_latency > 0);
+		m_frame = nullptr;
+		m_frames.Publish(m_simulation);
+	}
 
-		this->m_projection_matrix = glm::perspective(
-			glm::radians(45.f),
-			this->m_screen_width / (float)this->m_screen_height,
-			0.1f, 100.f);
+	void Renderer::CloseFrames()
+	{
+		m_frames.Close();
+	}
 
+	bool Renderer::AcquireFrame()
+	{
+		// a render thread waits a while for the simulation, then gives up so it can be stopped
+		bool fresh = false;
+		std::chrono::milliseconds timeout((m_frame_latency > 0) ? 50 : 0);
+		const FrameState* frame = m_frames.Acquire(timeout, fresh);
+		if (frame == nullptr || (m_frame_latency > 0 && !fresh))
+			return false;
+
+		m_frame = frame;
+		m_view_matrix = frame->view_matrix;
+		m_camera_position = frame->camera_position;
+		m_camera_target_position = frame->camera_target_position;
+		m_camera_up_vector = frame->camera_up_vector;
+
+		// nodes spawned after the snapshot keep their own transform. New ones count as just moved,
+		// and so does every node whose transform differs from the one it was last drawn with
+		m_frame_index++;
+		size_t count = std::min(frame->node_transforms.size(), m_nodes.size() + m_collidables_nodes.size());
+		if (m_node_moved_frames.size() != count)
+			m_node_moved_frames.resize(count, m_frame_index);
+		for (size_t i = 0; i < count; i++)
+		{
+			GeometryNode* node = (i < m_nodes.size()) ? m_nodes[i] : m_collidables_nodes[i - m_nodes.size()];
+			if (node->app_model_matrix != frame->node_transforms[i])
+				m_node_moved_frames[i] = m_frame_index;
+			node->model_matrix = frame->node_transforms[i];
+			node->app_model_matrix = frame->node_transforms[i];
+		}
+		return true;
 	}
 
 // HELPERS
@@ -239,24 +445,29 @@ bool Renderer::ResizeBuffers(int width, int height)
 		m_screen_width = width;
 		m_screen_height = height;
 
+		this->m_projection_matrix = glm::perspective(
+			glm::radians(45.f),
+			this->m_screen_width / (float)this->m_screen_height,
+			0.1f, 100.f);
+
 		// texture
-		glBindTexture(GL_TEXTURE_2D, m_fbo_texture);
+		GLState::GetInstance().BindTexture(GL_TEXTURE_2D, m_fbo_texture);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
-		glBindTexture(GL_TEXTURE_2D, m_fbo_depth_texture);
+		GLState::GetInstance().BindTexture(GL_TEXTURE_2D, m_fbo_depth_texture);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_screen_width, m_screen_height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-		glBindTexture(GL_TEXTURE_2D, 0);
+		GLState::GetInstance().BindTexture(GL_TEXTURE_2D, 0);
 
 		// framebuffer to link to everything together
-		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_fbo_texture, 0);
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_fbo_depth_texture, 0);
 
@@ -266,25 +477,233 @@ bool Renderer::ResizeBuffers(int width, int height)
 			return false;
 		}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
 
 		return true;
 	}
 
 bool Renderer::ReloadShaders()
 	{
-		m_geometry_program.ReloadProgram();
-		m_post_program.ReloadProgram();
+		// every program keeps rendering with its previous build until the new one links
+		m_geometry_variants.BeginReload();
+		m_post_variants.BeginReload();
+		m_spot_light_shadow_map_program.BeginReload();
+		m_point_shadow_program.BeginReload();
 		return true;
 	}
 
+	void Renderer::UpdateShaders()
+	{
+		if (m_shader_watcher.Poll())
+			ReloadShaders();
+
+		int swapped = m_geometry_variants.PollReload() + m_post_variants.PollReload();
+		if (m_spot_light_shadow_map_program.PollReload())
+			swapped++;
+		if (m_point_shadow_program.PollReload())
+			swapped++;
+		if (swapped > 0)
+		{
+			printf("Reloaded %d shader programs\n", swapped);
+			// the new programs may sample other maps
+			m_part_states.clear();
+		}
+	}
+
+	void Renderer::TogglePostFeature(unsigned int feature)
+	{
+		m_post_features ^= feature;
+	}
+
+	void Renderer::CycleShadowFilter()
+	{
+		m_shadow_filter = (SHADOW_FILTER)((m_shadow_filter + 1) % SHADOW_FILTER_COUNT);
+	}
+
+	void Renderer::SetShadowFilter(SHADOW_FILTER filter)
+	{
+		m_shadow_filter = filter;
+	}
+
+	void Renderer::SetShadowPoissonTaps(int taps, float radius)
+	{
+		m_shadow_poisson_taps = std::max(1, std::min(16, taps));
+		m_shadow_poisson_radius = radius;
+	}
+
+	void Renderer::SetInstancing(bool enable)
+	{
+		m_instancing = enable;
+	}
+
+	void Renderer::SpawnCrafts(int count)
+	{
+		// rows ahead of the craft, every copy shares the craft's asset and parts
+		GeometryNode& craft = *this->m_nodes[OBJECS::CRAFT];
+		int side = (int)std::ceil(std::sqrt((float)count));
+		for (int i = 0; i < count; i++)
+		{
+			GeometryNode* node = new GeometryNode();
+			node->InitCopy(craft);
+
+			glm::vec3 offset((i % side - side / 2) * 20.f, 0.f, -(i / side) * 20.f - 60.f);
+			node->model_matrix = glm::translate(glm::mat4(1.f), glm::vec3(craft_x, craft_y, craft_z) + offset);
+			node->app_model_matrix = node->model_matrix;
+			this->m_nodes.push_back(node);
+		}
+
+		// the copies go into the next snapshot right away
+		CaptureTransforms();
+		m_simulation.node_transforms[OBJECS::CRAFT] = glm::translate(glm::mat4(1.f), glm::vec3(craft_x, craft_y, craft_z));
+		UpdateWorldBounds();
+		m_frames.Publish(m_simulation);
+	}
+
+	int Renderer::AddShadowLight(const glm::vec3& position, const glm::vec3& target, const glm::vec3& color, float cone)
+	{
+		if ((int)m_atlas_lights.size() >= kMaxAtlasLights)
+			return -1;
+
+		// the light never casts through its own maps, its tile in the atlas is its shadow map
+		AtlasLight atlas_light = {};
+		atlas_light.light.reset(new LightNode());
+		atlas_light.light->SetPosition(position);
+		atlas_light.light->SetTarget(target);
+		atlas_light.light->SetColor(color);
+		atlas_light.light->SetConeSize(cone, cone);
+		atlas_light.tile = { 0, 0, 0, -1 };
+		m_atlas_lights.push_back(std::move(atlas_light));
+		return (int)m_atlas_lights.size() - 1;
+	}
+
+	LightNode* Renderer::GetShadowLight(int light)
+	{
+		if (light < 0 || light >= (int)m_atlas_lights.size())
+			return nullptr;
+		return m_atlas_lights[light].light.get();
+	}
+
+	void Renderer::SpawnShadowLights(int count)
+	{
+		// looking down from above the ground the main light points at, a little off vertical
+		// so the view up vector stays usable. Later calls carry on along the grid
+		glm::vec3 center = m_light.GetPosition() + m_light.GetDirection() * 5.f;
+		int side = (int)std::ceil(std::sqrt((float)kMaxAtlasLights));
+		int first = (int)m_atlas_lights.size();
+		for (int i = first; i < first + count; i++)
+		{
+			glm::vec3 offset((i % side - side / 2) * 2.f, 0.f, (i / side - side / 2) * 2.f);
+			glm::vec3 position = center + offset + glm::vec3(0.f, 3.f, 0.f);
+			if (AddShadowLight(position, center + offset + glm::vec3(0.f, 0.f, 0.5f), glm::vec3(30.f), 70.f) < 0)
+				break;
+		}
+	}
+
+	void Renderer::SetShadowAtlasBudget(int tiles)
+	{
+		m_shadow_atlas_budget = tiles;
+	}
+
+	void Renderer::SetMultiDraw(bool enable)
+	{
+		m_multi_draw = enable;
+	}
+
+	void Renderer::SetSortedDraws(bool enable)
+	{
+		m_render_queue.EnableSorting(enable);
+	}
+
+	void Renderer::SetDirectionalLight(bool enable)
+	{
+		// the spotlight's color falls off with the squared distance, the sun's does not
+		m_light.SetType(enable ? LightNode::LIGHT_DIRECTIONAL : LightNode::LIGHT_SPOT);
+		m_light.SetColor(enable ? glm::vec3(2.5f) : glm::vec3(250.f));
+	}
+
+	bool Renderer::IsDirectionalLight()
+	{
+		return m_light.GetType() == LightNode::LIGHT_DIRECTIONAL;
+	}
+
+	void Renderer::SetPointLight(bool enable)
+	{
+		// falls off with the squared distance like the spotlight
+		m_light.SetType(enable ? LightNode::LIGHT_POINT : LightNode::LIGHT_SPOT);
+		m_light.SetColor(glm::vec3(250.f));
+	}
+
+	bool Renderer::IsPointLight()
+	{
+		return m_light.GetType() == LightNode::LIGHT_POINT;
+	}
+
+	void Renderer::SetPointLightRange(float range)
+	{
+		m_light.SetPointRange(range);
+	}
+
+	void Renderer::SetPointFaceCulling(bool enable)
+	{
+		m_point_face_culling = enable;
+	}
+
+	void Renderer::SetShadowCascades(int count, float distance)
+	{
+		m_light.SetCascades(count, distance);
+	}
+
+	void Renderer::SetShadowCascadeResolution(int cascade, int resolution)
+	{
+		m_light.SetCascadeResolution(cascade, resolution);
+	}
+
+	void Renderer::SetShadowCascadeSplitLambda(float lambda)
+	{
+		m_light.SetCascadeSplitLambda(lambda);
+	}
+
+	void Renderer::SetShadowCascadeSplits(const std::vector<float>& splits)
+	{
+		m_light.SetCascadeSplits(splits);
+	}
+
+	void Renderer::SetShadowCasterCulling(bool enable)
+	{
+		m_shadow_caster_culling = enable;
+	}
+
+	void Renderer::SetShadowCaching(bool enable)
+	{
+		m_shadow_caching = enable;
+		m_shadow_cache_valid = false;
+	}
+
+	RenderQueue::Statistics Renderer::GetRenderQueueStatistics() const
+	{
+		return m_render_queue.GetStatistics();
+	}
+
 /// RENDER
-void Renderer::Render()
+bool Renderer::Render()
 {
+	if (!AcquireFrame())
+		return false;
+
+	UpdateShaders();
+	UpdateTextureStreaming();
+	UpdateCulling();
+	UpdateShadowAtlas();
+	UpdateInstances();
+
 	RenderShadowMaps();
 	RenderGeometry();
 	RenderPostProcess();
 
+	m_instance_ring.End();
+
+	GLState::GetInstance().EndFrame();
+
 	GLenum error = Tools::CheckGLError();
 
 	if (error != GL_NO_ERROR)
@@ -292,166 +711,1144 @@ void Renderer::Render()
 		printf("Reanderer:Draw GL Error\n");
 		system("pause");
 	}
+	return true;
 }
 
-	void Renderer::RenderShadowMaps()
+	void Renderer::UpdateTextureStreaming()
 	{
-		if (m_light.GetCastShadowsStatus())
+		TextureManager::GetInstance().ProcessUploads();
+
+		for (auto& node : this->m_nodes)
 		{
-			int m_depth_texture_resolution = m_light.GetShadowMapResolution();
+			float pixels = ProjectedScreenSize(node);
 
-			glBindFramebuffer(GL_FRAMEBUFFER, m_light.GetShadowMapFBO());
-			glViewport(0, 0, m_depth_texture_resolution, m_depth_texture_resolution);
-			glEnable(GL_DEPTH_TEST);
-			glClear(GL_DEPTH_BUFFER_BIT);
+			for (auto& part : node->parts)
+			{
+				for (auto& texture : part.textures)
+				{
+					if (texture.textureID > 0)
+						TextureManager::GetInstance().RequestScreenSize(texture.textureID, pixels);
+				}
+			}
+		}
 
-			// Bind the shadow mapping program
-			m_spot_light_shadow_map_program.Bind(); // !!!!
+		TextureManager::GetInstance().UpdateResidency();
+	}
 
-			glm::mat4 proj = m_light.GetProjectionMatrix() * m_light.GetViewMatrix() * m_world_matrix;
+	float Renderer::ProjectedScreenSize(GeometryNode* node)
+	{
+		glm::mat4 mvp = m_projection_matrix * m_view_matrix * m_world_matrix * node->app_model_matrix;
+		glm::vec2 ndc_min(std::numeric_limits<float>::max());
+		glm::vec2 ndc_max(-std::numeric_limits<float>::max());
+
+		for (int i = 0; i < 8; ++i)
+		{
+			glm::vec3 corner(
+				(i & 1) ? node->m_aabb.max.x : node->m_aabb.min.x,
+				(i & 2) ? node->m_aabb.max.y : node->m_aabb.min.y,
+				(i & 4) ? node->m_aabb.max.z : node->m_aabb.min.z);
+			glm::vec4 clip = mvp * glm::vec4(corner, 1.f);
+
+			// a corner behind the camera, the box may cover the whole screen
+			if (clip.w <= 0.f)
+				return (float)std::max(m_screen_width, m_screen_height);
+
+			ndc_min = glm::min(ndc_min, glm::vec2(clip) / clip.w);
+			ndc_max = glm::max(ndc_max, glm::vec2(clip) / clip.w);
+		}
+
+		ndc_min = glm::clamp(ndc_min, -1.f, 1.f);
+		ndc_max = glm::clamp(ndc_max, -1.f, 1.f);
+		glm::vec2 extent = (ndc_max - ndc_min) * 0.5f * glm::vec2(m_screen_width, m_screen_height);
+
+		return std::max(extent.x, extent.y);
+	}
 
-			for (auto& node : this->m_nodes)
+	void Renderer::UpdateWorldBounds()
+	{
+		// world boxes of the snapshot's transforms, only the local boxes of the nodes are read
+		std::vector<NodeBounds>& bounds = m_simulation.node_bounds;
+		const std::vector<glm::mat4>& transforms = m_simulation.node_transforms;
+		bounds.resize(transforms.size());
+		JobSystem::GetInstance().ParallelFor(transforms.size(), 256, [this, &bounds, &transforms](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
 			{
-				glBindVertexArray(node->m_vao);
+				GeometryNode* node = (i < m_nodes.size()) ? m_nodes[i] : m_collidables_nodes[i - m_nodes.size()];
+				Tools::TransformBounds(node->m_aabb.min, node->m_aabb.max, m_world_matrix * transforms[i],
+					bounds[i].min, bounds[i].max);
+			}
+		});
+	}
 
-				m_spot_light_shadow_map_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
+	void Renderer::UpdateCulling()
+	{
+		// nodes spawned after the snapshot are left out until the next one
+		const std::vector<NodeBounds>& node_bounds = m_frame->node_bounds;
+		size_t count = node_bounds.size();
 
-				for (int j = 0; j < node->parts.size(); ++j)
-				{
-					glDrawArrays(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count);
-				}
+		// only nodes that left their fattened box touch the tree
+		if (count != m_node_proxies.size())
+		{
+			// added nodes shift the indices of the collidables, start over
+			m_scene_tree.Clear();
+			m_node_proxies.clear();
+		}
+		m_frustum_culler.Resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			const NodeBounds& bounds = node_bounds[i];
+			m_frustum_culler.SetBox(i, bounds.min, bounds.max);
+			if (i < m_node_proxies.size())
+				m_scene_tree.Move(m_node_proxies[i], bounds.min, bounds.max);
+			else
+				m_node_proxies.push_back(m_scene_tree.Insert(bounds.min, bounds.max, (unsigned int)i));
+		}
+		m_scene_tree.Rebalance();
+
+		// both lists in node order, the passes rely on m_nodes coming first.
+		// The light query runs as a job next to the camera one
+		JobSystem& jobs = JobSystem::GetInstance();
+		m_shadow_casters.clear();
+		for (auto& casters : m_cascade_casters)
+			casters.clear();
+		JobSystem::Job* shadow_query = jobs.CreateJob([]() {});
+		if (m_light.GetCastShadowsStatus() && m_light.GetType() == LightNode::LIGHT_DIRECTIONAL)
+		{
+			// the cascades follow the camera, then each one culls its casters on its own
+			glm::vec3 scene_min, scene_max;
+			if (m_scene_tree.GetBounds(scene_min, scene_max))
+				m_light.FitCascades(m_view_matrix, m_projection_matrix, scene_min, scene_max);
 
-				glBindVertexArray(0);
+			for (int i = 0; i < m_light.GetCascadeCount(); i++)
+			{
+				jobs.Run(jobs.CreateJob([this, i]()
+				{
+					CullNodes(m_light.GetCascadeProjectionView(i), m_cascade_casters[i], AABBTree::PLANE_ALL & ~AABBTree::PLANE_NEAR);
+				}, shadow_query));
 			}
+		}
+		else if (m_light.GetCastShadowsStatus() && m_light.GetType() == LightNode::LIGHT_POINT)
+		{
+			jobs.Run(jobs.CreateJob([this]()
+			{
+				// everything within range on any side, the faces are sorted out per caster later
+				glm::vec3 range(m_light.GetPointRange());
+				m_scene_tree.QueryBox(m_light.GetPosition() - range, m_light.GetPosition() + range, m_shadow_casters);
+				std::sort(m_shadow_casters.begin(), m_shadow_casters.end());
+			}, shadow_query));
+		}
+		else if (m_light.GetCastShadowsStatus())
+		{
+			jobs.Run(jobs.CreateJob([this]()
+			{
+				// no near plane, casters between the light and the frustum still throw their shadow into it
+				CullNodes(m_light.GetProjectionMatrix() * m_light.GetViewMatrix(), m_shadow_casters, AABBTree::PLANE_ALL & ~AABBTree::PLANE_NEAR);
+			}, shadow_query));
+		}
+		jobs.Run(shadow_query);
+
+		m_visible_nodes.clear();
+		CullNodes(m_projection_matrix * m_view_matrix, m_visible_nodes);
+
+		jobs.Wait(shadow_query);
+	}
+
+	void Renderer::CullNodes(const glm::mat4& viewProjection, std::vector<unsigned int>& results, unsigned int planes) const
+	{
+		// candidates in node order, so the refined list comes out sorted. Each job thread has its own
+		static thread_local std::vector<unsigned int> candidates;
+		candidates.clear();
+		m_scene_tree.QueryFrustum(viewProjection, candidates, planes);
+		std::sort(candidates.begin(), candidates.end());
+		m_frustum_culler.Cull(viewProjection, candidates, results, planes);
+	}
+
+	std::vector<GeometryNode*>& Renderer::AddInstancePass(const glm::mat4& view, std::vector<InstanceGroup>& groups)
+	{
+		if (m_instance_passes.size() <= m_instance_pass_count)
+			m_instance_passes.emplace_back();
+		InstancePass& pass = m_instance_passes[m_instance_pass_count++];
+		pass.nodes.clear();
+		pass.view = view;
+		pass.groups = &groups;
+		return pass.nodes;
+	}
+
+	void Renderer::UpdateInstances()
+	{
+		m_instance_pass_count = 0;
+
+		// the camera list holds the collidables too, they come after m_nodes and are not drawn there.
+		// The geometry pass goes first so it is never the one left out
+		std::vector<GeometryNode*>& geometry_nodes = AddInstancePass(m_view_matrix, m_geometry_groups);
+		for (unsigned int index : m_visible_nodes)
+		{
+			if (index >= m_nodes.size())
+				break;
+			geometry_nodes.push_back(m_nodes[index]);
+		}
+
+		// casters that held still go to the cached map, the others are drawn every frame
+		std::vector<GeometryNode*>& spot_nodes = AddInstancePass(m_light.GetViewMatrix(), m_shadow_groups);
+		m_static_casters.clear();
+		m_shadow_cull_statistics = {};
+		bool directional = m_light.GetType() == LightNode::LIGHT_DIRECTIONAL;
+		bool point = m_light.GetType() == LightNode::LIGHT_POINT;
+		if (m_light.GetCastShadowsStatus() && !directional && !point)
+		{
+			glm::mat4 light_projection_view = m_light.GetProjectionMatrix() * m_light.GetViewMatrix();
+			const std::vector<NodeBounds>& node_bounds = m_frame->node_bounds;
+
+			// a moving caster only counts when it can darken a visible receiver
+			glm::vec3 receiver_min, receiver_max;
+			bool receivers = ShadowReceiverBounds(light_projection_view, receiver_min, receiver_max);
 
 			glm::vec3 camera_dir = normalize(m_camera_target_position - m_camera_position);
 			float_t isectT = 0.f;
 
-			for (auto& node : this->m_collidables_nodes)
+			// the triangle test only runs for the collidables whose box the view ray crosses
+			m_ray_candidates.clear();
+			m_scene_tree.QueryRay(m_camera_position, camera_dir, 1.e+15f, m_ray_candidates);
+			std::sort(m_ray_candidates.begin(), m_ray_candidates.end());
+
+			// only the nodes inside the light volume, collidables in the view ray stay out of the shadow map
+			for (unsigned int index : m_shadow_casters)
 			{
-				if (node->intersectRay(m_camera_position, camera_dir, m_world_matrix, isectT)) continue;
+				m_shadow_cull_statistics.candidates++;
+				glm::vec3 caster_min, caster_max;
+				bool projected = Tools::ProjectBounds(node_bounds[index].min, node_bounds[index].max, light_projection_view, caster_min, caster_max);
+				if (projected && caster_max.z < -1.f)
+					m_shadow_cull_statistics.before_near++;
+
+				// the cached map does not follow the camera, only the casters drawn every frame are tested.
+				// A caster has to overlap the receivers as the light sees them and be nearer than the furthest
+				bool is_static = index < m_nodes.size() && m_shadow_caching && index < m_node_moved_frames.size() &&
+					m_frame_index - m_node_moved_frames[index] >= kStaticShadowFrames;
+				if (!is_static && m_shadow_caster_culling)
+				{
+					bool shadows_receivers = receivers && projected &&
+						caster_min.x <= receiver_max.x && caster_max.x >= receiver_min.x &&
+						caster_min.y <= receiver_max.y && caster_max.y >= receiver_min.y &&
+						caster_min.z <= receiver_max.z;
+					if (!shadows_receivers)
+					{
+						m_shadow_cull_statistics.culled++;
+						continue;
+					}
+				}
 
-				glBindVertexArray(node->m_vao);
+				if (index < m_nodes.size())
+				{
+					if (is_static)
+						m_static_casters.push_back(index);
+					else
+						spot_nodes.push_back(m_nodes[index]);
+					continue;
+				}
 
-				m_spot_light_shadow_map_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
+				CollidableNode* collidable = m_collidables_nodes[index - m_nodes.size()];
+				if (std::binary_search(m_ray_candidates.begin(), m_ray_candidates.end(), index) &&
+					collidable->intersectRay(m_camera_position, camera_dir, m_world_matrix, isectT)) continue;
+				spot_nodes.push_back(collidable);
+			}
+			m_shadow_cull_statistics.cached = m_static_casters.size();
+			m_shadow_cull_statistics.drawn = spot_nodes.size();
+		}
 
-				for (int j = 0; j < node->parts.size(); ++j)
+		// each point light caster goes to the faces its box overlaps, casters of the same faces share a batch
+		m_point_shadow_statistics = {};
+		m_point_face_casters.clear();
+		if (m_light.GetCastShadowsStatus() && point)
+		{
+			const std::vector<NodeBounds>& node_bounds = m_frame->node_bounds;
+			for (unsigned int index : m_shadow_casters)
+			{
+				unsigned int mask = m_point_face_culling ? m_light.GetCubeFaceMask(node_bounds[index].min, node_bounds[index].max) : 0x3Fu;
+				if (mask == 0)
+					continue;
+				m_point_face_casters.push_back({ mask, index });
+				for (unsigned int faces = mask; faces != 0; faces &= faces - 1)
+					m_point_shadow_statistics.face_submissions++;
+			}
+			std::sort(m_point_face_casters.begin(), m_point_face_casters.end());
+			m_point_shadow_statistics.casters = m_point_face_casters.size();
+			m_shadow_cull_statistics.candidates = m_shadow_casters.size();
+			m_shadow_cull_statistics.drawn = m_point_face_casters.size();
+		}
+
+		// the passes point at the batches' groups, so the batches are all there before the first pass
+		size_t batches = 0;
+		for (size_t i = 0; i < m_point_face_casters.size(); i++)
+		{
+			if (i == 0 || m_point_face_casters[i].first != m_point_face_casters[i - 1].first)
+				batches++;
+		}
+		m_point_batches.resize(batches);
+		m_point_shadow_statistics.batches = batches;
+
+		size_t batch = 0;
+		for (size_t first = 0; first < m_point_face_casters.size(); batch++)
+		{
+			unsigned int mask = m_point_face_casters[first].first;
+			m_point_batches[batch].face_mask = mask;
+			std::vector<GeometryNode*>& batch_nodes = AddInstancePass(m_light.GetViewMatrix(), m_point_batches[batch].groups);
+			for (; first < m_point_face_casters.size() && m_point_face_casters[first].first == mask; first++)
+			{
+				unsigned int index = m_point_face_casters[first].second;
+				batch_nodes.push_back((index < m_nodes.size()) ? m_nodes[index] : m_collidables_nodes[index - m_nodes.size()]);
+			}
+		}
+
+		// each cascade draws what its own query found
+		int cascades = (m_light.GetCastShadowsStatus() && directional) ? m_light.GetCascadeCount() : 0;
+		for (int i = 0; i < LightNode::kMaxCascades; i++)
+		{
+			m_cascade_groups[i].clear();
+			if (i >= cascades)
+				continue;
+
+			std::vector<GeometryNode*>& cascade_nodes = AddInstancePass(m_light.GetCascadeProjectionView(i), m_cascade_groups[i]);
+			for (unsigned int index : m_cascade_casters[i])
+				cascade_nodes.push_back((index < m_nodes.size()) ? m_nodes[index] : m_collidables_nodes[index - m_nodes.size()]);
+			m_shadow_cull_statistics.candidates += cascade_nodes.size();
+			m_shadow_cull_statistics.drawn += cascade_nodes.size();
+		}
+
+		// only the atlas tiles redrawn this frame need their casters
+		for (auto& atlas_light : m_atlas_lights)
+			atlas_light.groups.clear();
+		for (size_t index : m_atlas_updates)
+		{
+			AtlasLight& atlas_light = m_atlas_lights[index];
+			std::vector<GeometryNode*>& atlas_nodes = AddInstancePass(atlas_light.light->GetViewMatrix(), atlas_light.groups);
+			for (unsigned int caster : atlas_light.casters)
+				atlas_nodes.push_back((caster < m_nodes.size()) ? m_nodes[caster] : m_collidables_nodes[caster - m_nodes.size()]);
+		}
+
+		// the cached map is redrawn once the light changed or a caster joined or left the static ones
+		m_shadow_cache_dirty = m_shadow_caching && m_light.GetCastShadowsStatus() && !directional && !point &&
+			(!m_shadow_cache_valid || m_shadow_cache_revision != m_light.GetRevision() || m_static_casters != m_cached_casters);
+		m_static_shadow_groups.clear();
+		if (m_shadow_cache_dirty)
+		{
+			std::vector<GeometryNode*>& static_nodes = AddInstancePass(m_light.GetViewMatrix(), m_static_shadow_groups);
+			for (unsigned int index : m_static_casters)
+				static_nodes.push_back(m_nodes[index]);
+			m_cached_casters = m_static_casters;
+			m_shadow_cache_revision = m_light.GetRevision();
+		}
+
+		// the section is sized for every pass of the frame before any of them is written
+		size_t required = 0;
+		for (size_t i = 0; i < m_instance_pass_count; i++)
+			required += m_instance_ring.Aligned(m_instance_passes[i].nodes.size() * sizeof(InstanceData));
+		m_instance_ring.Begin(required);
+
+		auto start = std::chrono::steady_clock::now();
+		m_geometry_instance_base = BuildInstanceGroups(m_instance_passes[0].nodes, m_view_matrix, m_geometry_groups);
+		PrepareGeometryPackets();
+		m_prepare_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		for (size_t i = 1; i < m_instance_pass_count; i++)
+		{
+			InstancePass& pass = m_instance_passes[i];
+			BuildInstanceGroups(pass.nodes, pass.view, *pass.groups);
+		}
+
+		m_instance_ring.Flush();
+	}
+
+	bool Renderer::ShadowReceiverBounds(const glm::mat4& light_projection_view, glm::vec3& min, glm::vec3& max) const
+	{
+		// the camera frustum as the light sees it, nothing outside it is seen receiving
+		glm::mat4 inverse = glm::inverse(m_projection_matrix * m_view_matrix);
+		glm::vec3 corners[8];
+		for (int i = 0; i < 8; i++)
+		{
+			glm::vec4 corner = inverse * glm::vec4((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, (i & 4) ? 1.f : -1.f, 1.f);
+			corners[i] = glm::vec3(corner) / corner.w;
+		}
+		glm::vec3 view_min, view_max;
+		if (!Tools::ProjectBounds(corners, light_projection_view, view_min, view_max))
+			return false;
+		view_min = glm::max(view_min, glm::vec3(-1.f));
+		view_max = glm::min(view_max, glm::vec3(1.f));
+
+		// the visible nodes, each cut to the part of the light's view the camera sees
+		min = glm::vec3(FLT_MAX);
+		max = glm::vec3(-FLT_MAX);
+		const std::vector<NodeBounds>& node_bounds = m_frame->node_bounds;
+		for (unsigned int index : m_visible_nodes)
+		{
+			glm::vec3 node_min, node_max;
+			if (!Tools::ProjectBounds(node_bounds[index].min, node_bounds[index].max, light_projection_view, node_min, node_max))
+				continue;
+			node_min = glm::max(node_min, view_min);
+			node_max = glm::min(node_max, view_max);
+			if (node_min.x > node_max.x || node_min.y > node_max.y || node_min.z > node_max.z)
+				continue;
+
+			min = glm::min(min, node_min);
+			max = glm::max(max, node_max);
+		}
+		return min.x <= max.x;
+	}
+
+	float Renderer::ShadowLightImportance(LightNode& light) const
+	{
+		// the corners of the light's frustum as the camera sees them
+		glm::mat4 inverse = glm::inverse(light.GetProjectionMatrix() * light.GetViewMatrix());
+		glm::vec3 corners[8];
+		for (int i = 0; i < 8; i++)
+		{
+			glm::vec4 corner = inverse * glm::vec4((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, (i & 4) ? 1.f : -1.f, 1.f);
+			corners[i] = glm::vec3(corner) / corner.w;
+		}
+		glm::vec3 ndc_min, ndc_max;
+		if (!Tools::ProjectBounds(corners, m_projection_matrix * m_view_matrix, ndc_min, ndc_max) || ndc_min.z > 1.f)
+			return 0.f;
+
+		ndc_min = glm::max(ndc_min, glm::vec3(-1.f));
+		ndc_max = glm::min(ndc_max, glm::vec3(1.f));
+		if (ndc_min.x >= ndc_max.x || ndc_min.y >= ndc_max.y)
+			return 0.f;
+		return std::max(ndc_max.x - ndc_min.x, ndc_max.y - ndc_min.y) * 0.5f;
+	}
+
+	void Renderer::UpdateShadowAtlas()
+	{
+		m_atlas_updates.clear();
+		m_shadow_atlas_statistics = {};
+		m_shadow_atlas_statistics.lights = m_atlas_lights.size();
+
+		// the smallest tile that keeps the light's texels about as large on screen as the largest tile
+		// does on the whole screen. A light only gets a new tile when it asks for a larger one or for
+		// one a quarter the size, a light at the edge of two sizes keeps its map
+		m_atlas_order.clear();
+		for (size_t i = 0; i < m_atlas_lights.size(); i++)
+		{
+			AtlasLight& atlas_light = m_atlas_lights[i];
+			atlas_light.importance = ShadowLightImportance(*atlas_light.light);
+			m_atlas_order.push_back(i);
+
+			int size = 0;
+			if (atlas_light.importance > 0.f)
+			{
+				size = kShadowAtlasMaxTile;
+				while (size > kShadowAtlasMinTile && atlas_light.importance * kShadowAtlasMaxTile <= size / 2)
+					size /= 2;
+			}
+			if (size > atlas_light.wanted_size || size * 4 <= atlas_light.wanted_size)
+			{
+				atlas_light.wanted_size = size;
+				m_shadow_atlas.Free(atlas_light.tile);
+				atlas_light.valid = false;
+			}
+		}
+
+		// the most important lights pick first, a full atlas hands out smaller tiles and then none
+		std::sort(m_atlas_order.begin(), m_atlas_order.end(),
+			[this](size_t a, size_t b) { return m_atlas_lights[a].importance > m_atlas_lights[b].importance; });
+		for (size_t index : m_atlas_order)
+		{
+			AtlasLight& atlas_light = m_atlas_lights[index];
+			if (atlas_light.wanted_size == 0 || atlas_light.tile.node >= 0)
+				continue;
+			for (int size = atlas_light.wanted_size; size >= kShadowAtlasMinTile; size /= 2)
+			{
+				if (m_shadow_atlas.Allocate(size, atlas_light.tile))
+					break;
+			}
+		}
+
+		// casters of the lights with a tile, and whether any of them moved, joined or left since the tile was drawn
+		JobSystem::GetInstance().ParallelFor(m_atlas_lights.size(), 1, [this](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				AtlasLight& atlas_light = m_atlas_lights[i];
+				atlas_light.casters.clear();
+				atlas_light.changed = false;
+				if (atlas_light.tile.node < 0)
+					continue;
+
+				LightNode& light = *atlas_light.light;
+				CullNodes(light.GetProjectionMatrix() * light.GetViewMatrix(), atlas_light.casters, AABBTree::PLANE_ALL & ~AABBTree::PLANE_NEAR);
+
+				atlas_light.changed = !atlas_light.valid || atlas_light.drawn_revision != light.GetRevision() ||
+					atlas_light.casters != atlas_light.drawn_casters;
+				for (size_t c = 0; c < atlas_light.casters.size() && !atlas_light.changed; c++)
+				{
+					unsigned int index = atlas_light.casters[c];
+					atlas_light.changed = index >= m_node_moved_frames.size() || m_node_moved_frames[index] > atlas_light.drawn_frame;
+				}
+			}
+		});
+
+		// lights without a map first, then importance times the frames the tile fell behind
+		for (size_t i = 0; i < m_atlas_lights.size(); i++)
+		{
+			const AtlasLight& atlas_light = m_atlas_lights[i];
+			if (atlas_light.importance > 0.f)
+				m_shadow_atlas_statistics.visible++;
+			if (atlas_light.tile.node >= 0)
+				m_shadow_atlas_statistics.tiles++;
+			if (atlas_light.changed)
+				m_atlas_updates.push_back(i);
+		}
+		auto priority = [this](size_t index)
+		{
+			const AtlasLight& atlas_light = m_atlas_lights[index];
+			return (atlas_light.valid ? 0.f : 1.e6f) + atlas_light.importance * (float)(m_frame_index - atlas_light.drawn_frame);
+		};
+		std::sort(m_atlas_updates.begin(), m_atlas_updates.end(),
+			[&priority](size_t a, size_t b) { return priority(a) > priority(b); });
+		if (m_shadow_atlas_budget > 0 && (int)m_atlas_updates.size() > m_shadow_atlas_budget)
+		{
+			m_shadow_atlas_statistics.stale = m_atlas_updates.size() - m_shadow_atlas_budget;
+			m_atlas_updates.resize(m_shadow_atlas_budget);
+		}
+		m_shadow_atlas_statistics.redrawn = m_atlas_updates.size();
+		m_shadow_atlas_statistics.used_texels = m_shadow_atlas.GetUsedTexels();
+	}
+
+	GLintptr Renderer::BuildInstanceGroups(const std::vector<GeometryNode*>& nodes, const glm::mat4& view, std::vector<InstanceGroup>& groups)
+	{
+		// nodes that share an asset share the group, with instancing off every node is its own
+		groups.clear();
+		m_node_groups.resize(nodes.size());
+		if (m_instancing)
+		{
+			m_group_lookup.clear();
+			for (size_t i = 0; i < nodes.size(); i++)
+			{
+				GeometryNode* node = nodes[i];
+				auto found = m_group_lookup.find((uintptr_t)node->m_vao);
+				if (found == m_group_lookup.end())
+				{
+					found = m_group_lookup.emplace((uintptr_t)node->m_vao, groups.size()).first;
+					groups.push_back({ node, 0, 0, FLT_MAX });
+				}
+
+				InstanceGroup& group = groups[found->second];
+				glm::vec3 center = glm::vec3(m_world_matrix * node->app_model_matrix * glm::vec4(node->m_aabb.center, 1.f));
+				group.depth = std::min(group.depth, -(view * glm::vec4(center, 1.f)).z);
+				group.count++;
+				m_node_groups[i] = found->second;
+			}
+
+			// first instance of each group, then the instances in group order
+			std::vector<size_t>& cursors = m_group_cursors;
+			cursors.assign(groups.size(), 0);
+			for (size_t g = 1; g < groups.size(); g++)
+				cursors[g] = cursors[g - 1] + groups[g - 1].count;
+			for (size_t g = 0; g < groups.size(); g++)
+				groups[g].offset = (GLintptr)(cursors[g] * sizeof(InstanceData));
+
+			// the slots are handed out in order, the matrices are filled in on the job system
+			for (size_t i = 0; i < nodes.size(); i++)
+				m_node_groups[i] = cursors[m_node_groups[i]]++;
+		}
+		else
+		{
+			// group and slot are the node's index, the jobs fill them in with the matrices
+			groups.resize(nodes.size());
+		}
+
+		bool own_groups = !m_instancing;
+		m_instance_data.resize(nodes.size());
+		JobSystem::GetInstance().ParallelFor(nodes.size(), 256, [this, &nodes, &view, &groups, own_groups](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				GeometryNode* node = nodes[i];
+				glm::mat4 world = m_world_matrix * node->app_model_matrix;
+				glm::mat3 normal = glm::transpose(glm::inverse(glm::mat3(world)));
+
+				InstanceData& instance = m_instance_data[own_groups ? i : m_node_groups[i]];
+				instance.world_matrix = world;
+				instance.normal_matrix[0] = glm::vec4(normal[0], 0.f);
+				instance.normal_matrix[1] = glm::vec4(normal[1], 0.f);
+				instance.normal_matrix[2] = glm::vec4(normal[2], 0.f);
+
+				if (own_groups)
 				{
-					glDrawArrays(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count);
+					glm::vec3 center = glm::vec3(world * glm::vec4(node->m_aabb.center, 1.f));
+					groups[i] = { node, (GLintptr)(i * sizeof(InstanceData)), 1, -(view * glm::vec4(center, 1.f)).z };
 				}
+			}
+		});
+
+		GLintptr base = nodes.empty() ? -1 : m_instance_ring.Push(m_instance_data.data(), nodes.size() * sizeof(InstanceData));
+		if (base < 0 && !nodes.empty())
+			printf("Instance ring full, a pass of %zu instances is not drawn\n", nodes.size());
+		for (auto& group : groups)
+		{
+			if (base < 0)
+				group.count = 0;
+			group.offset += base;
+		}
+		return base;
+	}
 
-				glBindVertexArray(0);
+	void Renderer::RenderShadowMaps()
+	{
+		bool main_light = m_light.GetCastShadowsStatus();
+		if (main_light || !m_atlas_updates.empty())
+		{
+			// the result of the query issued two frames ago is in by now
+			int query = (int)(m_frame_index & 1);
+			if (m_shadow_query_issued[query])
+			{
+				GLuint64 elapsed = 0;
+				glGetQueryObjectui64v(m_shadow_queries[query], GL_QUERY_RESULT, &elapsed);
+				m_shadow_ms = elapsed / 1.0e6;
 			}
+			glBeginQuery(GL_TIME_ELAPSED, m_shadow_queries[query]);
+			m_shadow_query_issued[query] = true;
+
+			GLState::GetInstance().Enable(GL_DEPTH_TEST);
+			// casters before the near plane land on it instead of being clipped
+			GLState::GetInstance().Enable(GL_DEPTH_CLAMP);
 
+			// Bind the shadow mapping program
+			m_spot_light_shadow_map_program.Bind(); // !!!!
+
+			if (main_light && m_light.GetType() == LightNode::LIGHT_DIRECTIONAL)
+				RenderShadowCascades();
+			else if (main_light && m_light.GetType() == LightNode::LIGHT_POINT)
+				RenderPointShadowMap();
+			else if (main_light)
+				RenderSpotShadowMap();
+			RenderShadowAtlas();
+
+			glEndQuery(GL_TIME_ELAPSED);
+
+			GLState::GetInstance().BindVertexArray(0);
 			m_spot_light_shadow_map_program.Unbind();
-			glDisable(GL_DEPTH_TEST);
-			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			GLState::GetInstance().Disable(GL_DEPTH_CLAMP);
+			GLState::GetInstance().Disable(GL_DEPTH_TEST);
+			GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+	}
+
+	void Renderer::RenderSpotShadowMap()
+	{
+		int m_depth_texture_resolution = m_light.GetShadowMapResolution();
+		GLState::GetInstance().Viewport(0, 0, m_depth_texture_resolution, m_depth_texture_resolution);
+
+		// the instances bring their world transform
+		m_spot_light_shadow_map_program.Set(m_shadow_projection_matrix, m_light.GetProjectionMatrix() * m_light.GetViewMatrix());
+
+		if (m_shadow_cache_dirty)
+		{
+			GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_light.GetStaticShadowMapFBO());
+			glClear(GL_DEPTH_BUFFER_BIT);
+			DrawShadowGroups(m_static_shadow_groups);
+			m_shadow_cache_updates++;
+
+			// a full instance ring left casters out, try again next frame
+			m_shadow_cache_valid = std::none_of(m_static_shadow_groups.begin(), m_static_shadow_groups.end(),
+				[](const InstanceGroup& group) { return group.count == 0; });
+		}
+
+		// the static depth as the start of the frame's map, the moving casters test against it
+		if (m_shadow_caching && m_shadow_cache_valid)
+		{
+			GLState::GetInstance().BindFramebuffer(GL_READ_FRAMEBUFFER, m_light.GetStaticShadowMapFBO());
+			GLState::GetInstance().BindFramebuffer(GL_DRAW_FRAMEBUFFER, m_light.GetShadowMapFBO());
+			glBlitFramebuffer(0, 0, m_depth_texture_resolution, m_depth_texture_resolution,
+				0, 0, m_depth_texture_resolution, m_depth_texture_resolution, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		}
+		else
+		{
+			GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_light.GetShadowMapFBO());
+			glClear(GL_DEPTH_BUFFER_BIT);
+		}
+		DrawShadowGroups(m_shadow_groups);
+	}
+
+	void Renderer::RenderShadowCascades()
+	{
+		// a layer per cascade, drawn in the corner its resolution covers
+		for (int i = 0; i < m_light.GetCascadeCount(); i++)
+		{
+			int resolution = m_light.GetCascadeResolution(i);
+			GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_light.GetCascadeFBO(i));
+			GLState::GetInstance().Viewport(0, 0, resolution, resolution);
+			glClear(GL_DEPTH_BUFFER_BIT);
+
+			m_spot_light_shadow_map_program.Set(m_shadow_projection_matrix, m_light.GetCascadeProjectionView(i));
+			DrawShadowGroups(m_cascade_groups[i]);
+		}
+	}
+
+	void Renderer::RenderPointShadowMap()
+	{
+		// the cube is attached whole, the clear reaches all six faces
+		int resolution = m_light.GetShadowMapResolution();
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_light.GetCubeFBO());
+		GLState::GetInstance().Viewport(0, 0, resolution, resolution);
+		glClear(GL_DEPTH_BUFFER_BIT);
+
+		glm::mat4 faces[LightNode::kCubeFaces];
+		for (int i = 0; i < LightNode::kCubeFaces; i++)
+			faces[i] = m_light.GetCubeFaceProjectionView(i);
+
+		// one draw per batch and asset for the whole cube, each triangle is emitted once per face of the mask
+		m_point_shadow_program.Bind();
+		m_point_shadow_program.Set(m_point_face_projection_view, faces, LightNode::kCubeFaces);
+		for (auto& batch : m_point_batches)
+		{
+			m_point_shadow_program.Set(m_point_face_mask, (int)batch.face_mask);
+			DrawShadowGroups(batch.groups);
+		}
+
+		// the atlas lights are drawn next with the spotlight program
+		m_spot_light_shadow_map_program.Bind();
+	}
+
+	void Renderer::RenderShadowAtlas()
+	{
+		if (m_atlas_updates.empty())
+			return;
+
+		// a tile is cleared and drawn on its own, the scissor keeps the clear inside it
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_shadow_atlas.GetFBO());
+		GLState::GetInstance().Enable(GL_SCISSOR_TEST);
+		for (size_t index : m_atlas_updates)
+		{
+			AtlasLight& atlas_light = m_atlas_lights[index];
+			const ShadowAtlas::Tile& tile = atlas_light.tile;
+			GLState::GetInstance().Viewport(tile.x, tile.y, tile.size, tile.size);
+			glScissor(tile.x, tile.y, tile.size, tile.size);
+			glClear(GL_DEPTH_BUFFER_BIT);
+
+			LightNode& light = *atlas_light.light;
+			glm::mat4 light_projection_view = light.GetProjectionMatrix() * light.GetViewMatrix();
+			m_spot_light_shadow_map_program.Set(m_shadow_projection_matrix, light_projection_view);
+			DrawShadowGroups(atlas_light.groups);
+
+			// a full instance ring left casters out, the tile is drawn again next frame
+			atlas_light.valid = std::none_of(atlas_light.groups.begin(), atlas_light.groups.end(),
+				[](const InstanceGroup& group) { return group.count == 0; });
+			if (atlas_light.valid)
+			{
+				atlas_light.drawn_revision = light.GetRevision();
+				atlas_light.drawn_frame = m_frame_index;
+				atlas_light.drawn_projection_view = light_projection_view;
+				atlas_light.drawn_casters = atlas_light.casters;
+			}
+		}
+		GLState::GetInstance().Disable(GL_SCISSOR_TEST);
+	}
+
+	void Renderer::DrawShadowGroups(const std::vector<InstanceGroup>& groups)
+	{
+		for (auto& group : groups)
+		{
+			if (group.count == 0)
+				continue;
+
+			GeometryNode* node = group.node;
+			AssetManager::GetInstance().BindInstances(node->m_vao, m_instance_ring.GetBuffer(), group.offset);
+
+			for (int j = 0; j < node->parts.size(); ++j)
+			{
+				glDrawArraysInstanced(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count, group.count);
+			}
 		}
 	}
 
 	void Renderer::RenderGeometry()
 	{
-		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
 		GLenum drawbuffers[1] = { GL_COLOR_ATTACHMENT0 };
 		glDrawBuffers(1, drawbuffers);
 
-		glViewport(0, 0, m_screen_width, m_screen_height);
-		glEnable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LEQUAL);
+		GLState::GetInstance().Viewport(0, 0, m_screen_width, m_screen_height);
+		GLState::GetInstance().Enable(GL_DEPTH_TEST);
+		GLState::GetInstance().DepthFunc(GL_LEQUAL);
 		glClearDepth(1.f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		m_geometry_program.Bind();
+		// camera and light, one upload for the whole frame
+		FrameBlock frame = {};
+		frame.light_projection_view = m_light.GetProjectionMatrix() * m_light.GetViewMatrix();
+		frame.camera_pos = m_camera_position;
+		frame.camera_dir = normalize(m_camera_target_position - m_camera_position);
+		frame.light_color = m_light.GetColor();
+		frame.light_pos = m_light.GetPosition();
+		frame.light_dir = m_light.GetDirection();
+		frame.light_point = (m_light.GetType() == LightNode::LIGHT_POINT) ? 1 : 0;
+		frame.light_range = m_light.GetPointRange();
+		frame.light_umbra = m_light.GetUmbra();
+		frame.light_penumbra = m_light.GetPenumbra();
+		frame.cast_shadows = m_light.GetCastShadowsStatus() ? 1 : 0;
+		frame.projection_view = m_projection_matrix * m_view_matrix;
+		frame.shadow_taps = m_shadow_poisson_taps;
+		frame.shadow_radius = m_shadow_poisson_radius;
+		if (m_light.GetType() == LightNode::LIGHT_DIRECTIONAL)
+		{
+			frame.light_directional = 1;
+			frame.cascade_count = m_light.GetCascadeCount();
+			for (int i = 0; i < frame.cascade_count; i++)
+			{
+				frame.cascade_projection_view[i] = m_light.GetCascadeProjectionView(i);
+				frame.cascade_splits[i] = m_light.GetCascadeSplit(i);
+				frame.cascade_scales[i] = m_light.GetCascadeResolution(i) / (float)m_light.GetCascadeArrayResolution();
+			}
+		}
 
-		glm::mat4 proj = m_projection_matrix * m_view_matrix * m_world_matrix;
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, m_frame_ubo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameBlock), &frame);
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+		GLState::GetInstance().BindBufferBase(GL_UNIFORM_BUFFER, UNIFORM_BLOCK_FRAME, m_frame_ubo);
+
+		// the atlas lights the camera sees. A stale tile is read with the view it was drawn from,
+		// a light without a map yet shines unshadowed
+		LightsBlock lights;
+		lights.count = 0;
+		float atlas_scale = 1.f / m_shadow_atlas.GetResolution();
+		for (auto& atlas_light : m_atlas_lights)
+		{
+			if (atlas_light.importance <= 0.f || lights.count == kMaxAtlasLights)
+				continue;
+
+			LightNode& light = *atlas_light.light;
+			const ShadowAtlas::Tile& tile = atlas_light.tile;
+			bool shadowed = tile.node >= 0 && atlas_light.valid;
+			AtlasLightData& data = lights.lights[lights.count++];
+			data.projection_view = atlas_light.drawn_projection_view;
+			data.position = glm::vec4(light.GetPosition(), std::cos(glm::radians(0.5f * light.GetUmbra())));
+			data.direction = glm::vec4(light.GetDirection(), std::cos(glm::radians(0.5f * light.GetPenumbra())));
+			data.color = glm::vec4(light.GetColor(), shadowed ? 1.f : 0.f);
+			data.tile = glm::vec4(tile.x, tile.y, tile.size, tile.size) * atlas_scale;
+		}
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, m_lights_ubo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, offsetof(LightsBlock, lights) + lights.count * sizeof(AtlasLightData), &lights);
+		GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+		GLState::GetInstance().BindBufferBase(GL_UNIFORM_BUFFER, UNIFORM_BLOCK_LIGHTS, m_lights_ubo);
+
+		// the raw depth on 2 and 5, the same maps again on 6 and 7 through the comparison sampler
+		GLState::GetInstance().BindTexture(2, GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
+		GLState::GetInstance().BindTexture(6, GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
+		GLState::GetInstance().BindSampler(6, m_light.GetShadowCompareSampler());
+		GLState::GetInstance().BindTexture(8, GL_TEXTURE_2D, m_shadow_atlas.GetTexture());
+		if (m_light.GetType() == LightNode::LIGHT_POINT)
+			GLState::GetInstance().BindTexture(9, GL_TEXTURE_CUBE_MAP, m_light.GetCubeTexture());
+		if (m_light.GetType() == LightNode::LIGHT_DIRECTIONAL)
+		{
+			GLState::GetInstance().BindTexture(5, GL_TEXTURE_2D_ARRAY, m_light.GetCascadeTexture());
+			GLState::GetInstance().BindTexture(7, GL_TEXTURE_2D_ARRAY, m_light.GetCascadeTexture());
+			GLState::GetInstance().BindSampler(7, m_light.GetShadowCompareSampler());
+		}
 
-		m_geometry_program.loadVec3("uniform_light_color", m_light.GetColor());
-		m_geometry_program.loadVec3("uniform_light_dir", m_light.GetDirection());
-		m_geometry_program.loadVec3("uniform_light_pos", m_light.GetPosition());
+		// the result of the query issued two frames ago is in by now
+		int query = (int)(m_frame_index & 1);
+		if (m_geometry_query_issued[query])
+		{
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(m_geometry_queries[query], GL_QUERY_RESULT, &elapsed);
+			m_geometry_ms = elapsed / 1.0e6;
+		}
+		glBeginQuery(GL_TIME_ELAPSED, m_geometry_queries[query]);
+		m_geometry_query_issued[query] = true;
 
-		m_geometry_program.loadFloat("uniform_light_umbra", m_light.GetUmbra());
-		m_geometry_program.loadFloat("uniform_light_penumbra", m_light.GetPenumbra());
+		RenderStaticGeometry();
 
-		m_geometry_program.loadVec3("uniform_camera_pos", m_camera_position);
-		m_geometry_program.loadVec3("uniform_camera_dir", normalize(m_camera_target_position - m_camera_position));
+		glEndQuery(GL_TIME_ELAPSED);
 
-		m_geometry_program.loadMat4("uniform_light_projection_view", m_light.GetProjectionMatrix() * m_light.GetViewMatrix());
-		m_geometry_program.loadInt("uniform_cast_shadows", m_light.GetCastShadowsStatus() ? 1 : 0);
+		GLState::GetInstance().UseProgram(0);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
+		GLState::GetInstance().Disable(GL_DEPTH_TEST);
 
-		glActiveTexture(GL_TEXTURE2);
-		m_geometry_program.loadInt("uniform_shadow_map", 2);
-		glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
+	}
 
-		RenderStaticGeometry();
+	void Renderer::PrepareGeometryPackets()
+	{
+		// light features are the same for every part
+		unsigned int frame_features = 0;
+		if (m_light.GetCastShadowsStatus())
+		{
+			frame_features |= FEATURE_CAST_SHADOWS;
+			if (m_shadow_filter == SHADOW_FILTER_NEAREST) frame_features |= FEATURE_SHADOW_NEAREST;
+			else if (m_shadow_filter == SHADOW_FILTER_PCF_MEAN) frame_features |= FEATURE_SHADOW_PCF_MEAN;
+			else if (m_shadow_filter == SHADOW_FILTER_HARDWARE) frame_features |= FEATURE_SHADOW_HARDWARE;
+			else if (m_shadow_filter == SHADOW_FILTER_POISSON) frame_features |= FEATURE_SHADOW_POISSON;
+			if (m_light.GetType() == LightNode::LIGHT_DIRECTIONAL) frame_features |= FEATURE_CASCADED_SHADOWS;
+		}
+
+		// one packet per part of each instance group. The jobs only read the groups and the resolved
+		// parts, a part seen for the first time gets its packet finished on the GL thread at submit
+		size_t slices = (m_geometry_groups.size() + kPrepareSlice - 1) / kPrepareSlice;
+		if (m_packet_slices.size() < slices)
+			m_packet_slices.resize(slices);
+		m_prepared_slices = slices;
+
+		JobSystem::GetInstance().ParallelFor(slices, 1, [this, frame_features](size_t begin, size_t end)
+		{
+			for (size_t slice = begin; slice < end; slice++)
+			{
+				PacketSlice& packets = m_packet_slices[slice];
+				packets.packets.clear();
+				packets.unresolved.clear();
+
+				size_t last = std::min(m_geometry_groups.size(), (slice + 1) * kPrepareSlice);
+				for (size_t g = slice * kPrepareSlice; g < last; g++)
+				{
+					const InstanceGroup& group = m_geometry_groups[g];
+					if (group.count == 0)
+						continue;
+
+					// the first node's parts and materials stand for every instance of the asset
+					GeometryNode* node = group.node;
+					for (int j = 0; j < node->parts.size(); ++j)
+					{
+						RenderQueue::DrawPacket packet;
+						packet.node = node;
+						packet.part = j;
+						packet.instanceOffset = group.offset;
+						packet.instanceCount = group.count;
+						packet.features = frame_features;
+
+						auto found = m_part_states.find(&node->parts[j]);
+						if (found != m_part_states.end())
+							ApplyPartState(found->second, group.depth, packet);
+						else
+							packets.unresolved.push_back({ packets.packets.size(), group.depth });
+						packets.packets.push_back(packet);
+					}
+				}
+			}
+		});
+	}
 
-		m_geometry_program.Unbind();
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glDisable(GL_DEPTH_TEST);
+	Renderer::PartState Renderer::ResolvePartState(GeometryNode::Objects& part)
+	{
+		// the variant with every map decides which maps are worth loading
+		ShaderProgram& textured = m_geometry_variants.Get(FEATURE_TEX_DIFFUSE | FEATURE_TEX_NORMAL);
+
+		// only the maps the program samples are ever loaded
+		bool uses_diffuse = textured.UsesTextureSlot(TEXTURE_SLOT_DIFFUSE);
+		bool uses_bump = textured.UsesTextureSlot(TEXTURE_SLOT_BUMP);
+		bool uses_normal = textured.UsesTextureSlot(TEXTURE_SLOT_NORMAL);
+		GLuint diffuse_texture = uses_diffuse ? part.RequestTexture(TEXTURE_SLOT_DIFFUSE) : 0;
+		GLuint bump_texture = uses_bump ? part.RequestTexture(TEXTURE_SLOT_BUMP) : 0;
+		GLuint normal_texture = (bump_texture == 0 && uses_normal) ? part.RequestTexture(TEXTURE_SLOT_NORMAL) : 0;
+
+		PartState state;
+		state.diffuse_texture = diffuse_texture;
+		state.diffuse_layer = part.textures[TEXTURE_SLOT_DIFFUSE].layer;
+		state.normal_texture = bump_texture > 0 ? bump_texture : normal_texture;
+		state.normal_layer = (bump_texture > 0) ? part.textures[TEXTURE_SLOT_BUMP].layer : part.textures[TEXTURE_SLOT_NORMAL].layer;
+
+		// pick the variant instead of branching on the maps in the shader
+		state.features = 0;
+		if (diffuse_texture > 0) state.features |= FEATURE_TEX_DIFFUSE | (state.diffuse_layer >= 0 ? FEATURE_TEX_DIFFUSE_ARRAY : 0);
+		if (state.normal_texture > 0) state.features |= FEATURE_TEX_NORMAL | (state.normal_layer >= 0 ? FEATURE_TEX_NORMAL_ARRAY : 0);
+		if (bump_texture > 0) state.features |= FEATURE_TEX_BUMP;
+
+		state.texture_set = m_render_queue.TextureSetId(state.diffuse_texture, state.normal_texture);
+		state.material = m_render_queue.MaterialId(&part);
+
+		// kept once no map it samples is still on its way, until then it is resolved again every frame
+		auto settled = [&part](bool used, int slot) { return !used || part.textures[slot].filename.empty() || part.textures[slot].requested; };
+		if (settled(uses_diffuse, TEXTURE_SLOT_DIFFUSE) && settled(uses_bump, TEXTURE_SLOT_BUMP) && settled(uses_normal, TEXTURE_SLOT_NORMAL))
+			m_part_states[&part] = state;
+		return state;
+	}
 
+	void Renderer::ApplyPartState(const PartState& state, float depth, RenderQueue::DrawPacket& packet) const
+	{
+		packet.diffuseTexture = state.diffuse_texture;
+		packet.diffuseLayer = state.diffuse_layer;
+		packet.normalTexture = state.normal_texture;
+		packet.normalLayer = state.normal_layer;
+		packet.features |= state.features;
+		packet.key = RenderQueue::MakeKey(RenderQueue::PASS_OPAQUE, packet.features, state.texture_set, state.material, depth);
 	}
 
-		void Renderer::RenderStaticGeometry()
+	void Renderer::RenderStaticGeometry()
+	{
+		// the prepared slices in order, finishing the packets the jobs could not
+		m_render_queue.Clear();
+		for (size_t slice = 0; slice < m_prepared_slices; slice++)
 		{
-			glm::mat4 proj = m_projection_matrix * m_view_matrix * m_world_matrix;
+			PacketSlice& packets = m_packet_slices[slice];
+			for (const auto& pending : packets.unresolved)
+			{
+				RenderQueue::DrawPacket& packet = packets.packets[pending.index];
+				ApplyPartState(ResolvePartState(packet.node->parts[packet.part]), pending.depth, packet);
+			}
+			for (const auto& packet : packets.packets)
+				m_render_queue.Push(packet);
+		}
+		m_render_queue.Sort();
+
+		BuildDrawCommands();
+		SubmitDrawCommands();
+
+		GLState::GetInstance().BindVertexArray(0);
+	}
 
-			for (auto& node : this->m_nodes)
+	void Renderer::BuildDrawCommands()
+	{
+		bool indirect = m_multi_draw && m_multi_draw_supported;
+
+		// one command per sorted packet, a bucket runs while program, asset and textures hold
+		m_draw_commands.resize(m_render_queue.GetCount());
+		m_draw_buckets.clear();
+		for (size_t i = 0; i < m_render_queue.GetCount(); i++)
+		{
+			const RenderQueue::DrawPacket& packet = m_render_queue[i];
+			GeometryNode::Objects& part = packet.node->parts[packet.part];
+
+			// the layers in the material block follow the maps as they arrive
+			packet.node->UpdateMaterialTextures(packet.part, packet.diffuseLayer, packet.normalLayer);
+
+			DrawArraysIndirectCommand& command = m_draw_commands[i];
+			command.count = part.count;
+			command.instance_count = (GLuint)packet.instanceCount;
+			command.first = part.start_offset;
+			command.base_instance = (GLuint)((packet.instanceOffset - m_geometry_instance_base) / sizeof(InstanceData));
+
+			DrawBucket* bucket = m_draw_buckets.empty() ? nullptr : &m_draw_buckets.back();
+			bool same_state = bucket != nullptr && bucket->count < kMultiDrawBatch &&
+				bucket->packet->features == packet.features && bucket->packet->node->m_vao == packet.node->m_vao &&
+				bucket->packet->diffuseTexture == packet.diffuseTexture && bucket->packet->normalTexture == packet.normalTexture;
+			if (!same_state)
+				m_draw_buckets.push_back({ &packet, i, 0, -1, -1 });
+			m_draw_buckets.back().count++;
+		}
+
+		if (!indirect || m_draw_commands.empty())
+			return;
+
+		// the commands in one copy, the materials of each bucket as the array the shader indexes by draw id.
+		// A bucket only pushes its own materials, the block bound past them reaches into the next bucket's,
+		// so the section keeps one whole block spare after the last
+		size_t material_bytes = kMultiDrawBatch * sizeof(MaterialBlock);
+		for (auto& bucket : m_draw_buckets)
+			material_bytes += m_draw_material_ring.Aligned(bucket.count * sizeof(MaterialBlock));
+		m_command_ring.Begin(m_command_ring.Aligned(m_draw_commands.size() * sizeof(DrawArraysIndirectCommand)));
+		m_draw_material_ring.Begin(material_bytes);
+		GLintptr commands = m_command_ring.Push(m_draw_commands.data(), m_draw_commands.size() * sizeof(DrawArraysIndirectCommand));
+		m_draw_materials.resize(kMultiDrawBatch);
+		for (auto& bucket : m_draw_buckets)
+		{
+			for (size_t i = 0; i < bucket.count; i++)
 			{
-				glBindVertexArray(node->m_vao);
+				const RenderQueue::DrawPacket& packet = m_render_queue[bucket.first + i];
+				m_draw_materials[i] = packet.node->parts[packet.part].material;
+			}
+
+			bucket.command_offset = (commands < 0) ? -1 : commands + (GLintptr)(bucket.first * sizeof(DrawArraysIndirectCommand));
+			bucket.material_offset = m_draw_material_ring.Push(m_draw_materials.data(), bucket.count * sizeof(MaterialBlock));
+		}
+		if (m_command_ring.GetOverflow() > 0 || m_draw_material_ring.GetOverflow() > 0)
+			printf("Draw command rings full, the buckets left out are drawn one call at a time\n");
+		m_command_ring.Flush();
+		m_draw_material_ring.Flush();
+	}
+
+	void Renderer::SubmitDrawCommands()
+	{
+		auto start = std::chrono::steady_clock::now();
+		bool indirect = m_multi_draw && m_multi_draw_supported && !m_draw_commands.empty();
+
+		ShaderProgram* bound = nullptr;
+		GeometryNode* bound_node = nullptr;
+		const GeometryNode::Objects* bound_material = nullptr;
+		for (auto& bucket : m_draw_buckets)
+		{
+			const RenderQueue::DrawPacket& first = *bucket.packet;
+
+			// a bucket the rings had no room for takes the loop below
+			bool multi_draw = indirect && bucket.command_offset >= 0 && bucket.material_offset >= 0;
+			ShaderProgram& program = m_geometry_variants.Get(first.features | (multi_draw ? FEATURE_MULTI_DRAW : 0));
+			if (&program != bound)
+			{
+				program.Bind();
+				bound = &program;
+			}
+
+			// pooled maps stay bound while consecutive buckets share the array
+			if (first.diffuseLayer >= 0)
+				TextureManager::GetInstance().BindTextureArray(3, first.diffuseTexture);
+			else
+				GLState::GetInstance().BindTexture(0, GL_TEXTURE_2D, first.diffuseTexture);
 
-				m_geometry_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
-				m_geometry_program.loadMat4("uniform_normal_matrix", glm::transpose(glm::inverse(m_world_matrix * node->app_model_matrix)));
-				m_geometry_program.loadMat4("uniform_world_matrix", m_world_matrix * node->app_model_matrix);
+			if (first.normalLayer >= 0)
+				TextureManager::GetInstance().BindTextureArray(4, first.normalTexture);
+			else
+				GLState::GetInstance().BindTexture(1, GL_TEXTURE_2D, first.normalTexture);
+
+			if (multi_draw)
+			{
+				// base instance picks each command's instances, the pointers stay at the start of the pass
+				AssetManager::GetInstance().BindInstances(first.node->m_vao, m_instance_ring.GetBuffer(), m_geometry_instance_base);
+				m_draw_material_ring.BindRange(UNIFORM_BLOCK_MATERIAL, bucket.material_offset, kMultiDrawBatch * sizeof(MaterialBlock));
+				GLState::GetInstance().BindBuffer(GL_DRAW_INDIRECT_BUFFER, m_command_ring.GetBuffer());
+				glMultiDrawArraysIndirect(GL_TRIANGLES, (const void*)bucket.command_offset, (GLsizei)bucket.count, 0);
+				bound_node = nullptr;
+				bound_material = nullptr;
+				continue;
+			}
 
-				for (int j = 0; j < node->parts.size(); ++j)
+			// GL 3.3, the same commands one at a time. without base instance the pointers move instead
+			for (size_t i = bucket.first; i < bucket.first + bucket.count; i++)
+			{
+				const RenderQueue::DrawPacket& packet = m_render_queue[i];
+				const DrawArraysIndirectCommand& command = m_draw_commands[i];
+
+				if (packet.node != bound_node)
 				{
-					m_geometry_program.loadVec3("uniform_diffuse", node->parts[j].diffuse);
-					m_geometry_program.loadVec3("uniform_ambient", node->parts[j].ambient);
-					m_geometry_program.loadVec3("uniform_specular", node->parts[j].specular);
-					m_geometry_program.loadFloat("uniform_shininess", node->parts[j].shininess);
-					m_geometry_program.loadInt("uniform_has_tex_diffuse", (node->parts[j].diffuse_textureID > 0) ? 1 : 0);
-					m_geometry_program.loadInt("uniform_has_tex_normal", (node->parts[j].bump_textureID > 0 || node->parts[j].normal_textureID > 0) ? 1 : 0);
-					m_geometry_program.loadInt("uniform_is_tex_bumb", (node->parts[j].bump_textureID > 0) ? 1 : 0);
-
-					glActiveTexture(GL_TEXTURE0);
-					m_geometry_program.loadInt("uniform_tex_diffuse", 0);
-					glBindTexture(GL_TEXTURE_2D, node->parts[j].diffuse_textureID);
-
-					glActiveTexture(GL_TEXTURE1);
-					m_geometry_program.loadInt("uniform_tex_normal", 1);
-					glBindTexture(GL_TEXTURE_2D, node->parts[j].bump_textureID > 0 ?
-						node->parts[j].bump_textureID : node->parts[j].normal_textureID);
-
-					glDrawArrays(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count);
+					AssetManager::GetInstance().BindInstances(packet.node->m_vao, m_instance_ring.GetBuffer(), packet.instanceOffset);
+					bound_node = packet.node;
 				}
 
-				glBindVertexArray(0);
+				const GeometryNode::Objects* material = &packet.node->parts[packet.part];
+				if (material != bound_material)
+				{
+					packet.node->BindMaterial(packet.part);
+					bound_material = material;
+				}
+
+				glDrawArraysInstanced(GL_TRIANGLES, command.first, command.count, command.instance_count);
 			}
 		}
 
+		if (indirect)
+		{
+			m_command_ring.End();
+			m_draw_material_ring.End();
+		}
+		m_submit_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
 	void Renderer::RenderPostProcess()
 	{
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
 		glClearColor(0.f, 0.8f, 1.f, 1.f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glDisable(GL_DEPTH_TEST);
+		GLState::GetInstance().Disable(GL_DEPTH_TEST);
 
-		m_post_program.Bind();
+		ShaderProgram& post_program = m_post_variants.Get(m_post_features);
+		post_program.Bind();
 
-		glBindVertexArray(m_vao_fbo);
+		GLState::GetInstance().BindVertexArray(m_vao_fbo);
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, m_fbo_texture);
-		m_post_program.loadInt("uniform_texture", 0);
+		GLState::GetInstance().BindTexture(0, GL_TEXTURE_2D, m_fbo_texture);
 
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
-		m_post_program.loadInt("uniform_shadow_map", 1);
+		GLState::GetInstance().BindTexture(1, GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
 
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
-		glBindVertexArray(0);
-		glBindTexture(GL_TEXTURE_2D, 0);
-		m_post_program.Unbind();
+		GLState::GetInstance().BindVertexArray(0);
+		GLState::GetInstance().BindTexture(GL_TEXTURE_2D, 0);
+		post_program.Unbind();
 	}
 
 // CAMERA
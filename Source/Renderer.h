@@ -3,16 +3,87 @@
 
 #include "GLEW\glew.h"
 #include "glm\glm.hpp"
+#include <memory>
+#include <unordered_map>
 #include <vector>
 #include "helpers/ShaderProgram.h"
 #include "helpers/GeometryNode.h"
 #include "helpers/CollidableNode.h"
 #include "helpers/LightNode.h"
+#include "helpers/UniformRing.h"
+#include "helpers/FileWatcher.h"
+#include "helpers/AABBTree.h"
+#include "helpers/FrustumCuller.h"
+#include "helpers/RenderQueue.h"
+#include "helpers/FrameQueue.h"
+#include "helpers/ShadowAtlas.h"
 
 class Renderer
 {
 public:
-	// Empty
+	// features of the geometry program, one bit per #define of basic_rendering.frag
+	enum GEOMETRY_FEATURES
+	{
+		FEATURE_TEX_DIFFUSE = 1 << 0,
+		FEATURE_TEX_NORMAL = 1 << 1,
+		FEATURE_TEX_BUMP = 1 << 2,
+		FEATURE_TEX_DIFFUSE_ARRAY = 1 << 3,
+		FEATURE_TEX_NORMAL_ARRAY = 1 << 4,
+		FEATURE_CAST_SHADOWS = 1 << 5,
+		FEATURE_SHADOW_NEAREST = 1 << 6,
+		FEATURE_SHADOW_PCF_MEAN = 1 << 7,
+		FEATURE_MULTI_DRAW = 1 << 8,
+		FEATURE_CASCADED_SHADOWS = 1 << 9,
+		FEATURE_SHADOW_HARDWARE = 1 << 10,
+		FEATURE_SHADOW_POISSON = 1 << 11,
+	};
+
+	// features of the post process program
+	enum POST_FEATURES
+	{
+		POST_PREVIEW_SHADOW_MAP = 1 << 0,
+		POST_CROSS_HAIR = 1 << 1,
+	};
+
+	// the first three compare in the shader, hardware and poisson on the light's comparison sampler
+	enum SHADOW_FILTER							{ SHADOW_FILTER_PCF_WEIGHTED, SHADOW_FILTER_PCF_MEAN, SHADOW_FILTER_NEAREST,
+												  SHADOW_FILTER_HARDWARE, SHADOW_FILTER_POISSON, SHADOW_FILTER_COUNT };
+
+	// Shadow casters of one light in the last frame. candidates are the nodes of the light volume,
+	// before_near the ones of them between the light and the near plane. culled shadow no visible
+	// receiver, cached are in the light's static map and drawn were drawn on top of it
+	struct ShadowCullStatistics
+	{
+		size_t									candidates;
+		size_t									before_near;
+		size_t									culled;
+		size_t									cached;
+		size_t									drawn;
+	};
+
+	// Spotlights of the shadow atlas in the last frame. visible are the ones the camera sees, tiles the
+	// ones holding a tile. stale tiles are behind their light or casters and waited for the budget
+	struct ShadowAtlasStatistics
+	{
+		size_t									lights;
+		size_t									visible;
+		size_t									tiles;
+		size_t									redrawn;
+		size_t									stale;
+		size_t									used_texels;
+	};
+
+	// the lights array of LightsBlock
+	static const int							kMaxAtlasLights = 32;
+
+	// Point light casters in the last frame. face_submissions are the cube faces they were drawn to,
+	// six per caster without the per face culling, and batches the draws of one face mask each
+	struct PointShadowStatistics
+	{
+		size_t									casters;
+		size_t									face_submissions;
+		size_t									batches;
+	};
 
 protected:
 	//craft positions
@@ -33,6 +104,7 @@ protected:
 	glm::vec2									m_camera_look_angle_destination;
 	
 	float										m_continous_time;
+	bool										m_use_texture_arrays;
 
 	//Objects
 	enum OBJECS									{ TERRAIN, CRAFT };
@@ -40,10 +112,221 @@ protected:
 	std::vector<GeometryNode*>					m_nodes;								
 	std::vector<CollidableNode*>				m_collidables_nodes;
 
+	// world bounds of m_nodes followed by m_collidables_nodes, one proxy each, and what each pass draws
+	AABBTree									m_scene_tree;
+	std::vector<int>							m_node_proxies;
+	// the same bounds as they are this frame, the tree's fattened leaves only give candidates
+	FrustumCuller								m_frustum_culler;
+	std::vector<unsigned int>					m_visible_nodes;
+	std::vector<unsigned int>					m_shadow_casters;
+	std::vector<unsigned int>					m_ray_candidates;
+
+	struct NodeBounds
+	{
+		glm::vec3								min;
+		glm::vec3								max;
+	};
+
+	// What Update hands to Render, never changed once published. Update fills m_simulation and
+	// publishes a copy, Render draws the oldest one it has not drawn from m_frame
+	struct FrameState
+	{
+		glm::mat4								view_matrix;
+		glm::vec3								camera_position;
+		glm::vec3								camera_target_position;
+		glm::vec3								camera_up_vector;
+		float									time;
+		// m_nodes followed by m_collidables_nodes
+		std::vector<glm::mat4>					node_transforms;
+		std::vector<NodeBounds>					node_bounds;
+	};
+	FrameState									m_simulation;
+	FrameQueue<FrameState>						m_frames;
+	const FrameState*							m_frame;
+	int											m_frame_latency;
+
 	LightNode									m_light;
-	ShaderProgram								m_geometry_program;
-	ShaderProgram								m_post_program;
+	ShaderVariants								m_geometry_variants;
+	ShaderVariants								m_post_variants;
 	ShaderProgram								m_spot_light_shadow_map_program;
+	ShaderProgram								m_point_shadow_program;
+
+	// uniform handles, resolved once the programs are linked
+	ShaderProgram::Uniform<glm::mat4>			m_shadow_projection_matrix;
+	ShaderProgram::Uniform<glm::mat4>			m_point_face_projection_view;
+	ShaderProgram::Uniform<int>					m_point_face_mask;
+
+	// edits under Assets/Shaders rebuild the programs in the background
+	FileWatcher									m_shader_watcher;
+
+	// post process features and the shadow filter of the geometry pass
+	unsigned int								m_post_features;
+	SHADOW_FILTER								m_shadow_filter;
+	int											m_shadow_poisson_taps;
+	float										m_shadow_poisson_radius;
+
+	// uniform blocks of the geometry program
+	GLuint										m_frame_ubo;
+
+	// nodes of one asset in a pass, drawn with one instanced call per part
+	struct InstanceGroup
+	{
+		// the first node, its parts and materials stand for all
+		GeometryNode*							node;
+		GLintptr								offset;
+		GLsizei									count;
+		float									depth;
+	};
+
+	// per instance transforms of both passes, streamed every frame
+	bool										m_instancing;
+	UniformRing									m_instance_ring;
+	std::vector<InstanceData>					m_instance_data;
+	std::vector<InstanceGroup>					m_shadow_groups;
+	std::vector<InstanceGroup>					m_static_shadow_groups;
+	// casters and instances of each cascade of the directional light
+	std::vector<unsigned int>					m_cascade_casters[LightNode::kMaxCascades];
+	std::vector<InstanceGroup>					m_cascade_groups[LightNode::kMaxCascades];
+	std::vector<InstanceGroup>					m_geometry_groups;
+
+	// Point light casters by the cube faces their box overlaps. The whole cube is drawn in one layered
+	// pass, a batch's mask tells the geometry shader which faces its triangles go to
+	struct PointShadowBatch
+	{
+		unsigned int							face_mask;
+		std::vector<InstanceGroup>				groups;
+	};
+	bool										m_point_face_culling;
+	PointShadowStatistics						m_point_shadow_statistics;
+	// face mask and caster, sorted so the casters of a batch are next to each other
+	std::vector<std::pair<unsigned int, unsigned int>>	m_point_face_casters;
+	std::vector<PointShadowBatch>				m_point_batches;
+
+	// Spotlights besides m_light, their shadow maps are tiles of one atlas. A light's tile follows the
+	// screen extent of its cone in powers of two, and at most m_shadow_atlas_budget tiles are redrawn
+	// per frame: lights without a map first, then the changed ones by importance and frames waited
+	static const int							kShadowAtlasResolution = 4096;
+	static const int							kShadowAtlasMaxTile = 1024;
+	static const int							kShadowAtlasMinTile = 128;
+	struct AtlasLight
+	{
+		std::unique_ptr<LightNode>				light;
+		ShadowAtlas::Tile						tile;
+		// screen extent of the light volume, 0 when the camera does not see it, and the tile size it asks for
+		float									importance;
+		int										wanted_size;
+		// once valid the tile holds the light's map as it was at drawn_frame
+		bool									valid;
+		bool									changed;
+		unsigned int							drawn_revision;
+		uint64_t								drawn_frame;
+		glm::mat4								drawn_projection_view;
+		std::vector<unsigned int>				drawn_casters;
+		std::vector<unsigned int>				casters;
+		std::vector<InstanceGroup>				groups;
+	};
+	ShadowAtlas									m_shadow_atlas;
+	std::vector<AtlasLight>						m_atlas_lights;
+	int											m_shadow_atlas_budget;
+	ShadowAtlasStatistics						m_shadow_atlas_statistics;
+	// lights by importance, and the ones whose tile this frame redraws
+	std::vector<size_t>							m_atlas_order;
+	std::vector<size_t>							m_atlas_updates;
+	GLuint										m_lights_ubo;
+	// the nodes of every pass, gathered before the instance ring section is sized for the frame
+	struct InstancePass
+	{
+		std::vector<GeometryNode*>				nodes;
+		glm::mat4								view;
+		std::vector<InstanceGroup>*				groups;
+	};
+	std::vector<InstancePass>					m_instance_passes;
+	size_t										m_instance_pass_count;
+	// group of each node, then its slot in m_instance_data
+	std::vector<size_t>							m_node_groups;
+	std::vector<size_t>							m_group_cursors;
+	std::unordered_map<uintptr_t, size_t>		m_group_lookup;
+
+	// draw packets of the geometry pass, sorted by the state they need
+	RenderQueue									m_render_queue;
+
+	// the sorted packets as indirect commands, one multi draw call per bucket of equal
+	// program, asset and textures. kMultiDrawBatch is MULTI_DRAW_BATCH of basic_rendering.frag
+	static const int							kMultiDrawBatch = 256;
+	struct DrawBucket
+	{
+		// first packet, its program, asset and textures hold for the bucket
+		const RenderQueue::DrawPacket*			packet;
+		size_t									first;
+		size_t									count;
+		GLintptr								command_offset;
+		GLintptr								material_offset;
+	};
+	bool										m_multi_draw;
+	bool										m_multi_draw_supported;
+	UniformRing									m_command_ring;
+	UniformRing									m_draw_material_ring;
+	std::vector<DrawArraysIndirectCommand>		m_draw_commands;
+	std::vector<MaterialBlock>					m_draw_materials;
+	std::vector<DrawBucket>						m_draw_buckets;
+	GLintptr									m_geometry_instance_base;
+	double										m_submit_ms;
+
+	// What the packets of a part need from its material. Resolved on the GL thread, where the maps are
+	// requested, and only read by the prepare jobs. Kept once none of its maps is still on its way
+	struct PartState
+	{
+		unsigned int							features;
+		GLuint									diffuse_texture;
+		int										diffuse_layer;
+		GLuint									normal_texture;
+		int										normal_layer;
+		unsigned int							texture_set;
+		unsigned int							material;
+	};
+	std::unordered_map<const GeometryNode::Objects*, PartState>	m_part_states;
+
+	// packets of kPrepareSlice instance groups, filled by one prepare job each without touching GL.
+	// unresolved are the packets of parts with no state yet, finished at submit
+	static const size_t							kPrepareSlice = 64;
+	struct PacketSlice
+	{
+		struct Pending
+		{
+			size_t								index;
+			float								depth;
+		};
+		std::vector<RenderQueue::DrawPacket>	packets;
+		std::vector<Pending>					unresolved;
+	};
+	std::vector<PacketSlice>					m_packet_slices;
+	size_t										m_prepared_slices;
+	double										m_prepare_ms;
+
+	// Static casters are drawn into the light's cached map only when the light or the set of them
+	// changes, every frame copies it and draws the moving casters on top. A node is static once its
+	// transform held for kStaticShadowFrames, collidables always count as moving
+	static const uint64_t						kStaticShadowFrames = 8;
+	bool										m_shadow_caching;
+	bool										m_shadow_caster_culling;
+	ShadowCullStatistics						m_shadow_cull_statistics;
+	bool										m_shadow_cache_valid;
+	bool										m_shadow_cache_dirty;
+	unsigned int								m_shadow_cache_revision;
+	size_t										m_shadow_cache_updates;
+	uint64_t									m_frame_index;
+	// frame each node's transform last changed, in the order of the snapshot transforms
+	std::vector<uint64_t>						m_node_moved_frames;
+	std::vector<unsigned int>					m_static_casters;
+	std::vector<unsigned int>					m_cached_casters;
+	// GPU time of the shadow pass, read a frame late so the query never stalls
+	GLuint										m_shadow_queries[2];
+	bool										m_shadow_query_issued[2];
+	double										m_shadow_ms;
+	// and of the geometry pass, where the shadow filter runs
+	GLuint										m_geometry_queries[2];
+	bool										m_geometry_query_issued[2];
+	double										m_geometry_ms;
 
 	GLuint										m_fbo;
 	GLuint										m_fbo_texture;
@@ -54,17 +337,58 @@ protected:
 	// Protected Functions
 	//'init' functions
 	bool										InitShaders();
+	void										InitUniformHandles();
 	bool										InitGeometricMeshes();
 	bool										InitLights();
 	bool										InitCommonItems();
 	bool										InitIntermediateBuffers();
+	bool										InitUniformBuffers();
 	void										BuildWorld();
 	void										InitCamera();
+	void										CaptureTransforms();
+
+	//snapshot of the simulation this frame draws
+	bool										AcquireFrame();
+
+	//shader hot reload
+	void										UpdateShaders();
+
+	//texture streaming
+	void										UpdateTextureStreaming();
+	float										ProjectedScreenSize(GeometryNode* node);
+
+	//culling
+	void										UpdateWorldBounds();
+	void										UpdateCulling();
+	// sorted indices of the nodes in the frustum, the tree's candidates refined against the exact bounds
+	void										CullNodes(const glm::mat4& viewProjection, std::vector<unsigned int>& results, unsigned int planes = AABBTree::PLANE_ALL) const;
+	// normalized device bounds in the light's view of the visible nodes the camera sees, false when none
+	bool										ShadowReceiverBounds(const glm::mat4& light_projection_view, glm::vec3& min, glm::vec3& max) const;
+	// tiles, casters and the tiles to redraw of the atlas lights
+	void										UpdateShadowAtlas();
+	// screen extent of a light's volume, from 0 for none to 1 for the whole screen
+	float										ShadowLightImportance(LightNode& light) const;
+
+	//instancing
+	void										UpdateInstances();
+	// start a pass of UpdateInstances, the returned list is valid until the next pass starts
+	std::vector<GeometryNode*>&					AddInstancePass(const glm::mat4& view, std::vector<InstanceGroup>& groups);
+	GLintptr									BuildInstanceGroups(const std::vector<GeometryNode*>& nodes, const glm::mat4& view, std::vector<InstanceGroup>& groups);
 
 	//'render' function
 	void										RenderGeometry();
 	void										RenderStaticGeometry();
+	void										PrepareGeometryPackets();
+	PartState									ResolvePartState(GeometryNode::Objects& part);
+	void										ApplyPartState(const PartState& state, float depth, RenderQueue::DrawPacket& packet) const;
+	void										BuildDrawCommands();
+	void										SubmitDrawCommands();
 	void										RenderShadowMaps();
+	void										RenderSpotShadowMap();
+	void										RenderShadowCascades();
+	void										RenderPointShadowMap();
+	void										RenderShadowAtlas();
+	void										DrawShadowGroups(const std::vector<InstanceGroup>& groups);
 	void										RenderPostProcess();
 
 public:
@@ -72,8 +396,15 @@ public:
 	Renderer();
 	~Renderer();
 	bool										Init(int SCREEN_WIDTH, int SCREEN_HEIGHT);
+	// Update simulates and publishes a snapshot, Render draws one. They may run on different threads,
+	// the thread of Render owning the GL context. Render returns false when no snapshot came in time
 	void										Update(float dt);
-	void										Render();
+	bool										Render();
+	// How many snapshots the simulation may get ahead, 0 when Update and Render share a thread
+	void										SetFrameLatency(int frames);
+	int											GetFrameLatency() const { return m_frame_latency; }
+	// Release a simulation blocked on a render side that stopped
+	void										CloseFrames();
 	
 	//update functions
 	void										UpdateGeometry(float dt);
@@ -94,6 +425,58 @@ public:
 	void										CraftLook(glm::vec2 lookDir);
 
 	bool										ReloadShaders();
+	void										TogglePostFeature(unsigned int feature);
+	void										CycleShadowFilter();
+	void										SetShadowFilter(SHADOW_FILTER filter);
+	SHADOW_FILTER								GetShadowFilter() const { return m_shadow_filter; }
+	// taps of the poisson filter, 1 to 16, spread on a disk of radius texels
+	void										SetShadowPoissonTaps(int taps, float radius);
+	void										SetInstancing(bool enable);
+	// copies of the craft on a grid ahead of it, to load the scene. Only with a frame latency of 0
+	void										SpawnCrafts(int count);
+	// a spotlight shadowed through the atlas, up to kMaxAtlasLights. Its index, -1 once they are all taken
+	int											AddShadowLight(const glm::vec3& position, const glm::vec3& target, const glm::vec3& color, float cone);
+	// moving the light or changing its cone redraws its tile
+	LightNode*									GetShadowLight(int light);
+	int											GetShadowLightCount() const { return (int)m_atlas_lights.size(); }
+	// atlas lights on a grid around where the main light points
+	void										SpawnShadowLights(int count);
+	// atlas tiles redrawn per frame at most, 0 for all that changed
+	void										SetShadowAtlasBudget(int tiles);
+	ShadowAtlasStatistics						GetShadowAtlasStatistics() const { return m_shadow_atlas_statistics; }
+	void										SetMultiDraw(bool enable);
+	bool										IsMultiDrawSupported() const { return m_multi_draw_supported; }
+	// CPU time of the last geometry pass submit
+	double										GetSubmitMilliseconds() const { return m_submit_ms; }
+	// CPU time of the last geometry pass prepare, instance data and packets on the job system
+	double										GetPrepareMilliseconds() const { return m_prepare_ms; }
+	void										SetSortedDraws(bool enable);
+	void										SetShadowCaching(bool enable);
+	// a directional light with cascaded shadows in place of the spotlight
+	void										SetDirectionalLight(bool enable);
+	bool										IsDirectionalLight();
+	// a point light with a shadow cube in place of the spotlight, its faces reach range
+	void										SetPointLight(bool enable);
+	bool										IsPointLight();
+	void										SetPointLightRange(float range);
+	// draw each caster only to the cube faces it overlaps, or to all six
+	void										SetPointFaceCulling(bool enable);
+	PointShadowStatistics						GetPointShadowStatistics() const { return m_point_shadow_statistics; }
+	// count cascades, up to LightNode::kMaxCascades, covering the view up to distance
+	void										SetShadowCascades(int count, float distance);
+	void										SetShadowCascadeResolution(int cascade, int resolution);
+	// the practical split scheme's blend of even (0) and logarithmic (1) splits, or the split depths themselves
+	void										SetShadowCascadeSplitLambda(float lambda);
+	void										SetShadowCascadeSplits(const std::vector<float>& splits);
+	// skip the moving casters whose shadow falls on no visible receiver
+	void										SetShadowCasterCulling(bool enable);
+	ShadowCullStatistics						GetShadowCullStatistics() const { return m_shadow_cull_statistics; }
+	// GPU time of the shadow pass a frame or two back, and how often the static casters were redrawn
+	double										GetShadowMilliseconds() const { return m_shadow_ms; }
+	size_t										GetShadowCacheUpdates() const { return m_shadow_cache_updates; }
+	// GPU time of the geometry pass a frame or two back
+	double										GetGeometryMilliseconds() const { return m_geometry_ms; }
+	RenderQueue::Statistics						GetRenderQueueStatistics() const;
 	bool										ResizeBuffers(int SCREEN_WIDTH, int SCREEN_HEIGHT);
 };
 
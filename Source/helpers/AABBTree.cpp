@@ -0,0 +1,496 @@
+#include "AABBTree.h"
+#include "Tools.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+	float SurfaceArea(const glm::vec3& min, const glm::vec3& max)
+	{
+		glm::vec3 size = max - min;
+		return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+
+	float CombinedArea(const glm::vec3& minA, const glm::vec3& maxA, const glm::vec3& minB, const glm::vec3& maxB)
+	{
+		return SurfaceArea(glm::min(minA, minB), glm::max(maxA, maxB));
+	}
+
+	bool Contains(const glm::vec3& outerMin, const glm::vec3& outerMax, const glm::vec3& min, const glm::vec3& max)
+	{
+		return outerMin.x <= min.x && outerMin.y <= min.y && outerMin.z <= min.z &&
+			max.x <= outerMax.x && max.y <= outerMax.y && max.z <= outerMax.z;
+	}
+
+	bool Overlaps(const glm::vec3& minA, const glm::vec3& maxA, const glm::vec3& minB, const glm::vec3& maxB)
+	{
+		return minA.x <= maxB.x && minB.x <= maxA.x &&
+			minA.y <= maxB.y && minB.y <= maxA.y &&
+			minA.z <= maxB.z && minB.z <= maxA.z;
+	}
+}
+
+AABBTree::AABBTree(float fattening)
+{
+	this->fattening = fattening;
+	root = kNullProxy;
+	freeList = kNullProxy;
+	leafCount = 0;
+	reinserts = 0;
+	visited = 0;
+}
+
+void AABBTree::Clear()
+{
+	nodes.clear();
+	root = kNullProxy;
+	freeList = kNullProxy;
+	leafCount = 0;
+	reinserts = 0;
+}
+
+int AABBTree::Allocate()
+{
+	if (freeList == kNullProxy)
+	{
+		nodes.push_back(Node());
+		freeList = (int)nodes.size() - 1;
+		nodes[freeList].parent = kNullProxy;
+	}
+
+	int node = freeList;
+	freeList = nodes[node].parent;
+	nodes[node].parent = kNullProxy;
+	nodes[node].left = kNullProxy;
+	nodes[node].right = kNullProxy;
+	nodes[node].height = 0;
+	nodes[node].data = 0;
+	return node;
+}
+
+void AABBTree::Free(int node)
+{
+	nodes[node].parent = freeList;
+	nodes[node].height = -1;
+	freeList = node;
+}
+
+int AABBTree::Insert(const glm::vec3& min, const glm::vec3& max, unsigned int data)
+{
+	int leaf = Allocate();
+	glm::vec3 margin = (max - min) * fattening;
+	nodes[leaf].min = min - margin;
+	nodes[leaf].max = max + margin;
+	nodes[leaf].data = data;
+
+	InsertLeaf(leaf);
+	leafCount++;
+	return leaf;
+}
+
+void AABBTree::Remove(int proxy)
+{
+	RemoveLeaf(proxy);
+	Free(proxy);
+	leafCount--;
+}
+
+bool AABBTree::Move(int proxy, const glm::vec3& min, const glm::vec3& max)
+{
+	Node& leaf = nodes[proxy];
+	glm::vec3 margin = (max - min) * fattening;
+
+	// keep the leaf while the box is inside it and has not shrunk to a fraction of it
+	if (Contains(leaf.min, leaf.max, min, max) &&
+		Contains(min - margin * 4.f, max + margin * 4.f, leaf.min, leaf.max))
+		return false;
+
+	RemoveLeaf(proxy);
+	nodes[proxy].min = min - margin;
+	nodes[proxy].max = max + margin;
+	InsertLeaf(proxy);
+	reinserts++;
+	return true;
+}
+
+void AABBTree::InsertLeaf(int leaf)
+{
+	if (root == kNullProxy)
+	{
+		root = leaf;
+		nodes[leaf].parent = kNullProxy;
+		return;
+	}
+
+	// descend towards the sibling that grows the total surface area the least
+	glm::vec3 min = nodes[leaf].min;
+	glm::vec3 max = nodes[leaf].max;
+	int index = root;
+	while (!nodes[index].IsLeaf())
+	{
+		const Node& node = nodes[index];
+		float area = SurfaceArea(node.min, node.max);
+		float combined = CombinedArea(node.min, node.max, min, max);
+
+		// pairing with this node makes a new parent, going down grows this node anyway
+		float cost = 2.f * combined;
+		float inheritance = 2.f * (combined - area);
+
+		const Node& left = nodes[node.left];
+		const Node& right = nodes[node.right];
+		float leftCost = CombinedArea(left.min, left.max, min, max) + inheritance;
+		float rightCost = CombinedArea(right.min, right.max, min, max) + inheritance;
+		if (!left.IsLeaf())
+			leftCost -= SurfaceArea(left.min, left.max);
+		if (!right.IsLeaf())
+			rightCost -= SurfaceArea(right.min, right.max);
+
+		if (cost < leftCost && cost < rightCost)
+			break;
+		index = (leftCost < rightCost) ? node.left : node.right;
+	}
+
+	int sibling = index;
+	int oldParent = nodes[sibling].parent;
+	int newParent = Allocate();
+	nodes[newParent].parent = oldParent;
+	nodes[newParent].left = sibling;
+	nodes[newParent].right = leaf;
+	nodes[newParent].min = glm::min(min, nodes[sibling].min);
+	nodes[newParent].max = glm::max(max, nodes[sibling].max);
+	nodes[newParent].height = nodes[sibling].height + 1;
+	nodes[sibling].parent = newParent;
+	nodes[leaf].parent = newParent;
+
+	if (oldParent == kNullProxy)
+		root = newParent;
+	else if (nodes[oldParent].left == sibling)
+		nodes[oldParent].left = newParent;
+	else
+		nodes[oldParent].right = newParent;
+
+	Refit(nodes[leaf].parent);
+}
+
+void AABBTree::RemoveLeaf(int leaf)
+{
+	if (leaf == root)
+	{
+		root = kNullProxy;
+		return;
+	}
+
+	int parent = nodes[leaf].parent;
+	int grandParent = nodes[parent].parent;
+	int sibling = (nodes[parent].left == leaf) ? nodes[parent].right : nodes[parent].left;
+
+	// the sibling takes the place of the parent
+	nodes[sibling].parent = grandParent;
+	Free(parent);
+	if (grandParent == kNullProxy)
+	{
+		root = sibling;
+		return;
+	}
+
+	if (nodes[grandParent].left == parent)
+		nodes[grandParent].left = sibling;
+	else
+		nodes[grandParent].right = sibling;
+	Refit(grandParent);
+}
+
+void AABBTree::Refit(int node)
+{
+	while (node != kNullProxy)
+	{
+		node = Balance(node);
+
+		Node& current = nodes[node];
+		const Node& left = nodes[current.left];
+		const Node& right = nodes[current.right];
+		current.height = 1 + std::max(left.height, right.height);
+		current.min = glm::min(left.min, right.min);
+		current.max = glm::max(left.max, right.max);
+
+		node = current.parent;
+	}
+}
+
+int AABBTree::Balance(int a)
+{
+	Node& A = nodes[a];
+	if (A.IsLeaf() || A.height < 2)
+		return a;
+
+	int b = A.left;
+	int c = A.right;
+	Node& B = nodes[b];
+	Node& C = nodes[c];
+	int balance = C.height - B.height;
+	if (balance >= -1 && balance <= 1)
+		return a;
+
+	// the taller child moves up into the place of a, a keeps its other child
+	// and takes the shorter grandchild, the taller grandchild stays with the child
+	int up = (balance > 1) ? c : b;
+	int other = (balance > 1) ? b : c;
+	Node& U = nodes[up];
+	int f = U.left;
+	int g = U.right;
+	int tall = (nodes[f].height > nodes[g].height) ? f : g;
+	int shorter = (tall == f) ? g : f;
+
+	U.left = a;
+	U.right = tall;
+	U.parent = A.parent;
+	A.parent = up;
+	if (U.parent == kNullProxy)
+		root = up;
+	else if (nodes[U.parent].left == a)
+		nodes[U.parent].left = up;
+	else
+		nodes[U.parent].right = up;
+
+	A.left = other;
+	A.right = shorter;
+	nodes[shorter].parent = a;
+
+	A.min = glm::min(nodes[other].min, nodes[shorter].min);
+	A.max = glm::max(nodes[other].max, nodes[shorter].max);
+	A.height = 1 + std::max(nodes[other].height, nodes[shorter].height);
+	U.min = glm::min(A.min, nodes[tall].min);
+	U.max = glm::max(A.max, nodes[tall].max);
+	U.height = 1 + std::max(A.height, nodes[tall].height);
+	return up;
+}
+
+bool AABBTree::Rebalance()
+{
+	if (leafCount < 2)
+		return false;
+
+	// a balanced tree is about log2(n) deep, rebuild well before the queries notice
+	int depthLimit = 2 * (int)std::ceil(std::log2((double)leafCount)) + 2;
+	if (GetHeight() <= depthLimit && reinserts <= leafCount)
+		return false;
+
+	Rebuild();
+	return true;
+}
+
+void AABBTree::Rebuild()
+{
+	// proxies are leaf indices, so the leaves stay where they are and only the inner nodes are rebuilt
+	std::vector<int> leaves;
+	leaves.reserve(leafCount);
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].height < 0)
+			continue;
+		if (nodes[i].IsLeaf())
+			leaves.push_back((int)i);
+		else
+			Free((int)i);
+	}
+
+	reinserts = 0;
+	root = leaves.empty() ? kNullProxy : Build(leaves.data(), leaves.size());
+	if (root != kNullProxy)
+		nodes[root].parent = kNullProxy;
+}
+
+int AABBTree::Build(int* leaves, size_t count)
+{
+	if (count == 1)
+		return leaves[0];
+
+	// split at the median centre along the axis the centres spread the most
+	glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+	for (size_t i = 0; i < count; i++)
+	{
+		glm::vec3 center = (nodes[leaves[i]].min + nodes[leaves[i]].max) * 0.5f;
+		low = glm::min(low, center);
+		high = glm::max(high, center);
+	}
+	glm::vec3 spread = high - low;
+	int axis = (spread.x > spread.y && spread.x > spread.z) ? 0 : (spread.y > spread.z ? 1 : 2);
+
+	size_t half = count / 2;
+	std::nth_element(leaves, leaves + half, leaves + count, [this, axis](int a, int b)
+	{
+		return nodes[a].min[axis] + nodes[a].max[axis] < nodes[b].min[axis] + nodes[b].max[axis];
+	});
+
+	int left = Build(leaves, half);
+	int right = Build(leaves + half, count - half);
+
+	int node = Allocate();
+	nodes[node].left = left;
+	nodes[node].right = right;
+	nodes[node].min = glm::min(nodes[left].min, nodes[right].min);
+	nodes[node].max = glm::max(nodes[left].max, nodes[right].max);
+	nodes[node].height = 1 + std::max(nodes[left].height, nodes[right].height);
+	nodes[left].parent = node;
+	nodes[right].parent = node;
+	return node;
+}
+
+void AABBTree::CollectLeaves(int node, std::vector<unsigned int>& results, size_t& visits) const
+{
+	visits++;
+	if (nodes[node].IsLeaf())
+	{
+		results.push_back(nodes[node].data);
+		return;
+	}
+	CollectLeaves(nodes[node].left, results, visits);
+	CollectLeaves(nodes[node].right, results, visits);
+}
+
+std::vector<AABBTree::Visit>& AABBTree::TraversalStack()
+{
+	// one per thread, so queries can run side by side
+	static thread_local std::vector<Visit> stack;
+	stack.clear();
+	return stack;
+}
+
+bool AABBTree::GetBounds(glm::vec3& min, glm::vec3& max) const
+{
+	if (root == kNullProxy)
+		return false;
+	min = nodes[root].min;
+	max = nodes[root].max;
+	return true;
+}
+
+size_t AABBTree::QueryFrustum(const glm::mat4& viewProjection, std::vector<unsigned int>& results, unsigned int planes) const
+{
+	visited = 0;
+	if (root == kNullProxy)
+		return 0;
+
+	size_t visits = 0;
+	std::vector<Visit>& stack = TraversalStack();
+
+	glm::vec4 equations[6];
+	Tools::FrustumPlanes(viewProjection, equations);
+
+	size_t found = results.size();
+	stack.push_back({ root, planes & PLANE_ALL });
+	while (!stack.empty())
+	{
+		Visit visit = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[visit.node];
+
+		// a plane the nearest corner is in front of can not cut anything below this node
+		bool outside = false;
+		for (int p = 0; p < 6 && !outside; p++)
+		{
+			if ((visit.planes & (1u << p)) == 0)
+				continue;
+
+			const glm::vec4& plane = equations[p];
+			glm::vec3 furthest((plane.x >= 0.f) ? node.max.x : node.min.x, (plane.y >= 0.f) ? node.max.y : node.min.y, (plane.z >= 0.f) ? node.max.z : node.min.z);
+			glm::vec3 nearest((plane.x >= 0.f) ? node.min.x : node.max.x, (plane.y >= 0.f) ? node.min.y : node.max.y, (plane.z >= 0.f) ? node.min.z : node.max.z);
+			if (glm::dot(glm::vec3(plane), furthest) + plane.w < 0.f)
+				outside = true;
+			else if (glm::dot(glm::vec3(plane), nearest) + plane.w >= 0.f)
+				visit.planes &= ~(1u << p);
+		}
+
+		if (outside)
+		{
+			visits++;
+			continue;
+		}
+
+		if (visit.planes == 0 || node.IsLeaf())
+		{
+			CollectLeaves(visit.node, results, visits);
+			continue;
+		}
+
+		visits++;
+		stack.push_back({ node.left, visit.planes });
+		stack.push_back({ node.right, visit.planes });
+	}
+	visited = visits;
+	return results.size() - found;
+}
+
+size_t AABBTree::QueryRay(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, std::vector<unsigned int>& results) const
+{
+	visited = 0;
+	if (root == kNullProxy)
+		return 0;
+
+	size_t visits = 0;
+	std::vector<Visit>& stack = TraversalStack();
+
+	// slab test, a zero component gives infinities that compare the right way
+	glm::vec3 inverse = 1.f / direction;
+
+	size_t found = results.size();
+	stack.push_back({ root, 0 });
+	while (!stack.empty())
+	{
+		const Node& node = nodes[stack.back().node];
+		stack.pop_back();
+		visits++;
+
+		glm::vec3 t0 = (node.min - origin) * inverse;
+		glm::vec3 t1 = (node.max - origin) * inverse;
+		glm::vec3 entry = glm::min(t0, t1);
+		glm::vec3 leave = glm::max(t0, t1);
+		float enter = std::max(std::max(entry.x, entry.y), std::max(entry.z, 0.f));
+		float exit = std::min(std::min(leave.x, leave.y), std::min(leave.z, maxDistance));
+		if (enter > exit)
+			continue;
+
+		if (node.IsLeaf())
+		{
+			results.push_back(node.data);
+			continue;
+		}
+		stack.push_back({ node.left, 0 });
+		stack.push_back({ node.right, 0 });
+	}
+	visited = visits;
+	return results.size() - found;
+}
+
+size_t AABBTree::QueryBox(const glm::vec3& min, const glm::vec3& max, std::vector<unsigned int>& results) const
+{
+	visited = 0;
+	if (root == kNullProxy)
+		return 0;
+
+	size_t visits = 0;
+	std::vector<Visit>& stack = TraversalStack();
+
+	size_t found = results.size();
+	stack.push_back({ root, 0 });
+	while (!stack.empty())
+	{
+		const Node& node = nodes[stack.back().node];
+		stack.pop_back();
+		visits++;
+
+		if (!Overlaps(node.min, node.max, min, max))
+			continue;
+
+		if (node.IsLeaf())
+		{
+			results.push_back(node.data);
+			continue;
+		}
+		stack.push_back({ node.left, 0 });
+		stack.push_back({ node.right, 0 });
+	}
+	visited = visits;
+	return results.size() - found;
+}
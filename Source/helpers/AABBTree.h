@@ -0,0 +1,104 @@
+#ifndef AABB_TREE_H
+#define AABB_TREE_H
+
+#include <atomic>
+#include <vector>
+#include "glm/glm.hpp"
+
+// Dynamic bounding volume tree over world space boxes.
+// Leaves keep their box fattened by a fraction of its size, so a node that moves a little
+// keeps its leaf and the tree is not touched. Inserts pick the sibling by surface area and
+// rotate on the way up to stay balanced, Rebalance rebuilds the whole tree when that drifted.
+// Queries append the data of the leaves they reach, conservatively since the boxes are fat.
+// They only read the tree, any number of them may run at once between updates.
+class AABBTree
+{
+public:
+	static const int kNullProxy = -1;
+
+	// planes of a frustum query, in the order they are extracted
+	enum FrustumPlane
+	{
+		PLANE_LEFT = 1 << 0,
+		PLANE_RIGHT = 1 << 1,
+		PLANE_BOTTOM = 1 << 2,
+		PLANE_TOP = 1 << 3,
+		PLANE_NEAR = 1 << 4,
+		PLANE_FAR = 1 << 5,
+		PLANE_ALL = 0x3F,
+	};
+
+	AABBTree(float fattening = 0.1f);
+
+	// Add a box, returns the proxy that identifies its leaf
+	int Insert(const glm::vec3& min, const glm::vec3& max, unsigned int data);
+	void Remove(int proxy);
+	// New bounds of a proxy, returns true when the leaf had to be reinserted
+	bool Move(int proxy, const glm::vec3& min, const glm::vec3& max);
+	void Clear();
+
+	unsigned int GetData(int proxy) const { return nodes[proxy].data; }
+	size_t GetLeafCount() const { return leafCount; }
+	int GetHeight() const { return (root == kNullProxy) ? 0 : nodes[root].height; }
+	// Box around every leaf, false while the tree is empty
+	bool GetBounds(glm::vec3& min, glm::vec3& max) const;
+	// Tree nodes the last query looked at
+	size_t GetVisitedCount() const { return visited; }
+
+	// Rebuild top down when the incremental updates left the tree too deep, returns true when it did
+	bool Rebalance();
+	void Rebuild();
+
+	// Leaves inside the planes of viewProjection picked by planes, leaving one out opens the frustum on that side
+	size_t QueryFrustum(const glm::mat4& viewProjection, std::vector<unsigned int>& results, unsigned int planes = PLANE_ALL) const;
+	size_t QueryRay(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, std::vector<unsigned int>& results) const;
+	size_t QueryBox(const glm::vec3& min, const glm::vec3& max, std::vector<unsigned int>& results) const;
+
+private:
+	struct Node
+	{
+		glm::vec3 min;
+		glm::vec3 max;
+		// next free node while on the free list
+		int parent;
+		int left;
+		int right;
+		// 0 for leaves, -1 while free
+		int height;
+		unsigned int data;
+
+		bool IsLeaf() const { return left == kNullProxy; }
+	};
+
+	std::vector<Node> nodes;
+	int root;
+	int freeList;
+	size_t leafCount;
+	float fattening;
+	// reinserts since the last rebuild
+	size_t reinserts;
+
+	// traversal stack, with the frustum planes a node still crosses
+	struct Visit
+	{
+		int node;
+		unsigned int planes;
+	};
+	mutable std::atomic<size_t> visited;
+	static std::vector<Visit>& TraversalStack();
+
+	int Allocate();
+	void Free(int node);
+
+	void InsertLeaf(int leaf);
+	void RemoveLeaf(int leaf);
+	// one rotation at node when its children differ in height by more than one, returns the new subtree root
+	int Balance(int node);
+	void Refit(int node);
+	int Build(int* leaves, size_t count);
+
+	// append every leaf below node
+	void CollectLeaves(int node, std::vector<unsigned int>& results, size_t& visits) const;
+};
+
+#endif
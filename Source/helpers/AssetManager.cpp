@@ -1,6 +1,9 @@
 #pragma once
 
 #include "AssetManager.hpp"
+#include "GLState.h"
+#include "UniformBlocks.h"
+#include <cstddef>
 
 AssetManager::AssetManager()
 {
@@ -52,10 +55,10 @@ GLuint AssetManager::RequestAsset(const std::string& assetName, GeometricMesh* m
 	asset.name = assetName;
 
 	glGenVertexArrays(1, &asset.m_vao);
-	glBindVertexArray(asset.m_vao);
+	GLState::GetInstance().BindVertexArray(asset.m_vao);
 
 	glGenBuffers(1, &asset.m_vbo_positions);
-	glBindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_positions);
+	GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_positions);
 	glBufferData(GL_ARRAY_BUFFER, mesh->vertices.size() * sizeof(glm::vec3), &mesh->vertices[0], GL_STATIC_DRAW);
 
 	glEnableVertexAttribArray(0);
@@ -69,7 +72,7 @@ GLuint AssetManager::RequestAsset(const std::string& assetName, GeometricMesh* m
 	);
 
 	glGenBuffers(1, &asset.m_vbo_normals);
-	glBindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_normals);
+	GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_normals);
 	glBufferData(GL_ARRAY_BUFFER, mesh->normals.size() * sizeof(glm::vec3), &mesh->normals[0], GL_STATIC_DRAW);
 
 	glEnableVertexAttribArray(1);
@@ -85,7 +88,7 @@ GLuint AssetManager::RequestAsset(const std::string& assetName, GeometricMesh* m
 	if (!mesh->textureCoord.empty())
 	{
 		glGenBuffers(1, &asset.m_vbo_texcoords);
-		glBindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_texcoords);
+		GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_texcoords);
 		glBufferData(GL_ARRAY_BUFFER, mesh->textureCoord.size() * sizeof(glm::vec2), &mesh->textureCoord[0], GL_STATIC_DRAW);
 
 		glEnableVertexAttribArray(2);
@@ -102,7 +105,7 @@ GLuint AssetManager::RequestAsset(const std::string& assetName, GeometricMesh* m
 	if (!mesh->tangents.empty())
 	{
 		glGenBuffers(1, &asset.m_vbo_tangents);
-		glBindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_tangents);
+		GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_tangents);
 		glBufferData(GL_ARRAY_BUFFER, mesh->tangents.size() * sizeof(glm::vec3), &mesh->tangents[0], GL_STATIC_DRAW);
 
 		glEnableVertexAttribArray(3);
@@ -116,7 +119,7 @@ GLuint AssetManager::RequestAsset(const std::string& assetName, GeometricMesh* m
 		);
 
 		glGenBuffers(1, &asset.m_vbo_tangents);
-		glBindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_tangents);
+		GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_tangents);
 		glBufferData(GL_ARRAY_BUFFER, mesh->tangents.size() * sizeof(glm::vec3), &mesh->tangents[0], GL_STATIC_DRAW);
 
 		glEnableVertexAttribArray(3);
@@ -130,7 +133,7 @@ GLuint AssetManager::RequestAsset(const std::string& assetName, GeometricMesh* m
 		);
 
 		glGenBuffers(1, &asset.m_vbo_bitangents);
-		glBindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_bitangents);
+		GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, asset.m_vbo_bitangents);
 		glBufferData(GL_ARRAY_BUFFER, mesh->bitangents.size() * sizeof(glm::vec3), &mesh->bitangents[0], GL_STATIC_DRAW);
 
 		glEnableVertexAttribArray(4);
@@ -144,9 +147,34 @@ GLuint AssetManager::RequestAsset(const std::string& assetName, GeometricMesh* m
 		);
 	}
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	// world and normal matrices advance once per instance, BindInstances points them at the frame's data
+	for (GLuint location = INSTANCE_ATTRIBUTE_WORLD_MATRIX; location < INSTANCE_ATTRIBUTE_END; location++)
+	{
+		glEnableVertexAttribArray(location);
+		glVertexAttribDivisor(location, 1);
+	}
+
+	GLState::GetInstance().BindVertexArray(0);
+	GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, 0);
 
 	this->assets.push_back(asset);
 	return asset.m_vao;
+}
+
+void AssetManager::BindInstances(GLuint vao, GLuint buffer, GLintptr offset)
+{
+	GLState::GetInstance().BindVertexArray(vao);
+	GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	// GL 3.3 has no base instance, so the pointers move instead
+	for (GLuint column = 0; column < 4; column++)
+	{
+		glVertexAttribPointer(INSTANCE_ATTRIBUTE_WORLD_MATRIX + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+			(const void*)(offset + offsetof(InstanceData, world_matrix) + column * sizeof(glm::vec4)));
+	}
+	for (GLuint column = 0; column < 3; column++)
+	{
+		glVertexAttribPointer(INSTANCE_ATTRIBUTE_NORMAL_MATRIX + column, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+			(const void*)(offset + offsetof(InstanceData, normal_matrix) + column * sizeof(glm::vec4)));
+	}
 }
\ No newline at end of file
@@ -39,6 +39,9 @@ public:
 
 	unsigned int RequestAsset(const std::string & assetName, GeometricMesh* mesh=nullptr);
 
+	// Bind an asset with its per instance attributes reading InstanceData from offset in buffer
+	void BindInstances(GLuint vao, GLuint buffer, GLintptr offset);
+
 protected:
 	AssetManager();
 	void operator=(AssetManager const&);
@@ -0,0 +1,128 @@
+#include "FileWatcher.h"
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+FileWatcher::FileWatcher()
+{
+#ifdef _WIN32
+	handle = INVALID_HANDLE_VALUE;
+#else
+	inotifyFd = -1;
+	watchFd = -1;
+#endif
+	changed = false;
+	settle = std::chrono::milliseconds(100);
+}
+
+FileWatcher::~FileWatcher()
+{
+	Stop();
+}
+
+bool FileWatcher::Watch(const char* directory, int settleMs)
+{
+	Stop();
+	this->directory = directory;
+	settle = std::chrono::milliseconds(settleMs);
+
+#ifdef _WIN32
+	handle = FindFirstChangeNotificationA(directory, TRUE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		printf("Could not watch %s\n", directory);
+		return false;
+	}
+#else
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0)
+	{
+		printf("Could not watch %s: inotify_init1 failed\n", directory);
+		return false;
+	}
+
+	// renames cover editors that save to a temporary file first
+	watchFd = inotify_add_watch(inotifyFd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+	if (watchFd < 0)
+	{
+		printf("Could not watch %s\n", directory);
+		Stop();
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+void FileWatcher::Stop()
+{
+#ifdef _WIN32
+	if (handle != INVALID_HANDLE_VALUE)
+		FindCloseChangeNotification(handle);
+	handle = INVALID_HANDLE_VALUE;
+#else
+	if (inotifyFd >= 0)
+	{
+		if (watchFd >= 0)
+			inotify_rm_watch(inotifyFd, watchFd);
+		close(inotifyFd);
+	}
+	inotifyFd = -1;
+	watchFd = -1;
+#endif
+	changed = false;
+}
+
+bool FileWatcher::ReadChanges()
+{
+#ifdef _WIN32
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool any = false;
+	while (WaitForSingleObject(handle, 0) == WAIT_OBJECT_0)
+	{
+		any = true;
+		if (!FindNextChangeNotification(handle))
+			break;
+	}
+	return any;
+#else
+	if (inotifyFd < 0)
+		return false;
+
+	// only whether something happened matters, the events themselves are dropped
+	bool any = false;
+	alignas(inotify_event) char buffer[4096];
+	while (true)
+	{
+		ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+		if (length <= 0)
+			break;
+		any = true;
+	}
+	return any;
+#endif
+}
+
+bool FileWatcher::Poll()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (ReadChanges())
+	{
+		changed = true;
+		lastChange = now;
+	}
+
+	if (changed && now - lastChange >= settle)
+	{
+		changed = false;
+		return true;
+	}
+	return false;
+}
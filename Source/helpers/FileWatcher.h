@@ -0,0 +1,42 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <chrono>
+#include <string>
+
+// Reports writes to the files of a directory without blocking.
+// inotify on Linux, a change notification handle on Windows.
+class FileWatcher
+{
+public:
+	FileWatcher();
+	~FileWatcher();
+
+	// Start watching, settleMs is how long the directory has to stay quiet before a change is reported
+	bool Watch(const char* directory, int settleMs = 100);
+	void Stop();
+
+	// True once per burst of changes, after they settled. Call once per frame
+	bool Poll();
+
+private:
+	FileWatcher(const FileWatcher&);
+	void operator=(const FileWatcher&);
+
+	std::string directory;
+#ifdef _WIN32
+	void* handle;
+#else
+	int inotifyFd;
+	int watchFd;
+#endif
+
+	// editors save in several writes, the reload waits for the last one
+	bool changed;
+	std::chrono::milliseconds settle;
+	std::chrono::steady_clock::time_point lastChange;
+
+	bool ReadChanges();
+};
+
+#endif
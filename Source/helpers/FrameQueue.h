@@ -0,0 +1,121 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Snapshots handed from one producer thread to one consumer thread, oldest first.
+// Depth is how many published snapshots may wait for the consumer. With all of them waiting
+// Publish blocks, or with blocking off replaces the oldest so a consumer that is behind only
+// sees the newest. The snapshot the consumer holds is left alone until its next Acquire.
+template <typename T>
+class FrameQueue
+{
+public:
+	FrameQueue()
+	{
+		Init(1, false);
+	}
+
+	// Drop every snapshot, neither side may be using the queue
+	void Init(int depth, bool blocking)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->depth = std::max(1, depth);
+		this->blocking = blocking;
+		closed = false;
+
+		// the waiting ones, the one the consumer holds and the one being written
+		slots.clear();
+		slots.resize(this->depth + 2);
+		queued.clear();
+		free.clear();
+		for (int i = 0; i < (int)slots.size(); i++)
+			free.push_back(i);
+		held = -1;
+	}
+
+	void Publish(const T& snapshot)
+	{
+		int slot = -1;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (blocking)
+				released.wait(lock, [this]() { return (int)queued.size() < depth || closed; });
+			if (closed)
+				return;
+
+			if ((int)queued.size() >= depth)
+			{
+				slot = queued.front();
+				queued.pop_front();
+			}
+			else
+			{
+				slot = free.back();
+				free.pop_back();
+			}
+		}
+
+		// the slot belongs to no one else while it is written
+		slots[slot] = snapshot;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queued.push_back(slot);
+		}
+		published.notify_one();
+	}
+
+	// The oldest waiting snapshot, fresh tells whether it is a new one or the held one again
+	// because nothing came within timeout. Null before anything was published
+	const T* Acquire(std::chrono::milliseconds timeout, bool& fresh)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (queued.empty() && timeout.count() > 0)
+			published.wait_for(lock, timeout, [this]() { return !queued.empty() || closed; });
+
+		fresh = !queued.empty();
+		if (fresh)
+		{
+			if (held >= 0)
+				free.push_back(held);
+			held = queued.front();
+			queued.pop_front();
+			released.notify_one();
+		}
+		return (held >= 0) ? &slots[held] : nullptr;
+	}
+
+	// Wake both sides for good, Publish drops its snapshots until the next Init
+	void Close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		published.notify_all();
+		released.notify_all();
+	}
+
+	int GetDepth() const { return depth; }
+
+private:
+	std::vector<T> slots;
+	std::deque<int> queued;
+	std::vector<int> free;
+	int held;
+	int depth;
+	bool blocking;
+	bool closed;
+
+	std::mutex mutex;
+	std::condition_variable published;
+	std::condition_variable released;
+};
+
+#endif
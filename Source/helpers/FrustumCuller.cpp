@@ -0,0 +1,329 @@
+#include "FrustumCuller.h"
+#include "Tools.h"
+#include <cfloat>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRUSTUM_CULLER_SSE
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC emits AVX intrinsics without /arch:AVX, the CPU check guards the call
+#define FRUSTUM_CULLER_AVX
+#define AVX_TARGET
+#elif defined(__GNUC__)
+#define FRUSTUM_CULLER_AVX
+#define AVX_TARGET __attribute__((target("avx")))
+#endif
+#endif
+
+namespace
+{
+	const size_t kLanes = 8;
+
+	size_t PaddedCount(size_t count)
+	{
+		return (count + kLanes - 1) / kLanes * kLanes;
+	}
+
+	bool QueryAVX()
+	{
+#if defined(FRUSTUM_CULLER_AVX) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		// the OS has to save the upper halves of the registers too
+		return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#elif defined(FRUSTUM_CULLER_AVX)
+		return __builtin_cpu_supports("avx");
+#else
+		return false;
+#endif
+	}
+
+	bool CpuHasAVX()
+	{
+		static const bool avx = QueryAVX();
+		return avx;
+	}
+}
+
+FrustumCuller::FrustumCuller()
+{
+	count = 0;
+}
+
+void FrustumCuller::Resize(size_t count)
+{
+	this->count = count;
+
+	// an inverted box fails every plane test
+	size_t padded = PaddedCount(count);
+	minX.resize(padded, FLT_MAX);
+	minY.resize(padded, FLT_MAX);
+	minZ.resize(padded, FLT_MAX);
+	maxX.resize(padded, -FLT_MAX);
+	maxY.resize(padded, -FLT_MAX);
+	maxZ.resize(padded, -FLT_MAX);
+	for (size_t i = count; i < padded; i++)
+		SetBox(i, glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX));
+}
+
+void FrustumCuller::SetBox(size_t index, const glm::vec3& min, const glm::vec3& max)
+{
+	minX[index] = min.x;
+	minY[index] = min.y;
+	minZ[index] = min.z;
+	maxX[index] = max.x;
+	maxY[index] = max.y;
+	maxZ[index] = max.z;
+}
+
+void FrustumCuller::SetBox(size_t index, const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform)
+{
+	glm::vec3 world_min, world_max;
+	Tools::TransformBounds(min, max, transform, world_min, world_max);
+	SetBox(index, world_min, world_max);
+}
+
+void FrustumCuller::ExtractPlanes(const glm::mat4& viewProjection, Plane planes[6], unsigned int mask) const
+{
+	glm::vec4 equations[6];
+	Tools::FrustumPlanes(viewProjection, equations);
+
+	for (int i = 0; i < 6; i++)
+	{
+		// a plane left out is one every box is in front of
+		const glm::vec4 e = (mask & (1u << i)) ? equations[i] : glm::vec4(0.f, 0.f, 0.f, 1.f);
+		planes[i].nx = e.x;
+		planes[i].ny = e.y;
+		planes[i].nz = e.z;
+		planes[i].d = e.w;
+		planes[i].x = (e.x >= 0.f) ? maxX.data() : minX.data();
+		planes[i].y = (e.y >= 0.f) ? maxY.data() : minY.data();
+		planes[i].z = (e.z >= 0.f) ? maxZ.data() : minZ.data();
+	}
+}
+
+size_t FrustumCuller::Cull(const glm::mat4& viewProjection, std::vector<unsigned int>& visible, Path path) const
+{
+	if (count == 0)
+		return 0;
+
+	Plane planes[6];
+	ExtractPlanes(viewProjection, planes);
+
+	if (path == PATH_AUTO)
+		path = BestPath();
+
+	switch (path)
+	{
+#ifdef FRUSTUM_CULLER_AVX
+		case PATH_AVX: return CpuHasAVX() ? CullAVX(planes, visible) : CullSSE(planes, visible);
+#endif
+#ifdef FRUSTUM_CULLER_SSE
+		case PATH_SSE: return CullSSE(planes, visible);
+#endif
+		default: return CullScalar(planes, visible);
+	}
+}
+
+size_t FrustumCuller::Cull(const glm::mat4& viewProjection, const std::vector<unsigned int>& candidates, std::vector<unsigned int>& visible, unsigned int mask) const
+{
+	Plane planes[6];
+	ExtractPlanes(viewProjection, planes, mask);
+
+	size_t found = 0;
+	size_t i = 0;
+#ifdef FRUSTUM_CULLER_SSE
+	__m128 nx[6], ny[6], nz[6], d[6];
+	for (int p = 0; p < 6; p++)
+	{
+		nx[p] = _mm_set1_ps(planes[p].nx);
+		ny[p] = _mm_set1_ps(planes[p].ny);
+		nz[p] = _mm_set1_ps(planes[p].nz);
+		d[p] = _mm_set1_ps(planes[p].d);
+	}
+
+	// the candidates are scattered, 4 of them are gathered per test
+	const __m128 zero = _mm_setzero_ps();
+	for (; i + 4 <= candidates.size(); i += 4)
+	{
+		const unsigned int* c = &candidates[i];
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; p++)
+		{
+			const Plane& plane = planes[p];
+			__m128 x = _mm_setr_ps(plane.x[c[0]], plane.x[c[1]], plane.x[c[2]], plane.x[c[3]]);
+			__m128 y = _mm_setr_ps(plane.y[c[0]], plane.y[c[1]], plane.y[c[2]], plane.y[c[3]]);
+			__m128 z = _mm_setr_ps(plane.z[c[0]], plane.z[c[1]], plane.z[c[2]], plane.z[c[3]]);
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], x), _mm_mul_ps(ny[p], y)), _mm_add_ps(_mm_mul_ps(nz[p], z), d[p]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, zero));
+		}
+
+		int lanes = _mm_movemask_ps(inside);
+		for (int lane = 0; lane < 4; lane++)
+		{
+			if ((lanes >> lane) & 1)
+			{
+				visible.push_back(c[lane]);
+				found++;
+			}
+		}
+	}
+#endif
+
+	for (; i < candidates.size(); i++)
+	{
+		unsigned int index = candidates[i];
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++)
+		{
+			const Plane& plane = planes[p];
+			inside = plane.nx * plane.x[index] + plane.ny * plane.y[index] + plane.nz * plane.z[index] + plane.d >= 0.f;
+		}
+
+		if (inside)
+		{
+			visible.push_back(index);
+			found++;
+		}
+	}
+	return found;
+}
+
+FrustumCuller::Path FrustumCuller::BestPath()
+{
+#ifdef FRUSTUM_CULLER_SSE
+	return CpuHasAVX() ? PATH_AVX : PATH_SSE;
+#else
+	return PATH_SCALAR;
+#endif
+}
+
+const char* FrustumCuller::PathName(Path path)
+{
+	switch (path)
+	{
+		case PATH_SCALAR: return "scalar";
+		case PATH_SSE: return "SSE";
+		case PATH_AVX: return "AVX";
+		default: return "auto";
+	}
+}
+
+size_t FrustumCuller::CullScalar(const Plane planes[6], std::vector<unsigned int>& visible) const
+{
+	size_t found = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++)
+		{
+			const Plane& plane = planes[p];
+			inside = plane.nx * plane.x[i] + plane.ny * plane.y[i] + plane.nz * plane.z[i] + plane.d >= 0.f;
+		}
+
+		if (inside)
+		{
+			visible.push_back((unsigned int)i);
+			found++;
+		}
+	}
+	return found;
+}
+
+#ifdef FRUSTUM_CULLER_SSE
+size_t FrustumCuller::CullSSE(const Plane planes[6], std::vector<unsigned int>& visible) const
+{
+	__m128 nx[6], ny[6], nz[6], d[6];
+	for (int p = 0; p < 6; p++)
+	{
+		nx[p] = _mm_set1_ps(planes[p].nx);
+		ny[p] = _mm_set1_ps(planes[p].ny);
+		nz[p] = _mm_set1_ps(planes[p].nz);
+		d[p] = _mm_set1_ps(planes[p].d);
+	}
+
+	size_t found = 0;
+	const __m128 zero = _mm_setzero_ps();
+	for (size_t i = 0; i < count; i += 4)
+	{
+		// lanes stay set while the furthest corner is in front of every plane
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; p++)
+		{
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(nx[p], _mm_loadu_ps(planes[p].x + i)), _mm_mul_ps(ny[p], _mm_loadu_ps(planes[p].y + i))),
+				_mm_add_ps(_mm_mul_ps(nz[p], _mm_loadu_ps(planes[p].z + i)), d[p]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, zero));
+		}
+
+		int mask = _mm_movemask_ps(inside);
+		while (mask != 0)
+		{
+			int lane = 0;
+			while (((mask >> lane) & 1) == 0) lane++;
+			mask &= mask - 1;
+			if (i + lane < count)
+			{
+				visible.push_back((unsigned int)(i + lane));
+				found++;
+			}
+		}
+	}
+	return found;
+}
+#else
+size_t FrustumCuller::CullSSE(const Plane planes[6], std::vector<unsigned int>& visible) const
+{
+	return CullScalar(planes, visible);
+}
+#endif
+
+#ifdef FRUSTUM_CULLER_AVX
+AVX_TARGET size_t FrustumCuller::CullAVX(const Plane planes[6], std::vector<unsigned int>& visible) const
+{
+	__m256 nx[6], ny[6], nz[6], d[6];
+	for (int p = 0; p < 6; p++)
+	{
+		nx[p] = _mm256_set1_ps(planes[p].nx);
+		ny[p] = _mm256_set1_ps(planes[p].ny);
+		nz[p] = _mm256_set1_ps(planes[p].nz);
+		d[p] = _mm256_set1_ps(planes[p].d);
+	}
+
+	size_t found = 0;
+	const __m256 zero = _mm256_setzero_ps();
+	for (size_t i = 0; i < count; i += 8)
+	{
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int p = 0; p < 6; p++)
+		{
+			__m256 distance = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(nx[p], _mm256_loadu_ps(planes[p].x + i)), _mm256_mul_ps(ny[p], _mm256_loadu_ps(planes[p].y + i))),
+				_mm256_add_ps(_mm256_mul_ps(nz[p], _mm256_loadu_ps(planes[p].z + i)), d[p]));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, zero, _CMP_GE_OQ));
+		}
+
+		int mask = _mm256_movemask_ps(inside);
+		while (mask != 0)
+		{
+			int lane = 0;
+			while (((mask >> lane) & 1) == 0) lane++;
+			mask &= mask - 1;
+			if (i + lane < count)
+			{
+				visible.push_back((unsigned int)(i + lane));
+				found++;
+			}
+		}
+	}
+	return found;
+}
+#else
+size_t FrustumCuller::CullAVX(const Plane planes[6], std::vector<unsigned int>& visible) const
+{
+	return CullSSE(planes, visible);
+}
+#endif
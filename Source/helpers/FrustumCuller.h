@@ -0,0 +1,64 @@
+#ifndef FRUSTUM_CULLER_H
+#define FRUSTUM_CULLER_H
+
+#include <vector>
+#include "glm/glm.hpp"
+
+// World space boxes tested against a view frustum.
+// Bounds are kept as separate min/max arrays per axis, so the SSE path tests 4 boxes
+// and the AVX path 8 boxes per instruction. AVX is picked at runtime when the CPU has it.
+class FrustumCuller
+{
+public:
+	enum Path
+	{
+		PATH_AUTO,
+		PATH_SCALAR,
+		PATH_SSE,
+		PATH_AVX,
+	};
+
+	FrustumCuller();
+
+	// Number of boxes, new ones start empty and are never visible
+	void Resize(size_t count);
+	size_t GetCount() const { return count; }
+
+	// World bounds of a box
+	void SetBox(size_t index, const glm::vec3& min, const glm::vec3& max);
+	// Local bounds and the transform to world space, the result encloses the transformed box
+	void SetBox(size_t index, const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform);
+
+	// Append the indices of the boxes inside or crossing the frustum of viewProjection, returns how many
+	size_t Cull(const glm::mat4& viewProjection, std::vector<unsigned int>& visible, Path path = PATH_AUTO) const;
+	// The same for the given boxes only, a coarse query's candidates, in their order. The mask picks planes
+	// in the order of Tools::FrustumPlanes, the ones left out pass every box
+	size_t Cull(const glm::mat4& viewProjection, const std::vector<unsigned int>& candidates, std::vector<unsigned int>& visible, unsigned int mask = 0x3F) const;
+
+	// The path PATH_AUTO resolves to on this CPU
+	static Path BestPath();
+	static const char* PathName(Path path);
+
+private:
+	size_t count;
+
+	// padded to a multiple of 8 with boxes no frustum contains
+	std::vector<float> minX, minY, minZ;
+	std::vector<float> maxX, maxY, maxZ;
+
+	struct Plane
+	{
+		// the box corner furthest along the normal decides, per axis the max or the min array
+		const float* x;
+		const float* y;
+		const float* z;
+		float nx, ny, nz, d;
+	};
+	void ExtractPlanes(const glm::mat4& viewProjection, Plane planes[6], unsigned int mask = 0x3F) const;
+
+	size_t CullScalar(const Plane planes[6], std::vector<unsigned int>& visible) const;
+	size_t CullSSE(const Plane planes[6], std::vector<unsigned int>& visible) const;
+	size_t CullAVX(const Plane planes[6], std::vector<unsigned int>& visible) const;
+};
+
+#endif
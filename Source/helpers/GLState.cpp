@@ -0,0 +1,281 @@
+#include "GLState.h"
+
+GLState::GLState()
+{
+	filtering = true;
+	frame = {};
+	lastFrame = {};
+	Invalidate();
+}
+
+void GLState::EnableFiltering(bool enable)
+{
+	filtering = enable;
+	Invalidate();
+}
+
+void GLState::Invalidate()
+{
+	program = kUnknown;
+	vertexArray = kUnknown;
+	drawFramebuffer = kUnknown;
+	readFramebuffer = kUnknown;
+	viewportKnown = false;
+	for (int i = 0; i < CAP_COUNT; i++)
+		capabilities[i] = -1;
+	depthFunc = kUnknown;
+
+	activeUnit = kUnknown;
+	for (int unit = 0; unit < kTextureUnits; unit++)
+	{
+		for (int target = 0; target < TARGET_COUNT; target++)
+			textures[unit][target] = kUnknown;
+		samplers[unit] = kUnknown;
+	}
+	for (int i = 0; i < BUFFER_COUNT; i++)
+		buffers[i] = kUnknown;
+	for (int i = 0; i < kUniformBindings; i++)
+		uniformBindings[i] = { kUnknown, 0, 0 };
+}
+
+void GLState::EndFrame()
+{
+	lastFrame = frame;
+	frame = {};
+}
+
+int GLState::TextureTargetIndex(GLenum target)
+{
+	switch (target)
+	{
+		case GL_TEXTURE_2D: return TARGET_2D;
+		case GL_TEXTURE_2D_ARRAY: return TARGET_2D_ARRAY;
+		case GL_TEXTURE_CUBE_MAP: return TARGET_CUBE_MAP;
+		case GL_TEXTURE_CUBE_MAP_ARRAY: return TARGET_CUBE_MAP_ARRAY;
+		case GL_TEXTURE_3D: return TARGET_3D;
+		default: return -1;
+	}
+}
+
+int GLState::BufferTargetIndex(GLenum target)
+{
+	// the element array binding belongs to the vertex array, it is never cached
+	switch (target)
+	{
+		case GL_ARRAY_BUFFER: return BUFFER_ARRAY;
+		case GL_UNIFORM_BUFFER: return BUFFER_UNIFORM;
+		case GL_PIXEL_UNPACK_BUFFER: return BUFFER_PIXEL_UNPACK;
+		case GL_PIXEL_PACK_BUFFER: return BUFFER_PIXEL_PACK;
+		case GL_DRAW_INDIRECT_BUFFER: return BUFFER_DRAW_INDIRECT;
+		case GL_COPY_READ_BUFFER: return BUFFER_COPY_READ;
+		case GL_COPY_WRITE_BUFFER: return BUFFER_COPY_WRITE;
+		default: return -1;
+	}
+}
+
+int GLState::CapabilityIndex(GLenum capability)
+{
+	switch (capability)
+	{
+		case GL_DEPTH_TEST: return CAP_DEPTH_TEST;
+		case GL_CULL_FACE: return CAP_CULL_FACE;
+		case GL_BLEND: return CAP_BLEND;
+		case GL_POLYGON_OFFSET_FILL: return CAP_POLYGON_OFFSET_FILL;
+		case GL_SCISSOR_TEST: return CAP_SCISSOR_TEST;
+		case GL_STENCIL_TEST: return CAP_STENCIL_TEST;
+		case GL_DEPTH_CLAMP: return CAP_DEPTH_CLAMP;
+		default: return -1;
+	}
+}
+
+bool GLState::Issue(bool needed)
+{
+	needed = needed || !filtering;
+	if (needed)
+		frame.issued++;
+	else
+		frame.skipped++;
+	return needed;
+}
+
+bool GLState::Changes(GLuint& cached, GLuint value)
+{
+	bool needed = Issue(cached != value);
+	cached = value;
+	return needed;
+}
+
+void GLState::UseProgram(GLuint program)
+{
+	if (Changes(this->program, program))
+		glUseProgram(program);
+}
+
+void GLState::BindVertexArray(GLuint vao)
+{
+	if (Changes(vertexArray, vao))
+		glBindVertexArray(vao);
+}
+
+void GLState::BindFramebuffer(GLenum target, GLuint framebuffer)
+{
+	bool needed;
+	if (target == GL_DRAW_FRAMEBUFFER)
+	{
+		needed = Issue(drawFramebuffer != framebuffer);
+		drawFramebuffer = framebuffer;
+	}
+	else if (target == GL_READ_FRAMEBUFFER)
+	{
+		needed = Issue(readFramebuffer != framebuffer);
+		readFramebuffer = framebuffer;
+	}
+	else
+	{
+		needed = Issue(drawFramebuffer != framebuffer || readFramebuffer != framebuffer);
+		drawFramebuffer = framebuffer;
+		readFramebuffer = framebuffer;
+	}
+
+	if (needed)
+		glBindFramebuffer(target, framebuffer);
+}
+
+void GLState::Viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	bool same = viewportKnown && viewport[0] == x && viewport[1] == y && viewport[2] == width && viewport[3] == height;
+	if (!Issue(!same))
+		return;
+
+	viewport[0] = x;
+	viewport[1] = y;
+	viewport[2] = width;
+	viewport[3] = height;
+	viewportKnown = true;
+	glViewport(x, y, width, height);
+}
+
+void GLState::SetCapability(GLenum capability, bool enable)
+{
+	int index = CapabilityIndex(capability);
+	bool needed;
+	if (index < 0)
+	{
+		needed = Issue(true);
+	}
+	else
+	{
+		needed = Issue(capabilities[index] != (enable ? 1 : 0));
+		capabilities[index] = enable ? 1 : 0;
+	}
+
+	if (!needed)
+		return;
+	if (enable)
+		glEnable(capability);
+	else
+		glDisable(capability);
+}
+
+void GLState::Enable(GLenum capability)
+{
+	SetCapability(capability, true);
+}
+
+void GLState::Disable(GLenum capability)
+{
+	SetCapability(capability, false);
+}
+
+void GLState::DepthFunc(GLenum func)
+{
+	if (Changes(depthFunc, func))
+		glDepthFunc(func);
+}
+
+void GLState::ActiveTexture(GLuint unit)
+{
+	if (Changes(activeUnit, unit))
+		glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLState::BindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+	int index = TextureTargetIndex(target);
+	if (index >= 0 && unit < (GLuint)kTextureUnits)
+	{
+		if (!Changes(textures[unit][index], texture))
+			return;
+	}
+	else
+	{
+		Issue(true);
+	}
+
+	ActiveTexture(unit);
+	glBindTexture(target, texture);
+}
+
+void GLState::BindTexture(GLenum target, GLuint texture)
+{
+	BindTexture(kUploadUnit, target, texture);
+}
+
+void GLState::BindSampler(GLuint unit, GLuint sampler)
+{
+	bool needed = (unit < (GLuint)kTextureUnits) ? Changes(samplers[unit], sampler) : Issue(true);
+	if (needed)
+		glBindSampler(unit, sampler);
+}
+
+void GLState::BindBuffer(GLenum target, GLuint buffer)
+{
+	int index = BufferTargetIndex(target);
+	bool needed = (index >= 0) ? Changes(buffers[index], buffer) : Issue(true);
+	if (needed)
+		glBindBuffer(target, buffer);
+}
+
+void GLState::BindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+	bool cached = (target == GL_UNIFORM_BUFFER && index < (GLuint)kUniformBindings);
+	if (cached)
+	{
+		IndexedBuffer& binding = uniformBindings[index];
+		bool same = binding.buffer == buffer && binding.size == 0;
+		if (!Issue(!same))
+			return;
+		binding = { buffer, 0, 0 };
+	}
+	else
+	{
+		Issue(true);
+	}
+
+	glBindBufferBase(target, index, buffer);
+	int generic = BufferTargetIndex(target);
+	if (generic >= 0)
+		buffers[generic] = buffer;
+}
+
+void GLState::BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+	bool cached = (target == GL_UNIFORM_BUFFER && index < (GLuint)kUniformBindings);
+	if (cached)
+	{
+		IndexedBuffer& binding = uniformBindings[index];
+		bool same = binding.buffer == buffer && binding.offset == offset && binding.size == size;
+		if (!Issue(!same))
+			return;
+		binding = { buffer, offset, size };
+	}
+	else
+	{
+		Issue(true);
+	}
+
+	glBindBufferRange(target, index, buffer, offset, size);
+	int generic = BufferTargetIndex(target);
+	if (generic >= 0)
+		buffers[generic] = buffer;
+}
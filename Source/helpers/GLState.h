@@ -0,0 +1,111 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include "GLEW\glew.h"
+#include <cstddef>
+
+// Singleton shadow of the main context's bindings and render state.
+// Every state change of the main context goes through it: calls that would not change
+// anything are dropped, the rest are issued and counted. Code that deletes bound
+// objects or touches the state behind its back has to call Invalidate.
+class GLState
+{
+public:
+	struct Statistics
+	{
+		size_t issued;
+		size_t skipped;
+	};
+
+	// get the static instance of the GL State
+	static GLState& GetInstance()
+	{
+		static GLState state;
+		return state;
+	}
+
+	// Drop redundant calls, when off every call is issued so the counts show the unfiltered cost
+	void EnableFiltering(bool enable);
+	bool IsFiltering() const { return filtering; }
+	// Forget every cached value, the next call of each kind is always issued
+	void Invalidate();
+
+	// Counts of the current frame, and of the last one after EndFrame
+	Statistics GetFrameStatistics() const { return frame; }
+	Statistics GetLastFrameStatistics() const { return lastFrame; }
+	void EndFrame();
+
+	void UseProgram(GLuint program);
+	// 0 while the current program is unknown
+	GLuint GetProgram() const { return (program == kUnknown) ? 0 : program; }
+	void BindVertexArray(GLuint vao);
+	void BindFramebuffer(GLenum target, GLuint framebuffer);
+	void Viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+	void Enable(GLenum capability);
+	void Disable(GLenum capability);
+	void DepthFunc(GLenum func);
+
+	// Unit no sampler reads from, textures are bound there to be created or uploaded to
+	static const GLuint kUploadUnit = 31;
+
+	// Bind a texture on a unit, the active unit only changes when the binding does
+	void BindTexture(GLuint unit, GLenum target, GLuint texture);
+	// Bind on the upload unit, so a load in the middle of a pass leaves the draw's textures bound
+	void BindTexture(GLenum target, GLuint texture);
+	void ActiveTexture(GLuint unit);
+	// Sampler object of a unit, 0 for the texture's own parameters
+	void BindSampler(GLuint unit, GLuint sampler);
+
+	void BindBuffer(GLenum target, GLuint buffer);
+	// Indexed uniform buffer bindings, both also set the generic binding
+	void BindBufferBase(GLenum target, GLuint index, GLuint buffer);
+	void BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+private:
+	GLState();
+
+	static const GLuint kUnknown = 0xFFFFFFFF;
+	static const int kTextureUnits = 32;
+	static const int kUniformBindings = 16;
+
+	enum TextureTarget { TARGET_2D, TARGET_2D_ARRAY, TARGET_CUBE_MAP, TARGET_CUBE_MAP_ARRAY, TARGET_3D, TARGET_COUNT };
+	enum BufferTarget { BUFFER_ARRAY, BUFFER_UNIFORM, BUFFER_PIXEL_UNPACK, BUFFER_PIXEL_PACK, BUFFER_DRAW_INDIRECT, BUFFER_COPY_READ, BUFFER_COPY_WRITE, BUFFER_COUNT };
+	enum Capability { CAP_DEPTH_TEST, CAP_CULL_FACE, CAP_BLEND, CAP_POLYGON_OFFSET_FILL, CAP_SCISSOR_TEST, CAP_STENCIL_TEST, CAP_DEPTH_CLAMP, CAP_COUNT };
+
+	struct IndexedBuffer
+	{
+		GLuint buffer;
+		GLintptr offset;
+		GLsizeiptr size;
+	};
+
+	bool filtering;
+	Statistics frame;
+	Statistics lastFrame;
+
+	GLuint program;
+	GLuint vertexArray;
+	GLuint drawFramebuffer;
+	GLuint readFramebuffer;
+	GLint viewport[4];
+	bool viewportKnown;
+	int capabilities[CAP_COUNT];
+	GLenum depthFunc;
+
+	GLuint activeUnit;
+	GLuint textures[kTextureUnits][TARGET_COUNT];
+	GLuint samplers[kTextureUnits];
+	GLuint buffers[BUFFER_COUNT];
+	IndexedBuffer uniformBindings[kUniformBindings];
+
+	static int TextureTargetIndex(GLenum target);
+	static int BufferTargetIndex(GLenum target);
+	static int CapabilityIndex(GLenum capability);
+
+	// whether a call changing `cached` to `value` has to reach the driver, counts either way
+	bool Changes(GLuint& cached, GLuint value);
+	bool Issue(bool needed);
+	void SetCapability(GLenum capability, bool enable);
+};
+
+#endif
@@ -2,10 +2,18 @@
 #include "GeometricMesh.h"
 #include <glm/gtc/type_ptr.hpp>
 #include "TextureManager.h"
+#include "GLState.h"
+#include <cstring>
 
-GeometryNode::GeometryNode() { /* Empty */ }
+GeometryNode::GeometryNode()
+{
+	m_material_ubo = 0;
+}
 
-GeometryNode::~GeometryNode() { /* Empty */ }
+GeometryNode::~GeometryNode()
+{
+	glDeleteBuffers(1, &m_material_ubo);
+}
 
 void GeometryNode::Init(const std::string & name, GeometricMesh* mesh)
 {
@@ -23,15 +31,22 @@ void GeometryNode::Init(const std::string & name, GeometricMesh* mesh)
 		part.ambient = glm::vec3(material.ambient[0], material.ambient[1], material.ambient[2]);
 
 		part.shininess = material.shininess;
-		part.diffuse_textureID = (material.textureDiffuse.empty())? 0 : TextureManager::GetInstance().RequestTexture(material.textureDiffuse.c_str());
-		part.mask_textureID = (material.textureSpecular.empty()) ? 0 : TextureManager::GetInstance().RequestTexture(material.textureSpecular.c_str());
-		part.emissive_textureID = (material.textureAmbient.empty()) ? 0 : TextureManager::GetInstance().RequestTexture(material.textureAmbient.c_str());
-		part.normal_textureID = (material.textureNormal.empty())? 0 : TextureManager::GetInstance().RequestTexture(material.textureNormal.c_str());
-		part.bump_textureID = (material.textureBump.empty()) ? 0 : TextureManager::GetInstance().RequestTexture(material.textureBump.c_str());
+		part.textures[TEXTURE_SLOT_DIFFUSE].filename = material.textureDiffuse;
+		part.textures[TEXTURE_SLOT_MASK].filename = material.textureSpecular;
+		part.textures[TEXTURE_SLOT_EMISSIVE].filename = material.textureAmbient;
+		part.textures[TEXTURE_SLOT_NORMAL].filename = material.textureNormal;
+		part.textures[TEXTURE_SLOT_BUMP].filename = material.textureBump;
+		for (auto& texture : part.textures)
+		{
+			if (!texture.filename.empty())
+				TextureManager::GetInstance().NameTexture(texture.filename.c_str());
+		}
 
 		parts.push_back(part);
 	}
 
+	InitMaterials();
+
 	this->m_aabb.min = glm::vec3(std::numeric_limits<float_t>::max());
 	this->m_aabb.max = glm::vec3(-std::numeric_limits<float_t>::max());
 
@@ -42,4 +57,77 @@ void GeometryNode::Init(const std::string & name, GeometricMesh* mesh)
 	}
 
 	this->m_aabb.center = (this->m_aabb.min + this->m_aabb.max) * 0.5f;
-}
\ No newline at end of file
+}
+
+void GeometryNode::InitCopy(const GeometryNode& source)
+{
+	this->m_vao = source.m_vao;
+	this->parts = source.parts;
+	this->m_aabb = source.m_aabb;
+	this->model_matrix = source.model_matrix;
+	this->app_model_matrix = source.app_model_matrix;
+
+	InitMaterials();
+}
+
+GLuint GeometryNode::Objects::RequestTexture(TextureSlot slot)
+{
+	MaterialTexture& texture = textures[slot];
+
+	// try once, a failed load stays 0 instead of hitting the disk every frame
+	if (!texture.requested && !texture.filename.empty())
+	{
+		texture.textureID = TextureManager::GetInstance().RequestTextureLayer(texture.filename.c_str(), texture.layer);
+		// still decoding in the background, ask again next frame
+		texture.requested = !TextureManager::GetInstance().IsTexturePending(texture.filename.c_str());
+	}
+
+	return texture.textureID;
+}
+
+void GeometryNode::InitMaterials()
+{
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	GLintptr stride = (sizeof(MaterialBlock) + alignment - 1) / alignment * alignment;
+
+	std::vector<unsigned char> data(stride * parts.size());
+	for (size_t i = 0; i < parts.size(); i++)
+	{
+		Objects& part = parts[i];
+		part.material = {};
+		part.material.diffuse = part.diffuse;
+		part.material.specular = part.specular;
+		part.material.ambient = part.ambient;
+		part.material.shininess = part.shininess;
+		part.material.tex_diffuse_layer = -1;
+		part.material.tex_normal_layer = -1;
+		part.material_offset = stride * i;
+		memcpy(&data[part.material_offset], &part.material, sizeof(MaterialBlock));
+	}
+
+	glGenBuffers(1, &m_material_ubo);
+	GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, m_material_ubo);
+	glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+	GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void GeometryNode::BindMaterial(int part)
+{
+	GLState::GetInstance().BindBufferRange(GL_UNIFORM_BUFFER, UNIFORM_BLOCK_MATERIAL, m_material_ubo, parts[part].material_offset, sizeof(MaterialBlock));
+}
+
+void GeometryNode::UpdateMaterialTextures(int part, int diffuseLayer, int normalLayer)
+{
+	MaterialBlock& material = parts[part].material;
+	if (material.tex_diffuse_layer == diffuseLayer && material.tex_normal_layer == normalLayer)
+		return;
+
+	// the maps arrive lazily, so this happens a few times per part at most
+	material.tex_diffuse_layer = diffuseLayer;
+	material.tex_normal_layer = normalLayer;
+
+	GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, m_material_ubo);
+	glBufferSubData(GL_UNIFORM_BUFFER, parts[part].material_offset, sizeof(MaterialBlock), &material);
+	GLState::GetInstance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+}
@@ -6,6 +6,8 @@
 #include <unordered_map>
 #include "glm\gtx\hash.hpp"
 #include "AssetManager.hpp"
+#include "TextureManager.h"
+#include "UniformBlocks.h"
 
 class GeometryNode
 {
@@ -14,6 +16,8 @@ public:
 	virtual ~GeometryNode();
 
 	virtual void Init(const std::string & name, class GeometricMesh* mesh);
+	// Share the asset, parts and bounds of a loaded node, the material blocks are its own
+	void InitCopy(const GeometryNode& source);
 
 	struct Objects
 	{
@@ -25,11 +29,24 @@ public:
 		glm::vec3 specular;
 
 		float shininess;
-		GLuint diffuse_textureID;
-		GLuint normal_textureID;
-		GLuint bump_textureID;
-		GLuint emissive_textureID;
-		GLuint mask_textureID;
+
+		// material maps, loaded on the first request of a consuming shader
+		struct MaterialTexture
+		{
+			std::string filename;
+			GLuint textureID = 0;
+			int layer = -1;
+			bool requested = false;
+		};
+		MaterialTexture textures[TEXTURE_SLOT_COUNT];
+
+		bool HasTexture(TextureSlot slot) const { return !textures[slot].filename.empty(); }
+		// the texture, or its texture array when the map got a layer
+		GLuint RequestTexture(TextureSlot slot);
+
+		// std140 MaterialBlock of the part, at material_offset in the node's material buffer
+		MaterialBlock material;
+		GLintptr material_offset;
 	};
 
 	struct aabb
@@ -41,10 +58,20 @@ public:
 
 	std::vector<Objects> parts;
 
+	// Bind the material block of a part
+	void BindMaterial(int part);
+	// Refresh the texture array layers of a part, the buffer is only touched when they change
+	void UpdateMaterialTextures(int part, int diffuseLayer, int normalLayer);
+
 	glm::mat4 model_matrix;
 	glm::mat4 app_model_matrix;
 	aabb m_aabb;
 	GLuint m_vao;
+
+protected:
+	// material blocks of all parts, one aligned slot each
+	GLuint m_material_ubo;
+	void InitMaterials();
 };
 
 #endif
\ No newline at end of file
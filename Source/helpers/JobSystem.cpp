@@ -0,0 +1,378 @@
+#include "JobSystem.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+namespace
+{
+	// jobs one thread can have alive and queued, powers of two
+	const size_t kMaxJobs = 4096;
+	const int64_t kQueueCapacity = 4096;
+
+	// index in the pool of the calling thread, -1 outside of it
+	thread_local int threadIndex = -1;
+
+	// Chase-Lev deque of a fixed capacity. The owner pushes and pops at the bottom,
+	// thieves take from the top and only the last job is contested
+	class WorkQueue
+	{
+	public:
+		WorkQueue() : top(0), bottom(0)
+		{
+			for (auto& slot : buffer)
+				slot.store(nullptr, std::memory_order_relaxed);
+		}
+
+		bool Push(JobSystem::Job* job)
+		{
+			int64_t b = bottom.load(std::memory_order_relaxed);
+			int64_t t = top.load(std::memory_order_acquire);
+			if (b - t >= kQueueCapacity)
+				return false;
+
+			// the release publishes the job to the thieves that read bottom
+			buffer[b & (kQueueCapacity - 1)].store(job, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_release);
+			return true;
+		}
+
+		JobSystem::Job* Pop()
+		{
+			int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = top.load(std::memory_order_relaxed);
+
+			if (t > b)
+			{
+				// empty
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			JobSystem::Job* job = buffer[b & (kQueueCapacity - 1)].load(std::memory_order_relaxed);
+			if (t == b)
+			{
+				// the last one, race the thieves for it
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					job = nullptr;
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return job;
+		}
+
+		JobSystem::Job* Steal()
+		{
+			int64_t t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = bottom.load(std::memory_order_acquire);
+			if (t >= b)
+				return nullptr;
+
+			JobSystem::Job* job = buffer[t & (kQueueCapacity - 1)].load(std::memory_order_relaxed);
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return nullptr;
+			return job;
+		}
+
+	private:
+		std::atomic<int64_t> top;
+		std::atomic<int64_t> bottom;
+		std::atomic<JobSystem::Job*> buffer[kQueueCapacity];
+	};
+}
+
+struct JobSystem::ThreadData
+{
+	WorkQueue queue;
+	std::unique_ptr<Job[]> jobs;
+	size_t next;
+	std::thread thread;
+	// client slots only, whether a thread holds it
+	std::atomic<bool> attached;
+
+	ThreadData() : jobs(new Job[kMaxJobs]), next(0), attached(false)
+	{
+		for (size_t i = 0; i < kMaxJobs; i++)
+			jobs[i].unfinished.store(0, std::memory_order_relaxed);
+	}
+};
+
+JobSystem::JobSystem()
+{
+	external.reset(new ThreadData());
+	workerCount = 0;
+	clientCount = 0;
+	queued = 0;
+	sleeping = 0;
+	stop = false;
+	jobsRun = 0;
+	steals = 0;
+	backgroundRun = 0;
+}
+
+JobSystem::~JobSystem()
+{
+	Shutdown();
+}
+
+void JobSystem::Init(int workerCount, int clientCount)
+{
+	Shutdown();
+
+	if (workerCount < 0)
+		workerCount = std::max(0, (int)std::thread::hardware_concurrency() - 1);
+	this->workerCount = workerCount;
+	this->clientCount = std::max(1, clientCount);
+	stop = false;
+
+	// the client slots come first, they have a deque but no thread of their own. The caller takes slot 0
+	for (int i = 0; i < this->clientCount + workerCount; i++)
+		threads.emplace_back(new ThreadData());
+	threads[0]->attached = true;
+	threadIndex = 0;
+	for (int i = this->clientCount; i < (int)threads.size(); i++)
+		threads[i]->thread = std::thread(&JobSystem::WorkerLoop, this, i);
+
+	printf("Job system: %d workers\n", workerCount);
+}
+
+void JobSystem::Shutdown()
+{
+	if (threads.empty())
+		return;
+
+	// nothing queued is dropped, the background jobs left run here and the workers empty the deques
+	while (true)
+	{
+		Job* job = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(backgroundMutex);
+			if (background.empty())
+				break;
+			job = background.front();
+			background.pop_front();
+		}
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		Execute(job);
+	}
+	while (workerCount > 0 && queued.load(std::memory_order_acquire) > 0)
+		std::this_thread::yield();
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stop = true;
+	}
+	wake.notify_all();
+	for (auto& data : threads)
+	{
+		if (data->thread.joinable())
+			data->thread.join();
+	}
+
+	threads.clear();
+	queued = 0;
+	workerCount = 0;
+	clientCount = 0;
+	threadIndex = -1;
+}
+
+bool JobSystem::Attach()
+{
+	if (threadIndex >= 0)
+		return true;
+
+	for (int i = 0; i < clientCount; i++)
+	{
+		bool expected = false;
+		if (threads[i]->attached.compare_exchange_strong(expected, true))
+		{
+			threadIndex = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+void JobSystem::Detach()
+{
+	if (threadIndex < 0 || threadIndex >= clientCount)
+		return;
+
+	threads[threadIndex]->attached = false;
+	threadIndex = -1;
+}
+
+JobSystem::Job* JobSystem::Allocate(void (*function)(Job*), Job* parent)
+{
+	bool pooled = threadIndex >= 0 && threadIndex < (int)threads.size();
+	ThreadData& data = pooled ? *threads[threadIndex] : *external;
+	std::unique_lock<std::mutex> lock(externalMutex, std::defer_lock);
+	if (!pooled)
+		lock.lock();
+
+	// slots are reused in order, one still running or waited on is skipped
+	Job* job = nullptr;
+	while (job == nullptr)
+	{
+		for (size_t tries = 0; tries < kMaxJobs && job == nullptr; tries++)
+		{
+			Job& slot = data.jobs[data.next++ & (kMaxJobs - 1)];
+			if (slot.unfinished.load(std::memory_order_acquire) == 0)
+				job = &slot;
+		}
+		if (job == nullptr)
+			std::this_thread::yield();
+	}
+
+	job->function = function;
+	job->parent = parent;
+	job->unfinished.store(1, std::memory_order_relaxed);
+	if (parent != nullptr)
+		parent->unfinished.fetch_add(1, std::memory_order_relaxed);
+	return job;
+}
+
+void JobSystem::Run(Job* job)
+{
+	if (threadIndex < 0 || threadIndex >= (int)threads.size() || workerCount == 0)
+	{
+		Execute(job);
+		return;
+	}
+
+	// a full deque runs the job right away
+	if (!threads[threadIndex]->queue.Push(job))
+	{
+		Execute(job);
+		return;
+	}
+	queued.fetch_add(1, std::memory_order_release);
+	Notify();
+}
+
+void JobSystem::RunBackground(Job* job)
+{
+	if (workerCount == 0)
+	{
+		Execute(job);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(backgroundMutex);
+		background.push_back(job);
+	}
+	queued.fetch_add(1, std::memory_order_release);
+	Notify();
+}
+
+void JobSystem::Notify()
+{
+	if (sleeping.load(std::memory_order_acquire) > 0)
+		wake.notify_one();
+}
+
+void JobSystem::Wait(Job* job)
+{
+	bool pooled = threadIndex >= 0 && threadIndex < (int)threads.size();
+	while (!IsFinished(job))
+	{
+		Job* next = pooled ? FindJob(threadIndex) : nullptr;
+		if (next != nullptr)
+			Execute(next);
+		else
+			std::this_thread::yield();
+	}
+}
+
+JobSystem::Job* JobSystem::FindJob(int thread)
+{
+	Job* job = threads[thread]->queue.Pop();
+	if (job == nullptr)
+	{
+		// the others, starting with the next thread so thieves spread out
+		int count = (int)threads.size();
+		for (int i = 1; i < count && job == nullptr; i++)
+			job = threads[(thread + i) % count]->queue.Steal();
+		if (job != nullptr)
+			steals.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// client threads wait on frame work, background jobs are left to the workers
+	if (job == nullptr && thread >= clientCount)
+	{
+		std::lock_guard<std::mutex> lock(backgroundMutex);
+		if (!background.empty())
+		{
+			job = background.front();
+			background.pop_front();
+			backgroundRun.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	if (job != nullptr)
+		queued.fetch_sub(1, std::memory_order_relaxed);
+	return job;
+}
+
+void JobSystem::Execute(Job* job)
+{
+	job->function(job);
+	jobsRun.fetch_add(1, std::memory_order_relaxed);
+	Finish(job);
+}
+
+void JobSystem::Finish(Job* job)
+{
+	// the slot can be reused as soon as the count drops, read the parent first
+	Job* parent = job->parent;
+	if (job->unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1 && parent != nullptr)
+		Finish(parent);
+}
+
+void JobSystem::WorkerLoop(int thread)
+{
+	threadIndex = thread;
+
+	int idle = 0;
+	while (!stop.load(std::memory_order_acquire))
+	{
+		Job* job = FindJob(thread);
+		if (job != nullptr)
+		{
+			Execute(job);
+			idle = 0;
+			continue;
+		}
+
+		// spin a little, frame jobs come in bursts
+		if (++idle < 64)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleeping.fetch_add(1, std::memory_order_acq_rel);
+		wake.wait_for(lock, std::chrono::milliseconds(1), [this]() { return stop.load() || queued.load(std::memory_order_acquire) > 0; });
+		sleeping.fetch_sub(1, std::memory_order_acq_rel);
+		idle = 0;
+	}
+}
+
+JobSystem::Statistics JobSystem::GetStatistics() const
+{
+	Statistics statistics;
+	statistics.jobs = jobsRun.load();
+	statistics.steals = steals.load();
+	statistics.background = backgroundRun.load();
+	return statistics;
+}
+
+void JobSystem::ResetStatistics()
+{
+	jobsRun = 0;
+	steals = 0;
+	backgroundRun = 0;
+}
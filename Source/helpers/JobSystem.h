@@ -0,0 +1,166 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Singleton pool of worker threads running small jobs.
+// Every thread of the pool owns a Chase-Lev deque, it pushes and pops its jobs at the bottom
+// while idle threads steal from the top. A job is finished once it ran and so did every child
+// created under it, Wait runs other jobs meanwhile so nested waits keep the pool busy.
+// The thread that called Init is part of the pool, and so are threads that Attach to one of the
+// client slots Init reserves. Any other thread runs what it submits inline.
+class JobSystem
+{
+public:
+	static const size_t kJobPayload = 80;
+
+	struct Job
+	{
+		void (*function)(Job*);
+		Job* parent;
+		// the job itself and its unfinished children, 0 once the slot is free again
+		std::atomic<int> unfinished;
+		// the callable, constructed in place
+		alignas(alignof(std::max_align_t)) unsigned char payload[kJobPayload];
+	};
+
+	struct Statistics
+	{
+		size_t jobs;
+		size_t steals;
+		size_t background;
+	};
+
+	// get the static instance of the Job System
+	static JobSystem& GetInstance()
+	{
+		static JobSystem system;
+		return system;
+	}
+	~JobSystem();
+
+	// Start the workers, -1 for one per hardware thread besides the calling one.
+	// The calling thread takes the first of clientCount slots for threads that submit work
+	void Init(int workerCount = -1, int clientCount = 2);
+	// Join the workers once every queued job ran
+	void Shutdown();
+	// Give the calling thread a free client slot, false when none is left
+	bool Attach();
+	// Hand the slot back, its deque has to be empty
+	void Detach();
+	int GetWorkerCount() const { return workerCount; }
+	// the workers and the thread that called Init
+	int GetThreadCount() const { return workerCount + 1; }
+
+	// A job running function, counted as a child of parent when there is one.
+	// Children have to be created before the parent finishes, from its function or before it runs
+	template <typename F>
+	Job* CreateJob(F&& function, Job* parent = nullptr);
+	void Run(Job* job);
+	// Queue for the workers only, for long jobs the frame should never wait behind
+	void RunBackground(Job* job);
+	// Run other jobs until this one and its children are done
+	void Wait(Job* job);
+	bool IsFinished(const Job* job) const { return job->unfinished.load(std::memory_order_acquire) == 0; }
+
+	// Split [0, count) into ranges of at least grain and call function(begin, end) on them, returns when all ran
+	template <typename F>
+	void ParallelFor(size_t count, size_t grain, const F& function);
+
+	// jobs run and stolen since the last reset
+	Statistics GetStatistics() const;
+	void ResetStatistics();
+
+private:
+	JobSystem();
+	void operator=(JobSystem const&);
+
+	struct ThreadData;
+	std::vector<std::unique_ptr<ThreadData>> threads;
+	// jobs of threads outside the pool, they run where they are created
+	std::unique_ptr<ThreadData> external;
+	std::mutex externalMutex;
+	int workerCount;
+	int clientCount;
+
+	// long jobs, taken by the workers once no deque has work
+	std::deque<Job*> background;
+	std::mutex backgroundMutex;
+
+	// idle workers sleep until a job is queued
+	std::atomic<int> queued;
+	std::atomic<int> sleeping;
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	std::atomic<bool> stop;
+
+	std::atomic<size_t> jobsRun;
+	std::atomic<size_t> steals;
+	std::atomic<size_t> backgroundRun;
+
+	Job* Allocate(void (*function)(Job*), Job* parent);
+	// a job of the thread's own deque, stolen from another one or, for workers, a background job
+	Job* FindJob(int thread);
+	void Execute(Job* job);
+	void Finish(Job* job);
+	void WorkerLoop(int thread);
+	void Notify();
+
+	template <typename F>
+	static void Invoke(Job* job)
+	{
+		F* function = reinterpret_cast<F*>(job->payload);
+		(*function)();
+		function->~F();
+	}
+};
+
+template <typename F>
+JobSystem::Job* JobSystem::CreateJob(F&& function, Job* parent)
+{
+	typedef typename std::decay<F>::type Callable;
+	static_assert(sizeof(Callable) <= kJobPayload, "job captures too much, capture by reference");
+	static_assert(alignof(Callable) <= alignof(std::max_align_t), "job capture alignment not supported");
+
+	Job* job = Allocate(&Invoke<Callable>, parent);
+	new (job->payload) Callable(std::forward<F>(function));
+	return job;
+}
+
+template <typename F>
+void JobSystem::ParallelFor(size_t count, size_t grain, const F& function)
+{
+	if (count == 0)
+		return;
+
+	// a few ranges per thread so stealing can even out uneven ones
+	size_t ranges = (size_t)GetThreadCount() * 4;
+	size_t size = std::max(std::max(grain, (size_t)1), (count + ranges - 1) / ranges);
+	if (workerCount == 0 || size >= count)
+	{
+		function((size_t)0, count);
+		return;
+	}
+
+	Job* root = CreateJob([]() {});
+	for (size_t begin = 0; begin < count; begin += size)
+	{
+		size_t end = std::min(count, begin + size);
+		Run(CreateJob([&function, begin, end]() { function(begin, end); }, root));
+	}
+	Run(root);
+	Wait(root);
+}
+
+#endif
@@ -1,15 +1,22 @@
 #include "LightNode.h"
 #include "glm\gtc\matrix_transform.hpp"
 #include "Tools.h"
+#include "GLState.h"
+#include <algorithm>
+#include <cfloat>
+
+const float LightNode::kPointNear = 0.1f;
 
 // Spot Light
 LightNode::LightNode()
 {
 	m_name = "defaultSpotLight1";
+	m_type = LIGHT_SPOT;
 
 	m_light_direction = glm::normalize(glm::vec3(-1, -1, 0));
 	m_light_position = glm::vec3(5, 3, 0);
 	m_light_color = glm::vec3(1.0f);
+	m_revision = 0;
 	SetPosition(m_light_position);
 	SetConeSize(60, 60);
 
@@ -18,48 +25,160 @@ LightNode::LightNode()
 	m_shadow_map_bias = 0.001;
 	m_shadow_map_texture = 0;
 	m_shadow_map_fbo = 0;
+	m_static_shadow_map_texture = 0;
+	m_static_shadow_map_fbo = 0;
+	m_shadow_compare_sampler = 0;
+	m_shadow_compare_linear = true;
+
+	m_cascade_count = 3;
+	m_cascade_split_lambda = 0.75f;
+	m_cascade_distance = 20.f;
+	m_cascade_texture = 0;
+	for (int i = 0; i < kMaxCascades; i++)
+	{
+		m_cascade_resolution[i] = 1024;
+		m_cascade_splits[i] = 0.f;
+		m_cascade_projection_view[i] = glm::mat4(1.f);
+		m_cascade_fbos[i] = 0;
+	}
+
+	m_point_range = 20.f;
+	m_cube_texture = 0;
+	m_cube_fbo = 0;
 }
 
 LightNode::~LightNode()
 {
 	glDeleteFramebuffers(1, &m_shadow_map_fbo);
 	glDeleteTextures(1, &m_shadow_map_texture);
+	glDeleteFramebuffers(1, &m_static_shadow_map_fbo);
+	glDeleteTextures(1, &m_static_shadow_map_texture);
+	glDeleteFramebuffers(kMaxCascades, m_cascade_fbos);
+	glDeleteTextures(1, &m_cascade_texture);
+	glDeleteFramebuffers(1, &m_cube_fbo);
+	glDeleteTextures(1, &m_cube_texture);
+	glDeleteSamplers(1, &m_shadow_compare_sampler);
 }
 
 void LightNode::CastShadow(bool cast)
 {
 	m_cast_shadow = cast;
+	m_revision++;
 
 	if (cast)
 	{
-		if (m_shadow_map_texture == 0)
-			glGenTextures(1, &m_shadow_map_texture);
-		// Depth buffer
-		glBindTexture(GL_TEXTURE_2D, m_shadow_map_texture);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_shadow_map_resolution, m_shadow_map_resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-		glBindTexture(GL_TEXTURE_2D, 0);
-
-		if (m_shadow_map_fbo == 0)
-			glGenFramebuffers(1, &m_shadow_map_fbo);
-		glBindFramebuffer(GL_FRAMEBUFFER, m_shadow_map_fbo);
-		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_shadow_map_texture, 0);
-		glDrawBuffer(GL_NONE);
-		glReadBuffer(GL_NONE);
-
-		GLenum status = Tools::CheckFramebufferStatus(m_shadow_map_fbo);
-		if (status != GL_FRAMEBUFFER_COMPLETE)
+		// the map sampled by the geometry pass and the cache of the static casters, same size and format
+		if (!CreateShadowTarget(m_shadow_map_texture, m_shadow_map_fbo) ||
+			!CreateShadowTarget(m_static_shadow_map_texture, m_static_shadow_map_fbo))
 		{
 			printf("Error in Spotlight shadow FB generation.\n");
 			return;
 		}
+		CreateCompareSampler();
+		if (m_type == LIGHT_DIRECTIONAL && !CreateCascadeTargets())
+			printf("Error in cascaded shadow FB generation.\n");
+		if (m_type == LIGHT_POINT && !CreateCubeTarget())
+			printf("Error in point light shadow FB generation.\n");
+	}
+}
+
+bool LightNode::CreateCascadeTargets()
+{
+	int resolution = GetCascadeArrayResolution();
+	if (m_cascade_texture == 0)
+		glGenTextures(1, &m_cascade_texture);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D_ARRAY, m_cascade_texture);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, resolution, resolution, m_cascade_count, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// one framebuffer per layer
+	bool complete = true;
+	for (int i = 0; i < m_cascade_count; i++)
+	{
+		if (m_cascade_fbos[i] == 0)
+			glGenFramebuffers(1, &m_cascade_fbos[i]);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_cascade_fbos[i]);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_cascade_texture, 0, i);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		complete = complete && Tools::CheckFramebufferStatus(m_cascade_fbos[i]) == GL_FRAMEBUFFER_COMPLETE;
 	}
+	GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
+	return complete;
+}
+
+bool LightNode::CreateCubeTarget()
+{
+	if (m_cube_texture == 0)
+		glGenTextures(1, &m_cube_texture);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_CUBE_MAP, m_cube_texture);
+	for (int i = 0; i < kCubeFaces; i++)
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT24, m_shadow_map_resolution, m_shadow_map_resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	// sampled as a samplerCubeShadow, a tap is the bilinear pcf of the four nearest texels
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	// the whole cube is attached, a layered target
+	if (m_cube_fbo == 0)
+		glGenFramebuffers(1, &m_cube_fbo);
+	GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, m_cube_fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_cube_texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+
+	GLenum status = Tools::CheckFramebufferStatus(m_cube_fbo);
+	GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
+	return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void LightNode::CreateCompareSampler()
+{
+	if (m_shadow_compare_sampler == 0)
+		glGenSamplers(1, &m_shadow_compare_sampler);
+	// lit where the reference is at most the stored depth, as the manual filters test
+	glSamplerParameteri(m_shadow_compare_sampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glSamplerParameteri(m_shadow_compare_sampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	GLint filter = m_shadow_compare_linear ? GL_LINEAR : GL_NEAREST;
+	glSamplerParameteri(m_shadow_compare_sampler, GL_TEXTURE_MIN_FILTER, filter);
+	glSamplerParameteri(m_shadow_compare_sampler, GL_TEXTURE_MAG_FILTER, filter);
+	glSamplerParameteri(m_shadow_compare_sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(m_shadow_compare_sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+bool LightNode::CreateShadowTarget(GLuint & texture, GLuint & fbo)
+{
+	if (texture == 0)
+		glGenTextures(1, &texture);
+	// Depth buffer
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_shadow_map_resolution, m_shadow_map_resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, 0);
+
+	if (fbo == 0)
+		glGenFramebuffers(1, &fbo);
+	GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+
+	GLenum status = Tools::CheckFramebufferStatus(fbo);
+	GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
+	return status == GL_FRAMEBUFFER_COMPLETE;
 }
 
 
@@ -70,6 +189,7 @@ void LightNode::SetColor(const glm::vec3 & color)
 
 void LightNode::SetPosition(const glm::vec3 & pos)
 {
+	m_revision++;
 	m_light_position = pos;
 	m_light_direction = glm::normalize(m_light_target - m_light_position);
 	m_view_matrix = glm::lookAt(m_light_position, m_light_target, glm::vec3(0, 1, 0));
@@ -78,6 +198,7 @@ void LightNode::SetPosition(const glm::vec3 & pos)
 
 void LightNode::SetTarget(const glm::vec3 & target)
 {
+	m_revision++;
 	m_light_target = target;
 	m_light_direction = glm::normalize(m_light_target - m_light_position);
 	m_view_matrix = glm::lookAt(m_light_position, m_light_target, glm::vec3(0, 1, 0));
@@ -86,6 +207,7 @@ void LightNode::SetTarget(const glm::vec3 & target)
 
 void LightNode::SetConeSize(float umbra, float penumbra)
 {
+	m_revision++;
 	m_umbra = umbra;
 	m_penumbra = penumbra;
 
@@ -142,6 +264,33 @@ int LightNode::GetShadowMapResolution()
 	return m_shadow_map_resolution;;
 }
 
+GLuint LightNode::GetStaticShadowMapFBO()
+{
+	return m_static_shadow_map_fbo;
+}
+
+GLuint LightNode::GetShadowCompareSampler()
+{
+	return m_shadow_compare_sampler;
+}
+
+void LightNode::SetShadowCompareFiltering(bool linear)
+{
+	m_shadow_compare_linear = linear;
+	if (m_shadow_compare_sampler != 0)
+		CreateCompareSampler();
+}
+
+bool LightNode::GetShadowCompareFiltering()
+{
+	return m_shadow_compare_linear;
+}
+
+unsigned int LightNode::GetRevision()
+{
+	return m_revision;
+}
+
 glm::mat4 LightNode::GetProjectionMatrix()
 {
 	return m_projection_matrix;
@@ -150,4 +299,207 @@ glm::mat4 LightNode::GetProjectionMatrix()
 glm::mat4 LightNode::GetViewMatrix()
 {
 	return m_view_matrix;
-}
\ No newline at end of file
+}
+
+void LightNode::SetType(LIGHT_TYPE type)
+{
+	m_type = type;
+	m_revision++;
+
+	if (m_cast_shadow && m_type == LIGHT_DIRECTIONAL && !CreateCascadeTargets())
+		printf("Error in cascaded shadow FB generation.\n");
+	if (m_cast_shadow && m_type == LIGHT_POINT && m_cube_texture == 0 && !CreateCubeTarget())
+		printf("Error in point light shadow FB generation.\n");
+}
+
+LightNode::LIGHT_TYPE LightNode::GetType()
+{
+	return m_type;
+}
+
+void LightNode::SetCascades(int count, float distance)
+{
+	m_cascade_count = glm::clamp(count, 1, (int)kMaxCascades);
+	m_cascade_distance = std::max(distance, 0.01f);
+	m_revision++;
+
+	if (m_cast_shadow && m_type == LIGHT_DIRECTIONAL && !CreateCascadeTargets())
+		printf("Error in cascaded shadow FB generation.\n");
+}
+
+void LightNode::SetCascadeResolution(int cascade, int resolution)
+{
+	if (cascade < 0 || cascade >= kMaxCascades)
+		return;
+	m_cascade_resolution[cascade] = std::max(resolution, 16);
+	m_revision++;
+
+	if (m_cast_shadow && m_type == LIGHT_DIRECTIONAL && !CreateCascadeTargets())
+		printf("Error in cascaded shadow FB generation.\n");
+}
+
+void LightNode::SetCascadeSplitLambda(float lambda)
+{
+	m_cascade_split_lambda = glm::clamp(lambda, 0.f, 1.f);
+}
+
+void LightNode::SetCascadeSplits(const std::vector<float> & splits)
+{
+	m_cascade_fixed_splits = splits;
+}
+
+void LightNode::FitCascades(const glm::mat4 & camera_view, const glm::mat4 & camera_projection, const glm::vec3 & scene_min, const glm::vec3 & scene_max)
+{
+	// the clip range of the camera's perspective projection, the cascades stop at m_cascade_distance
+	float clip_near = camera_projection[3][2] / (camera_projection[2][2] - 1.f);
+	float clip_far = camera_projection[3][2] / (camera_projection[2][2] + 1.f);
+	float distance = std::min(m_cascade_distance, clip_far);
+
+	for (int i = 0; i < m_cascade_count; i++)
+	{
+		if ((int)m_cascade_fixed_splits.size() == m_cascade_count)
+		{
+			m_cascade_splits[i] = m_cascade_fixed_splits[i];
+			continue;
+		}
+
+		// practical split scheme, logarithmic near the camera and even further out
+		float fraction = (i + 1) / (float)m_cascade_count;
+		float logarithmic = clip_near * glm::pow(distance / clip_near, fraction);
+		float even = clip_near + (distance - clip_near) * fraction;
+		m_cascade_splits[i] = m_cascade_split_lambda * logarithmic + (1.f - m_cascade_split_lambda) * even;
+	}
+
+	// the light's orientation only, each cascade puts the origin at the center of its slice
+	glm::vec3 up = (glm::abs(m_light_direction.y) > 0.99f) ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+	glm::mat4 light_rotation = glm::lookAt(glm::vec3(0.f), m_light_direction, up);
+	glm::mat4 camera_inverse = glm::inverse(camera_view);
+
+	float slice_start = clip_near;
+	for (int i = 0; i < m_cascade_count; i++)
+	{
+		float slice_end = m_cascade_splits[i];
+
+		// the slice's corners in world space and the sphere around them
+		glm::vec3 corners[8];
+		glm::vec3 center(0.f);
+		for (int c = 0; c < 8; c++)
+		{
+			float depth = (c & 4) ? slice_end : slice_start;
+			glm::vec4 corner((c & 1 ? 1.f : -1.f) * depth / camera_projection[0][0], (c & 2 ? 1.f : -1.f) * depth / camera_projection[1][1], -depth, 1.f);
+			corners[c] = glm::vec3(camera_inverse * corner);
+			center += corners[c] * 0.125f;
+		}
+		float radius = 0.f;
+		for (int c = 0; c < 8; c++)
+			radius = std::max(radius, glm::length(corners[c] - center));
+		radius = glm::ceil(radius * 16.f) / 16.f;
+
+		glm::vec3 light_center = glm::vec3(light_rotation * glm::vec4(center, 1.f));
+		glm::mat4 view = glm::translate(glm::mat4(1.f), -light_center) * light_rotation;
+
+		// toward the light up to the furthest scene corner, so every caster that can reach the slice is in
+		float scene_front = -FLT_MAX;
+		for (int c = 0; c < 8; c++)
+		{
+			glm::vec3 corner((c & 1) ? scene_max.x : scene_min.x, (c & 2) ? scene_max.y : scene_min.y, (c & 4) ? scene_max.z : scene_min.z);
+			scene_front = std::max(scene_front, (view * glm::vec4(corner, 1.f)).z);
+		}
+		glm::mat4 projection = glm::ortho(-radius, radius, -radius, radius, -std::max(scene_front, radius), radius);
+
+		// the world origin lands on a texel corner, so the cascade moves in whole texels
+		float texels = m_cascade_resolution[i] * 0.5f;
+		glm::vec4 origin = projection * view * glm::vec4(0.f, 0.f, 0.f, 1.f) * texels;
+		glm::vec4 offset = (glm::round(origin) - origin) / texels;
+		projection[3][0] += offset.x;
+		projection[3][1] += offset.y;
+
+		m_cascade_projection_view[i] = projection * view;
+		slice_start = slice_end;
+	}
+}
+
+int LightNode::GetCascadeCount()
+{
+	return m_cascade_count;
+}
+
+int LightNode::GetCascadeResolution(int cascade)
+{
+	return m_cascade_resolution[cascade];
+}
+
+int LightNode::GetCascadeArrayResolution()
+{
+	return *std::max_element(m_cascade_resolution, m_cascade_resolution + m_cascade_count);
+}
+
+float LightNode::GetCascadeSplit(int cascade)
+{
+	return m_cascade_splits[cascade];
+}
+
+glm::mat4 LightNode::GetCascadeProjectionView(int cascade)
+{
+	return m_cascade_projection_view[cascade];
+}
+
+GLuint LightNode::GetCascadeTexture()
+{
+	return m_cascade_texture;
+}
+
+GLuint LightNode::GetCascadeFBO(int cascade)
+{
+	return m_cascade_fbos[cascade];
+}
+
+void LightNode::SetPointRange(float range)
+{
+	m_point_range = std::max(range, kPointNear * 2.f);
+	m_revision++;
+}
+
+float LightNode::GetPointRange()
+{
+	return m_point_range;
+}
+
+glm::mat4 LightNode::GetCubeFaceProjectionView(int face)
+{
+	// the axes and up vectors of the cube map faces, a face looks down its axis
+	static const glm::vec3 axes[kCubeFaces] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+	static const glm::vec3 ups[kCubeFaces] = { { 0, -1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }, { 0, -1, 0 }, { 0, -1, 0 } };
+
+	glm::mat4 projection = glm::perspective(glm::radians(90.f), 1.f, kPointNear, m_point_range);
+	return projection * glm::lookAt(m_light_position, m_light_position + axes[face], ups[face]);
+}
+
+unsigned int LightNode::GetCubeFaceMask(const glm::vec3 & min, const glm::vec3 & max)
+{
+	// the box relative to the light, and its point nearest to each axis
+	glm::vec3 low = min - m_light_position;
+	glm::vec3 high = max - m_light_position;
+	glm::vec3 nearest = glm::max(glm::max(low, -high), glm::vec3(0.f));
+
+	unsigned int mask = 0;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float across = std::max(nearest[(axis + 1) % 3], nearest[(axis + 2) % 3]);
+		if (high[axis] >= across)
+			mask |= 1u << (axis * 2);
+		if (-low[axis] >= across)
+			mask |= 1u << (axis * 2 + 1);
+	}
+	return mask;
+}
+
+GLuint LightNode::GetCubeTexture()
+{
+	return m_cube_texture;
+}
+
+GLuint LightNode::GetCubeFBO()
+{
+	return m_cube_fbo;
+}
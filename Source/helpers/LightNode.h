@@ -4,11 +4,24 @@
 #include "glm/glm.hpp"
 
 #include <unordered_map>
+#include <vector>
 #include "GLEW\glew.h"
 
 class LightNode
 {
+public:
+	// a spotlight with one shadow map, a directional light with cascades fitted to the camera,
+	// or a point light with a depth cube drawn in one layered pass
+	enum LIGHT_TYPE { LIGHT_SPOT, LIGHT_DIRECTIONAL, LIGHT_POINT };
+	static const int kMaxCascades = 4;
+	// cube faces in layer order, +X -X +Y -Y +Z -Z
+	static const int kCubeFaces = 6;
+	// near plane of the cube faces, the shader rebuilds the depth of a face from it
+	static const float kPointNear;
+
+private:
 	std::string m_name;
+	LIGHT_TYPE m_type;
 	glm::vec3 m_light_direction;
 	glm::vec3 m_light_position;
 	glm::vec3 m_light_target;
@@ -22,7 +35,43 @@ class LightNode
 	float m_shadow_map_bias;
 	GLuint m_shadow_map_texture;
 	GLuint m_shadow_map_fbo;
+	// depth of the casters that never move, kept across frames by the renderer
+	GLuint m_static_shadow_map_texture;
+	GLuint m_static_shadow_map_fbo;
+	// bumped by every setter the shadow map depends on
+	unsigned int m_revision;
+
+	bool CreateShadowTarget(GLuint & texture, GLuint & fbo);
+
+	// Sampler comparing against the depth of a shadow map or cascade instead of returning it, so a
+	// sampler2DShadow tap is a lit fraction. Linear filtering blends the four nearest comparisons
+	GLuint m_shadow_compare_sampler;
+	bool m_shadow_compare_linear;
+
+	void CreateCompareSampler();
+
+	// Cascades, each a layer of one depth array. A cascade renders into the corner of its layer its
+	// resolution covers, the array is as large as the largest. Splits are view depths where a cascade
+	// ends, from the practical scheme unless set by hand
+	int m_cascade_count;
+	int m_cascade_resolution[kMaxCascades];
+	float m_cascade_split_lambda;
+	float m_cascade_distance;
+	std::vector<float> m_cascade_fixed_splits;
+	float m_cascade_splits[kMaxCascades];
+	glm::mat4 m_cascade_projection_view[kMaxCascades];
+	GLuint m_cascade_texture;
+	GLuint m_cascade_fbos[kMaxCascades];
+
+	bool CreateCascadeTargets();
 
+	// Point light, one depth cube attached whole so a draw picks its face with gl_Layer.
+	// The faces reach range from the light
+	float m_point_range;
+	GLuint m_cube_texture;
+	GLuint m_cube_fbo;
+
+	bool CreateCubeTarget();
 	glm::mat4 m_projection_matrix;
 	glm::mat4 m_projection_inverse_matrix;
 	glm::mat4 m_view_matrix;
@@ -49,9 +98,51 @@ public:
 	GLuint GetShadowMapFBO();
 	GLuint GetShadowMapDepthTexture();
 	int GetShadowMapResolution();
+	GLuint GetStaticShadowMapFBO();
+	// bound over the shadow map and the cascades for the hardware filtered taps, 0 before CastShadow
+	GLuint GetShadowCompareSampler();
+	// bilinear comparison, 2x2 pcf per tap, or nearest for one hard comparison
+	void SetShadowCompareFiltering(bool linear);
+	bool GetShadowCompareFiltering();
+	// changes whenever position, target, cone or the shadow map change, cached shadows compare it
+	unsigned int GetRevision();
 
 	glm::mat4 GetProjectionMatrix();
 	glm::mat4 GetViewMatrix();
+
+	// the direction from position to target holds for a directional light, its position is unused
+	void SetType(LIGHT_TYPE type);
+	LIGHT_TYPE GetType();
+
+	// 1 to kMaxCascades cascades covering the view up to distance
+	void SetCascades(int count, float distance);
+	void SetCascadeResolution(int cascade, int resolution);
+	// 0 splits the distance evenly, 1 logarithmically, the practical scheme blends the two
+	void SetCascadeSplitLambda(float lambda);
+	// view depths where the cascades end, count of them, instead of the scheme. Empty for the scheme again
+	void SetCascadeSplits(const std::vector<float> & splits);
+
+	// Fit the cascades to the slices of the camera frustum. Each cascade bounds its slice with a sphere
+	// so its size does not change as the camera turns, and moves in whole texels so edges do not shimmer.
+	// Depth reaches back to the scene bounds so casters between the light and the slice are kept
+	void FitCascades(const glm::mat4 & camera_view, const glm::mat4 & camera_projection, const glm::vec3 & scene_min, const glm::vec3 & scene_max);
+
+	int GetCascadeCount();
+	int GetCascadeResolution(int cascade);
+	int GetCascadeArrayResolution();
+	float GetCascadeSplit(int cascade);
+	glm::mat4 GetCascadeProjectionView(int cascade);
+	GLuint GetCascadeTexture();
+	GLuint GetCascadeFBO(int cascade);
+
+	void SetPointRange(float range);
+	float GetPointRange();
+	glm::mat4 GetCubeFaceProjectionView(int face);
+	// Faces of the cube a box overlaps, bit i for layer i. A face sees where its axis is the major one,
+	// so the box is on it when its furthest point along the axis is past its nearest across the other two
+	unsigned int GetCubeFaceMask(const glm::vec3 & min, const glm::vec3 & max);
+	GLuint GetCubeTexture();
+	GLuint GetCubeFBO();
 };
 
 #endif
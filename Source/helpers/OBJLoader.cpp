@@ -5,6 +5,7 @@
 #include <fstream>
 #include <iostream>
 #include "Tools.h"
+#include "JobSystem.h"
 
 using namespace std;
 
@@ -301,16 +302,20 @@ void OBJLoader::generateDataFromFaces()
 
 void OBJLoader::calculate_flat_normals()
 {
-	for (unsigned int i = 0; i < mesh->vertices.size(); i++)
+	// one triangle per index, each writes only its own three normals
+	mesh->normals.resize(mesh->vertices.size() / 3 * 3);
+	JobSystem::GetInstance().ParallelFor(mesh->vertices.size() / 3, 4096, [this](size_t begin, size_t end)
 	{
-		if ((i % 3) == 2) {
+		for (size_t t = begin; t < end; t++)
+		{
+			size_t i = t * 3;
 			glm::vec3 normal = glm::normalize(glm::cross(
-				mesh->vertices[i] - mesh->vertices[i - 2],
-				mesh->vertices[i - 1] - mesh->vertices[i - 2]));
+				mesh->vertices[i + 2] - mesh->vertices[i],
+				mesh->vertices[i + 1] - mesh->vertices[i]));
 			for (int n = 0; n < 3; n++)
-				mesh->normals.push_back(normal);
+				mesh->normals[i + n] = normal;
 		}
-	}
+	});
 }
 
 
@@ -359,56 +364,52 @@ void OBJLoader::calculate_avg_normals(std::vector<glm::vec3>& shared_vertices, s
 
 void OBJLoader::calculate_tangents()
 {
-	mesh->tangents.clear();
+	mesh->tangents.resize(mesh->vertices.size());
+	mesh->bitangents.resize(mesh->vertices.size());
 
-	for (unsigned int i = 0; i < mesh->vertices.size(); i += 3)
+	// triangles are independent, ranges of them run as jobs
+	JobSystem::GetInstance().ParallelFor(mesh->vertices.size() / 3, 4096, [this](size_t begin, size_t end)
 	{
-		glm::vec3& v0 = mesh->vertices[i + 0];
-		glm::vec3& v1 = mesh->vertices[i + 1];
-		glm::vec3& v2 = mesh->vertices[i + 2];
-
-		glm::vec2& uv0 = mesh->textureCoord[i + 0];
-		glm::vec2& uv1 = mesh->textureCoord[i + 1];
-		glm::vec2& uv2 = mesh->textureCoord[i + 2];
-
-		// edges of the triangle : position delta
-		glm::vec3 deltaPos1 = v1 - v0;
-		glm::vec3 deltaPos2 = v2 - v0;
+		for (size_t i = begin * 3; i < end * 3; i += 3)
+		{
+			glm::vec3& v0 = mesh->vertices[i + 0];
+			glm::vec3& v1 = mesh->vertices[i + 1];
+			glm::vec3& v2 = mesh->vertices[i + 2];
 
-		// uv delta
-		glm::vec2 deltaUV1 = uv1 - uv0;
-		glm::vec2 deltaUV2 = uv2 - uv0;
+			glm::vec2& uv0 = mesh->textureCoord[i + 0];
+			glm::vec2& uv1 = mesh->textureCoord[i + 1];
+			glm::vec2& uv2 = mesh->textureCoord[i + 2];
 
-		float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
-		glm::vec3 tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * r;
-		glm::vec3 b = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * r;
+			// edges of the triangle : position delta
+			glm::vec3 deltaPos1 = v1 - v0;
+			glm::vec3 deltaPos2 = v2 - v0;
 
-		// set the same tangent for all the three vertices of the triangle.
-		// they will be merged later
+			// uv delta
+			glm::vec2 deltaUV1 = uv1 - uv0;
+			glm::vec2 deltaUV2 = uv2 - uv0;
 
-		mesh->tangents.push_back(tangent);
-		mesh->tangents.push_back(tangent);
-		mesh->tangents.push_back(tangent);
+			float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
+			glm::vec3 tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * r;
+			glm::vec3 b = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * r;
 
-		mesh->bitangents.push_back(b);
-		mesh->bitangents.push_back(b);
-		mesh->bitangents.push_back(b);
-	}
+			// set the same tangent for all the three vertices of the triangle.
+			for (size_t v = i; v < i + 3; v++)
+			{
+				glm::vec3& n = mesh->normals[v];
 
-	for (unsigned int i = 0; i < mesh->vertices.size(); i += 1)
-	{
-		glm::vec3& n = mesh->normals[i];
-		glm::vec3& t = mesh->tangents[i];
-		glm::vec3& b = mesh->bitangents[i];
+				// Gram-Schmidt orthogonalize
+				glm::vec3 t = glm::normalize(tangent - n * glm::dot(n, tangent));
 
-		// Gram-Schmidt orthogonalize
-		t = glm::normalize(t - n * glm::dot(n, t));
+				// Calculate handedness
+				if (glm::dot(glm::cross(n, t), b) < 0.0f) {
+					t = t * -1.0f;
+				}
 
-		// Calculate handedness
-		if (glm::dot(glm::cross(n, t), b) < 0.0f) {
-			t = t * -1.0f;
+				mesh->tangents[v] = t;
+				mesh->bitangents[v] = b;
+			}
 		}
-	}
+	});
 }
 
 void OBJLoader::read_usemtl(const char* buff, int& currentMaterialID)
@@ -0,0 +1,612 @@
+#include "PNGDecoder.h"
+#include <cstring>
+#include <cstdlib>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PNG_DECODER_SSE2
+#include <emmintrin.h>
+#endif
+
+// Inflate (RFC 1951)
+namespace
+{
+	const int kFastBits = 10;
+	const int kFastMask = (1 << kFastBits) - 1;
+
+	const uint16_t kLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const uint8_t kLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const uint16_t kDistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	const uint8_t kDistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	const uint8_t kCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	// canonical Huffman code, short codes resolve with one lookup in the fast table
+	struct Huffman
+	{
+		uint16_t fast[1 << kFastBits];
+		uint16_t firstCode[16];
+		int maxCode[17];
+		uint16_t firstSymbol[16];
+		uint8_t size[288];
+		uint16_t value[288];
+	};
+
+	inline int BitReverse16(int n)
+	{
+		n = ((n & 0xAAAA) >> 1) | ((n & 0x5555) << 1);
+		n = ((n & 0xCCCC) >> 2) | ((n & 0x3333) << 2);
+		n = ((n & 0xF0F0) >> 4) | ((n & 0x0F0F) << 4);
+		n = ((n & 0xFF00) >> 8) | ((n & 0x00FF) << 8);
+		return n;
+	}
+
+	inline int BitReverse(int v, int bits)
+	{
+		return BitReverse16(v) >> (16 - bits);
+	}
+
+	bool BuildHuffman(Huffman& h, const uint8_t* lengths, int count)
+	{
+		int sizes[17] = { 0 };
+		int nextCode[16];
+
+		memset(h.fast, 0, sizeof(h.fast));
+		for (int i = 0; i < count; i++)
+			sizes[lengths[i]]++;
+		sizes[0] = 0;
+
+		int code = 0;
+		int k = 0;
+		for (int i = 1; i < 16; i++)
+		{
+			nextCode[i] = code;
+			h.firstCode[i] = (uint16_t)code;
+			h.firstSymbol[i] = (uint16_t)k;
+			code += sizes[i];
+			if (sizes[i] && code - 1 >= (1 << i))
+				return false; // over subscribed
+			h.maxCode[i] = code << (16 - i);
+			code <<= 1;
+			k += sizes[i];
+		}
+		h.maxCode[16] = 0x10000;
+
+		for (int i = 0; i < count; i++)
+		{
+			int s = lengths[i];
+			if (s == 0)
+				continue;
+
+			int c = nextCode[s] - h.firstCode[s] + h.firstSymbol[s];
+			h.size[c] = (uint8_t)s;
+			h.value[c] = (uint16_t)i;
+
+			if (s <= kFastBits)
+			{
+				uint16_t entry = (uint16_t)((s << 9) | i);
+				for (int j = BitReverse(nextCode[s], s); j < (1 << kFastBits); j += (1 << s))
+					h.fast[j] = entry;
+			}
+			nextCode[s]++;
+		}
+		return true;
+	}
+
+	// LSB first bit reader over a 64 bit buffer
+	struct BitReader
+	{
+		const uint8_t* p;
+		const uint8_t* end;
+		uint64_t bits;
+		int count;
+
+		void refill()
+		{
+			if (end - p >= 8)
+			{
+				// branchless: top up to at least 56 bits with one unaligned load (little endian)
+				uint64_t v;
+				memcpy(&v, p, 8);
+				bits |= v << count;
+				p += (63 - count) >> 3;
+				count |= 56;
+			}
+			else
+			{
+				while (count <= 56)
+				{
+					uint64_t byte = (p < end) ? *p++ : 0;
+					bits |= byte << count;
+					count += 8;
+				}
+			}
+		}
+
+		int get(int n)
+		{
+			if (count < n) refill();
+			int v = (int)(bits & ((1ull << n) - 1));
+			bits >>= n;
+			count -= n;
+			return v;
+		}
+
+		int decode(const Huffman& h)
+		{
+			if (count < 16) refill();
+
+			int entry = h.fast[bits & kFastMask];
+			if (entry)
+			{
+				int s = entry >> 9;
+				bits >>= s;
+				count -= s;
+				return entry & 511;
+			}
+
+			int k = BitReverse16((int)(bits & 0xFFFF));
+			int s;
+			for (s = kFastBits + 1; ; s++)
+				if (k < h.maxCode[s]) break;
+			if (s >= 16)
+				return -1;
+
+			int c = (k >> (16 - s)) - h.firstCode[s] + h.firstSymbol[s];
+			if (c >= 288 || h.size[c] != s)
+				return -1;
+
+			bits >>= s;
+			count -= s;
+			return h.value[c];
+		}
+	};
+
+	bool InflateBlock(BitReader& br, const Huffman& lit, const Huffman& dist, uint8_t* start, uint8_t*& out, uint8_t* end)
+	{
+		for (;;)
+		{
+			int sym = br.decode(lit);
+			if (sym < 256)
+			{
+				if (sym < 0 || out >= end)
+					return false;
+				*out++ = (uint8_t)sym;
+				continue;
+			}
+			if (sym == 256)
+				return true;
+
+			sym -= 257;
+			if (sym >= 29)
+				return false;
+			int len = kLengthBase[sym] + (kLengthExtra[sym] ? br.get(kLengthExtra[sym]) : 0);
+
+			int dsym = br.decode(dist);
+			if (dsym < 0 || dsym >= 30)
+				return false;
+			int d = kDistBase[dsym] + (kDistExtra[dsym] ? br.get(kDistExtra[dsym]) : 0);
+
+			if (d > out - start || len > end - out)
+				return false;
+
+			const uint8_t* src = out - d;
+			if (d == 1)
+			{
+				memset(out, *src, len);
+			}
+			else if (d >= len)
+			{
+				memcpy(out, src, len);
+			}
+			else
+			{
+				for (int i = 0; i < len; i++)
+					out[i] = src[i];
+			}
+			out += len;
+		}
+	}
+
+	bool BuildFixed(Huffman& lit, Huffman& dist)
+	{
+		uint8_t lengths[288];
+		int i = 0;
+		for (; i <= 143; i++) lengths[i] = 8;
+		for (; i <= 255; i++) lengths[i] = 9;
+		for (; i <= 279; i++) lengths[i] = 7;
+		for (; i <= 287; i++) lengths[i] = 8;
+
+		uint8_t dist_lengths[30];
+		memset(dist_lengths, 5, sizeof(dist_lengths));
+
+		return BuildHuffman(lit, lengths, 288) && BuildHuffman(dist, dist_lengths, 30);
+	}
+
+	bool BuildDynamic(BitReader& br, Huffman& lit, Huffman& dist)
+	{
+		int hlit = br.get(5) + 257;
+		int hdist = br.get(5) + 1;
+		int hclen = br.get(4) + 4;
+		// the 5 bit counts go past what RFC 1951 allows, such a stream would overrun lengths
+		if (hlit > 286 || hdist > 30)
+			return false;
+
+		uint8_t code_lengths[19] = { 0 };
+		for (int i = 0; i < hclen; i++)
+			code_lengths[kCodeLengthOrder[i]] = (uint8_t)br.get(3);
+
+		Huffman code_huffman;
+		if (!BuildHuffman(code_huffman, code_lengths, 19))
+			return false;
+
+		uint8_t lengths[286 + 30];
+		int total = hlit + hdist;
+		int n = 0;
+		while (n < total)
+		{
+			int c = br.decode(code_huffman);
+			if (c < 0 || c >= 19)
+				return false;
+
+			if (c < 16)
+			{
+				lengths[n++] = (uint8_t)c;
+				continue;
+			}
+
+			uint8_t fill = 0;
+			int repeat;
+			if (c == 16)
+			{
+				if (n == 0)
+					return false;
+				repeat = br.get(2) + 3;
+				fill = lengths[n - 1];
+			}
+			else if (c == 17)
+			{
+				repeat = br.get(3) + 3;
+			}
+			else
+			{
+				repeat = br.get(7) + 11;
+			}
+
+			if (n + repeat > total)
+				return false;
+			memset(lengths + n, fill, repeat);
+			n += repeat;
+		}
+
+		return BuildHuffman(lit, lengths, hlit) && BuildHuffman(dist, lengths + hlit, hdist);
+	}
+
+	uint32_t ReadBE32(const unsigned char* p)
+	{
+		return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+	}
+
+	const unsigned char kSignature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+}
+
+// Unfiltering (PNG spec, section 9), rows are reconstructed from the filtered row into the output
+namespace
+{
+	inline uint8_t Paeth(int a, int b, int c)
+	{
+		int p = a + b - c;
+		int pa = abs(p - a);
+		int pb = abs(p - b);
+		int pc = abs(p - c);
+		if (pa <= pb && pa <= pc) return (uint8_t)a;
+		if (pb <= pc) return (uint8_t)b;
+		return (uint8_t)c;
+	}
+
+	void UnfilterUp(uint8_t* row, const uint8_t* src, const uint8_t* prev, size_t stride)
+	{
+		size_t i = 0;
+#ifdef PNG_DECODER_SSE2
+		for (; i + 16 <= stride; i += 16)
+		{
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(x, b));
+		}
+#endif
+		for (; i < stride; i++)
+			row[i] = (uint8_t)(src[i] + prev[i]);
+	}
+
+#ifdef PNG_DECODER_SSE2
+	// one pixel per register, 3 byte pixels go through a 4 byte temporary
+	template <int BPP>
+	inline __m128i LoadPixel(const uint8_t* p)
+	{
+		int v = 0;
+		memcpy(&v, p, BPP);
+		return _mm_cvtsi32_si128(v);
+	}
+
+	template <int BPP>
+	inline void StorePixel(uint8_t* p, __m128i x)
+	{
+		int v = _mm_cvtsi128_si32(x);
+		memcpy(p, &v, BPP);
+	}
+
+	inline __m128i Abs16(__m128i x)
+	{
+		return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+	}
+
+	inline __m128i Select(__m128i mask, __m128i a, __m128i b)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+
+	template <int BPP>
+	void UnfilterSubSSE2(uint8_t* row, const uint8_t* src, size_t stride)
+	{
+		__m128i a = _mm_setzero_si128();
+		for (size_t i = 0; i < stride; i += BPP)
+		{
+			a = _mm_add_epi8(a, LoadPixel<BPP>(src + i));
+			StorePixel<BPP>(row + i, a);
+		}
+	}
+
+	template <int BPP>
+	void UnfilterAvgSSE2(uint8_t* row, const uint8_t* src, const uint8_t* prev, size_t stride)
+	{
+		const __m128i one = _mm_set1_epi8(1);
+		__m128i a = _mm_setzero_si128();
+		for (size_t i = 0; i < stride; i += BPP)
+		{
+			__m128i b = LoadPixel<BPP>(prev + i);
+			// _mm_avg_epu8 rounds up, take the carry back to get floor((a + b) / 2)
+			__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+			a = _mm_add_epi8(LoadPixel<BPP>(src + i), avg);
+			StorePixel<BPP>(row + i, a);
+		}
+	}
+
+	template <int BPP>
+	void UnfilterPaethSSE2(uint8_t* row, const uint8_t* src, const uint8_t* prev, size_t stride)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i a = zero;
+		__m128i c = zero;
+		for (size_t i = 0; i < stride; i += BPP)
+		{
+			// 16 bit lanes so the predictor differences do not overflow
+			__m128i b = _mm_unpacklo_epi8(LoadPixel<BPP>(prev + i), zero);
+			__m128i x = _mm_unpacklo_epi8(LoadPixel<BPP>(src + i), zero);
+
+			__m128i pa = _mm_sub_epi16(b, c);	// p - a
+			__m128i pb = _mm_sub_epi16(a, c);	// p - b
+			__m128i pc = _mm_add_epi16(pa, pb);	// p - c
+			pa = Abs16(pa);
+			pb = Abs16(pb);
+			pc = Abs16(pc);
+
+			// ties favour a, then b, then c
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+			__m128i nearest = Select(_mm_cmpeq_epi16(smallest, pa), a,
+				Select(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+			a = _mm_and_si128(_mm_add_epi16(x, nearest), _mm_set1_epi16(0xFF));
+			StorePixel<BPP>(row + i, _mm_packus_epi16(a, a));
+			c = b;
+		}
+	}
+#endif
+
+	void UnfilterSub(uint8_t* row, const uint8_t* src, size_t stride, int bpp)
+	{
+#ifdef PNG_DECODER_SSE2
+		if (bpp == 3) return UnfilterSubSSE2<3>(row, src, stride);
+		if (bpp == 4) return UnfilterSubSSE2<4>(row, src, stride);
+#endif
+		for (size_t i = 0; i < stride; i++)
+			row[i] = (uint8_t)(src[i] + (i >= (size_t)bpp ? row[i - bpp] : 0));
+	}
+
+	void UnfilterAvg(uint8_t* row, const uint8_t* src, const uint8_t* prev, size_t stride, int bpp)
+	{
+#ifdef PNG_DECODER_SSE2
+		if (bpp == 3) return UnfilterAvgSSE2<3>(row, src, prev, stride);
+		if (bpp == 4) return UnfilterAvgSSE2<4>(row, src, prev, stride);
+#endif
+		for (size_t i = 0; i < stride; i++)
+			row[i] = (uint8_t)(src[i] + (((i >= (size_t)bpp ? row[i - bpp] : 0) + prev[i]) >> 1));
+	}
+
+	void UnfilterPaeth(uint8_t* row, const uint8_t* src, const uint8_t* prev, size_t stride, int bpp)
+	{
+#ifdef PNG_DECODER_SSE2
+		if (bpp == 3) return UnfilterPaethSSE2<3>(row, src, prev, stride);
+		if (bpp == 4) return UnfilterPaethSSE2<4>(row, src, prev, stride);
+#endif
+		for (size_t i = 0; i < stride; i++)
+		{
+			int a = (i >= (size_t)bpp) ? row[i - bpp] : 0;
+			int c = (i >= (size_t)bpp) ? prev[i - bpp] : 0;
+			row[i] = (uint8_t)(src[i] + Paeth(a, prev[i], c));
+		}
+	}
+}
+
+PNGDecoder::PNGDecoder()
+{
+
+}
+
+PNGDecoder::~PNGDecoder()
+{
+
+}
+
+bool PNGDecoder::ReadInfo(const unsigned char* file, size_t size, Info& info)
+{
+	if (size < 33 || memcmp(file, kSignature, 8) != 0)
+		return false;
+
+	if (ReadBE32(file + 8) != 13 || memcmp(file + 12, "IHDR", 4) != 0)
+		return false;
+
+	const unsigned char* ihdr = file + 16;
+	info.width = (int)ReadBE32(ihdr);
+	info.height = (int)ReadBE32(ihdr + 4);
+	int bit_depth = ihdr[8];
+	int color_type = ihdr[9];
+	int compression = ihdr[10];
+	int filter = ihdr[11];
+	int interlace = ihdr[12];
+
+	if (info.width <= 0 || info.height <= 0 || bit_depth != 8 || compression != 0 || filter != 0 || interlace != 0)
+		return false;
+
+	if (color_type == 2) info.channels = 3;
+	else if (color_type == 6) info.channels = 4;
+	else return false;
+
+	return true;
+}
+
+bool PNGDecoder::Decode(const unsigned char* file, size_t size, unsigned char* dst, bool flip, unsigned char* copy)
+{
+	Info info;
+	if (!ReadInfo(file, size, info))
+		return false;
+
+	// gather the zlib stream
+	compressed.clear();
+	size_t offset = 8;
+	while (offset + 12 <= size)
+	{
+		uint32_t length = ReadBE32(file + offset);
+		const unsigned char* type = file + offset + 4;
+		if (length > size - offset - 12)
+			return false;
+
+		if (memcmp(type, "IDAT", 4) == 0)
+			compressed.insert(compressed.end(), file + offset + 8, file + offset + 8 + length);
+		else if (memcmp(type, "IEND", 4) == 0)
+			break;
+
+		offset += 12 + length;
+	}
+
+	// zlib header: deflate, no preset dictionary
+	if (compressed.size() < 2 || (compressed[0] & 0x0F) != 8 || ((compressed[0] << 8) | compressed[1]) % 31 != 0 || (compressed[1] & 0x20))
+		return false;
+
+	size_t stride = (size_t)info.width * info.channels;
+	filtered.resize((stride + 1) * info.height);
+
+	if (!inflate(compressed.data() + 2, compressed.size() - 2, filtered.data(), filtered.size()))
+		return false;
+
+	return unfilter(info, dst, flip, copy);
+}
+
+bool PNGDecoder::inflate(const unsigned char* src, size_t size, unsigned char* dst, size_t dstSize)
+{
+	BitReader br = { src, src + size, 0, 0 };
+	uint8_t* out = dst;
+	uint8_t* end = dst + dstSize;
+
+	Huffman* lit = new Huffman();
+	Huffman* dist = new Huffman();
+	bool ok = true;
+	int final_block = 0;
+
+	while (ok && !final_block)
+	{
+		final_block = br.get(1);
+		int type = br.get(2);
+
+		if (type == 0)
+		{
+			// stored block, drop to a byte boundary
+			br.get(br.count & 7);
+			int len = br.get(16);
+			int nlen = br.get(16);
+			if ((len ^ 0xFFFF) != nlen || len > end - out)
+			{
+				ok = false;
+				break;
+			}
+
+			while (len > 0 && br.count >= 8)
+			{
+				*out++ = (uint8_t)(br.bits & 0xFF);
+				br.bits >>= 8;
+				br.count -= 8;
+				len--;
+			}
+			if (br.count == 0)
+				br.bits = 0; // the look ahead bytes are about to be skipped
+
+			if (len > br.end - br.p)
+			{
+				ok = false;
+				break;
+			}
+			memcpy(out, br.p, len);
+			out += len;
+			br.p += len;
+		}
+		else if (type == 1)
+		{
+			ok = BuildFixed(*lit, *dist) && InflateBlock(br, *lit, *dist, dst, out, end);
+		}
+		else if (type == 2)
+		{
+			ok = BuildDynamic(br, *lit, *dist) && InflateBlock(br, *lit, *dist, dst, out, end);
+		}
+		else
+		{
+			ok = false;
+		}
+	}
+
+	delete lit;
+	delete dist;
+
+	return ok && out == end;
+}
+
+bool PNGDecoder::unfilter(const Info& info, unsigned char* dst, bool flip, unsigned char* copy)
+{
+	// the filters read the row above and the row itself, both stay in cached scratch
+	size_t stride = (size_t)info.width * info.channels;
+	rows.assign(stride * 2, 0);
+	unsigned char* prev = rows.data();
+	unsigned char* row = rows.data() + stride;
+
+	for (int y = 0; y < info.height; y++)
+	{
+		const unsigned char* src = &filtered[y * (stride + 1)];
+		unsigned char filter = *src++;
+
+		switch (filter)
+		{
+			case 0: memcpy(row, src, stride); break;
+			case 1: UnfilterSub(row, src, stride, info.channels); break;
+			case 2: UnfilterUp(row, src, prev, stride); break;
+			case 3: UnfilterAvg(row, src, prev, stride, info.channels); break;
+			case 4: UnfilterPaeth(row, src, prev, stride, info.channels); break;
+			default: return false;
+		}
+
+		size_t offset = (flip ? (info.height - 1 - y) : y) * stride;
+		memcpy(dst + offset, row, stride);
+		if (copy) memcpy(copy + offset, row, stride);
+
+		std::swap(prev, row);
+	}
+
+	return true;
+}
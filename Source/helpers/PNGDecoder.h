@@ -0,0 +1,48 @@
+#ifndef PNG_DECODER_H
+#define PNG_DECODER_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/* Decoder for the PNG flavour our assets use:
+8 bit RGB or RGBA, non interlaced.
+Anything else is rejected so the caller can fall back to SDL_image.
+The pixels are written into a caller provided buffer (a mapped PBO region, an arena...),
+the decoder only keeps its own scratch buffers between calls.
+-- One decoder per thread
+*/
+class PNGDecoder
+{
+public:
+	struct Info
+	{
+		int width;
+		int height;
+		int channels;
+	};
+
+	PNGDecoder();
+	~PNGDecoder();
+
+	// Parse the header, false when the image is not a supported PNG
+	bool ReadInfo(const unsigned char* file, size_t size, Info& info);
+
+	// Decode into dst, which must hold width * height * channels bytes.
+	// With flip set the rows are stored bottom up, as OpenGL expects them.
+	// dst is only written, never read back, so it can be write combined memory;
+	// copy, when set, receives the same rows in the same pass
+	bool Decode(const unsigned char* file, size_t size, unsigned char* dst, bool flip, unsigned char* copy = nullptr);
+
+private:
+	// concatenated IDAT chunks and the inflated, still filtered, scanlines
+	std::vector<unsigned char> compressed;
+	std::vector<unsigned char> filtered;
+	// the row being unfiltered and the one above it
+	std::vector<unsigned char> rows;
+
+	bool inflate(const unsigned char* src, size_t size, unsigned char* dst, size_t dstSize);
+	bool unfilter(const Info& info, unsigned char* dst, bool flip, unsigned char* copy);
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "RenderQueue.h"
+#include <cstring>
+
+RenderQueue::RenderQueue()
+{
+	sorting = true;
+	statistics = {};
+}
+
+uint64_t RenderQueue::MakeKey(Pass pass, unsigned int variant, unsigned int textureSet, unsigned int material, float depth)
+{
+	// positive floats order like their bits, the top 20 keep the exponent and 11 bits of mantissa
+	if (!(depth > 0.f))
+		depth = 0.f;
+	uint32_t depthBits;
+	memcpy(&depthBits, &depth, sizeof(depthBits));
+
+	return ((uint64_t)(pass & 0xF) << 60) |
+		((uint64_t)(variant & 0xFFF) << 48) |
+		((uint64_t)(textureSet & 0x3FFF) << 34) |
+		((uint64_t)(material & 0x3FFF) << 20) |
+		(uint64_t)((depthBits >> 11) & 0xFFFFF);
+}
+
+unsigned int RenderQueue::TextureSetId(GLuint diffuse, GLuint normal)
+{
+	uint64_t textures = ((uint64_t)diffuse << 32) | normal;
+	auto found = textureSets.find(textures);
+	if (found != textureSets.end())
+		return found->second;
+
+	// ids past the field wrap, equal ids only put unrelated packets next to each other
+	unsigned int id = (unsigned int)textureSets.size() & 0x3FFF;
+	textureSets[textures] = id;
+	return id;
+}
+
+unsigned int RenderQueue::MaterialId(const void* material)
+{
+	auto found = materials.find(material);
+	if (found != materials.end())
+		return found->second;
+
+	unsigned int id = (unsigned int)materials.size() & 0x3FFF;
+	materials[material] = id;
+	return id;
+}
+
+void RenderQueue::Clear()
+{
+	packets.clear();
+	order.clear();
+}
+
+void RenderQueue::Push(const DrawPacket& packet)
+{
+	order.push_back({ packet.key, (uint32_t)packets.size() });
+	packets.push_back(packet);
+}
+
+void RenderQueue::Sort()
+{
+	if (sorting)
+		RadixSort();
+
+	statistics = {};
+	statistics.packets = order.size();
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		uint64_t key = order[i].key;
+		uint64_t previous = (i > 0) ? order[i - 1].key : ~key;
+		if (i == 0 || GetVariant(key) != GetVariant(previous)) statistics.programs++;
+		if (i == 0 || GetTextureSet(key) != GetTextureSet(previous)) statistics.textureSets++;
+		if (i == 0 || GetMaterial(key) != GetMaterial(previous)) statistics.materials++;
+	}
+}
+
+void RenderQueue::RadixSort()
+{
+	if (order.size() < 2)
+		return;
+
+	// least significant byte first, each pass is stable so the earlier ones hold
+	scratch.resize(order.size());
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t counts[256] = {};
+		for (const SortEntry& entry : order)
+			counts[(entry.key >> shift) & 0xFF]++;
+
+		// a byte every key shares moves nothing
+		if (counts[(order.front().key >> shift) & 0xFF] == order.size())
+			continue;
+
+		size_t offset = 0;
+		for (int i = 0; i < 256; i++)
+		{
+			size_t count = counts[i];
+			counts[i] = offset;
+			offset += count;
+		}
+		for (const SortEntry& entry : order)
+			scratch[counts[(entry.key >> shift) & 0xFF]++] = entry;
+		order.swap(scratch);
+	}
+}
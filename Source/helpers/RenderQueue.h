@@ -0,0 +1,93 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "GLEW\glew.h"
+
+class GeometryNode;
+
+// Draw packets of one frame, ordered by a 64 bit key so draws that share state end up together.
+// Key, from the highest bits: pass (4), program variant (12), texture set (14), material (14),
+// view depth (20) so equal state draws front to back. Packets are radix sorted on the key.
+class RenderQueue
+{
+public:
+	enum Pass
+	{
+		PASS_OPAQUE,
+		PASS_COUNT,
+	};
+
+	struct DrawPacket
+	{
+		uint64_t key;
+
+		GeometryNode* node;
+		int part;
+		GLintptr instanceOffset;
+		GLsizei instanceCount;
+		unsigned int features;
+
+		GLuint diffuseTexture;
+		int diffuseLayer;
+		GLuint normalTexture;
+		int normalLayer;
+	};
+
+	// Key field changes between consecutive packets, each one is a state change at submit
+	struct Statistics
+	{
+		size_t packets;
+		size_t programs;
+		size_t textureSets;
+		size_t materials;
+	};
+
+	RenderQueue();
+
+	static uint64_t MakeKey(Pass pass, unsigned int variant, unsigned int textureSet, unsigned int material, float depth);
+	// Fields of a key, for counting the state changes of an order
+	static unsigned int GetVariant(uint64_t key) { return (unsigned int)(key >> 48) & 0xFFF; }
+	static unsigned int GetTextureSet(uint64_t key) { return (unsigned int)(key >> 34) & 0x3FFF; }
+	static unsigned int GetMaterial(uint64_t key) { return (unsigned int)(key >> 20) & 0x3FFF; }
+
+	// Small ids for the key, stable across frames so the order is too.
+	// They only order the packets, submit compares the state itself since the ids wrap
+	unsigned int TextureSetId(GLuint diffuse, GLuint normal);
+	unsigned int MaterialId(const void* material);
+
+	void Clear();
+	void Push(const DrawPacket& packet);
+	// Order the packets by key, or keep them as pushed while sorting is off
+	void Sort();
+
+	size_t GetCount() const { return packets.size(); }
+	const DrawPacket& operator[](size_t index) const { return packets[order[index].index]; }
+
+	void EnableSorting(bool enable) { sorting = enable; }
+	bool IsSorting() const { return sorting; }
+	// Counts of the order of the last Sort
+	Statistics GetStatistics() const { return statistics; }
+
+private:
+	struct SortEntry
+	{
+		uint64_t key;
+		uint32_t index;
+	};
+
+	std::vector<DrawPacket> packets;
+	std::vector<SortEntry> order;
+	std::vector<SortEntry> scratch;
+	bool sorting;
+	Statistics statistics;
+
+	std::unordered_map<uint64_t, unsigned int> textureSets;
+	std::unordered_map<const void*, unsigned int> materials;
+
+	void RadixSort();
+};
+
+#endif
@@ -0,0 +1,276 @@
+#include "ShaderCompiler.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+ShaderCompiler::ShaderCompiler()
+{
+	mode = MODE_SYNCHRONOUS;
+	maxShaderCompilerThreads = nullptr;
+	window = nullptr;
+	workerContext = nullptr;
+	stopWorker = false;
+}
+
+ShaderCompiler::~ShaderCompiler()
+{
+	// the GL context is gone by now, only the thread is stopped
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		stopWorker = true;
+	}
+	jobReady.notify_all();
+	if (worker.joinable())
+		worker.join();
+}
+
+void ShaderCompiler::Init()
+{
+	if (mode != MODE_SYNCHRONOUS)
+		return;
+
+	if (GLEW_ARB_parallel_shader_compile)
+	{
+		maxShaderCompilerThreads = glMaxShaderCompilerThreadsARB;
+	}
+	else if (HasExtension("GL_KHR_parallel_shader_compile"))
+	{
+		maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSARBPROC)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+	}
+
+	if (maxShaderCompilerThreads != nullptr)
+	{
+		// let the driver pick the number of threads
+		maxShaderCompilerThreads(0xFFFFFFFF);
+		mode = MODE_PARALLEL_EXTENSION;
+		printf("Shader compiler: driver parallel compile\n");
+	}
+	else if (CreateWorkerContext())
+	{
+		stopWorker = false;
+		worker = std::thread(&ShaderCompiler::CompileWorker, this);
+		mode = MODE_WORKER_CONTEXT;
+		printf("Shader compiler: worker context\n");
+	}
+	else
+	{
+		printf("Shader compiler: synchronous, reloads block the frame\n");
+	}
+}
+
+void ShaderCompiler::Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		stopWorker = true;
+		queue.clear();
+	}
+	jobReady.notify_all();
+	if (worker.joinable())
+		worker.join();
+
+	if (workerContext != nullptr)
+	{
+		SDL_GL_DeleteContext(workerContext);
+		workerContext = nullptr;
+	}
+	mode = MODE_SYNCHRONOUS;
+}
+
+bool ShaderCompiler::HasExtension(const char* name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++)
+	{
+		const char* extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, (GLuint)i));
+		if (extension != NULL && strcmp(extension, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool ShaderCompiler::CreateWorkerContext()
+{
+	SDL_GLContext mainContext = SDL_GL_GetCurrentContext();
+	window = SDL_GL_GetCurrentWindow();
+	if (mainContext == nullptr || window == nullptr)
+		return false;
+
+	// creating the context makes it current, the main one is restored right after
+	SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+	workerContext = SDL_GL_CreateContext(window);
+	SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+	SDL_GL_MakeCurrent(window, mainContext);
+
+	if (workerContext == nullptr)
+	{
+		printf("Could not create the shader compile context: %s\n", SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+std::shared_ptr<ShaderCompiler::Job> ShaderCompiler::Submit(const char* vertexFilename, const char* fragmentFilename,
+	const std::string& vertexSource, const std::string& fragmentSource, bool retrievable,
+	const char* geometryFilename, const std::string& geometrySource)
+{
+	std::shared_ptr<Job> job = std::make_shared<Job>();
+	job->vertexFilename = vertexFilename;
+	job->fragmentFilename = fragmentFilename;
+	if (geometryFilename != NULL)
+		job->geometryFilename = geometryFilename;
+	job->vertexSource = vertexSource;
+	job->fragmentSource = fragmentSource;
+	job->geometrySource = geometrySource;
+	job->retrievable = retrievable;
+
+	if (mode == MODE_WORKER_CONTEXT)
+	{
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			queue.push_back(job);
+		}
+		jobReady.notify_one();
+	}
+	else
+	{
+		StartBuild(*job);
+		if (mode == MODE_SYNCHRONOUS)
+		{
+			FinishBuild(*job);
+			job->done = true;
+		}
+	}
+
+	return job;
+}
+
+bool ShaderCompiler::Poll(Job& job)
+{
+	if (job.done)
+		return true;
+
+	if (mode == MODE_PARALLEL_EXTENSION)
+	{
+		// asking for the link status before this would wait for the compile
+		GLint complete = GL_FALSE;
+		glGetProgramiv(job.program, GL_COMPLETION_STATUS_ARB, &complete);
+		if (complete == GL_TRUE)
+		{
+			FinishBuild(job);
+			job.done = true;
+		}
+	}
+
+	return job.done;
+}
+
+void ShaderCompiler::CompileWorker()
+{
+	SDL_GL_MakeCurrent(window, workerContext);
+
+	while (true)
+	{
+		std::shared_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobReady.wait(lock, [this]() { return stopWorker || !queue.empty(); });
+			if (stopWorker)
+				break;
+			job = queue.front();
+			queue.pop_front();
+		}
+
+		StartBuild(*job);
+		FinishBuild(*job);
+
+		// the main context may only use the program once this context is done with it
+		glFinish();
+		job->done = true;
+	}
+
+	SDL_GL_MakeCurrent(window, nullptr);
+}
+
+void ShaderCompiler::StartBuild(Job& job)
+{
+	const char* vertexSource = job.vertexSource.c_str();
+	const char* fragmentSource = job.fragmentSource.c_str();
+
+	GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(vs, 1, &vertexSource, NULL);
+	glCompileShader(vs);
+
+	GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(fs, 1, &fragmentSource, NULL);
+	glCompileShader(fs);
+
+	GLuint gs = 0;
+	if (!job.geometrySource.empty())
+	{
+		const char* geometrySource = job.geometrySource.c_str();
+		gs = glCreateShader(GL_GEOMETRY_SHADER);
+		glShaderSource(gs, 1, &geometrySource, NULL);
+		glCompileShader(gs);
+	}
+
+	job.program = glCreateProgram();
+	glAttachShader(job.program, vs);
+	glAttachShader(job.program, fs);
+	if (gs != 0)
+		glAttachShader(job.program, gs);
+	if (job.retrievable)
+		glProgramParameteri(job.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(job.program);
+
+	// flagged for deletion, they go away with the program
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	glDeleteShader(gs);
+}
+
+void ShaderCompiler::FinishBuild(Job& job)
+{
+	GLint link_ok = GL_FALSE;
+	glGetProgramiv(job.program, GL_LINK_STATUS, &link_ok);
+	job.linked = (link_ok == GL_TRUE);
+	if (job.linked)
+		return;
+
+	// report the stage that failed, the link log alone rarely says much
+	GLuint shaders[3] = { 0, 0, 0 };
+	GLsizei count = 0;
+	glGetAttachedShaders(job.program, 3, &count, shaders);
+	for (GLsizei i = 0; i < count; i++)
+	{
+		GLint compile_ok = GL_FALSE;
+		GLint type = 0;
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &compile_ok);
+		glGetShaderiv(shaders[i], GL_SHADER_TYPE, &type);
+		if (compile_ok == GL_FALSE)
+		{
+			const std::string& name = (type == GL_VERTEX_SHADER) ? job.vertexFilename :
+				(type == GL_GEOMETRY_SHADER) ? job.geometryFilename : job.fragmentFilename;
+			PrintLog(name.c_str(), shaders[i]);
+		}
+	}
+	PrintLog("glLinkProgram", job.program);
+}
+
+void ShaderCompiler::PrintLog(const char* name, GLuint object)
+{
+	GLint log_length = 0;
+	if (glIsShader(object))
+		glGetShaderiv(object, GL_INFO_LOG_LENGTH, &log_length);
+	else
+		glGetProgramiv(object, GL_INFO_LOG_LENGTH, &log_length);
+
+	std::vector<char> log(log_length + 1, 0);
+	if (glIsShader(object))
+		glGetShaderInfoLog(object, log_length, NULL, log.data());
+	else
+		glGetProgramInfoLog(object, log_length, NULL, log.data());
+
+	printf("%s:%s\n", name, log.data());
+}
@@ -0,0 +1,96 @@
+#ifndef SHADER_COMPILER_H
+#define SHADER_COMPILER_H
+
+#include "SDL2/SDL.h"
+#include "GLEW\glew.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Singleton that builds programs without stalling the frame.
+// With GL_KHR/ARB_parallel_shader_compile the driver compiles in the background and
+// completion is polled, otherwise a worker thread links on a context sharing objects
+// with the main one. When neither is possible the build happens inside Submit.
+class ShaderCompiler
+{
+public:
+	enum Mode
+	{
+		MODE_SYNCHRONOUS,
+		MODE_PARALLEL_EXTENSION,
+		MODE_WORKER_CONTEXT,
+	};
+
+	struct Job
+	{
+		std::string vertexFilename;
+		std::string fragmentFilename;
+		std::string geometryFilename;
+		std::string vertexSource;
+		std::string fragmentSource;
+		// empty for programs without a geometry stage
+		std::string geometrySource;
+		bool retrievable;
+
+		// owned by whoever polls the job once it is done
+		GLuint program;
+		bool linked;
+		std::atomic<bool> done;
+
+		Job() : retrievable(false), program(0), linked(false), done(false) {}
+	};
+
+	// get the static instance of the Shader Compiler
+	static ShaderCompiler& GetInstance()
+	{
+		static ShaderCompiler compiler;
+		return compiler;
+	}
+	~ShaderCompiler();
+
+	// Pick the backend, the main context has to be current
+	void Init();
+	// Stop the worker and drop the jobs it has not started
+	void Shutdown();
+	Mode GetMode() const { return mode; }
+
+	// Start building a program from preprocessed sources, the geometry stage only with a source
+	std::shared_ptr<Job> Submit(const char* vertexFilename, const char* fragmentFilename,
+		const std::string& vertexSource, const std::string& fragmentSource, bool retrievable,
+		const char* geometryFilename = NULL, const std::string& geometrySource = std::string());
+	// Whether the job finished, never blocks. A linked program is then usable on the main context
+	bool Poll(Job& job);
+
+private:
+	ShaderCompiler();
+
+	Mode mode;
+
+	// KHR has no GLEW entry, so the thread count hint is fetched by hand. Same signature as ARB
+	PFNGLMAXSHADERCOMPILERTHREADSARBPROC maxShaderCompilerThreads;
+
+	// worker context and its queue
+	SDL_Window* window;
+	SDL_GLContext workerContext;
+	std::thread worker;
+	std::mutex jobMutex;
+	std::condition_variable jobReady;
+	std::deque<std::shared_ptr<Job>> queue;
+	bool stopWorker;
+
+	bool HasExtension(const char* name);
+	bool CreateWorkerContext();
+	void CompileWorker();
+
+	// queue the compile and link, nothing here waits on the driver
+	static void StartBuild(Job& job);
+	// read the status and the logs of a build that finished
+	static void FinishBuild(Job& job);
+	static void PrintLog(const char* name, GLuint object);
+};
+
+#endif
@@ -1,6 +1,81 @@
 #include "ShaderProgram.h"
 #include "Tools.h"
+#include "GLState.h"
 #include "SDL2\SDL.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+static bool IsSamplerType(GLenum type)
+{
+	switch (type)
+	{
+		case GL_SAMPLER_2D:
+		case GL_SAMPLER_2D_SHADOW:
+		case GL_SAMPLER_2D_ARRAY:
+		case GL_SAMPLER_2D_ARRAY_SHADOW:
+		case GL_SAMPLER_3D:
+		case GL_SAMPLER_CUBE:
+		case GL_SAMPLER_CUBE_SHADOW:
+		case GL_SAMPLER_CUBE_MAP_ARRAY:
+		case GL_SAMPLER_CUBE_MAP_ARRAY_SHADOW:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static const uint64_t kHashSeed = 14695981039346656037ull;
+static const uint32_t kBinaryMagic = 0x31425050; // "PPB1"
+
+struct ProgramBinaryHeader
+{
+	uint32_t magic;
+	GLenum format;
+	uint32_t length;
+};
+
+// the #version line has to stay first
+static std::string InjectDefines(const char* source, const std::string& defines)
+{
+	std::string result(source);
+	if (defines.empty())
+		return result;
+
+	size_t insert = 0;
+	size_t version = result.find("#version");
+	if (version != std::string::npos)
+	{
+		size_t line_end = result.find('\n', version);
+		if (line_end == std::string::npos)
+		{
+			result += '\n';
+			line_end = result.size() - 1;
+		}
+		insert = line_end + 1;
+	}
+
+	result.insert(insert, defines);
+	return result;
+}
+
+// FNV-1a
+static uint64_t HashString(uint64_t hash, const char* str)
+{
+	for (; str != NULL && *str; str++)
+	{
+		hash ^= (unsigned char)*str;
+		hash *= 1099511628211ull;
+	}
+	// terminator, so moving text between the strings changes the hash
+	hash ^= 0xFF;
+	hash *= 1099511628211ull;
+	return hash;
+}
+
+std::string ShaderProgram::binaryCacheDirectory;
+int ShaderProgram::binaryCacheHits = 0;
+int ShaderProgram::binaryCacheMisses = 0;
 
 ShaderProgram::ShaderProgram()
 {
@@ -8,15 +83,24 @@ ShaderProgram::ShaderProgram()
 
 	vertexShaderFilename = NULL;
 	fragmentShaderFilename = NULL;
+	geometryShaderFilename = NULL;
 	vs = 0;
 	fs = 0;
+	gs = 0;
+	textureSlotMask = 0;
+	reloadQueued = false;
 }
 
 ShaderProgram::~ShaderProgram()
 {
 	delete[] vertexShaderFilename;
 	delete[] fragmentShaderFilename;
+	delete[] geometryShaderFilename;
 	glDeleteProgram(program);
+
+	// a build still running on the worker context is left to it, any other is ours to free
+	if (pendingBuild != nullptr && (pendingBuild->done || ShaderCompiler::GetInstance().GetMode() != ShaderCompiler::MODE_WORKER_CONTEXT))
+		glDeleteProgram(pendingBuild->program);
 }
 
 int ShaderProgram::LoadVertexShaderFromFile(const char* filename)
@@ -37,24 +121,192 @@ int ShaderProgram::LoadFragmentShaderFromFile(const char* filename)
 	return 0;
 }
 
+int ShaderProgram::LoadGeometryShaderFromFile(const char* filename)
+{
+	// copy geometry shader file path
+	char* fname = new char[strlen(filename) + 1];
+	strcpy(fname, filename);
+	geometryShaderFilename = fname;
+	return 0;
+}
+
+bool ShaderProgram::LoadSources(std::string& vertexSource, std::string& fragmentSource, std::string& geometrySource)
+{
+	char* vertex_file = Tools::LoadWholeStringFile(vertexShaderFilename);
+	char* fragment_file = Tools::LoadWholeStringFile(fragmentShaderFilename);
+	if (vertex_file == NULL || fragment_file == NULL) {
+		printf("Error opening %s\n", (vertex_file == NULL) ? vertexShaderFilename : fragmentShaderFilename);
+		delete[] vertex_file;
+		delete[] fragment_file;
+		return false;
+	}
+
+	vertexSource = InjectDefines(vertex_file, defines);
+	fragmentSource = InjectDefines(fragment_file, defines);
+	delete[] vertex_file;
+	delete[] fragment_file;
+
+	geometrySource.clear();
+	if (geometryShaderFilename != NULL)
+	{
+		char* geometry_file = Tools::LoadWholeStringFile(geometryShaderFilename);
+		if (geometry_file == NULL) {
+			printf("Error opening %s\n", geometryShaderFilename);
+			return false;
+		}
+		geometrySource = InjectDefines(geometry_file, defines);
+		delete[] geometry_file;
+	}
+	return true;
+}
+
 bool ShaderProgram::CreateProgramShader()
 {
-	glDeleteProgram(program);
+	std::string vertex_source, fragment_source, geometry_source;
+	if (!LoadSources(vertex_source, fragment_source, geometry_source))
+		return false;
+
+	// the previous program stays in use if the new one fails
+	GLuint previous = program;
 	program = glCreateProgram();
+
+	// a cached binary skips compiling, linking and validating
+	std::string cache_path;
+	bool loaded = false;
+	if (!binaryCacheDirectory.empty())
+	{
+		cache_path = BinaryCachePath(vertex_source.c_str(), fragment_source.c_str(), geometry_source.c_str());
+		loaded = LoadProgramBinary(cache_path, program);
+	}
+
+	if (!loaded)
+		binaryCacheMisses++;
+
+	if (!loaded && !LinkProgram(vertex_source.c_str(), fragment_source.c_str(), geometry_source.c_str()))
+	{
+		glDeleteProgram(program);
+		program = previous;
+		return false;
+	}
+
+	if (!cache_path.empty() && !loaded)
+		SaveProgramBinary(cache_path);
+
+	GLuint linked = program;
+	program = previous;
+	SwapProgram(linked);
+	return true;
+}
+
+void ShaderProgram::SwapProgram(GLuint linked)
+{
+	glDeleteProgram(program);
+	program = linked;
+
+	ReflectUniforms();
+	ResolveTextureSlots();
+	ApplyUniformBlocks();
+	ApplySamplerUnits();
+	for (auto& it : uniforms)
+	{
+		it.second = glGetUniformLocation(program, it.first.c_str());
+	}
+
+	// only once the samplers have their units, before that they all share unit 0. Validation also
+	// looks at the state bound right now, so a failure is reported and the program kept
+	GLint validate_ok = GL_FALSE;
+	glValidateProgram(program);
+	glGetProgramiv(program, GL_VALIDATE_STATUS, &validate_ok);
+	if (!validate_ok) {
+		printf("glValidateProgram:");
+		PrintLog(program);
+	}
+}
+
+void ShaderProgram::BeginReload()
+{
+	// one build at a time, a change during it starts another one after
+	if (pendingBuild != nullptr)
+	{
+		reloadQueued = true;
+		return;
+	}
+
+	std::string vertex_source, fragment_source, geometry_source;
+	if (!LoadSources(vertex_source, fragment_source, geometry_source))
+		return;
+
+	// sources seen before load in place of a compile
+	if (!binaryCacheDirectory.empty())
+	{
+		GLuint cached = glCreateProgram();
+		if (LoadProgramBinary(BinaryCachePath(vertex_source.c_str(), fragment_source.c_str(), geometry_source.c_str()), cached))
+		{
+			SwapProgram(cached);
+			return;
+		}
+		glDeleteProgram(cached);
+	}
+
+	binaryCacheMisses++;
+	pendingBuild = ShaderCompiler::GetInstance().Submit(vertexShaderFilename, fragmentShaderFilename,
+		vertex_source, fragment_source, !binaryCacheDirectory.empty(), geometryShaderFilename, geometry_source);
+}
+
+bool ShaderProgram::PollReload()
+{
+	if (pendingBuild == nullptr || !ShaderCompiler::GetInstance().Poll(*pendingBuild))
+		return false;
+
+	std::shared_ptr<ShaderCompiler::Job> build = pendingBuild;
+	pendingBuild.reset();
+
+	bool swapped = build->linked;
+	if (swapped)
+	{
+		SwapProgram(build->program);
+		if (!binaryCacheDirectory.empty())
+			SaveProgramBinary(BinaryCachePath(build->vertexSource.c_str(), build->fragmentSource.c_str(), build->geometrySource.c_str()));
+	}
+	else
+	{
+		printf("%s, %s: keeping the previous program\n", vertexShaderFilename, fragmentShaderFilename);
+		glDeleteProgram(build->program);
+	}
+
+	if (reloadQueued)
+	{
+		reloadQueued = false;
+		BeginReload();
+	}
+	return swapped;
+}
+
+bool ShaderProgram::LinkProgram(const char* vertexSource, const char* fragmentSource, const char* geometrySource)
+{
 	// load the VS Shader
-	if ((vs = GenerateShader(vertexShaderFilename, GL_VERTEX_SHADER)) == 0) return false;
+	if ((vs = GenerateShader(vertexShaderFilename, vertexSource, GL_VERTEX_SHADER)) == 0) return false;
 	glAttachShader(program, vs);
 	//glDeleteShader(vs);
 
 
 	// load the FS shader
-	if ((fs = GenerateShader(fragmentShaderFilename, GL_FRAGMENT_SHADER)) == 0) return false;
+	if ((fs = GenerateShader(fragmentShaderFilename, fragmentSource, GL_FRAGMENT_SHADER)) == 0) return false;
 	glAttachShader(program, fs);
 	//glDeleteShader(fs);
 
+	// load the GS shader, when there is one
+	if (geometryShaderFilename != NULL)
+	{
+		if ((gs = GenerateShader(geometryShaderFilename, geometrySource, GL_GEOMETRY_SHADER)) == 0) return false;
+		glAttachShader(program, gs);
+	}
+
+	if (!binaryCacheDirectory.empty())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	// link them
 	GLint link_ok = GL_FALSE;
-	GLint validate_ok = GL_FALSE;
 	glLinkProgram(program);
 	glGetProgramiv(program, GL_LINK_STATUS, &link_ok);
 	if (!link_ok) {
@@ -62,20 +314,17 @@ bool ShaderProgram::CreateProgramShader()
 		PrintLog(program);
 		return false;
 	}
-	glValidateProgram(program);
-	glGetProgramiv(program, GL_VALIDATE_STATUS, &validate_ok);
-	if (!validate_ok) {
-		printf("glValidateProgram:");
-		PrintLog(program);
-		return false;
-	}
 	return true;
 }
 
 bool ShaderProgram::CreateProgram()
 {
-	// if fail, show text message and redo
-	SDL_assert_release(CreateProgramShader());
+	// a broken shader is reported and leaves the program empty, it does not stop the app
+	if (!CreateProgramShader())
+	{
+		printf("Could not create the program of %s and %s\n", vertexShaderFilename, fragmentShaderFilename);
+		return false;
+	}
 	return true;
 }
 
@@ -87,22 +336,22 @@ GLenum ShaderProgram::LoadUniform(std::string uniform)
 
 bool ShaderProgram::ReloadProgram()
 {
-	SDL_assert_release(CreateProgramShader());
-	for (auto& it : uniforms)
+	if (!CreateProgramShader())
 	{
-		it.second = glGetUniformLocation(program, it.first.c_str());
+		printf("%s, %s: keeping the previous program\n", vertexShaderFilename, fragmentShaderFilename);
+		return false;
 	}
 	return true;
 }
 
 void ShaderProgram::Bind()
 {
-	glUseProgram(program);
+	GLState::GetInstance().UseProgram(program);
 }
 
 void ShaderProgram::Unbind()
 {
-	glUseProgram(0);
+	GLState::GetInstance().UseProgram(0);
 }
 
 void ShaderProgram::PrintLog(GLuint object)
@@ -129,19 +378,11 @@ void ShaderProgram::PrintLog(GLuint object)
 	delete[] log;
 }
 
-GLuint ShaderProgram::GenerateShader(const char* filename, GLenum shaderType)
+GLuint ShaderProgram::GenerateShader(const char* filename, const char* source, GLenum shaderType)
 {
-	const char* source = Tools::LoadWholeStringFile(filename);
-	if (source == NULL) {
-		printf("Error opening %s: ", filename);
-		delete[] source;
-		return 0;
-	}
-	
 	GLuint res = glCreateShader(shaderType);
 
 	glShaderSource(res, 1, &source, NULL);
-	delete[] source;
 
 	glCompileShader(res);
 	GLint compile_ok = GL_FALSE;
@@ -156,6 +397,236 @@ GLuint ShaderProgram::GenerateShader(const char* filename, GLenum shaderType)
 	return res;
 }
 
+bool ShaderProgram::EnableBinaryCache(const char* directory)
+{
+	GLint formats = 0;
+	if (GLEW_ARB_get_program_binary)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+	if (formats == 0)
+	{
+		printf("Program binary cache disabled: the driver has no program binary formats\n");
+		return false;
+	}
+
+	if (!Tools::MakeDirectory(directory))
+	{
+		printf("Program binary cache disabled: could not create %s\n", directory);
+		return false;
+	}
+
+	binaryCacheDirectory = directory;
+	return true;
+}
+
+void ShaderProgram::DisableBinaryCache()
+{
+	binaryCacheDirectory.clear();
+}
+
+void ShaderProgram::GetBinaryCacheStatistics(int& hits, int& misses)
+{
+	hits = binaryCacheHits;
+	misses = binaryCacheMisses;
+}
+
+std::string ShaderProgram::BinaryCachePath(const char* vertexSource, const char* fragmentSource, const char* geometrySource)
+{
+	// a driver update changes the version string and with it the key
+	uint64_t hash = kHashSeed;
+	hash = HashString(hash, reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+	hash = HashString(hash, reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+	hash = HashString(hash, reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+	hash = HashString(hash, vertexSource);
+	hash = HashString(hash, fragmentSource);
+	// left out without the stage, so the keys of the other programs stay the same
+	if (geometrySource != NULL && *geometrySource)
+		hash = HashString(hash, geometrySource);
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+	return binaryCacheDirectory + "/" + name;
+}
+
+bool ShaderProgram::LoadProgramBinary(const std::string& path, GLuint& target)
+{
+	std::vector<unsigned char> file;
+	ProgramBinaryHeader header;
+	if (!Tools::LoadWholeBinaryFile(path.c_str(), file) || file.size() < sizeof(header))
+		return false;
+
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != kBinaryMagic || header.length != file.size() - sizeof(header))
+		return false;
+
+	// the driver may still refuse it, then compile as if there was no cache and overwrite the file
+	glProgramBinary(target, header.format, file.data() + sizeof(header), header.length);
+	GLint link_ok = GL_FALSE;
+	glGetProgramiv(target, GL_LINK_STATUS, &link_ok);
+	if (!link_ok)
+	{
+		printf("Program binary %s rejected, recompiling\n", path.c_str());
+		glDeleteProgram(target);
+		target = glCreateProgram();
+		return false;
+	}
+
+	binaryCacheHits++;
+	return true;
+}
+
+void ShaderProgram::SaveProgramBinary(const std::string& path)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<unsigned char> file(sizeof(ProgramBinaryHeader) + length);
+	ProgramBinaryHeader header;
+	header.magic = kBinaryMagic;
+	glGetProgramBinary(program, length, NULL, &header.format, file.data() + sizeof(header));
+	header.length = (uint32_t)length;
+	memcpy(file.data(), &header, sizeof(header));
+
+	FILE* out = fopen(path.c_str(), "wb");
+	if (out == NULL)
+		return;
+	fwrite(file.data(), 1, file.size(), out);
+	fclose(out);
+}
+
+void ShaderProgram::DeclareTextureSlot(int slot, const char* sampler)
+{
+	textureSlots.push_back({ slot, sampler });
+	if (program != 0) ResolveTextureSlots();
+}
+
+bool ShaderProgram::UsesTextureSlot(int slot) const
+{
+	return (textureSlotMask & (1u << slot)) != 0;
+}
+
+void ShaderProgram::ResolveTextureSlots()
+{
+	// the linker drops unused samplers, so an inactive uniform means the slot is never read
+	textureSlotMask = 0;
+	for (auto& slot : textureSlots)
+	{
+		if (activeUniforms.find(slot.second) != activeUniforms.end())
+			textureSlotMask |= (1u << slot.first);
+	}
+}
+
+void ShaderProgram::BindUniformBlock(const char* block, GLuint binding)
+{
+	uniformBlocks.push_back({ block, binding });
+	if (program != 0) ApplyUniformBlocks();
+}
+
+void ShaderProgram::ApplyUniformBlocks()
+{
+	for (auto& block : uniformBlocks)
+	{
+		GLuint index = glGetUniformBlockIndex(program, block.first.c_str());
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, block.second);
+	}
+}
+
+void ShaderProgram::BindSampler(const char* sampler, int unit)
+{
+	samplerUnits.push_back({ sampler, unit });
+	if (program != 0) ApplySamplerUnits();
+}
+
+void ShaderProgram::ApplySamplerUnits()
+{
+	if (samplerUnits.empty())
+		return;
+
+	GLuint current = GLState::GetInstance().GetProgram();
+	GLState::GetInstance().UseProgram(program);
+	for (auto& sampler : samplerUnits)
+	{
+		glUniform1i(glGetUniformLocation(program, sampler.first.c_str()), sampler.second);
+	}
+	GLState::GetInstance().UseProgram(current);
+}
+
+void ShaderProgram::SetDefines(const std::string& defines)
+{
+	this->defines = defines;
+}
+
+void ShaderProgram::ReflectUniforms()
+{
+	activeUniforms.clear();
+
+	GLint count = 0;
+	GLint max_length = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+
+	std::vector<char> name(max_length + 1);
+	for (GLint i = 0; i < count; i++)
+	{
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(program, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, name.data());
+
+		// arrays are reported as "name[0]"
+		std::string key(name.data(), length);
+		if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+			key.resize(key.size() - 3);
+
+		// members of uniform blocks have no location
+		GLint location = glGetUniformLocation(program, name.data());
+		if (location != -1)
+			activeUniforms[key] = { location, type };
+	}
+
+	for (size_t i = 0; i < handleUniforms.size(); i++)
+	{
+		handleLocations[i] = LocateUniform(handleUniforms[i].first, handleUniforms[i].second);
+	}
+}
+
+int ShaderProgram::ResolveUniform(const char* name, GLenum type)
+{
+	for (size_t i = 0; i < handleUniforms.size(); i++)
+	{
+		if (handleUniforms[i].first.compare(name) == 0 && handleUniforms[i].second == type)
+			return (int)i;
+	}
+
+	handleUniforms.push_back({ name, type });
+	handleLocations.push_back(LocateUniform(name, type));
+	return (int)handleUniforms.size() - 1;
+}
+
+GLint ShaderProgram::LocateUniform(const std::string& name, GLenum type)
+{
+	auto it = activeUniforms.find(name);
+	if (it == activeUniforms.end())
+		return -1; // optimized out, or not in this program
+
+	GLenum active = it->second.type;
+	bool matches = (active == type);
+
+	// glUniform1i also sets bools and samplers
+	if (!matches && type == GL_INT)
+		matches = (active == GL_BOOL) || IsSamplerType(active);
+
+	if (!matches)
+	{
+		printf("Uniform %s: handle type 0x%x does not match the shader type 0x%x\n", name.c_str(), type, active);
+		return -1;
+	}
+	return it->second.location;
+}
+
 GLint ShaderProgram::operator[](const std::string key)
 {
 	auto it = uniforms.find(key);
@@ -193,4 +664,171 @@ void ShaderProgram::loadMat4(const std::string& pKey, const glm::mat4 & pValue)
 {
 	glUniformMatrix4fv((*this)[pKey], 1, GL_FALSE,
 		glm::value_ptr(pValue));
-}
\ No newline at end of file
+}
+
+// Variants
+ShaderVariants::ShaderVariants()
+{
+
+}
+
+ShaderVariants::~ShaderVariants()
+{
+	for (auto& variant : variants)
+		delete variant.second;
+	variants.clear();
+}
+
+void ShaderVariants::Init(const char* vertexFilename, const char* fragmentFilename, const std::vector<std::string>& features)
+{
+	this->vertexFilename = vertexFilename;
+	this->fragmentFilename = fragmentFilename;
+	this->features = features;
+}
+
+unsigned int ShaderVariants::FeatureBit(const char* feature) const
+{
+	for (size_t i = 0; i < features.size(); i++)
+	{
+		if (features[i].compare(feature) == 0)
+			return 1u << i;
+	}
+	return 0;
+}
+
+void ShaderVariants::DeclareTextureSlot(int slot, const char* sampler)
+{
+	textureSlots.push_back({ slot, sampler });
+	for (auto& variant : variants)
+		variant.second->DeclareTextureSlot(slot, sampler);
+}
+
+void ShaderVariants::BindUniformBlock(const char* block, GLuint binding)
+{
+	uniformBlocks.push_back({ block, binding });
+	for (auto& variant : variants)
+		variant.second->BindUniformBlock(block, binding);
+}
+
+void ShaderVariants::BindSampler(const char* sampler, int unit)
+{
+	samplerUnits.push_back({ sampler, unit });
+	for (auto& variant : variants)
+		variant.second->BindSampler(sampler, unit);
+}
+
+int ShaderVariants::ResolveUniform(const char* name, GLenum type)
+{
+	for (size_t i = 0; i < uniforms.size(); i++)
+	{
+		if (uniforms[i].first.compare(name) == 0 && uniforms[i].second == type)
+			return (int)i;
+	}
+
+	uniforms.push_back({ name, type });
+	for (auto& variant : variants)
+		variant.second->ResolveUniform(name, type);
+	return (int)uniforms.size() - 1;
+}
+
+ShaderProgram& ShaderVariants::Get(unsigned int mask)
+{
+	auto it = variants.find(mask);
+	if (it != variants.end())
+		return *it->second;
+
+	std::string defines;
+	for (size_t i = 0; i < features.size(); i++)
+	{
+		if (mask & (1u << i))
+			defines += "#define " + features[i] + "\n";
+	}
+
+	ShaderProgram* variant = new ShaderProgram();
+	variant->LoadVertexShaderFromFile(vertexFilename.c_str());
+	variant->LoadFragmentShaderFromFile(fragmentFilename.c_str());
+	variant->SetDefines(defines);
+	for (auto& slot : textureSlots)
+		variant->DeclareTextureSlot(slot.first, slot.second.c_str());
+	for (auto& block : uniformBlocks)
+		variant->BindUniformBlock(block.first.c_str(), block.second);
+	for (auto& sampler : samplerUnits)
+		variant->BindSampler(sampler.first.c_str(), sampler.second);
+	variant->CreateProgram();
+
+	// same order as on the other variants, so the handle indices match
+	for (auto& uniform : uniforms)
+		variant->ResolveUniform(uniform.first.c_str(), uniform.second);
+
+	variants[mask] = variant;
+	return *variant;
+}
+
+int ShaderVariants::Precompile(const char* manifest)
+{
+	char* text = Tools::LoadWholeStringFile(manifest);
+	if (text == NULL)
+	{
+		printf("Could not open the shader variant manifest %s\n", manifest);
+		return 0;
+	}
+
+	int compiled = 0;
+	char* line = strtok(text, "\r\n");
+	while (line != NULL)
+	{
+		std::string entry(line);
+		line = strtok(NULL, "\r\n");
+
+		// feature names separated by spaces, # starts a comment
+		entry = entry.substr(0, entry.find('#'));
+		unsigned int mask = 0;
+		bool empty = true;
+		size_t start = entry.find_first_not_of(" \t");
+		while (start != std::string::npos)
+		{
+			size_t end = entry.find_first_of(" \t", start);
+			std::string feature = entry.substr(start, end - start);
+			unsigned int bit = FeatureBit(feature.c_str());
+			if (bit == 0)
+				printf("%s: unknown shader feature %s\n", manifest, feature.c_str());
+			mask |= bit;
+			empty = false;
+			start = entry.find_first_not_of(" \t", end);
+		}
+
+		if (!empty && variants.find(mask) == variants.end())
+		{
+			Get(mask);
+			compiled++;
+		}
+	}
+
+	delete[] text;
+	return compiled;
+}
+
+bool ShaderVariants::Reload()
+{
+	bool reloaded = true;
+	for (auto& variant : variants)
+		reloaded = variant.second->ReloadProgram() && reloaded;
+	return reloaded;
+}
+
+void ShaderVariants::BeginReload()
+{
+	for (auto& variant : variants)
+		variant.second->BeginReload();
+}
+
+int ShaderVariants::PollReload()
+{
+	int swapped = 0;
+	for (auto& variant : variants)
+	{
+		if (variant.second->PollReload())
+			swapped++;
+	}
+	return swapped;
+}
@@ -4,41 +4,130 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <memory>
 #include "GLEW\glew.h"
+#include "ShaderCompiler.h"
 #include "glm/gtc/type_ptr.hpp"
 
+// GL type a typed uniform handle expects
+template <typename T> struct UniformTypeOf;
+template <> struct UniformTypeOf<int> { static const GLenum value = GL_INT; };
+template <> struct UniformTypeOf<float> { static const GLenum value = GL_FLOAT; };
+template <> struct UniformTypeOf<glm::vec2> { static const GLenum value = GL_FLOAT_VEC2; };
+template <> struct UniformTypeOf<glm::vec3> { static const GLenum value = GL_FLOAT_VEC3; };
+template <> struct UniformTypeOf<glm::vec4> { static const GLenum value = GL_FLOAT_VEC4; };
+template <> struct UniformTypeOf<glm::mat4> { static const GLenum value = GL_FLOAT_MAT4; };
+
 class ShaderProgram
 {
+	friend class ShaderVariants;
+
 	// filepaths of the shaders
 	const char* vertexShaderFilename;
 	const char* fragmentShaderFilename;
+	// NULL for programs without a geometry stage
+	const char* geometryShaderFilename;
 	
 	// program and shaders
 	GLuint program;
-	GLuint vs, fs;
+	GLuint vs, fs, gs;
 
 	// hash map with uniform indices
 	std::unordered_map<std::string, GLint> uniforms;
 
+	// active uniforms of the linked program, reflected once after linking
+	struct ActiveUniform
+	{
+		GLint location;
+		GLenum type;
+	};
+	std::unordered_map<std::string, ActiveUniform> activeUniforms;
+
+	// typed handles index these, the locations are refreshed after every link
+	std::vector<std::pair<std::string, GLenum>> handleUniforms;
+	std::vector<GLint> handleLocations;
+
+	// declared texture slots with their sampler, and the ones the linked program samples
+	std::vector<std::pair<int, std::string>> textureSlots;
+	unsigned int textureSlotMask;
+
+	// uniform blocks and the binding points they read from
+	std::vector<std::pair<std::string, GLuint>> uniformBlocks;
+
+	// samplers and their fixed texture units
+	std::vector<std::pair<std::string, int>> samplerUnits;
+
+	// #define lines injected after the #version line of both stages
+	std::string defines;
+
+	// rebuild in flight, the current program keeps rendering until it links
+	std::shared_ptr<ShaderCompiler::Job> pendingBuild;
+	bool reloadQueued;
+
+	// program binaries on disk, keyed by the sources and the driver
+	static std::string binaryCacheDirectory;
+	static int binaryCacheHits;
+	static int binaryCacheMisses;
+
 public:
+	// Typed handle to a uniform, stays valid across ReloadProgram
+	template <typename T>
+	struct Uniform
+	{
+		int index = -1;
+	};
+
 	ShaderProgram();
 	~ShaderProgram();
 
 	// Load Vertex and Fragment shader
 	int LoadVertexShaderFromFile(const char* filename);
 	int LoadFragmentShaderFromFile(const char* filename);
+	// Optional geometry stage between the two
+	int LoadGeometryShaderFromFile(const char* filename);
 	
 	// Create the program using the provided vertex and fragment shader
 	bool CreateProgram();
 
-	// Delete and reload shaders
+	// Delete and reload shaders, the previous program stays if the new one fails
 	bool ReloadProgram();
 
+	// Rebuild from the files without waiting, the program keeps its previous build until then
+	void BeginReload();
+	// Swap in the rebuilt program once it linked, true when a swap happened. Call once per frame
+	bool PollReload();
+	bool IsReloading() const { return pendingBuild != nullptr; }
+
+	// Keep linked programs in a directory and load them instead of compiling, needs GL_ARB_get_program_binary
+	static bool EnableBinaryCache(const char* directory);
+	static void DisableBinaryCache();
+	// programs loaded from the cache and programs that had to be compiled
+	static void GetBinaryCacheStatistics(int& hits, int& misses);
+
 	void loadVec3(const std::string& pKey, const glm::vec3& pValue);
 	void loadInt(const std::string& pKey, const int pValue);
 	void loadMat4(const std::string& pKey, const glm::mat4& pValue);
 	void loadFloat(const std::string& pKey, const float pValue);
 
+	// Resolve a uniform once, uploads through the handle skip the name lookup.
+	// Uniforms the linker dropped get a handle whose uploads do nothing
+	template <typename T>
+	Uniform<T> GetUniform(const char* name)
+	{
+		Uniform<T> uniform;
+		uniform.index = ResolveUniform(name, UniformTypeOf<T>::value);
+		return uniform;
+	}
+
+	void Set(Uniform<int> uniform, const int value) { glUniform1i(HandleLocation(uniform.index), value); }
+	void Set(Uniform<float> uniform, const float value) { glUniform1f(HandleLocation(uniform.index), value); }
+	void Set(Uniform<glm::vec2> uniform, const glm::vec2& value) { glUniform2f(HandleLocation(uniform.index), value.x, value.y); }
+	void Set(Uniform<glm::vec3> uniform, const glm::vec3& value) { glUniform3f(HandleLocation(uniform.index), value.x, value.y, value.z); }
+	void Set(Uniform<glm::vec4> uniform, const glm::vec4& value) { glUniform4f(HandleLocation(uniform.index), value.x, value.y, value.z, value.w); }
+	void Set(Uniform<glm::mat4> uniform, const glm::mat4& value) { glUniformMatrix4fv(HandleLocation(uniform.index), 1, GL_FALSE, glm::value_ptr(value)); }
+	// count elements of an array uniform, the handle is resolved by the name without [0]
+	void Set(Uniform<glm::mat4> uniform, const glm::mat4* values, GLsizei count) { glUniformMatrix4fv(HandleLocation(uniform.index), count, GL_FALSE, glm::value_ptr(values[0])); }
+
 	// Bind the program to use
 	void Bind();
 	// Unbind the program
@@ -46,6 +135,19 @@ public:
 	// Load the index of the uniform
 	GLenum LoadUniform(const std::string uniform);
 
+	// Declare the sampler through which the shader reads a material texture slot
+	void DeclareTextureSlot(int slot, const char* sampler);
+	// Whether the linked program actually samples the slot
+	bool UsesTextureSlot(int slot) const;
+
+	// Read a uniform block from a buffer binding point, kept across reloads
+	void BindUniformBlock(const char* block, GLuint binding);
+	// Point a sampler at a fixed texture unit, kept across reloads
+	void BindSampler(const char* sampler, int unit);
+
+	// Compile with these #defines, takes effect on the next CreateProgram or ReloadProgram
+	void SetDefines(const std::string& defines);
+
 	// Access the index of the uniform
 	GLint operator[](const std::string key);
 	GLint GetIndex(const std::string key);
@@ -53,11 +155,93 @@ public:
 private:
 	// Create the shader
 	bool CreateProgramShader();
+	// Read the stages from their files with the defines injected, geometrySource stays empty without that stage
+	bool LoadSources(std::string& vertexSource, std::string& fragmentSource, std::string& geometrySource);
+	// Replace the program with a linked one and refresh everything read from it
+	void SwapProgram(GLuint linked);
+	// Compile and link from the sources
+	bool LinkProgram(const char* vertexSource, const char* fragmentSource, const char* geometrySource);
+
+	// Binary cache file of the sources on this driver
+	std::string BinaryCachePath(const char* vertexSource, const char* fragmentSource, const char* geometrySource);
+	bool LoadProgramBinary(const std::string& path, GLuint& target);
+	void SaveProgramBinary(const std::string& path);
 
-	// Load the shader from the disk
-	GLuint GenerateShader(const char* filename, GLenum shaderType);
+	// Find which declared texture slots are active after linking
+	void ResolveTextureSlots();
+
+	// Assign the declared uniform blocks and samplers to their binding points after linking
+	void ApplyUniformBlocks();
+	void ApplySamplerUnits();
+
+	// Read the active uniforms of the linked program and refresh the handle locations
+	void ReflectUniforms();
+	int ResolveUniform(const char* name, GLenum type);
+	GLint LocateUniform(const std::string& name, GLenum type);
+	GLint HandleLocation(int index) const { return (index >= 0) ? handleLocations[index] : -1; }
+
+	// Compile one shader stage
+	GLuint GenerateShader(const char* filename, const char* source, GLenum shaderType);
 	// print the log when something goes wrong
 	void PrintLog(GLuint object);
 };
 
+// Permutations of one vertex/fragment pair. Every feature is a bit of the variant mask
+// and compiles as "#define <FEATURE>". Variants are built the first time they are asked for,
+// or ahead of time from a manifest, and settings and handles apply to all of them alike.
+class ShaderVariants
+{
+public:
+	ShaderVariants();
+	~ShaderVariants();
+
+	void Init(const char* vertexFilename, const char* fragmentFilename, const std::vector<std::string>& features);
+
+	// Bit of a feature in the variant mask, 0 for an unknown feature
+	unsigned int FeatureBit(const char* feature) const;
+
+	void DeclareTextureSlot(int slot, const char* sampler);
+	void BindUniformBlock(const char* block, GLuint binding);
+	void BindSampler(const char* sampler, int unit);
+
+	// Handle valid on every variant, each one resolves the same uniforms in the same order
+	template <typename T>
+	ShaderProgram::Uniform<T> GetUniform(const char* name)
+	{
+		ShaderProgram::Uniform<T> uniform;
+		uniform.index = ResolveUniform(name, UniformTypeOf<T>::value);
+		return uniform;
+	}
+
+	// Variant with the given feature bits, compiled on first use
+	ShaderProgram& Get(unsigned int mask);
+	// Compile the variants a manifest lists, one per line as feature names
+	int Precompile(const char* manifest);
+	// Recompile every variant built so far
+	bool Reload();
+	// Rebuild every variant in the background, PollReload swaps them in as they link
+	void BeginReload();
+	int PollReload();
+
+	size_t GetVariantCount() const { return variants.size(); }
+
+private:
+	ShaderVariants(const ShaderVariants&);
+	void operator=(const ShaderVariants&);
+
+	std::string vertexFilename;
+	std::string fragmentFilename;
+	std::vector<std::string> features;
+
+	// replayed on every new variant
+	std::vector<std::pair<int, std::string>> textureSlots;
+	std::vector<std::pair<std::string, GLuint>> uniformBlocks;
+	std::vector<std::pair<std::string, int>> samplerUnits;
+	std::vector<std::pair<std::string, GLenum>> uniforms;
+
+	std::unordered_map<unsigned int, ShaderProgram*> variants;
+
+	int ResolveUniform(const char* name, GLenum type);
+};
+
 #endif
@@ -0,0 +1,146 @@
+#include "ShadowAtlas.h"
+#include "GLState.h"
+#include "Tools.h"
+
+ShadowAtlas::ShadowAtlas()
+{
+	resolution = 0;
+	minTile = 0;
+	usedTexels = 0;
+	texture = 0;
+	fbo = 0;
+}
+
+ShadowAtlas::~ShadowAtlas()
+{
+	Destroy();
+}
+
+bool ShadowAtlas::Init(int resolution, int minTile)
+{
+	Destroy();
+	this->resolution = resolution;
+	this->minTile = minTile;
+	nodes.push_back({ 0, 0, resolution, -1, -1, NODE_FREE });
+
+	glGenTextures(1, &texture);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, resolution, resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	// one tap is the bilinear pcf of the four nearest texels, the shader keeps taps inside their tile
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &fbo);
+	GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+
+	GLenum status = Tools::CheckFramebufferStatus(fbo);
+	GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
+	return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void ShadowAtlas::Destroy()
+{
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &texture);
+	fbo = 0;
+	texture = 0;
+	nodes.clear();
+	usedTexels = 0;
+}
+
+bool ShadowAtlas::Allocate(int size, Tile& tile)
+{
+	tile = { 0, 0, 0, -1 };
+	if (nodes.empty())
+		return false;
+
+	int rounded = minTile;
+	while (rounded < size)
+		rounded *= 2;
+	if (rounded > resolution)
+		return false;
+
+	// a free tile of the size first, so larger ones are only split when none is left
+	int node = Find(0, rounded, false);
+	if (node < 0)
+		node = Find(0, rounded, true);
+	if (node < 0)
+		return false;
+
+	nodes[node].state = NODE_USED;
+	usedTexels += (size_t)rounded * rounded;
+	tile = { nodes[node].x, nodes[node].y, rounded, node };
+	return true;
+}
+
+void ShadowAtlas::Free(Tile& tile)
+{
+	int node = tile.node;
+	tile = { 0, 0, 0, -1 };
+	if (node < 0 || node >= (int)nodes.size() || nodes[node].state != NODE_USED)
+		return;
+
+	nodes[node].state = NODE_FREE;
+	usedTexels -= (size_t)nodes[node].size * nodes[node].size;
+
+	// merge up while all four siblings are free
+	int parent = nodes[node].parent;
+	while (parent >= 0)
+	{
+		int first = nodes[parent].children;
+		bool merge = true;
+		for (int i = 0; i < 4; i++)
+			merge = merge && nodes[first + i].state == NODE_FREE;
+		if (!merge)
+			break;
+		nodes[parent].state = NODE_FREE;
+		parent = nodes[parent].parent;
+	}
+}
+
+int ShadowAtlas::Find(int node, int size, bool split)
+{
+	if (nodes[node].size < size || nodes[node].state == NODE_USED)
+		return -1;
+
+	if (nodes[node].state == NODE_FREE)
+	{
+		if (nodes[node].size == size)
+			return node;
+		if (!split)
+			return -1;
+		Split(node);
+	}
+
+	int first = nodes[node].children;
+	for (int i = 0; i < 4; i++)
+	{
+		int found = Find(first + i, size, split);
+		if (found >= 0)
+			return found;
+	}
+	return -1;
+}
+
+void ShadowAtlas::Split(int node)
+{
+	// a merged node keeps its children, they are all free again
+	if (nodes[node].children < 0)
+	{
+		int half = nodes[node].size / 2;
+		int x = nodes[node].x;
+		int y = nodes[node].y;
+		nodes[node].children = (int)nodes.size();
+		for (int i = 0; i < 4; i++)
+			nodes.push_back({ x + (i & 1) * half, y + (i >> 1) * half, half, node, -1, NODE_FREE });
+	}
+	nodes[node].state = NODE_SPLIT;
+}
@@ -0,0 +1,68 @@
+#ifndef SHADOW_ATLAS_H
+#define SHADOW_ATLAS_H
+
+#include "GLEW\glew.h"
+#include <vector>
+
+// One depth texture holding the shadow maps of many lights, each a square tile of it.
+// Tiles are power of two sizes cut from a quadtree: a free tile is split in four until one
+// has the size asked for, and a tile whose three siblings are free merges back with them.
+// The texture compares against the reference depth, it is sampled as a sampler2DShadow
+class ShadowAtlas
+{
+public:
+	struct Tile
+	{
+		int x;
+		int y;
+		int size;
+		// quadtree node, -1 for no tile
+		int node;
+	};
+
+	ShadowAtlas();
+	~ShadowAtlas();
+
+	// resolution and minTile powers of two
+	bool Init(int resolution, int minTile);
+	void Destroy();
+
+	// false when no tile of size is free, size is rounded up to a power of two of at least the minimum
+	bool Allocate(int size, Tile& tile);
+	// back to the free ones, tile becomes no tile
+	void Free(Tile& tile);
+	// the texels held by tiles
+	size_t GetUsedTexels() const { return usedTexels; }
+
+	int GetResolution() const { return resolution; }
+	int GetMinTile() const { return minTile; }
+	GLuint GetTexture() const { return texture; }
+	GLuint GetFBO() const { return fbo; }
+
+private:
+	enum NodeState { NODE_FREE, NODE_SPLIT, NODE_USED };
+
+	struct Node
+	{
+		int x;
+		int y;
+		int size;
+		int parent;
+		// the four children are next to each other, -1 before the node was first split
+		int children;
+		NodeState state;
+	};
+
+	std::vector<Node> nodes;
+	int resolution;
+	int minTile;
+	size_t usedTexels;
+	GLuint texture;
+	GLuint fbo;
+
+	// a free node of size below node, splitting larger free ones only with split
+	int Find(int node, int size, bool split);
+	void Split(int node);
+};
+
+#endif
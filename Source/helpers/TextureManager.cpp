@@ -1,26 +1,144 @@
 #include "TextureManager.h"
+#include "Tools.h"
+#include "GLState.h"
+#include "JobSystem.h"
 #include <algorithm>
 #include "SDL2/SDL_image.h"
 #include <iostream>
+#include <cmath>
+#include <chrono>
+
+// mips at or below this size never leave the GPU
+static const int kStreamingFloorSize = 64;
+
+static int MipDimension(int size, int level)
+{
+	return std::max(1, size >> level);
+}
+
+static int MipCount(int width, int height)
+{
+	int levels = 1;
+	while ((std::max(width, height) >> levels) > 0) levels++;
+	return levels;
+}
+
+// finest level the texture is created with
+static int StreamingFloor(int width, int height)
+{
+	int level = MipCount(width, height) - 1;
+	while (level > 0 && std::max(MipDimension(width, level - 1), MipDimension(height, level - 1)) <= kStreamingFloorSize)
+	{
+		level--;
+	}
+	return level;
+}
+
+// 2x2 box filter of the previous level
+static std::vector<unsigned char> DownsampleMip(const std::vector<unsigned char>& src, int width, int height, int bpp)
+{
+	int w = MipDimension(width, 1);
+	int h = MipDimension(height, 1);
+	std::vector<unsigned char> dst(w * h * bpp);
+
+	for (int y = 0; y < h; y++)
+	{
+		int y0 = std::min(y * 2, height - 1);
+		int y1 = std::min(y * 2 + 1, height - 1);
+		for (int x = 0; x < w; x++)
+		{
+			int x0 = std::min(x * 2, width - 1);
+			int x1 = std::min(x * 2 + 1, width - 1);
+			for (int c = 0; c < bpp; c++)
+			{
+				int sum = src[(y0 * width + x0) * bpp + c] + src[(y0 * width + x1) * bpp + c] +
+					src[(y1 * width + x0) * bpp + c] + src[(y1 * width + x1) * bpp + c];
+				dst[(y * w + x) * bpp + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+
+	return dst;
+}
 
 // Texture
 TextureManager::TextureManager()
 {
-
+	streaming = false;
+	budgetBytes = 0;
+	residentBytes = 0;
+	uploadsPerFrame = 0;
+	frame = 0;
+	textureArrays = false;
+	maxArrayLayers = 0;
+	bindsIssued = 0;
+	bindsSaved = 0;
+	asyncUploads = false;
+	jobDecodes = false;
+	decodesRunning = 0;
+	asyncUploadsPerFrame = 0;
+	stopWorkers = false;
+	jobsInFlight = 0;
+	frameUploadMs = 0.0;
+	lastFrameUploadMs = 0.0;
+	maxFrameUploadMs = 0.0;
+	builtinPNG = false;
 }
 
 TextureManager::~TextureManager()
 {
+	// stop the decode workers, the GL context is gone by now so the ring is left alone
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		stopWorkers = true;
+	}
+	jobReady.notify_all();
+	ring.Shutdown();
+	for (auto& worker : workers)
+		worker.join();
+	workers.clear();
+	while (decodesRunning > 0)
+		std::this_thread::yield();
+	for (auto& upload : streamUploads)
+	{
+		while (!upload->copied)
+			std::this_thread::yield();
+	}
+	streamUploads.clear();
+
+	for (auto job : decodeQueue) delete job;
+	for (auto job : uploadQueue) delete job;
+
 	// delete textures
 	for (int i = 0; i < textures.size(); i++)
 		glDeleteTextures(1, &textures[i].textureID);
 	textures.clear();
+
+	for (int i = 0; i < pools.size(); i++)
+		glDeleteTextures(1, &pools[i].arrayID);
+	pools.clear();
 }
 
 void TextureManager::Clear()
 {
-	std::for_each(textures.begin(), textures.end(), [](TextureContainer container) { glDeleteTextures(1, &container.textureID); });
+	// the workers write into textures entries, let them finish first
+	while (jobsInFlight > 0)
+	{
+		ProcessUploads();
+		std::this_thread::yield();
+	}
+	// so do the copies of streamed mips
+	finishStreams(true);
+
+	std::for_each(textures.begin(), textures.end(), [](TextureContainer& container) { glDeleteTextures(1, &container.textureID); });
 	textures.clear();
+	textureIndices.clear();
+	std::for_each(pools.begin(), pools.end(), [](TexturePool& pool) { glDeleteTextures(1, &pool.arrayID); });
+	pools.clear();
+	// deleted names come back from glGenTextures, the cached bindings would match them
+	GLState::GetInstance().Invalidate();
+	pendingStreams.clear();
+	residentBytes = 0;
 }
 
 int TextureManager::findTexture(const char* filename, bool hasMipmaps)
@@ -35,31 +153,25 @@ int TextureManager::findTexture(const char* filename, bool hasMipmaps)
 	return -1;
 }
 
-GLuint TextureManager::RequestTexture(const char* filename, bool hasMipmaps)
+int TextureManager::findTextureByID(GLuint textureID)
 {
-	// first check if we can find it in the manager
-	//int index = findTexture(filename, hasMipmaps);
-
-	//if (index != -1)
-	//	return textures[index].textureID;
+	auto it = textureIndices.find(textureID);
+	return (it != textureIndices.end()) ? it->second : -1;
+}
 
+SDL_Surface* TextureManager::decodeSurface(const char* filename, TextureContainer& container)
+{
 	// load the texture
 	SDL_Surface* surf = IMG_Load(filename);
 	if (surf == 0)
 	{
 		printf("Could not Load texture %s\n", filename);
 		printf("SDL load Error %s\n", SDL_GetError());
-		return 0; // error
+		return nullptr; // error
 	}
-	
-	TextureContainer container;
-	container.filename = filename;
-	container.hasMipmaps = hasMipmaps;
+
 	GLenum texture_format;
-	GLenum internal_texture_format;
 	GLint nOfColors;
-	glGenTextures(1, &container.textureID);
-	glBindTexture(GL_TEXTURE_2D, container.textureID);
 	nOfColors = surf->format->BytesPerPixel;
 
 	switch (surf->format->BytesPerPixel)
@@ -79,8 +191,47 @@ GLuint TextureManager::RequestTexture(const char* filename, bool hasMipmaps)
 			printf("Error in number of colors at %s\n", filename);
 	}
 
-	unsigned char* data = new unsigned char[surf->w * surf->h * surf->format->BytesPerPixel];
+	initContainer(container, filename, surf->w, surf->h, texture_format, nOfColors, surf->format->BytesPerPixel);
 
+	return surf;
+}
+
+void TextureManager::initContainer(TextureContainer& container, const char* filename, int width, int height, GLenum pixelFormat, GLint pixelInternalFormat, int bytesPerPixel)
+{
+	container.textureID = 0;
+	container.filename = filename;
+	container.decodedBytes = width * height * bytesPerPixel;
+	container.pending = false;
+	container.width = width;
+	container.height = height;
+	container.pixelFormat = pixelFormat;
+	container.pixelInternalFormat = pixelInternalFormat;
+	container.floorLevel = 0;
+	container.residentLevel = 0;
+	container.neededLevel = 0;
+	container.requestedLevel = 0;
+	container.streamingLevel = -1;
+	container.lastUsedFrame = 0;
+	container.pool = -1;
+	container.layer = -1;
+}
+
+bool TextureManager::readPNG(const char* filename, TextureContainer& container, PNGDecoder& decoder, std::vector<unsigned char>& file)
+{
+	if (!Tools::LoadWholeBinaryFile(filename, file))
+		return false;
+
+	PNGDecoder::Info info;
+	if (!decoder.ReadInfo(file.data(), file.size(), info))
+		return false;
+
+	GLenum format = (info.channels == 4) ? GL_RGBA : GL_RGB;
+	initContainer(container, filename, info.width, info.height, format, format, info.channels);
+	return true;
+}
+
+void TextureManager::flipPixels(SDL_Surface* surf, unsigned char* data)
+{
 	// flip image
 	for (int y = 0; y < surf->h; y++)
 	{
@@ -89,27 +240,777 @@ GLuint TextureManager::RequestTexture(const char* filename, bool hasMipmaps)
 			&static_cast<unsigned char*>(surf->pixels)[y * surf->w * surf->format->BytesPerPixel],
 			surf->w * surf->format->BytesPerPixel * sizeof(unsigned char));
 	}
+}
 
-	SDL_LockSurface(surf);
-	glTexImage2D(GL_TEXTURE_2D, 0, nOfColors, surf->w, surf->h, 0, texture_format, GL_UNSIGNED_BYTE, data);
-	SDL_UnlockSurface(surf);
-	delete[] data;
+unsigned char* TextureManager::loadPixels(const char* filename, TextureContainer& container)
+{
+	if (builtinPNG && readPNG(filename, container, pngDecoder, pngFile))
+	{
+		unsigned char* data = new unsigned char[container.decodedBytes];
+		if (pngDecoder.Decode(pngFile.data(), pngFile.size(), data, true))
+		{
+			container.lastUsedFrame = frame;
+			return data;
+		}
+		delete[] data;
+	}
+
+	SDL_Surface* surf = decodeSurface(filename, container);
+	if (surf == nullptr)
+		return nullptr; // error
+
+	unsigned char* data = new unsigned char[container.decodedBytes];
+	flipPixels(surf, data);
+	SDL_FreeSurface(surf);
+
+	container.lastUsedFrame = frame;
+	return data;
+}
+
+void TextureManager::buildMips(TextureContainer& container)
+{
+	// build the chain on the CPU, the GPU starts with the coarse mips only
+	int levels = MipCount(container.width, container.height);
+	int bpp = (int)(container.decodedBytes / (container.width * container.height));
+	for (int level = 1; level < levels; level++)
+	{
+		container.mips.push_back(DownsampleMip(container.mips[level - 1],
+			MipDimension(container.width, level - 1), MipDimension(container.height, level - 1), bpp));
+	}
+
+	container.floorLevel = StreamingFloor(container.width, container.height);
+	container.neededLevel = container.floorLevel;
+	container.requestedLevel = container.floorLevel;
+}
+
+bool TextureManager::reserveLevels(UploadJob* job)
+{
+	// one region for the whole set, a worker never holds part of the ring while it waits for the rest
+	TextureContainer& container = job->container;
+	int bpp = (int)(container.decodedBytes / (container.width * container.height));
+	int levels = job->buildMips ? MipCount(container.width, container.height) : 1;
+	container.floorLevel = job->buildMips ? StreamingFloor(container.width, container.height) : 0;
+
+	size_t bytes = 0;
+	job->levelOffsets.assign(levels, 0);
+	for (int level = container.floorLevel; level < levels; level++)
+	{
+		job->levelOffsets[level] = bytes;
+		size_t size = (size_t)MipDimension(container.width, level) * MipDimension(container.height, level) * bpp;
+		bytes += (size + UploadRing::kRegionAlignment - 1) & ~(UploadRing::kRegionAlignment - 1);
+	}
+
+	job->inRing = ring.Reserve(bytes, job->region, true);
+	return job->inRing;
+}
+
+void TextureManager::createTexture(TextureContainer& container, const unsigned char* data, UploadJob* job)
+{
+	glGenTextures(1, &container.textureID);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, container.textureID);
 
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
-	if (hasMipmaps)
+	int first = 0;
+	int levels = 1;
+	if (!container.mips.empty())
+	{
+		first = container.floorLevel;
+		levels = (int)container.mips.size();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, first);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		container.residentLevel = first;
+	}
+
+	// storage for the levels the texture starts with is specified once, the uploads only fill it
+	for (int level = first; level < levels; level++)
+	{
+		glTexImage2D(GL_TEXTURE_2D, level, container.pixelInternalFormat,
+			MipDimension(container.width, level), MipDimension(container.height, level), 0,
+			container.pixelFormat, GL_UNSIGNED_BYTE, NULL);
+	}
+
+	// the pixels already sit in the ring, the driver pulls them from there
+	bool staged = job != nullptr && job->inRing;
+	const unsigned char* base = staged ? static_cast<const unsigned char*>(ring.BeginUpload(job->region)) : nullptr;
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int level = levels - 1; level >= first; level--)
+	{
+		const void* pixels = staged ? base + job->levelOffsets[level] : (container.mips.empty() ? data : container.mips[level].data());
+		glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, MipDimension(container.width, level), MipDimension(container.height, level),
+			container.pixelFormat, GL_UNSIGNED_BYTE, pixels);
+
+		if (!container.mips.empty())
+			residentBytes += container.mips[level].size();
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	if (staged)
+		ring.EndUpload(job->region);
+
+	if (container.mips.empty() && container.hasMipmaps)
 	{
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glGenerateMipmap(GL_TEXTURE_2D);
 	}
 
-	if (surf) SDL_FreeSurface(surf);
-	glBindTexture(GL_TEXTURE_2D, 0); // unbind the texture
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, 0); // unbind the texture
+}
+
+GLuint TextureManager::RequestTexture(const char* filename, bool hasMipmaps)
+{
+	// first check if we can find it in the manager
+	int index = findTexture(filename, hasMipmaps);
+
+	// still 0 while a worker decodes it
+	if (index != -1 && textures[index].pool == -1)
+		return textures[index].textureID;
+
+	if (asyncUploads)
+	{
+		TextureContainer container = {};
+		container.filename = filename;
+		container.hasMipmaps = hasMipmaps;
+		container.pending = true;
+		container.pool = -1;
+		container.layer = -1;
+		container.streamingLevel = -1;
+		textures.push_back(container);
+
+		UploadJob* job = new UploadJob();
+		job->texture = (int)textures.size() - 1;
+		job->filename = filename;
+		job->buildMips = streaming;
+		job->inRing = false;
+		job->failed = false;
+		jobsInFlight++;
+		if (jobDecodes)
+		{
+			// behind the frame's jobs, the scratch buffers stay with the worker that ran it
+			decodesRunning++;
+			JobSystem::GetInstance().RunBackground(JobSystem::GetInstance().CreateJob([this, job]()
+			{
+				static thread_local PNGDecoder png;
+				static thread_local std::vector<unsigned char> file;
+				decode(job, png, file);
+				decodesRunning--;
+			}));
+			return 0;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			decodeQueue.push_back(job);
+		}
+		jobReady.notify_one();
+		return 0;
+	}
+
+	TextureContainer container;
+	unsigned char* data = loadPixels(filename, container);
+	if (data == nullptr)
+		return 0; // error
+
+	container.hasMipmaps = hasMipmaps;
+	if (streaming)
+	{
+		container.mips.emplace_back(data, data + container.decodedBytes);
+		buildMips(container);
+	}
+
+	createTexture(container, data, nullptr);
+	delete[] data;
 
 	// save the texture
 	textures.push_back(container);
+	textureIndices[container.textureID] = (int)textures.size() - 1;
 	return container.textureID;
-}
\ No newline at end of file
+}
+
+bool TextureManager::IsTexturePending(const char* filename)
+{
+	for (auto& container : textures)
+	{
+		if (container.pending && container.filename.compare(filename) == 0)
+			return true;
+	}
+	return false;
+}
+
+void TextureManager::EnableAsyncUploads(int workerCount, size_t ringBytes, int maxUploadsPerFrame)
+{
+	if (asyncUploads)
+		return;
+
+	ring.Init(ringBytes);
+	asyncUploads = true;
+	asyncUploadsPerFrame = maxUploadsPerFrame;
+	stopWorkers = false;
+
+	// decodes wait on the ring, they can only share the job system when it has threads besides this one
+	jobDecodes = workerCount == 0 && JobSystem::GetInstance().GetWorkerCount() > 0;
+	if (workerCount == 0 && !jobDecodes)
+		workerCount = 1;
+	for (int i = 0; i < workerCount; i++)
+		workers.emplace_back(&TextureManager::decodeWorker, this);
+
+	if (jobDecodes)
+		printf("Texture uploads: decoded on the job system, %zu MB %s ring\n", ringBytes / (1024 * 1024),
+			ring.IsPersistent() ? "persistent" : "staged");
+	else
+		printf("Texture uploads: %d decode workers, %zu MB %s ring\n", workerCount, ringBytes / (1024 * 1024),
+			ring.IsPersistent() ? "persistent" : "staged");
+}
+
+void TextureManager::decodeWorker()
+{
+	// scratch buffers live as long as the worker
+	PNGDecoder png;
+	std::vector<unsigned char> file;
+
+	while (true)
+	{
+		UploadJob* job = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobReady.wait(lock, [this]() { return stopWorkers || !decodeQueue.empty(); });
+			if (stopWorkers)
+				return;
+			job = decodeQueue.front();
+			decodeQueue.pop_front();
+		}
+
+		decode(job, png, file);
+	}
+}
+
+void TextureManager::decode(UploadJob* job, PNGDecoder& png, std::vector<unsigned char>& file)
+{
+	// no GL and no shared manager state in here
+	TextureContainer& container = job->container;
+	bool builtin = builtinPNG && readPNG(job->filename.c_str(), container, png, file);
+	SDL_Surface* surf = builtin ? nullptr : decodeSurface(job->filename.c_str(), container);
+
+	if (!builtin && surf == nullptr)
+	{
+		job->failed = true;
+		std::lock_guard<std::mutex> lock(jobMutex);
+		uploadQueue.push_back(job);
+		return;
+	}
+
+	// level 0 lands straight in the ring when the texture is created with it
+	unsigned char* staged = (reserveLevels(job) && container.floorLevel == 0) ? job->region.data : nullptr;
+	unsigned char* pixels = nullptr;
+	if (job->buildMips)
+	{
+		// the CPU chain keeps level 0 for streaming
+		container.mips.emplace_back(container.decodedBytes);
+		pixels = container.mips[0].data();
+	}
+	else if (staged == nullptr)
+	{
+		// larger than the whole ring, upload from client memory
+		job->pixels.resize(container.decodedBytes);
+		pixels = job->pixels.data();
+	}
+
+	if (builtin)
+	{
+		// the rows go out to the ring and the CPU chain in one pass, nothing is read back from the ring
+		job->failed = !png.Decode(file.data(), file.size(), staged ? staged : pixels, true, staged ? pixels : nullptr);
+		if (job->failed)
+			printf("Could not decode texture %s\n", job->filename.c_str());
+	}
+	else
+	{
+		flipPixels(surf, pixels ? pixels : staged);
+		if (pixels && staged)
+			memcpy(staged, pixels, container.decodedBytes);
+		SDL_FreeSurface(surf);
+	}
+
+	if (!job->failed && job->buildMips)
+	{
+		buildMips(container);
+
+		// the coarse levels go into their parts of the region here, off the GL thread
+		if (job->inRing)
+		{
+			for (int level = std::max(container.floorLevel, 1); level < (int)container.mips.size(); level++)
+			{
+				memcpy(job->region.data + job->levelOffsets[level], container.mips[level].data(), container.mips[level].size());
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(jobMutex);
+	uploadQueue.push_back(job);
+}
+
+void TextureManager::EnableBuiltinPNG(bool enable)
+{
+	builtinPNG = enable;
+}
+
+void TextureManager::ProcessUploads()
+{
+	if (!asyncUploads)
+		return;
+
+	// close the previous frame's upload timing
+	lastFrameUploadMs = frameUploadMs;
+	maxFrameUploadMs = std::max(maxFrameUploadMs, frameUploadMs);
+	frameUploadMs = 0.0;
+
+	auto start = std::chrono::steady_clock::now();
+	ring.Retire();
+
+	for (int uploads = 0; uploads < asyncUploadsPerFrame; uploads++)
+	{
+		UploadJob* job = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			if (uploadQueue.empty())
+				break;
+			job = uploadQueue.front();
+			uploadQueue.pop_front();
+		}
+
+		TextureContainer& container = textures[job->texture];
+		if (!job->failed)
+		{
+			job->container.hasMipmaps = container.hasMipmaps;
+			job->container.lastUsedFrame = frame;
+			createTexture(job->container, job->pixels.empty() ? nullptr : job->pixels.data(), job);
+			container = std::move(job->container);
+			textureIndices[container.textureID] = job->texture;
+		}
+		else if (job->inRing)
+		{
+			// nothing to upload, just hand the region back
+			ring.EndUpload(job->region);
+		}
+		container.pending = false;
+
+		delete job;
+		jobsInFlight--;
+	}
+
+	frameUploadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+GLuint TextureManager::RequestTextureLayer(const char* filename, int& layer)
+{
+	layer = -1;
+	if (!textureArrays)
+		return RequestTexture(filename);
+
+	for (auto& container : textures)
+	{
+		if (container.pool != -1 && container.filename.compare(filename) == 0)
+		{
+			layer = container.layer;
+			return pools[container.pool].arrayID;
+		}
+	}
+
+	TextureContainer container;
+	unsigned char* data = loadPixels(filename, container);
+	if (data == nullptr)
+		return 0; // error
+
+	// pooled textures keep their base level on the CPU so the array can grow
+	container.hasMipmaps = true;
+	container.mips.emplace_back(data, data + container.decodedBytes);
+	delete[] data;
+
+	if (maxArrayLayers == 0)
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxArrayLayers);
+
+	int pool_index = -1;
+	for (int i = 0; i < pools.size(); i++)
+	{
+		TexturePool& pool = pools[i];
+		if (pool.width == container.width && pool.height == container.height &&
+			pool.pixelFormat == container.pixelFormat && pool.pixelInternalFormat == container.pixelInternalFormat &&
+			pool.layers.size() < maxArrayLayers)
+		{
+			pool_index = i;
+			break;
+		}
+	}
+
+	if (pool_index == -1)
+	{
+		TexturePool pool;
+		pool.width = container.width;
+		pool.height = container.height;
+		pool.pixelFormat = container.pixelFormat;
+		pool.pixelInternalFormat = container.pixelInternalFormat;
+		pool.capacity = 0;
+		glGenTextures(1, &pool.arrayID);
+		GLState::GetInstance().BindTexture(GL_TEXTURE_2D_ARRAY, pool.arrayID);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+
+		pools.push_back(pool);
+		pool_index = (int)pools.size() - 1;
+	}
+
+	TexturePool& pool = pools[pool_index];
+	container.pool = pool_index;
+	container.layer = (int)pool.layers.size();
+	textures.push_back(container);
+	pool.layers.push_back((int)textures.size() - 1);
+
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D_ARRAY, pool.arrayID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	if (pool.layers.size() > pool.capacity)
+	{
+		// respecify with room to spare and re-upload the layers we already had
+		pool.capacity = std::min(std::max(4, pool.capacity * 2), (int)maxArrayLayers);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, pool.pixelInternalFormat, pool.width, pool.height, pool.capacity, 0,
+			pool.pixelFormat, GL_UNSIGNED_BYTE, NULL);
+
+		for (int i = 0; i < pool.layers.size() - 1; i++)
+		{
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, pool.width, pool.height, 1,
+				pool.pixelFormat, GL_UNSIGNED_BYTE, textures[pool.layers[i]].mips[0].data());
+		}
+	}
+
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, container.layer, pool.width, pool.height, 1,
+		pool.pixelFormat, GL_UNSIGNED_BYTE, textures.back().mips[0].data());
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	layer = container.layer;
+	return pool.arrayID;
+}
+
+void TextureManager::BindTextureArray(int unit, GLuint arrayID)
+{
+	// GLState owns the cache, its skipped count tells whether this bind was dropped
+	size_t skipped = GLState::GetInstance().GetFrameStatistics().skipped;
+	GLState::GetInstance().BindTexture(unit, GL_TEXTURE_2D_ARRAY, arrayID);
+	if (GLState::GetInstance().GetFrameStatistics().skipped != skipped)
+		bindsSaved++;
+	else
+		bindsIssued++;
+}
+
+void TextureManager::EnableTextureArrays(bool enable)
+{
+	textureArrays = enable;
+}
+
+void TextureManager::NameTexture(const char* filename)
+{
+	if (std::find(namedTextures.begin(), namedTextures.end(), filename) == namedTextures.end())
+		namedTextures.push_back(filename);
+}
+
+size_t TextureManager::decodedSize(const char* filename)
+{
+	// the header is enough for the PNGs the built-in decoder reads, anything else is decoded once
+	PNGDecoder::Info info;
+	if (Tools::LoadWholeBinaryFile(filename, pngFile) && pngDecoder.ReadInfo(pngFile.data(), pngFile.size(), info))
+		return (size_t)info.width * info.height * info.channels;
+
+	SDL_Surface* surf = IMG_Load(filename);
+	if (surf == nullptr)
+		return 0;
+	size_t bytes = (size_t)surf->w * surf->h * surf->format->BytesPerPixel;
+	SDL_FreeSurface(surf);
+	return bytes;
+}
+
+TextureManager::Statistics TextureManager::GetStatistics()
+{
+	Statistics stats = {};
+
+	for (auto& container : textures)
+	{
+		stats.texturesLoaded++;
+		stats.decodedBytes += container.decodedBytes;
+	}
+
+	// what lazy loading saved, the maps of slots no shader samples
+	for (auto& filename : namedTextures)
+	{
+		bool decoded = std::any_of(textures.begin(), textures.end(),
+			[&filename](const TextureContainer& container) { return container.filename == filename && !container.pending; });
+		if (!decoded)
+		{
+			stats.texturesUnused++;
+			stats.unusedBytes += decodedSize(filename.c_str());
+		}
+	}
+
+	stats.arrayPools = pools.size();
+	stats.bindsIssued = bindsIssued;
+	stats.bindsSaved = bindsSaved;
+	stats.lastFrameUploadMs = lastFrameUploadMs;
+	stats.maxFrameUploadMs = maxFrameUploadMs;
+
+	return stats;
+}
+
+void TextureManager::PrintStatistics()
+{
+	Statistics stats = GetStatistics();
+
+	printf("Textures loaded: %zu (%.2f MB decoded)\n", stats.texturesLoaded, stats.decodedBytes / (1024.0 * 1024.0));
+	printf("Textures named by materials but never decoded: %zu (%.2f MB saved)\n", stats.texturesUnused, stats.unusedBytes / (1024.0 * 1024.0));
+
+	if (textureArrays)
+	{
+		printf("Texture array pools: %zu, array binds issued: %zu, saved: %zu\n", stats.arrayPools, stats.bindsIssued, stats.bindsSaved);
+	}
+
+	if (asyncUploads || streaming)
+	{
+		printf("Texture upload time per frame: %.3f ms last, %.3f ms max\n", stats.lastFrameUploadMs, stats.maxFrameUploadMs);
+	}
+
+	if (streaming)
+	{
+		Residency residency = GetResidency();
+		printf("Texture residency: %.2f / %.2f MB, %zu mips pending\n",
+			residency.residentBytes / (1024.0 * 1024.0), residency.budgetBytes / (1024.0 * 1024.0), residency.pending.size());
+	}
+}
+
+void TextureManager::EnableStreaming(size_t budget, int maxUploadsPerFrame)
+{
+	streaming = true;
+	budgetBytes = budget;
+	uploadsPerFrame = maxUploadsPerFrame;
+}
+
+void TextureManager::RequestScreenSize(GLuint textureID, float pixels)
+{
+	int index = findTextureByID(textureID);
+	if (index == -1 || textures[index].mips.empty())
+		return;
+
+	TextureContainer& container = textures[index];
+
+	// one texel per covered pixel
+	float texels = (float)std::max(container.width, container.height);
+	int level = (pixels >= 1.f) ? (int)std::floor(std::log2(std::max(texels / pixels, 1.f))) : container.floorLevel;
+	level = std::min(level, container.floorLevel);
+
+	container.requestedLevel = std::min(container.requestedLevel, level);
+	container.lastUsedFrame = frame;
+}
+
+void TextureManager::uploadMip(TextureContainer& container, int level, const void* pixels)
+{
+	int width = MipDimension(container.width, level);
+	int height = MipDimension(container.height, level);
+
+	// the level was never resident or an eviction released it, specify it once and fill it
+	glTexImage2D(GL_TEXTURE_2D, level, container.pixelInternalFormat, width, height, 0, container.pixelFormat, GL_UNSIGNED_BYTE, NULL);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, container.pixelFormat, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+
+	container.residentLevel = level;
+}
+
+bool TextureManager::streamMip(int index, int level)
+{
+	const std::vector<unsigned char>& pixels = textures[index].mips[level];
+
+	std::unique_ptr<StreamUpload> upload(new StreamUpload());
+	if (!ring.Reserve(pixels.size(), upload->region, false))
+		return false;
+
+	upload->texture = index;
+	upload->level = level;
+	upload->copied = false;
+	textures[index].streamingLevel = level;
+
+	// the mip buffers never move while the texture lives, Clear waits for the copies
+	StreamUpload* target = upload.get();
+	const unsigned char* src = pixels.data();
+	size_t size = pixels.size();
+	streamUploads.push_back(std::move(upload));
+
+	if (JobSystem::GetInstance().GetWorkerCount() > 0)
+	{
+		JobSystem::GetInstance().RunBackground(JobSystem::GetInstance().CreateJob([target, src, size]()
+		{
+			memcpy(target->region.data, src, size);
+			target->copied = true;
+		}));
+	}
+	else
+	{
+		memcpy(target->region.data, src, size);
+		target->copied = true;
+	}
+	return true;
+}
+
+void TextureManager::finishStreams(bool wait)
+{
+	// in order, a copy still running holds back the ones behind it
+	while (!streamUploads.empty())
+	{
+		StreamUpload& upload = *streamUploads.front();
+		if (!upload.copied)
+		{
+			if (!wait)
+				break;
+			std::this_thread::yield();
+			continue;
+		}
+
+		TextureContainer& container = textures[upload.texture];
+		GLState::GetInstance().BindTexture(GL_TEXTURE_2D, container.textureID);
+		uploadMip(container, upload.level, ring.BeginUpload(upload.region));
+		ring.EndUpload(upload.region);
+
+		container.streamingLevel = -1;
+		streamUploads.pop_front();
+	}
+}
+
+bool TextureManager::evictMip(int excluded)
+{
+	// mips finer than needed go first, then textures not drawn this frame, least recently used first
+	int victim = -1;
+	bool victim_unneeded = false;
+
+	for (int i = 0; i < textures.size(); i++)
+	{
+		TextureContainer& container = textures[i];
+		if (i == excluded || container.mips.empty() || container.residentLevel >= container.floorLevel || container.streamingLevel != -1)
+			continue;
+
+		bool unneeded = container.residentLevel < container.neededLevel;
+		if (!unneeded && container.lastUsedFrame == frame)
+			continue;
+
+		if (victim == -1 || (unneeded && !victim_unneeded) ||
+			(unneeded == victim_unneeded && container.lastUsedFrame < textures[victim].lastUsedFrame))
+		{
+			victim = i;
+			victim_unneeded = unneeded;
+		}
+	}
+
+	if (victim == -1)
+		return false;
+
+	TextureContainer& container = textures[victim];
+	int level = container.residentLevel;
+
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, container.textureID);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level + 1);
+	// a zero sized image releases the level storage
+	glTexImage2D(GL_TEXTURE_2D, level, container.pixelInternalFormat, 0, 0, 0, container.pixelFormat, GL_UNSIGNED_BYTE, NULL);
+
+	container.residentLevel = level + 1;
+	residentBytes -= container.mips[level].size();
+	return true;
+}
+
+void TextureManager::UpdateResidency()
+{
+	if (!streaming)
+		return;
+
+	pendingStreams.clear();
+	for (auto& container : textures)
+	{
+		if (container.mips.empty() || container.pool != -1)
+			continue;
+
+		if (container.lastUsedFrame == frame)
+			container.neededLevel = container.requestedLevel;
+		container.requestedLevel = container.floorLevel;
+
+		// the next level waits until the one in flight is resident
+		if (container.neededLevel < container.residentLevel && container.streamingLevel == -1)
+		{
+			pendingStreams.push_back({ container.filename, container.textureID, container.residentLevel - 1, container.residentLevel, container.neededLevel });
+		}
+	}
+
+	// the textures furthest from their wanted mip stream first
+	std::sort(pendingStreams.begin(), pendingStreams.end(), [](const StreamRequest& a, const StreamRequest& b)
+	{
+		return (a.residentLevel - a.neededLevel) > (b.residentLevel - b.neededLevel);
+	});
+
+	int uploads = 0;
+	auto it = pendingStreams.begin();
+	while (it != pendingStreams.end() && uploads < uploadsPerFrame)
+	{
+		int index = findTextureByID(it->textureID);
+		TextureContainer& container = textures[index];
+		size_t bytes = container.mips[it->level].size();
+
+		while (residentBytes + bytes > budgetBytes && evictMip(index)) {}
+		if (residentBytes + bytes > budgetBytes)
+			break;
+
+		// an earlier eviction this frame dropped a mip of this texture, keep the chain contiguous
+		if (container.residentLevel != it->level + 1)
+		{
+			++it;
+			continue;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		if (asyncUploads && bytes <= ring.GetSize())
+		{
+			// the ring is still busy with earlier uploads, retry next frame instead of stalling
+			if (!streamMip(index, it->level))
+				break;
+		}
+		else
+		{
+			GLState::GetInstance().BindTexture(GL_TEXTURE_2D, container.textureID);
+			uploadMip(container, it->level, container.mips[it->level].data());
+		}
+		frameUploadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		// counted from the start of the copy so the budget holds while it is in flight
+		residentBytes += bytes;
+		uploads++;
+
+		it = pendingStreams.erase(it);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	finishStreams(false);
+	frameUploadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	GLState::GetInstance().BindTexture(GL_TEXTURE_2D, 0);
+
+	frame++;
+}
+
+TextureManager::Residency TextureManager::GetResidency()
+{
+	Residency residency;
+	residency.budgetBytes = budgetBytes;
+	residency.residentBytes = residentBytes;
+	residency.pending = pendingStreams;
+	return residency;
+}
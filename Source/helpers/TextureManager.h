@@ -4,7 +4,27 @@
 #include "SDL2/SDL.h"
 #include "GLEW\glew.h"
 #include <string>
+#include <unordered_map>
 #include <vector>
+#include <memory>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "UploadRing.h"
+#include "PNGDecoder.h"
+
+// Material texture slots, a shader declares which of them it samples
+enum TextureSlot
+{
+	TEXTURE_SLOT_DIFFUSE = 0,
+	TEXTURE_SLOT_NORMAL,
+	TEXTURE_SLOT_BUMP,
+	TEXTURE_SLOT_EMISSIVE,
+	TEXTURE_SLOT_MASK,
+	TEXTURE_SLOT_COUNT
+};
 
 // Singleton Class of Texture Manager
 class TextureManager
@@ -15,14 +35,168 @@ protected:
 		GLuint textureID;
 		std::string filename;
 		bool hasMipmaps;
+		size_t decodedBytes;
+		bool pending;
+
+		// streaming state, the CPU keeps the whole chain so evicted mips can come back
+		int width;
+		int height;
+		GLenum pixelFormat;
+		GLint pixelInternalFormat;
+		std::vector<std::vector<unsigned char>> mips;
+		int floorLevel;
+		int residentLevel;
+		int neededLevel;
+		int requestedLevel;
+		// level on its way through the ring, -1 when none is
+		int streamingLevel;
+		unsigned long lastUsedFrame;
+
+		// texture array pool and layer, -1 for plain textures
+		int pool;
+		int layer;
 	};
 	std::vector<TextureContainer> textures;
+	// index in textures of every GL texture, looked up per drawn part each frame
+	std::unordered_map<GLuint, int> textureIndices;
+
+	// textures of the same size and format share one GL_TEXTURE_2D_ARRAY
+	struct TexturePool
+	{
+		GLuint arrayID;
+		int width;
+		int height;
+		GLenum pixelFormat;
+		GLint pixelInternalFormat;
+		int capacity;
+		std::vector<int> layers;
+	};
+	std::vector<TexturePool> pools;
+	bool textureArrays;
+	GLint maxArrayLayers;
+
+	// array binds GLState issued and dropped as redundant
+	size_t bindsIssued;
+	size_t bindsSaved;
+
+	// residency budget
+	bool streaming;
+	size_t budgetBytes;
+	size_t residentBytes;
+	int uploadsPerFrame;
+	unsigned long frame;
+
+	// background decoding, pixels reach the GPU through the PBO ring
+	struct UploadJob
+	{
+		int texture;
+		std::string filename;
+		bool buildMips;
+		TextureContainer container;
+		UploadRing::Region region;
+		bool inRing;
+		// offset in region of every level the texture is created with, written on the worker
+		std::vector<size_t> levelOffsets;
+		std::vector<unsigned char> pixels;
+		bool failed;
+	};
+	bool asyncUploads;
+	// decodes run as background jobs of the JobSystem instead of on the workers
+	bool jobDecodes;
+	std::atomic<int> decodesRunning;
+	int asyncUploadsPerFrame;
+	UploadRing ring;
+	std::vector<std::thread> workers;
+	std::mutex jobMutex;
+	std::condition_variable jobReady;
+	std::deque<UploadJob*> decodeQueue;
+	std::deque<UploadJob*> uploadQueue;
+	bool stopWorkers;
+	int jobsInFlight;
+	double frameUploadMs;
+	double lastFrameUploadMs;
+	double maxFrameUploadMs;
+
+	// a streamed mip copied into the ring off the GL thread, uploaded once the copy is done
+	struct StreamUpload
+	{
+		int texture;
+		int level;
+		UploadRing::Region region;
+		std::atomic<bool> copied;
+	};
+	std::deque<std::unique_ptr<StreamUpload>> streamUploads;
+
+	// in-house PNG decoding, SDL_image handles the formats it rejects
+	bool builtinPNG;
+	PNGDecoder pngDecoder;
+	std::vector<unsigned char> pngFile;
+
+	// maps the materials name, most are only decoded once a shader samples their slot
+	std::vector<std::string> namedTextures;
 
 	// find the texture with the fiven filename and mipmaps
 	int findTexture(const char* filename, bool hasMipmaps);
+	int findTextureByID(GLuint textureID);
+	// describe a freshly decoded image
+	void initContainer(TextureContainer& container, const char* filename, int width, int height, GLenum pixelFormat, GLint pixelInternalFormat, int bytesPerPixel);
+	// decode the image, filling the container description
+	SDL_Surface* decodeSurface(const char* filename, TextureContainer& container);
+	// read a PNG the built-in decoder supports and fill the container description, the pixels come from decoder.Decode
+	bool readPNG(const char* filename, TextureContainer& container, PNGDecoder& decoder, std::vector<unsigned char>& file);
+	void flipPixels(SDL_Surface* surf, unsigned char* data);
+	// bytes the image would take decoded, 0 when it can not be read
+	size_t decodedSize(const char* filename);
+	unsigned char* loadPixels(const char* filename, TextureContainer& container);
+	// build the chain below mips[0]
+	void buildMips(TextureContainer& container);
+	// reserve one ring region holding every level the texture is created with
+	bool reserveLevels(UploadJob* job);
+	// create the GL texture from client memory or from the job's ring region
+	void createTexture(TextureContainer& container, const unsigned char* data, UploadJob* job);
 	GLenum internalFormat(uint8_t bitsPerPixel);
+	void decodeWorker();
+	// decode and hand the job to ProcessUploads, on a worker thread or a job
+	void decode(UploadJob* job, PNGDecoder& png, std::vector<unsigned char>& file);
+
+	// specify and fill one mip of the bound texture, pixels is a ring offset while the ring is bound
+	void uploadMip(TextureContainer& container, int level, const void* pixels);
+	bool evictMip(int excluded);
+	// start the copy of a streamed mip into the ring, false while the ring is busy
+	bool streamMip(int index, int level);
+	// upload the streamed mips whose copies are done
+	void finishStreams(bool wait);
 
 public:
+	struct Statistics
+	{
+		size_t texturesLoaded;
+		size_t texturesUnused;
+		size_t decodedBytes;
+		size_t unusedBytes;
+		size_t arrayPools;
+		size_t bindsIssued;
+		size_t bindsSaved;
+		double lastFrameUploadMs;
+		double maxFrameUploadMs;
+	};
+
+	struct StreamRequest
+	{
+		std::string filename;
+		GLuint textureID;
+		int level;
+		int residentLevel;
+		int neededLevel;
+	};
+
+	struct Residency
+	{
+		size_t budgetBytes;
+		size_t residentBytes;
+		std::vector<StreamRequest> pending;
+	};
+
 	// get the static instance of Texture Manager
 	static TextureManager& GetInstance()
 	{
@@ -34,12 +208,46 @@ public:
 	// delete all textures
 	void Clear();
 
-	// Request a texture handle
+	// Request a texture handle, 0 while an async upload is still pending
 	GLuint RequestTexture(const char* filename, bool hasMipmaps = false);
+	bool IsTexturePending(const char* filename);
+
+	// Decode on worker threads and upload through a PBO ring, 0 workers decodes on the JobSystem
+	void EnableAsyncUploads(int workerCount, size_t ringBytes, int maxUploadsPerFrame = 2);
+	// Hand finished decodes to GL and recycle ring regions, once per frame
+	void ProcessUploads();
+
+	// Decode 8 bit RGB/RGBA PNGs with PNGDecoder instead of SDL_image
+	void EnableBuiltinPNG(bool enable);
+
+	// Pack same sized textures into texture arrays
+	void EnableTextureArrays(bool enable);
+	// Request a texture as a layer of a texture array, falls back to a plain texture when arrays are off
+	GLuint RequestTextureLayer(const char* filename, int& layer);
+	// Bind a texture array through GLState, which drops the call when it is already bound on the unit
+	void BindTextureArray(int unit, GLuint arrayID);
+
+	// Note a map a material names, loaded or not
+	void NameTexture(const char* filename);
+
+	// decoded bytes of all textures, and of the named maps lazy loading never decoded
+	Statistics GetStatistics();
+	void PrintStatistics();
+
+	// Keep textures under a VRAM budget, resident from the low mips up
+	void EnableStreaming(size_t budget, int maxUploadsPerFrame = 4);
+	// Ask for the mip that matches a material's projected size in pixels
+	void RequestScreenSize(GLuint textureID, float pixels);
+	// Stream in requested mips and evict LRU ones, once per frame
+	void UpdateResidency();
+	// budget, resident bytes and the mips still waiting to stream
+	Residency GetResidency();
 
 protected:
 	TextureManager();	
 	void operator=(TextureManager const&);
+
+	std::vector<StreamRequest> pendingStreams;
 };
 
 #endif
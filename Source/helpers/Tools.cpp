@@ -1,7 +1,15 @@
 #include "Tools.h"
+#include "GLState.h"
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <cerrno>
+#include <cfloat>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 namespace Tools
 {
@@ -30,6 +38,23 @@ namespace Tools
 		return buffer;
 	}
 
+	bool LoadWholeBinaryFile(const char* filename, std::vector<unsigned char>& data)
+	{
+		std::ifstream in(filename, std::ifstream::ate | std::ifstream::binary);
+		if (!in.is_open())
+			return false;
+
+		size_t length = in.tellg();
+		in.seekg(0, in.beg);
+
+		data.resize(length);
+		in.read(reinterpret_cast<char*>(data.data()), length);
+		bool ok = !in.fail();
+		in.close();
+
+		return ok;
+	}
+
 	std::string GetFolderPath(const char* filename)
 	{
 		std::string str(filename);
@@ -51,6 +76,93 @@ namespace Tools
 		return (str2.compare(str1) == 0);
 	}
 
+	bool MakeDirectory(const char* path)
+	{
+		// succeeds when the directory already exists too
+#ifdef _WIN32
+		int result = _mkdir(path);
+#else
+		int result = mkdir(path, 0755);
+#endif
+		return result == 0 || errno == EEXIST;
+	}
+
+	void TransformBounds(const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform, glm::vec3& outMin, glm::vec3& outMax)
+	{
+		// transform the center, the extents grow by the absolute rotation (Arvo)
+		glm::vec3 center = glm::vec3(transform * glm::vec4((min + max) * 0.5f, 1.f));
+		glm::vec3 extent = (max - min) * 0.5f;
+		glm::mat3 rotation(transform);
+		glm::vec3 world_extent(
+			glm::abs(rotation[0][0]) * extent.x + glm::abs(rotation[1][0]) * extent.y + glm::abs(rotation[2][0]) * extent.z,
+			glm::abs(rotation[0][1]) * extent.x + glm::abs(rotation[1][1]) * extent.y + glm::abs(rotation[2][1]) * extent.z,
+			glm::abs(rotation[0][2]) * extent.x + glm::abs(rotation[1][2]) * extent.y + glm::abs(rotation[2][2]) * extent.z);
+
+		outMin = center - world_extent;
+		outMax = center + world_extent;
+	}
+
+	void FrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+	{
+		// Gribb/Hartmann, the rows of the matrix added to and subtracted from the w row
+		const glm::mat4& m = viewProjection;
+		glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+		glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+		glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+		glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+		planes[0] = row3 + row0;
+		planes[1] = row3 - row0;
+		planes[2] = row3 + row1;
+		planes[3] = row3 - row1;
+		planes[4] = row3 + row2;
+		planes[5] = row3 - row2;
+	}
+
+	bool ProjectBounds(const glm::vec3& min, const glm::vec3& max, const glm::mat4& viewProjection, glm::vec3& outMin, glm::vec3& outMax)
+	{
+		glm::vec3 corners[8];
+		for (int i = 0; i < 8; i++)
+			corners[i] = glm::vec3((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+		return ProjectBounds(corners, viewProjection, outMin, outMax);
+	}
+
+	bool ProjectBounds(const glm::vec3 corners[8], const glm::mat4& viewProjection, glm::vec3& outMin, glm::vec3& outMax)
+	{
+		// corners behind the eye flip under the divide, the edges that cross over are cut just in front of it
+		const float eye = 1.e-4f;
+		glm::vec4 clip[8];
+		for (int i = 0; i < 8; i++)
+			clip[i] = viewProjection * glm::vec4(corners[i], 1.f);
+
+		outMin = glm::vec3(FLT_MAX);
+		outMax = glm::vec3(-FLT_MAX);
+		bool any = false;
+		auto add = [&](const glm::vec4& point)
+		{
+			glm::vec3 ndc = glm::vec3(point) / point.w;
+			outMin = glm::min(outMin, ndc);
+			outMax = glm::max(outMax, ndc);
+			any = true;
+		};
+
+		for (int i = 0; i < 8; i++)
+		{
+			if (clip[i].w > eye)
+				add(clip[i]);
+
+			// the three edges to the corners that differ in one bit
+			for (int axis = 1; axis < 8; axis <<= 1)
+			{
+				int j = i | axis;
+				if (j == i || (clip[i].w > eye) == (clip[j].w > eye))
+					continue;
+				float t = (eye - clip[i].w) / (clip[j].w - clip[i].w);
+				add(clip[i] + (clip[j] - clip[i]) * t);
+			}
+		}
+		return any;
+	}
+
 	GLenum CheckGLError()
 	{
 		GLenum error = glGetError();
@@ -65,7 +177,7 @@ namespace Tools
 
 	GLenum CheckFramebufferStatus(GLuint framebuffer_object)
 	{
-		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_object);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, framebuffer_object);
 		GLenum status;
 		if ((status = glCheckFramebufferStatus(GL_FRAMEBUFFER)) != GL_FRAMEBUFFER_COMPLETE)
 		{
@@ -92,7 +204,7 @@ namespace Tools
 				break;
 			}
 		}
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		GLState::GetInstance().BindFramebuffer(GL_FRAMEBUFFER, 0);
 		return status;
 	}
 };
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include <string>
+#include <vector>
 #include "GLEW\glew.h"
+#include "glm/glm.hpp"
 
 #ifndef TOOLS_H
 #define TOOLS_H
@@ -8,12 +10,28 @@ namespace Tools
 {
 	char* LoadWholeStringFile(const char* filename);
 
+	bool LoadWholeBinaryFile(const char* filename, std::vector<unsigned char>& data);
+
 	std::string GetFolderPath(const char* filename);
 
 	std::string tolowerCase(std::string str);
 
 	bool compareStringIgnoreCase(std::string str1, std::string str2);
 
+	bool MakeDirectory(const char* path);
+
+	// Box around the transformed box of min and max
+	void TransformBounds(const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform, glm::vec3& outMin, glm::vec3& outMax);
+
+	// Planes of the frustum of viewProjection, left, right, bottom, top, near and far. A point p is on
+	// the inside of a plane when dot(xyz, p) + w >= 0, the planes are not normalized
+	void FrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+
+	// Normalized device bounds of a box, or of 8 corners with the box's layout (bit 0 x, 1 y, 2 z),
+	// under viewProjection. Only the part in front of the eye counts, false when there is none
+	bool ProjectBounds(const glm::vec3& min, const glm::vec3& max, const glm::mat4& viewProjection, glm::vec3& outMin, glm::vec3& outMax);
+	bool ProjectBounds(const glm::vec3 corners[8], const glm::mat4& viewProjection, glm::vec3& outMin, glm::vec3& outMax);
+
 	GLenum CheckGLError();
 
 	GLenum CheckFramebufferStatus(GLuint framebuffer_object);
@@ -0,0 +1,107 @@
+#ifndef UNIFORM_BLOCKS_H
+#define UNIFORM_BLOCKS_H
+
+#include "GLEW\glew.h"
+#include "glm/glm.hpp"
+
+// Binding points of the uniform blocks in basic_rendering.vert/.frag
+enum UniformBlockBinding
+{
+	UNIFORM_BLOCK_FRAME = 0,
+	UNIFORM_BLOCK_MATERIAL,
+	UNIFORM_BLOCK_LIGHTS,
+};
+
+// Locations of the per instance attributes of basic_rendering.vert and shadow_map_rendering.vert
+enum InstanceAttribute
+{
+	INSTANCE_ATTRIBUTE_WORLD_MATRIX = 5,
+	INSTANCE_ATTRIBUTE_NORMAL_MATRIX = 9,
+	INSTANCE_ATTRIBUTE_END = 12,
+};
+
+// std140 mirrors of the blocks, every vec3 is followed by a 4 byte member so nothing is padded
+
+// camera and light, written once per frame
+struct FrameBlock
+{
+	glm::mat4 light_projection_view;
+	glm::vec3 camera_pos;
+	float light_umbra;
+	glm::vec3 camera_dir;
+	float light_penumbra;
+	glm::vec3 light_color;
+	int cast_shadows;
+	glm::vec3 light_pos;
+	// point light, the far plane of its cube faces
+	float light_range;
+	glm::vec3 light_dir;
+	int light_point;
+	glm::mat4 projection_view;
+	// directional light, cascades as many as LightNode::kMaxCascades. The view depth each one ends
+	// at and the part of its layer it covers
+	glm::mat4 cascade_projection_view[4];
+	glm::vec4 cascade_splits;
+	glm::vec4 cascade_scales;
+	int cascade_count;
+	int light_directional;
+	// poisson shadow filter, taps and disk radius in texels
+	int shadow_taps;
+	float shadow_radius;
+};
+
+// a spotlight with its shadow map in the atlas. w of position and direction are the cosines of half
+// the umbra and penumbra, w of color is 1 when the tile holds the light's map. tile is the atlas
+// offset and scale of the map in texture coordinates
+struct AtlasLightData
+{
+	glm::mat4 projection_view;
+	glm::vec4 position;
+	glm::vec4 direction;
+	glm::vec4 color;
+	glm::vec4 tile;
+};
+
+// the lights of the atlas the camera sees, written once per frame up to count of them
+struct LightsBlock
+{
+	int count;
+	int pad[3];
+	AtlasLightData lights[32];
+};
+
+// one per GeometryNode::Objects, built at load
+struct MaterialBlock
+{
+	glm::vec3 diffuse;
+	float shininess;
+	glm::vec3 specular;
+	int tex_diffuse_layer;
+	glm::vec3 ambient;
+	int tex_normal_layer;
+};
+
+// per instance transforms, streamed every frame as vertex attributes with divisor 1.
+// the normal matrix is a mat3 attribute, each column padded to 16 bytes
+struct InstanceData
+{
+	glm::mat4 world_matrix;
+	glm::vec4 normal_matrix[3];
+};
+
+// one command of glMultiDrawArraysIndirect, the layout is fixed by GL
+struct DrawArraysIndirectCommand
+{
+	GLuint count;
+	GLuint instance_count;
+	GLuint first;
+	GLuint base_instance;
+};
+
+static_assert(sizeof(FrameBlock) == 512, "FrameBlock does not match the std140 layout");
+static_assert(sizeof(LightsBlock) == 16 + 32 * 128, "LightsBlock does not match the std140 layout");
+static_assert(sizeof(MaterialBlock) == 48, "MaterialBlock does not match the std140 layout");
+static_assert(sizeof(InstanceData) == 112, "InstanceData does not match the attribute pointers");
+static_assert(sizeof(DrawArraysIndirectCommand) == 16, "DrawArraysIndirectCommand does not match GL");
+
+#endif
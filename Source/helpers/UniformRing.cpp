@@ -0,0 +1,161 @@
+#include "UniformRing.h"
+#include "GLState.h"
+#include <cstring>
+#include <cstdio>
+
+UniformRing::UniformRing()
+{
+	buffer = 0;
+	target = GL_UNIFORM_BUFFER;
+	sectionSize = 0;
+	sectionCount = 0;
+	section = 0;
+	used = 0;
+	overflow = 0;
+	alignment = 256;
+	persistent = false;
+	mappedSection = false;
+	mapped = nullptr;
+	write = nullptr;
+}
+
+UniformRing::~UniformRing()
+{
+	Destroy();
+}
+
+bool UniformRing::Init(size_t size, int sections, GLenum target)
+{
+	// vertex attributes only need their components aligned
+	this->target = target;
+	if (target == GL_UNIFORM_BUFFER)
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	else
+		alignment = 16;
+	sectionSize = (size + alignment - 1) & ~(size_t)(alignment - 1);
+	sectionCount = sections;
+	section = sections - 1;
+	fences.assign(sections, 0);
+
+	glGenBuffers(1, &buffer);
+	GLState::GetInstance().BindBuffer(target, buffer);
+
+	if (GLEW_ARB_buffer_storage)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(target, sectionSize * sectionCount, NULL, flags);
+		mapped = static_cast<unsigned char*>(glMapBufferRange(target, 0, sectionSize * sectionCount, flags));
+		persistent = (mapped != nullptr);
+	}
+	else
+	{
+		glBufferData(target, sectionSize * sectionCount, NULL, GL_STREAM_DRAW);
+	}
+
+	GLState::GetInstance().BindBuffer(target, 0);
+	return buffer != 0;
+}
+
+void UniformRing::Destroy()
+{
+	if (buffer == 0)
+		return;
+
+	for (auto& fence : fences)
+	{
+		if (fence) glDeleteSync(fence);
+	}
+	fences.clear();
+
+	if (persistent || mappedSection)
+	{
+		GLState::GetInstance().BindBuffer(target, buffer);
+		glUnmapBuffer(target);
+		GLState::GetInstance().BindBuffer(target, 0);
+	}
+	glDeleteBuffers(1, &buffer);
+
+	buffer = 0;
+	mapped = nullptr;
+	write = nullptr;
+	persistent = false;
+	mappedSection = false;
+}
+
+void UniformRing::Begin(size_t required)
+{
+	if (required > sectionSize && buffer != 0)
+	{
+		// a quarter to spare so a slowly growing frame does not reallocate every time
+		size_t size = required + required / 4;
+		printf("Uniform ring: sections grown from %zu KB to %zu KB\n", sectionSize / 1024, size / 1024);
+		int sections = sectionCount;
+		GLenum ring_target = target;
+		Destroy();
+		Init(size, sections, ring_target);
+	}
+
+	section = (section + 1) % sectionCount;
+	used = 0;
+	overflow = 0;
+
+	// the section was last used sectionCount frames ago, this rarely waits
+	GLsync& fence = fences[section];
+	if (fence)
+	{
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fence);
+		fence = 0;
+	}
+
+	if (persistent)
+	{
+		write = mapped + section * sectionSize;
+	}
+	else
+	{
+		GLState::GetInstance().BindBuffer(target, buffer);
+		write = static_cast<unsigned char*>(glMapBufferRange(target, section * sectionSize, sectionSize,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+		GLState::GetInstance().BindBuffer(target, 0);
+		mappedSection = (write != nullptr);
+	}
+}
+
+GLintptr UniformRing::Push(const void* data, size_t size)
+{
+	if (write == nullptr || used + size > sectionSize)
+	{
+		overflow += Aligned(size);
+		return -1;
+	}
+
+	GLintptr offset = (GLintptr)(section * sectionSize + used);
+	memcpy(write + used, data, size);
+	used = (used + size + alignment - 1) & ~(size_t)(alignment - 1);
+	return offset;
+}
+
+void UniformRing::Flush()
+{
+	// coherent persistent writes need nothing, a mapped section has to be unmapped before drawing
+	if (mappedSection)
+	{
+		GLState::GetInstance().BindBuffer(target, buffer);
+		glUnmapBuffer(target);
+		GLState::GetInstance().BindBuffer(target, 0);
+		mappedSection = false;
+		write = nullptr;
+	}
+}
+
+void UniformRing::BindRange(GLuint binding, GLintptr offset, size_t size)
+{
+	GLState::GetInstance().BindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+}
+
+void UniformRing::End()
+{
+	Flush();
+	fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
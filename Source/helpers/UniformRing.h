@@ -0,0 +1,57 @@
+#ifndef UNIFORM_RING_H
+#define UNIFORM_RING_H
+
+#include "GLEW\glew.h"
+#include <vector>
+
+// Buffer for data that changes every frame, split in one section per frame in flight.
+// Uniform blocks by default, per instance vertex attributes with a GL_ARRAY_BUFFER target.
+// A section is filled before the draws that read it and fenced after them,
+// so the CPU never writes where the GPU is still reading.
+// With ARB_buffer_storage the buffer stays persistently mapped, otherwise each section is mapped unsynchronized.
+class UniformRing
+{
+public:
+	UniformRing();
+	~UniformRing();
+
+	bool Init(size_t sectionSize, int sections = 3, GLenum target = GL_UNIFORM_BUFFER);
+	void Destroy();
+
+	GLuint GetBuffer() const { return buffer; }
+	size_t GetSectionSize() const { return sectionSize; }
+	// bytes a block of size takes in a section
+	size_t Aligned(size_t size) const { return (size + alignment - 1) & ~(size_t)(alignment - 1); }
+	// bytes of the blocks that did not fit since Begin
+	size_t GetOverflow() const { return overflow; }
+
+	// Start filling the next section, waits if the GPU still reads it.
+	// Sections smaller than required are reallocated first, the old buffer lives on until the GPU is done with it
+	void Begin(size_t required = 0);
+	// Copy a block into the section, returns its offset or -1 when the section is full
+	GLintptr Push(const void* data, size_t size);
+	// Make the pushed blocks visible to the draws
+	void Flush();
+	// Fence the section after the draws that read it
+	void End();
+
+	// Bind a pushed block to a uniform block binding point
+	void BindRange(GLuint binding, GLintptr offset, size_t size);
+
+private:
+	GLuint buffer;
+	GLenum target;
+	size_t sectionSize;
+	int sectionCount;
+	int section;
+	size_t used;
+	size_t overflow;
+	GLint alignment;
+	bool persistent;
+	bool mappedSection;
+	unsigned char* mapped;
+	unsigned char* write;
+	std::vector<GLsync> fences;
+};
+
+#endif
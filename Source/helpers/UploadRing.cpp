@@ -0,0 +1,190 @@
+#include "UploadRing.h"
+#include "GLState.h"
+#include <cstring>
+
+UploadRing::UploadRing()
+{
+	buffer = 0;
+	ringSize = 0;
+	persistent = false;
+	mapped = nullptr;
+	head = 0;
+	tail = 0;
+	shutdown = false;
+}
+
+UploadRing::~UploadRing()
+{
+	Shutdown();
+}
+
+bool UploadRing::Init(size_t size)
+{
+	ringSize = size;
+	shutdown = false;
+	glGenBuffers(1, &buffer);
+	GLState::GetInstance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+
+	if (GLEW_ARB_buffer_storage)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, ringSize, NULL, flags);
+		mapped = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, ringSize, flags));
+		persistent = (mapped != nullptr);
+	}
+	else
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, ringSize, NULL, GL_STREAM_DRAW);
+	}
+
+	GLState::GetInstance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return buffer != 0;
+}
+
+void UploadRing::Destroy()
+{
+	Shutdown();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto& region : inFlight)
+	{
+		if (region.fence) glDeleteSync(region.fence);
+	}
+	inFlight.clear();
+
+	if (persistent)
+	{
+		GLState::GetInstance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		GLState::GetInstance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &buffer);
+
+	buffer = 0;
+	mapped = nullptr;
+	persistent = false;
+}
+
+bool UploadRing::allocate(size_t size, size_t& offset)
+{
+	if (inFlight.empty())
+	{
+		head = tail = 0;
+	}
+
+	if (inFlight.empty() || head > tail)
+	{
+		// free space at the end, or wrap to the start before the oldest region
+		if (head + size <= ringSize)
+		{
+			offset = head;
+			return true;
+		}
+		if (size <= tail)
+		{
+			offset = 0;
+			return true;
+		}
+		return false;
+	}
+
+	if (head + size <= tail)
+	{
+		offset = head;
+		return true;
+	}
+	return false;
+}
+
+bool UploadRing::Reserve(size_t size, Region& region, bool wait)
+{
+	size = (size + kRegionAlignment - 1) & ~(kRegionAlignment - 1);
+	if (buffer == 0 || size > ringSize)
+		return false;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	size_t offset = 0;
+	while (!allocate(size, offset))
+	{
+		if (!wait || shutdown)
+			return false;
+		released.wait(lock);
+	}
+
+	head = offset + size;
+	inFlight.push_back({ offset, size, 0, false });
+
+	region.offset = offset;
+	region.size = size;
+	// without a mapping the worker fills a staging block, copied into the range at upload time
+	region.data = persistent ? mapped + offset : new unsigned char[size];
+	return true;
+}
+
+const void* UploadRing::BeginUpload(Region& region)
+{
+	GLState::GetInstance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+
+	if (!persistent)
+	{
+		// the fences keep the GPU off this range, so only it is invalidated and the map does not sync
+		void* ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, region.offset, region.size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		memcpy(ptr, region.data, region.size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+
+	return reinterpret_cast<const void*>(region.offset);
+}
+
+void UploadRing::EndUpload(Region& region)
+{
+	GLState::GetInstance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (!persistent)
+	{
+		delete[] region.data;
+		region.data = nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto& it : inFlight)
+	{
+		if (it.offset == region.offset && !it.submitted)
+		{
+			it.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			it.submitted = true;
+			break;
+		}
+	}
+}
+
+void UploadRing::Retire()
+{
+	bool any = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		while (!inFlight.empty() && inFlight.front().submitted)
+		{
+			GLenum status = glClientWaitSync(inFlight.front().fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				break;
+
+			glDeleteSync(inFlight.front().fence);
+			tail = inFlight.front().offset + inFlight.front().size;
+			inFlight.pop_front();
+			any = true;
+		}
+	}
+
+	if (any) released.notify_all();
+}
+
+void UploadRing::Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shutdown = true;
+	}
+	released.notify_all();
+}
@@ -0,0 +1,75 @@
+#ifndef UPLOAD_RING_H
+#define UPLOAD_RING_H
+
+#include "GLEW\glew.h"
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Pixel unpack buffer split into a ring of upload regions.
+// With ARB_buffer_storage the buffer stays persistently mapped and worker threads
+// write straight into it, fences tell when the GPU is done with a region.
+// Without it workers fill a staging block that is copied into the region's range at
+// upload time, invalidating only that range so the GPU keeps reading the others.
+class UploadRing
+{
+public:
+	// glTexSubImage2D reads fastest from aligned offsets
+	static const size_t kRegionAlignment = 256;
+
+	struct Region
+	{
+		size_t offset;
+		size_t size;
+		unsigned char* data;
+	};
+
+	UploadRing();
+	~UploadRing();
+
+	// GL thread only
+	bool Init(size_t size);
+	void Destroy();
+
+	bool IsPersistent() const { return persistent; }
+	size_t GetSize() const { return ringSize; }
+
+	// Reserve room for an upload, any thread. With wait set the caller blocks until
+	// the GPU releases enough of the ring, regions larger than the ring always fail
+	bool Reserve(size_t size, Region& region, bool wait);
+
+	// GL thread: bind the buffer and return the offset to pass to glTex*Image
+	const void* BeginUpload(Region& region);
+	// GL thread: fence the region after the upload calls
+	void EndUpload(Region& region);
+	// GL thread: release regions whose fences have signaled
+	void Retire();
+
+	// wake and fail every waiting Reserve
+	void Shutdown();
+
+private:
+	struct InFlight
+	{
+		size_t offset;
+		size_t size;
+		GLsync fence;
+		bool submitted;
+	};
+
+	GLuint buffer;
+	size_t ringSize;
+	bool persistent;
+	unsigned char* mapped;
+
+	std::mutex mutex;
+	std::condition_variable released;
+	std::deque<InFlight> inFlight;
+	size_t head;
+	size_t tail;
+	bool shutdown;
+
+	bool allocate(size_t size, size_t& offset);
+};
+
+#endif
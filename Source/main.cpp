@@ -1,8 +1,13 @@
 #include "SDL2/SDL.h"
 #include <iostream>
 #include <chrono>
+#include <cstring>
 #include "GLEW\glew.h"
 #include "Renderer.h"
+#include "helpers/TextureManager.h"
+#include "helpers/JobSystem.h"
+#include "Benchmarks.h"
+#include "RenderThread.h"
 #include <thread>         // std::this_thread::sleep_for
 
 using namespace std;
@@ -20,9 +25,25 @@ SDL_Event event;
 
 Renderer * renderer = nullptr;
 
+// draws on its own thread while the frame latency is above 0
+RenderThread render_thread;
+
+// GL work runs on whichever thread owns the context
+void render_command(std::function<void()> command)
+{
+	if (render_thread.IsRunning())
+		render_thread.Post(command);
+	else
+		command();
+}
+
 void clean_up()
 {
+	// the context comes back to this thread for the deletes
+	render_thread.Stop();
+	TextureManager::GetInstance().PrintStatistics();
 	delete renderer;
+	JobSystem::GetInstance().Shutdown();
 
 	SDL_GL_DeleteContext(gContext);
 	SDL_DestroyWindow(window);
@@ -88,6 +109,24 @@ bool init()
 
 int main(int argc, char *argv[])
 {
+	// --workers N sizes the job system, by default one worker per hardware thread besides this one.
+	// --latency N is how many frames the simulation may run ahead of the render thread, 0 renders here
+	int workers = -1;
+	int latency = 1;
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (strcmp(argv[i], "--workers") == 0)
+			workers = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--latency") == 0)
+			latency = atoi(argv[i + 1]);
+	}
+	JobSystem::GetInstance().Init(workers);
+
+	// benchmarks run headless and exit
+	int benchmark_result = Benchmarks::Run(argc, argv);
+	if (benchmark_result >= 0)
+		return benchmark_result;
+
 	//Initialize SDL, glew, engine
 	if (init() == false)
 	{
@@ -95,6 +134,10 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	renderer->SetFrameLatency(latency);
+	if (renderer->GetFrameLatency() > 0 && !render_thread.Start(renderer, window, gContext))
+		renderer->SetFrameLatency(0);
+
 	//Quit flag
 	bool quit = false;
 	bool mouse_button_pressed = false;
@@ -116,7 +159,13 @@ int main(int argc, char *argv[])
 			{
 				// Key down events
 				if (event.key.keysym.sym == SDLK_ESCAPE) quit = true;
-				else if (event.key.keysym.sym == SDLK_r) renderer->ReloadShaders();
+				else if (event.key.keysym.sym == SDLK_r) render_command([]() { renderer->ReloadShaders(); });
+				else if (event.key.keysym.sym == SDLK_p) render_command([]() { renderer->TogglePostFeature(Renderer::POST_PREVIEW_SHADOW_MAP); });
+				else if (event.key.keysym.sym == SDLK_c) render_command([]() { renderer->TogglePostFeature(Renderer::POST_CROSS_HAIR); });
+				else if (event.key.keysym.sym == SDLK_f) render_command([]() { renderer->CycleShadowFilter(); });
+				else if (event.key.keysym.sym == SDLK_l) render_command([]() { renderer->SetDirectionalLight(!renderer->IsDirectionalLight()); });
+				else if (event.key.keysym.sym == SDLK_k) render_command([]() { renderer->SpawnShadowLights(4); });
+				else if (event.key.keysym.sym == SDLK_o) render_command([]() { renderer->SetPointLight(!renderer->IsPointLight()); });
 				else if (event.key.keysym.sym == SDLK_w || event.key.keysym.sym == SDLK_UP)
 				{
 					renderer->CraftMoveForward(true);
@@ -187,7 +236,8 @@ int main(int argc, char *argv[])
 			{
 				if (event.window.event == SDL_WINDOWEVENT_RESIZED)
 				{
-					renderer->ResizeBuffers(event.window.data1, event.window.data2);
+					int width = event.window.data1, height = event.window.data2;
+					render_command([width, height]() { renderer->ResizeBuffers(width, height); });
 				}
 			}
 		}
@@ -200,9 +250,13 @@ int main(int argc, char *argv[])
 
 		simulation_start = chrono::steady_clock::now();
 
-		// Update
+		// Update, publishes the frame's snapshot
 		renderer->Update(dt);
 
+		// the render thread draws and swaps on its own
+		if (render_thread.IsRunning())
+			continue;
+
 		// Draw
 		renderer->Render();
 		